@@ -0,0 +1,26 @@
+// CAN output for machine controllers, see can_output.h for the frames.
+//  Built in when CAN_OUTPUT_BITRATE is defined (125000, 250000, 500000 or
+//    1000000, e.g. -DCAN_OUTPUT_BITRATE=250000). Sends on the ESP32's TWAI
+//    controller through an external transceiver. The identifiers, cyclic
+//    period and event inhibit time are holding registers 12-15, so they can
+//    be changed over Modbus.
+//  Runs in its own task on the core loop() doesn't use, reading the latest
+//    snapshot every millisecond. Frames are only ever queued without waiting:
+//    a bus that's busy, unplugged or off never holds anything else up, and
+//    the controller is put back on the bus after a bus-off.
+#ifndef CAN_SERVER_H
+#define CAN_SERVER_H
+
+#ifdef CAN_OUTPUT_BITRATE
+
+#include "sensor_snapshot.h"
+
+// Starts the output task. Both channels must outlive it.
+void can_server_start(
+  sensor_snapshot_channel &snapshots,
+  sensor_config_channel &config
+);
+
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+// Decision tree classifier over the calibrated readings.
+//  Generated by the host treefit tool from labelled captures, replace this
+//    file with its output and rebuild. Each tree is straight-line integer
+//    comparisons, no tables or floats. With trees, classify_frame() uses them
+//    instead of color_classify_noisy().
+//  As shipped there are none (CLASS_TREES 0).
+#ifndef CLASS_TREE_H
+#define CLASS_TREE_H
+
+#include <stdint.h>
+
+#include "color_core.h"
+
+// Trees and the treefit options they were fitted with, for treefit -c.
+#define CLASS_TREES 0
+#define CLASS_TREE_DEPTH 0
+#define CLASS_TREE_MIN_LEAF 0
+#define CLASS_TREE_SEED 0
+
+// Classifies calibrated readings, indexed by enum COLOR_CHANNELS, into enum
+//  COLOR_STR_MAP, with confidence 0-100.
+static inline uint8_t class_tree_classify(
+  const int readings[4],
+  uint8_t *confidence
+){
+  *confidence = 0;
+
+  return COLOR_MAP_ERR;
+}
+
+#endif
@@ -0,0 +1,29 @@
+// I2C peripheral mode, for machines whose own MCU wants results over I2C.
+//  Built in when I2C_PERIPHERAL_ADDR is defined (e.g.
+//    -DI2C_PERIPHERAL_ADDR=0x3A). The head is then a slave at that address on
+//    a second bus, Wire1, serving the sensor_registers input register map:
+//    latest raw/calibrated channels, class, confidence, faults and counters,
+//    with the frame counter (registers 12-13) as the sequence number.
+//  Protocol, registers 16 bit high byte first as over Modbus:
+//    write [register]          sets the register pointer
+//    read  N bytes             registers from the pointer on
+//    Registers past the end of the map read as 0xFF bytes. Write the pointer
+//    in its own transaction (STOP, then read) before every read: the ESP32
+//    can't stretch the clock as a slave, so the reply is loaded when the
+//    pointer is written.
+//  Every reply comes from one snapshot, copied out of the channel loop()
+//    publishes into, so a read spanning the whole map is always consistent
+//    and neither side ever waits for the other.
+#ifndef I2C_SERVER_H
+#define I2C_SERVER_H
+
+#ifdef I2C_PERIPHERAL_ADDR
+
+#include "sensor_snapshot.h"
+
+// Starts serving snapshots from the channel, which must outlive the server.
+void i2c_server_start(sensor_snapshot_channel &snapshots);
+
+#endif
+
+#endif
@@ -0,0 +1,14 @@
+// Linearisation tables per illumination step and channel.
+//  Generated by the host linfit tool from grey step target captures, replace
+//    this file with its output and rebuild. Channels without a table (knots
+//    0) fall back to the {min, max} calibration of their step.
+//  As shipped no channel has a table.
+#ifndef LINEARIZE_TABLES_H
+#define LINEARIZE_TABLES_H
+
+#include "illumination.h"
+#include "linearize.h"
+
+static const lin_table linearize_tables[ILLUM_STEPS][4] = {};
+
+#endif
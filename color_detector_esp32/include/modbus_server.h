@@ -0,0 +1,24 @@
+// Modbus slave for the PLCs.
+//  Serves the sensor_registers map as Modbus RTU over RS-485 on Serial2 and,
+//    when WiFi credentials are built in (MODBUS_WIFI_SSID/MODBUS_WIFI_PASS
+//    build flags), as Modbus TCP on port 502.
+//  The server runs in its own task on the core loop() doesn't use. Register
+//    reads copy from the snapshot channel loop() publishes into, and register
+//    writes go out through the config channel for loop() to apply between
+//    frames, so a busy bus never holds up acquisition and a slow frame never
+//    holds up a master.
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include <stdint.h>
+
+#include "sensor_snapshot.h"
+
+// Starts the server task. Both channels must outlive it, config must already
+//  hold the configuration in use so holding register reads start out right.
+void modbus_server_start(
+  sensor_snapshot_channel &snapshots,
+  sensor_config_channel &config
+);
+
+#endif
@@ -0,0 +1,32 @@
+// Palettes compiled into the firmware.
+//  palette_short is colors_short.csv from the repository root, regenerate it by
+//    hand if that file changes. The head matches every frame against it, see
+//    lib/palette.
+#ifndef PALETTES_H
+#define PALETTES_H
+
+#include "palette.h"
+
+static const palette_color palette_short_colors[] = {
+  {"Black",   {  0,   0,   0}},
+  {"White",   {255, 255, 255}},
+  {"Red",     {255,   0,   0}},
+  {"Blue",    {  0,   0, 255}},
+  {"Yellow",  {255, 255,   0}},
+  {"Cyan",    {  0, 255, 255}},
+  {"Magenta", {255,   0, 255}},
+  {"Silver",  {192, 192, 192}},
+  {"Gray",    {128, 128, 128}},
+  {"Olive",   {128, 128,   0}},
+  {"Green",   {  0, 128,   0}},
+  {"Purple",  {128,   0, 128}},
+  {"Teal",    {  0, 128, 128}}
+};
+
+static const palette palette_short = {
+  "colors_short",
+  palette_short_colors,
+  sizeof(palette_short_colors) / sizeof(palette_short_colors[0])
+};
+
+#endif
@@ -0,0 +1,45 @@
+// TCS3200 readings on the PCNT peripheral, for the ESP-IDF build.
+//  The Arduino build times single LOW half periods of the sensor's output with
+//    pulseIn(), which spins on the pin for the whole pulse and counts whole
+//    microseconds. Here a PCNT unit counts both edges of the output, and its
+//    watch points timestamp the first edge and the Nth from the interrupt, so
+//    a reading is the mean half period over the N - 1 between them. That is
+//    what pulseIn() measures, in the same microsecond units the calibration
+//    and linearisation tables use, but averaged in hardware while the reading
+//    task blocks instead of spinning, and with the interval's end points set
+//    by the sensor's edges rather than by polling.
+//  N is picked per channel from its last reading, so each channel takes about
+//    PCNT_SENSOR_GATE_US whatever its brightness, and kept odd so the half
+//    periods come in whole HIGH/LOW pairs and the duty cycle cancels out.
+//  Wired as in the Arduino build: output on GPIO32, filter select on S2
+//    GPIO15 and S3 GPIO33, S0/S1 hardwired HIGH.
+#ifndef PCNT_SENSOR_H
+#define PCNT_SENSOR_H
+
+#include <stdint.h>
+
+// Time per channel reading aimed for, in us.
+#define PCNT_SENSOR_GATE_US 2000
+
+// Edges per reading, bounds. The most also bounds the PCNT count.
+#define PCNT_SENSOR_MIN_EDGES 3
+#define PCNT_SENSOR_MAX_EDGES 1023
+
+// A channel with no N edges in this long reads as timed out, in ms.
+#define PCNT_SENSOR_TIMEOUT_MS 50
+
+struct pcnt_reading {
+  int width_us;             // Mean half period, 0 if timed out.
+  uint32_t variance;        // Of width_us, as color_raw_variance().
+  uint16_t edges;           // N.
+};
+
+// Sets up the filter select pins and the PCNT unit. Returns false if a
+//  driver call failed.
+bool pcnt_sensor_start();
+
+// Selects channel's filter (enum COLOR_CHANNELS) and reads it, blocking
+//  until the reading completes or times out.
+void pcnt_sensor_read(uint8_t channel, pcnt_reading &out);
+
+#endif
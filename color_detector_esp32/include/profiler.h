@@ -0,0 +1,61 @@
+// Statistical PC sampling profiler.
+//  Built in with the PROFILER build flag (-DPROFILER), otherwise none of it is
+//    compiled.
+//  A hardware timer interrupts the core loop() runs on PROFILER_SAMPLE_HZ
+//    times a second. The ISR picks the interrupted program counter out of the
+//    FreeRTOS interrupt frame and counts it in a fixed PC histogram, and walks
+//    the interrupted task's register window save areas for a short call stack
+//    which is counted in a fixed table of distinct stacks. Nothing is
+//    instrumented and nothing is allocated after start.
+//  Every PROFILER_WINDOW_MS sampling stops and the window is sent to the host
+//    over the link (LINK_PROFILE_* frames) a few frames per loop, then both
+//    tables are cleared and sampling resumes. The host profile tool turns the
+//    addresses into a flat profile and a flame graph against the firmware ELF.
+//  Limits:
+//    Code running with interrupts masked (critical sections, other ISRs at or
+//      above the timer's level) can't be sampled, ticks landing in another
+//      interrupt are only counted.
+//    Only the loop() core is sampled, the Modbus server task on the other
+//      core isn't.
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#ifdef PROFILER
+
+#include <stdint.h>
+
+#ifndef PROFILER_SAMPLE_HZ
+#define PROFILER_SAMPLE_HZ 2000
+#endif
+
+#ifndef PROFILER_WINDOW_MS
+#define PROFILER_WINDOW_MS 10000
+#endif
+
+// PC histogram size, shared between the ROM, IRAM and flash code ranges.
+//  Each range's bucket width is the smallest power of two that fits it in its
+//    share, 2 bytes per bucket.
+#define PROFILER_BUCKETS 4096
+
+// Distinct call stacks kept per window. Stacks seen after it fills are
+//  counted as dropped but still land in the PC histogram.
+#define PROFILER_STACKS 256
+
+// Link frames sent per profiler_poll() call while dumping a window.
+#define PROFILER_FRAMES_PER_POLL 8
+
+typedef void (*profiler_write_fn)(
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len
+);
+
+// Starts sampling the calling task's core. Dumps go out through write.
+void profiler_start(profiler_write_fn write);
+
+// Ends sampling windows and sends them. Call from loop(), once a frame.
+void profiler_poll();
+
+#endif
+
+#endif
@@ -0,0 +1,41 @@
+// Host link over the UART driver, for the ESP-IDF build.
+//  The Arduino build polls Serial from loop() and, for clock sync, spins on it
+//    for up to TIME_SYNC_TIMEOUT_MS waiting for the response. Here the UART
+//    driver's event queue wakes a receive task on core 0 as bytes arrive. It
+//    decodes frames as they complete, stamps each with esp_timer time there
+//    and then, and queues it for the frame task, which takes what's there
+//    without ever waiting. Sync responses so get their t4 when they arrive,
+//    not when a frame next gets round to looking.
+//  Same wire format, port and baud as the Arduino build, so the host tools
+//    can't tell the two apart.
+#ifndef UART_LINK_H
+#define UART_LINK_H
+
+#include <stdint.h>
+
+#include "serial_link.h"
+
+struct uart_link_frame {
+  int64_t rx_time_us;       // esp_timer time the frame completed at.
+  uint8_t type;
+  uint8_t len;
+  uint8_t payload[LINK_MAX_PAYLOAD];
+};
+
+// Installs the UART driver and starts the receive task. Returns false if
+//  either failed.
+bool uart_link_start();
+
+// Frames and queues a single message for the host. Returns once it's in the
+//  driver's transmit buffer, not once it's sent.
+void uart_link_write_frame(uint8_t type, const uint8_t *payload, uint8_t len);
+
+// Takes the oldest frame received from the host, if there is one. Never
+//  blocks.
+bool uart_link_receive(uart_link_frame &frame);
+
+// Frames lost to a full queue, and receive FIFO or buffer overflows, since
+//  start.
+uint32_t uart_link_dropped();
+
+#endif
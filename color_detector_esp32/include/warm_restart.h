@@ -0,0 +1,69 @@
+// Checkpointing of pipeline state into RTC slow memory.
+//  RTC slow memory keeps its contents through deep sleep and every reset short
+//    of a power cycle (watchdog, panic, software reset), so after one of those
+//    the head can pick up where it left off instead of re-converging from
+//    scratch.
+#ifndef WARM_RESTART_H
+#define WARM_RESTART_H
+
+#include <stdint.h>
+
+#include "can_output.h"
+#include "illumination.h"
+#include "integration.h"
+#include "spc.h"
+
+// Bump whenever warm_restart_state changes, checkpoints written by an older
+//  layout are then treated as invalid and the head cold starts.
+#define WARM_RESTART_VERSION 6
+
+// Everything needed to resume the pipeline.
+//  Plain data only, it's copied byte for byte into RTC memory.
+struct warm_restart_state {
+  // Next reading record sequence number, so the host sees a gap rather than a
+  //  reset stream.
+  uint16_t reading_seq;
+
+  // Extrema of the raw readings since the last power on.
+  int color_min_max_readings[4][2];
+
+  // Calibration tables per illumination step, and the brightness loop.
+  int illum_calib_vals[ILLUM_STEPS][4][2];
+  illum_controller illum;
+
+  // Pulses per channel and the channels' learned jitter.
+  integ_scheduler integ;
+
+  // Frame delay and CAN output settings, possibly set over the field bus, and
+  //  the bus frame counter.
+  uint16_t loop_delay_ms;
+  can_output_config can_config;
+  uint32_t frame_count;
+
+  // Process control baselines and chart state, so a reset mid-shift doesn't
+  //  need a fresh in-control baseline.
+  spc_monitor spc;
+  uint16_t spc_generation;
+
+  // Clock drift estimate. The offset itself is meaningless once esp_timer
+  //  restarts, but the crystal's drift carries over.
+  bool drift_valid;
+  int32_t drift_ppb;
+  uint32_t drift_uncertainty_ppb;
+};
+
+// Checks the reset reason and the RTC checkpoint slots. Returns true and fills
+//  state if the reset kept RTC memory and a valid checkpoint was found.
+//  Should be called once, early in setup().
+bool warm_restart_restore(warm_restart_state &state);
+
+// Writes state to RTC memory.
+//  Alternates between two CRC protected slots so a reset in the middle of a
+//    write still leaves the previous checkpoint intact. Cheap enough to call
+//    every loop.
+void warm_restart_checkpoint(const warm_restart_state &state);
+
+// Consecutive warm restarts since the last cold boot, 0 after a cold boot.
+uint32_t warm_restart_count();
+
+#endif
@@ -0,0 +1,40 @@
+#include "binlog.h"
+
+#include <stddef.h>
+
+static binlog_write_fn binlog_writer = NULL;
+static binlog_clock_fn binlog_clock = NULL;
+static uint32_t binlog_drops = 0;
+
+void binlog_start(binlog_write_fn write, binlog_clock_fn clock){
+  binlog_writer = write;
+  binlog_clock = clock;
+
+  return;
+}
+
+uint32_t binlog_dropped(){
+  return binlog_drops;
+}
+
+void binlog_send(const binlog_site *site, const link_log &msg){
+  if(!binlog_writer){
+    binlog_drops++;
+    return;
+  }
+
+  // The site's address is its ID, on the 32 bit target it's the address the
+  //  ELF has it at.
+  link_log out = msg;
+  out.site = (uint32_t)(uintptr_t)site;
+  out.device_time_us = binlog_clock();
+  if(out.count > LINK_LOG_MAX_WORDS){
+    out.count = LINK_LOG_MAX_WORDS;
+    binlog_drops++;
+  }
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  binlog_writer(LINK_LOG, payload, link_pack_log(out, payload));
+
+  return;
+}
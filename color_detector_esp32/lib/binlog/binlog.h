@@ -0,0 +1,170 @@
+// Binary logging with formatting deferred to the host.
+//  A log call sends no text. Each call site gets a static binlog_site holding
+//    its level, format string, file and line, placed in flash by the linker
+//    like any other constant, and the site's address in the image is its ID.
+//    At run time only that ID, a device timestamp and the raw argument words
+//    go out, as a LINK_LOG frame: a handful of stores and no printf, and a
+//    fraction of the bytes the formatted text would take. The host reads the
+//    sites back out of the firmware ELF and renders the text (ingest -e).
+//  Calls below BINLOG_LEVEL, a build flag, expand to nothing: no site, no
+//    format string in flash and the arguments aren't evaluated.
+//
+//  Usage, printf style:
+//    BINLOG_INFO("illumination step %u -> %u", old_step, illum.step);
+//  Arguments are integers (up to 64 bit), floats and pointers, at most
+//    LINK_LOG_MAX_WORDS words of them. Floats are sent single precision. %s
+//    only works for strings in the image (literals and other constants), the
+//    host reads them from the ELF.
+//  Not reentrant, log from one task only (the loop() task).
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include "serial_link.h"
+
+#define BINLOG_LEVEL_DEBUG 0
+#define BINLOG_LEVEL_INFO 1
+#define BINLOG_LEVEL_WARN 2
+#define BINLOG_LEVEL_ERROR 3
+#define BINLOG_LEVEL_NONE 4
+
+// Lowest level compiled in, e.g. -DBINLOG_LEVEL=0 for debug logging.
+#ifndef BINLOG_LEVEL
+#define BINLOG_LEVEL BINLOG_LEVEL_INFO
+#endif
+
+// A log call site. Layout is read by the host from the 32 bit image: format
+//  pointer, file pointer, line (16 bit), level (8 bit).
+struct binlog_site {
+  const char *fmt;
+  const char *file;
+  uint16_t line;
+  uint8_t level;
+};
+
+typedef void (*binlog_write_fn)(
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len
+);
+
+typedef int64_t (*binlog_clock_fn)();
+
+// Starts sending records through write, stamped with clock. Records logged
+//  before are dropped.
+void binlog_start(binlog_write_fn write, binlog_clock_fn clock);
+
+// Records dropped, before binlog_start() or for having too many argument
+//  words (those are sent truncated).
+uint32_t binlog_dropped();
+
+// Sends a record. Called by the macros below.
+void binlog_send(const binlog_site *site, const link_log &msg);
+
+// Argument packing. Each argument becomes one 32 bit word, 64 bit integers
+//  two (low word first), floating point a float's bits.
+template<typename T>
+typename std::enable_if<
+  (std::is_integral<T>::value || std::is_enum<T>::value) && sizeof(T) <= 4
+>::type binlog_put(link_log &msg, T val){
+  if(msg.count < LINK_LOG_MAX_WORDS)
+    msg.words[msg.count] = (uint32_t)val;
+  msg.count++;
+
+  return;
+}
+
+template<typename T>
+typename std::enable_if<
+  std::is_integral<T>::value && (sizeof(T) > 4)
+>::type binlog_put(link_log &msg, T val){
+  binlog_put(msg, (uint32_t)(uint64_t)val);
+  binlog_put(msg, (uint32_t)((uint64_t)val >> 32));
+
+  return;
+}
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type binlog_put(
+  link_log &msg,
+  T val
+){
+  float f = val;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  binlog_put(msg, bits);
+
+  return;
+}
+
+template<typename T>
+void binlog_put(link_log &msg, const T *ptr){
+  binlog_put(msg, (uint32_t)(uintptr_t)ptr);
+
+  return;
+}
+
+inline void binlog_pack(link_log &){
+  return;
+}
+
+template<typename T, typename... Rest>
+void binlog_pack(link_log &msg, T val, Rest... rest){
+  binlog_put(msg, val);
+  binlog_pack(msg, rest...);
+
+  return;
+}
+
+template<typename... Args>
+void binlog_log(const binlog_site *site, Args... args){
+  link_log msg;
+  msg.count = 0;
+  binlog_pack(msg, args...);
+  binlog_send(site, msg);
+
+  return;
+}
+
+// Sites go in their own input section, ".rodata.*" so the linker scripts put
+//  them in flash rodata with everything else.
+#define BINLOG_AT(level, fmt, ...)                                            \
+  do {                                                                        \
+    static const binlog_site binlog_site_                                     \
+      __attribute__((section(".rodata.binlog"), used)) =                      \
+        {fmt, __FILE__, __LINE__, level};                                     \
+    binlog_log(&binlog_site_, ##__VA_ARGS__);                                 \
+  } while(0)
+
+#define BINLOG_NOTHING() do {} while(0)
+
+#if BINLOG_LEVEL <= BINLOG_LEVEL_DEBUG
+#define BINLOG_DEBUG(fmt, ...) \
+  BINLOG_AT(BINLOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define BINLOG_DEBUG(fmt, ...) BINLOG_NOTHING()
+#endif
+
+#if BINLOG_LEVEL <= BINLOG_LEVEL_INFO
+#define BINLOG_INFO(fmt, ...) BINLOG_AT(BINLOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define BINLOG_INFO(fmt, ...) BINLOG_NOTHING()
+#endif
+
+#if BINLOG_LEVEL <= BINLOG_LEVEL_WARN
+#define BINLOG_WARN(fmt, ...) BINLOG_AT(BINLOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define BINLOG_WARN(fmt, ...) BINLOG_NOTHING()
+#endif
+
+#if BINLOG_LEVEL <= BINLOG_LEVEL_ERROR
+#define BINLOG_ERROR(fmt, ...) \
+  BINLOG_AT(BINLOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define BINLOG_ERROR(fmt, ...) BINLOG_NOTHING()
+#endif
+
+#endif
@@ -0,0 +1,266 @@
+#include "can_output.h"
+
+#include <string.h>
+
+#include "color_core.h"
+
+void can_output_config_default(can_output_config &config){
+  config.cyclic_id = CAN_OUTPUT_DEFAULT_CYCLIC_ID;
+  config.event_id = CAN_OUTPUT_DEFAULT_EVENT_ID;
+  config.period_ms = CAN_OUTPUT_DEFAULT_PERIOD_MS;
+  config.inhibit_ms = CAN_OUTPUT_DEFAULT_INHIBIT_MS;
+
+  return;
+}
+
+void can_output_init(
+  can_output &out,
+  const can_output_config &config,
+  const can_hal &hal,
+  uint32_t now_ms
+){
+  memset(&out, 0, sizeof(out));
+  out.hal = hal;
+  out.reported_class = COLOR_MAP_ERR;
+  can_output_configure(out, config, now_ms);
+
+  return;
+}
+
+void can_output_configure(
+  can_output &out,
+  const can_output_config &config,
+  uint32_t now_ms
+){
+  out.config = config;
+  out.next_cyclic_ms = now_ms + config.period_ms;
+
+  return;
+}
+
+static bool can_output_send(can_output &out, const can_frame_data &frame){
+  if(!out.hal.send(out.hal.ctx, frame)){
+    out.tx_full++;
+    return false;
+  }
+  out.bits_sent += can_frame_bits(frame);
+
+  return true;
+}
+
+// Takes a new frame's result, noting class changes.
+static void can_output_update(can_output &out, const sensor_snapshot &snap){
+  if(!out.have_result){
+    out.have_result = true;
+    out.reported_class = snap.class_index;
+    out.class_frame = snap.frame;
+  }
+  else if(snap.class_index != out.result.class_index){
+    out.class_frame = snap.frame;
+    if(out.event_pending)
+      out.coalesced++;
+  }
+  out.result = snap;
+  out.event_pending = snap.class_index != out.reported_class;
+
+  return;
+}
+
+void can_output_poll(
+  can_output &out,
+  const sensor_snapshot &snap,
+  uint32_t now_ms
+){
+  if(!out.have_result || snap.frame != out.result.frame)
+    can_output_update(out, snap);
+
+  // Signed differences, so the millisecond clock may wrap.
+  bool inhibited =
+    out.event_sent &&
+    (int32_t)(now_ms - out.last_event_ms) < (int32_t)out.config.inhibit_ms;
+  if(out.event_pending && !inhibited){
+    can_frame_data frame;
+    frame.id = out.config.event_id;
+    frame.len = CAN_OUTPUT_EVENT_LEN;
+    can_output_encode_event(
+      out.result,
+      out.event_seq,
+      out.reported_class,
+      out.class_frame,
+      frame.data
+    );
+    if(can_output_send(out, frame)){
+      out.event_seq++;
+      out.events_sent++;
+      out.reported_class = out.result.class_index;
+      out.event_pending = false;
+      out.event_sent = true;
+      out.last_event_ms = now_ms;
+    }
+  }
+
+  if(
+    out.config.period_ms &&
+    out.have_result &&
+    (int32_t)(now_ms - out.next_cyclic_ms) >= 0
+  ){
+    can_frame_data frame;
+    frame.id = out.config.cyclic_id;
+    frame.len = CAN_OUTPUT_CYCLIC_LEN;
+    can_output_encode_cyclic(out.result, out.cyclic_seq, frame.data);
+    if(can_output_send(out, frame)){
+      out.cyclic_seq++;
+      out.cyclic_sent++;
+    }
+
+    // Keep to the period's grid, unless a stall put us whole periods behind.
+    out.next_cyclic_ms += out.config.period_ms;
+    if((int32_t)(now_ms - out.next_cyclic_ms) >= 0)
+      out.next_cyclic_ms = now_ms + out.config.period_ms;
+  }
+
+  return;
+}
+
+static uint8_t can_output_clamp(int16_t val){
+  if(val < 0)
+    return 0;
+  if(val > 255)
+    return 255;
+
+  return val;
+}
+
+void can_output_encode_cyclic(
+  const sensor_snapshot &snap,
+  uint8_t seq,
+  uint8_t *data
+){
+  data[0] = seq;
+  data[1] = snap.class_index;
+  data[2] = snap.confidence;
+  for(uint8_t i=0; i<3; i++)
+    data[3 + i] = can_output_clamp(snap.mapped[i]);
+  data[6] = snap.faults & 0xFF;
+  data[7] = snap.palette_index < 0xFF ? snap.palette_index : 0xFF;
+
+  return;
+}
+
+void can_output_encode_event(
+  const sensor_snapshot &snap,
+  uint8_t seq,
+  uint8_t previous_class,
+  uint32_t frame,
+  uint8_t *data
+){
+  data[0] = seq;
+  data[1] = snap.class_index;
+  data[2] = previous_class;
+  data[3] = snap.confidence;
+  for(uint8_t i=0; i<4; i++)
+    data[4 + i] = frame >> (i * 8);
+
+  return;
+}
+
+bool can_output_decode_cyclic(
+  const can_frame_data &frame,
+  can_output_cyclic &out
+){
+  if(frame.len != CAN_OUTPUT_CYCLIC_LEN)
+    return false;
+
+  out.seq = frame.data[0];
+  out.class_index = frame.data[1];
+  out.confidence = frame.data[2];
+  for(uint8_t i=0; i<3; i++)
+    out.rgb[i] = frame.data[3 + i];
+  out.faults = frame.data[6];
+  out.palette_index = frame.data[7];
+
+  return true;
+}
+
+bool can_output_decode_event(
+  const can_frame_data &frame,
+  can_output_event &out
+){
+  if(frame.len != CAN_OUTPUT_EVENT_LEN)
+    return false;
+
+  out.seq = frame.data[0];
+  out.class_index = frame.data[1];
+  out.previous_class = frame.data[2];
+  out.confidence = frame.data[3];
+  out.frame = 0;
+  for(uint8_t i=0; i<4; i++)
+    out.frame |= (uint32_t)frame.data[4 + i] << (i * 8);
+
+  return true;
+}
+
+// Stuffed section of a frame, start of frame through the CRC, bit by bit.
+//  After five equal bits the transmitter inserts one of the opposite level,
+//  which itself starts the next run.
+struct can_bit_stream {
+  uint16_t crc;
+  uint8_t last;
+  uint8_t run;
+  uint16_t bits;
+};
+
+static void can_bit_put(can_bit_stream &bs, uint8_t bit){
+  bs.bits++;
+  if(bit == bs.last)
+    bs.run++;
+  else{
+    bs.last = bit;
+    bs.run = 1;
+  }
+  if(bs.run == 5){
+    bs.bits++;
+    bs.last = !bit;
+    bs.run = 1;
+  }
+
+  return;
+}
+
+// Bits covered by the CRC, which is over the unstuffed bits.
+static void can_bit_put_crc(can_bit_stream &bs, uint32_t val, uint8_t count){
+  for(int8_t i=count - 1; i>=0; i--){
+    uint8_t bit = (val >> i) & 1;
+    uint8_t feedback = bit ^ ((bs.crc >> 14) & 1);
+    bs.crc = (bs.crc << 1) & 0x7FFF;
+    if(feedback)
+      bs.crc ^= 0x4599;
+    can_bit_put(bs, bit);
+  }
+
+  return;
+}
+
+uint16_t can_frame_bits(const can_frame_data &frame){
+  can_bit_stream bs;
+  bs.crc = 0;
+  bs.last = 2;
+  bs.run = 0;
+  bs.bits = 0;
+
+  uint8_t len = frame.len <= 8 ? frame.len : 8;
+
+  can_bit_put_crc(bs, 0, 1);                    // Start of frame.
+  can_bit_put_crc(bs, frame.id & 0x7FF, 11);
+  can_bit_put_crc(bs, 0, 3);                    // RTR, IDE, r0.
+  can_bit_put_crc(bs, len, 4);
+  for(uint8_t i=0; i<len; i++)
+    can_bit_put_crc(bs, frame.data[i], 8);
+
+  uint16_t crc = bs.crc;
+  for(int8_t i=14; i>=0; i--)
+    can_bit_put(bs, (crc >> i) & 1);
+
+  // CRC delimiter, ACK slot and delimiter, end of frame, interframe space.
+  return bs.bits + 1 + 2 + 7 + 3;
+}
@@ -0,0 +1,165 @@
+// CAN output of the frame results, for machine controllers on a CAN bus.
+//  Two frame types, standard 11 bit identifiers, little-endian fields:
+//    Cyclic, every period_ms, the latest result:
+//      0  sequence, counts cyclic frames
+//      1  class index, enum COLOR_STR_MAP or COLOR_MAP_ERR
+//      2  confidence, 0-100
+//      3  calibrated R, clamped to 0-255
+//      4  calibrated G
+//      5  calibrated B
+//      6  fault flags, low byte of enum SENSOR_FAULTS
+//      7  nearest colors_short.csv color, 0xFF if none (or past 254)
+//    Event, when the class changes:
+//      0  sequence, counts event frames
+//      1  new class index
+//      2  previous class index
+//      3  confidence
+//      4-7 frame counter of the first frame in the new class
+//  Events get their own (by default lower, so higher priority) identifier.
+//    A change within inhibit_ms of the last event is held back until the
+//    inhibit time is up and then sent as one event from the last reported
+//    class to the current one, so a flickering class can't flood the bus.
+//    An event the controller's queue refuses stays pending and is retried,
+//    cyclic frames are simply skipped to the next period.
+//  The scheduler is driven with the latest sensor_snapshot and the time, and
+//    hands frames to a can_hal: the ESP32's TWAI controller on the head, and
+//    SocketCAN (or a simulated bus) on the host for testing and benchmarking.
+#ifndef CAN_OUTPUT_H
+#define CAN_OUTPUT_H
+
+#include <stdint.h>
+
+#include "sensor_snapshot.h"
+
+#define CAN_OUTPUT_MAX_ID 0x7FF
+#define CAN_OUTPUT_MAX_PERIOD_MS 10000
+
+#define CAN_OUTPUT_DEFAULT_CYCLIC_ID 0x181
+#define CAN_OUTPUT_DEFAULT_EVENT_ID 0x101
+#define CAN_OUTPUT_DEFAULT_PERIOD_MS 100
+#define CAN_OUTPUT_DEFAULT_INHIBIT_MS 20
+
+#define CAN_OUTPUT_CYCLIC_LEN 8
+#define CAN_OUTPUT_EVENT_LEN 8
+
+struct can_frame_data {
+  uint16_t id;
+  uint8_t len;
+  uint8_t data[8];
+};
+
+// Transmit side of a CAN controller. send queues a frame without waiting and
+//  returns false if the controller's transmit queue is full.
+struct can_hal {
+  bool (*send)(void *ctx, const can_frame_data &frame);
+  void *ctx;
+};
+
+struct can_output_config {
+  uint16_t cyclic_id;
+  uint16_t event_id;
+  uint16_t period_ms;       // 0 turns the cyclic frames off.
+  uint16_t inhibit_ms;
+};
+
+struct can_output {
+  can_output_config config;
+  can_hal hal;
+
+  // Latest result and the frame it came from.
+  bool have_result;
+  sensor_snapshot result;
+
+  uint8_t cyclic_seq;
+  uint8_t event_seq;
+  uint32_t next_cyclic_ms;
+
+  // Frame the current class started at.
+  uint32_t class_frame;
+
+  // Class the last event reported (the first result's before any event), and
+  //  whether the current class differs from it and still has to be sent.
+  uint8_t reported_class;
+  bool event_pending;
+  bool event_sent;
+  uint32_t last_event_ms;
+
+  // Counters.
+  uint32_t cyclic_sent;
+  uint32_t events_sent;
+  uint32_t tx_full;         // Sends the controller refused, retries included.
+  uint32_t coalesced;       // Changes superseded before they were sent.
+  uint64_t bits_sent;       // On the wire, see can_frame_bits().
+};
+
+void can_output_config_default(can_output_config &config);
+
+void can_output_init(
+  can_output &out,
+  const can_output_config &config,
+  const can_hal &hal,
+  uint32_t now_ms
+);
+
+// Applies a new configuration, restarting the cyclic schedule from now.
+void can_output_configure(
+  can_output &out,
+  const can_output_config &config,
+  uint32_t now_ms
+);
+
+// Takes the latest snapshot and sends whatever is due. Call often (every
+//  millisecond or so), the snapshot may repeat between frames.
+void can_output_poll(
+  can_output &out,
+  const sensor_snapshot &snap,
+  uint32_t now_ms
+);
+
+// Frame contents, as decoded by a receiver.
+struct can_output_cyclic {
+  uint8_t seq;
+  uint8_t class_index;
+  uint8_t confidence;
+  uint8_t rgb[3];
+  uint8_t faults;
+  uint8_t palette_index;
+};
+
+struct can_output_event {
+  uint8_t seq;
+  uint8_t class_index;
+  uint8_t previous_class;
+  uint8_t confidence;
+  uint32_t frame;
+};
+
+// Frame encoders and decoders. The decoders return false if the length is
+//  wrong.
+void can_output_encode_cyclic(
+  const sensor_snapshot &snap,
+  uint8_t seq,
+  uint8_t *data
+);
+void can_output_encode_event(
+  const sensor_snapshot &snap,
+  uint8_t seq,
+  uint8_t previous_class,
+  uint32_t frame,
+  uint8_t *data
+);
+bool can_output_decode_cyclic(
+  const can_frame_data &frame,
+  can_output_cyclic &out
+);
+bool can_output_decode_event(
+  const can_frame_data &frame,
+  can_output_event &out
+);
+
+// Length of a frame on the wire in bits, from start of frame through the
+//  interframe space, with the stuff bits its contents actually need. Divide
+//  by the bit rate for the time it holds the bus.
+uint16_t can_frame_bits(const can_frame_data &frame);
+
+#endif
@@ -0,0 +1,144 @@
+#include "capture.h"
+
+#include <string.h>
+
+#define CAPTURE_DEPTH_MASK (CAPTURE_DEPTH - 1)
+
+void capture_init(capture_recorder &c){
+  memset(&c, 0, sizeof(c));
+  c.live = 0;
+  c.slots[0].state = CAPTURE_LIVE;
+  c.pre = CAPTURE_DEFAULT_PRE;
+  c.post = CAPTURE_DEFAULT_POST;
+  c.causes = CAPTURE_ALL_CAUSES;
+
+  return;
+}
+
+bool capture_configure(
+  capture_recorder &c,
+  uint8_t pre,
+  uint8_t post,
+  uint8_t causes
+){
+  if(pre + 1 + post > CAPTURE_DEPTH || (causes & ~CAPTURE_ALL_CAUSES))
+    return false;
+
+  c.pre = pre;
+  c.post = post;
+  c.causes = causes;
+
+  return true;
+}
+
+capture_sample &capture_next(capture_recorder &c){
+  const capture_slot &slot = c.slots[c.live];
+
+  return c.samples[c.live][slot.written & CAPTURE_DEPTH_MASK];
+}
+
+// A free segment, or -1.
+static int capture_free_segment(const capture_recorder &c){
+  for(uint8_t i=0; i<CAPTURE_SEGMENTS; i++){
+    if(c.slots[i].state == CAPTURE_FREE)
+      return i;
+  }
+
+  return -1;
+}
+
+// Holds the live segment as a capture and goes live on a free one, found
+//  when the trigger was accepted.
+static void capture_freeze(capture_recorder &c){
+  capture_slot &slot = c.slots[c.live];
+  slot.state = CAPTURE_HELD;
+  slot.announced = false;
+  c.captures++;
+
+  c.live = capture_free_segment(c);
+  capture_slot &next = c.slots[c.live];
+  memset(&next, 0, sizeof(next));
+  next.state = CAPTURE_LIVE;
+
+  return;
+}
+
+void capture_commit(capture_recorder &c){
+  capture_slot &slot = c.slots[c.live];
+  slot.written++;
+
+  if(slot.state == CAPTURE_TRIGGERED && --slot.post_left == 0)
+    capture_freeze(c);
+
+  return;
+}
+
+bool capture_trigger(capture_recorder &c, uint8_t cause){
+  capture_slot &slot = c.slots[c.live];
+
+  if(!(cause & c.causes) || slot.written == 0)
+    return false;
+  if(slot.state == CAPTURE_TRIGGERED){
+    slot.causes |= cause;
+    return true;
+  }
+  if(capture_free_segment(c) < 0){
+    c.missed++;
+    return false;
+  }
+
+  // Whatever history the segment has, up to pre frames.
+  uint32_t trigger = slot.written - 1;
+  slot.pre = trigger < c.pre ? trigger : c.pre;
+  slot.post = c.post;
+  slot.post_left = c.post;
+  slot.start = trigger - slot.pre;
+  slot.causes = cause;
+  slot.id = c.next_id++;
+  slot.state = CAPTURE_TRIGGERED;
+
+  if(slot.post_left == 0)
+    capture_freeze(c);
+
+  return true;
+}
+
+int capture_completed(capture_recorder &c){
+  for(uint8_t i=0; i<CAPTURE_SEGMENTS; i++){
+    capture_slot &slot = c.slots[i];
+    if(slot.state == CAPTURE_HELD && !slot.announced){
+      slot.announced = true;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+const capture_slot *capture_held(const capture_recorder &c, uint8_t slot){
+  if(slot >= CAPTURE_SEGMENTS || c.slots[slot].state != CAPTURE_HELD)
+    return NULL;
+
+  return &c.slots[slot];
+}
+
+const capture_sample &capture_at(
+  const capture_recorder &c,
+  uint8_t slot,
+  uint16_t i
+){
+  return c.samples[slot][(c.slots[slot].start + i) & CAPTURE_DEPTH_MASK];
+}
+
+uint16_t capture_length(const capture_slot &slot){
+  return slot.pre + 1 + slot.post;
+}
+
+bool capture_release(capture_recorder &c, uint8_t slot){
+  if(!capture_held(c, slot))
+    return false;
+
+  c.slots[slot].state = CAPTURE_FREE;
+
+  return true;
+}
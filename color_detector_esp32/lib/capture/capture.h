@@ -0,0 +1,126 @@
+// Oscilloscope style captures of the frames around a QC event.
+//  Frames go straight into a ring of CAPTURE_DEPTH samples, the live segment.
+//    On a trigger the next post frames are still recorded into it, then the
+//    segment itself is frozen as a capture, holding the pre frames before the
+//    trigger frame, the trigger frame and the post frames after it, and a
+//    free segment becomes the live one. Nothing is copied on a trigger or
+//    per frame beyond writing the sample once, where the caller fills it in.
+//  A capture stays held until released, normally once the host has
+//    downloaded it. With every segment held, triggers are counted as missed
+//    until one is released.
+//  Right after a capture the new live segment has little history yet, so a
+//    capture triggered soon after another one may have fewer pre frames than
+//    asked for. capture_slot::pre says how many it has.
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+// Samples per segment, a power of two. pre + 1 + post must fit in it.
+#define CAPTURE_DEPTH_BITS 6
+#define CAPTURE_DEPTH (1 << CAPTURE_DEPTH_BITS)
+
+// Captures held at once. One more segment is always kept for live frames.
+#define CAPTURE_SLOTS 4
+#define CAPTURE_SEGMENTS (CAPTURE_SLOTS + 1)
+
+#define CAPTURE_DEFAULT_PRE 32
+#define CAPTURE_DEFAULT_POST 16
+
+// What triggered a capture, bits of capture_slot::causes.
+enum CAPTURE_CAUSES {
+  CAPTURE_CAUSE_SPC     = 0x01,   // A new process control alarm.
+  CAPTURE_CAUSE_FAULT   = 0x02,   // A newly raised frame fault.
+  CAPTURE_CAUSE_COMMAND = 0x04    // Asked for by the host.
+};
+#define CAPTURE_ALL_CAUSES 0x07
+
+enum CAPTURE_STATES {
+  CAPTURE_FREE      = 0,
+  CAPTURE_LIVE      = 1,    // Recording, no trigger yet.
+  CAPTURE_TRIGGERED = 2,    // Recording the post trigger frames.
+  CAPTURE_HELD      = 3     // Frozen until released.
+};
+
+// One frame, as read.
+struct capture_sample {
+  int64_t device_time_us;
+  uint32_t frame;
+  uint16_t raw[4];          // Pulse widths, us, saturated.
+  uint16_t faults;          // enum SENSOR_FAULTS.
+  uint8_t class_index;
+};
+
+struct capture_slot {
+  uint8_t state;
+  uint8_t causes;
+  uint16_t id;              // Counts up per capture, tells them apart.
+  bool announced;           // Returned by capture_completed() yet.
+
+  // Samples written to the segment, and where the capture starts in it.
+  uint32_t written;
+  uint32_t start;
+
+  uint8_t pre;
+  uint8_t post;
+  uint8_t post_left;        // CAPTURE_TRIGGERED: frames still to record.
+};
+
+struct capture_recorder {
+  capture_sample samples[CAPTURE_SEGMENTS][CAPTURE_DEPTH];
+  capture_slot slots[CAPTURE_SEGMENTS];
+  uint8_t live;
+
+  // Configuration, applied to the next trigger.
+  uint8_t pre;
+  uint8_t post;
+  uint8_t causes;           // Causes allowed to trigger.
+
+  uint16_t next_id;
+  uint32_t captures;
+  uint32_t missed;          // Triggers dropped with every segment held.
+};
+
+void capture_init(capture_recorder &c);
+
+// Sets the frames kept before and after the trigger frame and the causes
+//  that trigger. Returns false, changing nothing, if they don't fit.
+bool capture_configure(
+  capture_recorder &c,
+  uint8_t pre,
+  uint8_t post,
+  uint8_t causes
+);
+
+// The sample to fill in for the next frame, in the live segment. It becomes
+//  part of the history on capture_commit().
+capture_sample &capture_next(capture_recorder &c);
+void capture_commit(capture_recorder &c);
+
+// Triggers on the last committed frame. A trigger while the post frames of
+//  another are being recorded adds its cause to that capture. Returns false
+//  if the trigger was dropped: cause not enabled, nothing recorded yet, or no
+//  segment free.
+bool capture_trigger(capture_recorder &c, uint8_t cause);
+
+// A capture completed since the last call, or -1. Each is returned once.
+int capture_completed(capture_recorder &c);
+
+// The held capture in slot, or NULL if there's none.
+const capture_slot *capture_held(const capture_recorder &c, uint8_t slot);
+
+// Sample i of a held capture, 0 the oldest. The trigger frame is at
+//  capture_slot::pre.
+const capture_sample &capture_at(
+  const capture_recorder &c,
+  uint8_t slot,
+  uint16_t i
+);
+
+// Samples in a held capture.
+uint16_t capture_length(const capture_slot &slot);
+
+// Frees a held capture. Returns false if slot isn't held.
+bool capture_release(capture_recorder &c, uint8_t slot);
+
+#endif
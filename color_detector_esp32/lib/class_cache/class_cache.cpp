@@ -0,0 +1,106 @@
+#include "class_cache.h"
+
+#include "color_core.h"
+
+// Bits per channel in a key: the shift, up to 16 - CLASS_CACHE_MANTISSA_BITS,
+//  in 4 bits over the kept mantissa.
+#define CLASS_CACHE_CHANNEL_BITS (CLASS_CACHE_MANTISSA_BITS + 4)
+
+// Noise buckets, in the two bits above the channels.
+#define CLASS_CACHE_NOISE_BUCKETS 4
+
+void class_cache_init(class_cache &cache){
+  for(uint16_t i=0; i<CLASS_CACHE_ENTRIES; i++)
+    cache.entries[i].generation = 0;
+  cache.generation = 1;
+  cache.hits = 0;
+  cache.misses = 0;
+
+  return;
+}
+
+void class_cache_invalidate(class_cache &cache){
+  // Only a wrap back to 0 has to touch the entries, once every 2^32 changes.
+  if(++cache.generation == 0){
+    for(uint16_t i=0; i<CLASS_CACHE_ENTRIES; i++)
+      cache.entries[i].generation = 0;
+    cache.generation = 1;
+  }
+
+  return;
+}
+
+// A pulse width's top CLASS_CACHE_MANTISSA_BITS significant bits and how far
+//  they were shifted down.
+static uint32_t class_cache_channel(int raw){
+  uint32_t width = raw > 0xFFFF ? 0xFFFF : raw;
+  uint32_t shift = 0;
+  if(width >> CLASS_CACHE_MANTISSA_BITS)
+    shift = (32 - __builtin_clz(width)) - CLASS_CACHE_MANTISSA_BITS;
+
+  return (shift << CLASS_CACHE_MANTISSA_BITS) | (width >> shift);
+}
+
+uint32_t class_cache_key(const int raw[3], const uint32_t variances[3]){
+  uint32_t key = 0;
+  for(uint8_t c=0; c<3; c++){
+    if(raw[c] <= 0)
+      return CLASS_CACHE_NO_KEY;
+    key = (key << CLASS_CACHE_CHANNEL_BITS) | class_cache_channel(raw[c]);
+  }
+
+  // The classifier widens each pair's radius by two standard deviations of
+  //  the pair's difference, so the noisiest pair's widening is at least
+  //  CLASS_CACHE_NOISE_STEP * bucket when its summed variance is at least
+  //  (CLASS_CACHE_NOISE_STEP * bucket / 2)^2.
+  uint64_t worst = 0;
+  for(uint8_t i=0; i<3; i++){
+    uint64_t pair = (uint64_t)variances[i] + variances[(i + 1) % 3];
+    if(pair > worst)
+      worst = pair;
+  }
+  uint32_t bucket = 0;
+  while(bucket + 1 < CLASS_CACHE_NOISE_BUCKETS){
+    uint64_t half = (uint64_t)CLASS_CACHE_NOISE_STEP * (bucket + 1) / 2;
+    if(worst < (half * half) << COLOR_VAR_FRAC_BITS)
+      break;
+    bucket++;
+  }
+
+  return (bucket << (3 * CLASS_CACHE_CHANNEL_BITS)) | key;
+}
+
+// Slot of a key, Fibonacci hashed so neighbouring bins spread out.
+static uint16_t class_cache_slot(uint32_t key){
+  return (uint32_t)(key * 2654435761UL) >> (32 - CLASS_CACHE_BITS);
+}
+
+bool class_cache_get(
+  class_cache &cache,
+  uint32_t key,
+  class_cache_value &value
+){
+  const class_cache_entry &entry = cache.entries[class_cache_slot(key)];
+  if(entry.generation != cache.generation || entry.key != key){
+    cache.misses++;
+    return false;
+  }
+
+  cache.hits++;
+  value = entry.value;
+
+  return true;
+}
+
+void class_cache_put(
+  class_cache &cache,
+  uint32_t key,
+  const class_cache_value &value
+){
+  class_cache_entry &entry = cache.entries[class_cache_slot(key)];
+  entry.key = key;
+  entry.generation = cache.generation;
+  entry.value = value;
+
+  return;
+}
@@ -0,0 +1,83 @@
+// Direct-mapped RAM cache of per frame classification results.
+//  Classifying a frame (color_classify_noisy() and its confidence, in double
+//    precision, plus the palette match) costs far more than looking it up,
+//    and a line runs the same few product colors past the head all day, so
+//    its readings keep landing on the same handful of keys. Rather than a
+//    precomputed table over every reading, which would cost flash and need
+//    rebuilding on every calibration change, results are cached as they are
+//    computed: a miss runs the exact classifier and fills the slot.
+//  Keys are the raw R, G, B pulse widths quantised relative to their size,
+//    CLASS_CACHE_MANTISSA_BITS significant bits each (bins of 1.6-3%, about
+//    the sensor's own period jitter), plus how far the readings' noise
+//    widens the classifier's black/white radius, in CLASS_CACHE_NOISE_STEP
+//    steps. A slot holds whichever reading of its bin filled it, so readings
+//    right on a class boundary may come back with their neighbour's class.
+//  Every slot is tagged with the generation it was filled in. Invalidating
+//    bumps the generation, dropping every entry at once without touching
+//    them, so a calibration or palette change costs nothing up front.
+#ifndef CLASS_CACHE_H
+#define CLASS_CACHE_H
+
+#include <stdint.h>
+
+// log2 of the number of slots.
+#define CLASS_CACHE_BITS 8
+#define CLASS_CACHE_ENTRIES (1 << CLASS_CACHE_BITS)
+
+// Significant bits kept of each pulse width.
+#define CLASS_CACHE_MANTISSA_BITS 6
+
+// Black/white radius widening per noise bucket, calibrated units. Four
+//  buckets cover up to COLOR_NOISE_MAX_WIDEN.
+#define CLASS_CACHE_NOISE_STEP 6
+
+// Returned by class_cache_key() for frames that aren't cached (a channel
+//  timed out). No real key has all bits set.
+#define CLASS_CACHE_NO_KEY 0xFFFFFFFF
+
+// What a frame classifies to.
+struct class_cache_value {
+  uint8_t class_index;
+  uint8_t confidence;
+  uint16_t palette_index;
+};
+
+struct class_cache_entry {
+  uint32_t key;
+  uint32_t generation;    // 0 never matches.
+  class_cache_value value;
+};
+
+struct class_cache {
+  class_cache_entry entries[CLASS_CACHE_ENTRIES];
+  uint32_t generation;
+  uint32_t hits;
+  uint32_t misses;
+};
+
+// Empties the cache and clears its counters.
+void class_cache_init(class_cache &cache);
+
+// Drops every entry, e.g. after a calibration or palette change.
+void class_cache_invalidate(class_cache &cache);
+
+// Key of a frame from its raw R, G, B pulse widths and calibrated variances.
+//  Returns CLASS_CACHE_NO_KEY if a channel timed out.
+uint32_t class_cache_key(const int raw[3], const uint32_t variances[3]);
+
+// Looks key up, counting a hit or a miss. Returns true and fills value on a
+//  hit.
+bool class_cache_get(
+  class_cache &cache,
+  uint32_t key,
+  class_cache_value &value
+);
+
+// Stores the exact result for key, evicting whatever shared its slot.
+void class_cache_put(
+  class_cache &cache,
+  uint32_t key,
+  const class_cache_value &value
+);
+
+#endif
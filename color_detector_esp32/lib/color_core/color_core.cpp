@@ -0,0 +1,361 @@
+#include "color_core.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Min and max reading values used to map each  of the color channels to typical
+//  RGB 0->255 values.
+//  Format is [COLOR_CHANNELS::<COLOR>][{MIN, MAX}]
+//  Note: these values are determined empirically, and for a cheap sensor like
+//    the TCS2300 (w/o mountains of effort at least) these are nothing but a 
+//    vain attempt at real calibration.
+//    To calibrate though use whatever power source the final circuit intends to
+//      use, in lighting conditions similar to the use case environment, and 
+//      read in a few readings using known red, green, and blue colored objects
+//      in front of the sensor. Note down the lowest and highest values, then
+//      plug those two values in to this array.
+//  Think the best reasonable result here is to find the absolute min/max values
+//    possible and use those, that way the values mapped will never exceed the
+//    [0,255] range.
+//  Final values we chose the lowest/highest for each between the two tests.
+int color_read_calib_vals[4][2]{
+  {1, 111}, 
+  {2, 125},
+  {1, 101},
+  {0, 255}
+};
+
+// +- value determining spread of values that indicate the read color is 
+//  either black or white (closest match of the 5 alloted colors we have 
+//  mapped).
+// Note that this value is radial, meaning full deviation range can be twice
+//  this value.
+// To determine an appropriate value here we need to finalize our test samples
+//  test each, find the smallest deviation between the RGB tests and the 
+//  readings, i.e. for each color tested figure out what the smallest range
+//  between the positive RGB color reading is and the negative RGB colors then
+//  that value, minus some tolerance, is this value.
+//  Ex. Red paper: RGB reads 255,200,200.
+//      Grn paper: RGB reads 200,245,200.
+//      Blu paper: RGB reads 200,200,235.
+//        Blue's 235 is the smallest difference between the red and green for
+//          its reading, so our b/w threshold determiner is 35.
+static const uint8_t wb_deviation = 8;
+
+// Threshold for determining whether a positive black/white reading is either
+//  black or white.
+//  Note that we are currently defining this as a multiplicative value for 
+//    ease of transcription.
+//    i.e. if each channel returns a value greater than N, where N * 3 = deter
+//      then we assume white, else black.
+static const uint16_t wb_determine = 220 * 3;
+
+// Standard deviations of a channel difference the black/white radius grows by,
+//  and the most it may grow by so a timed out channel can't swallow every
+//  class.
+#define COLOR_NOISE_SIGMAS 2
+#define COLOR_NOISE_MAX_WIDEN 24
+
+// Black/white radius for the channel pair i, j.
+static double color_bw_radius(
+  const uint32_t variances[4],
+  uint8_t i,
+  uint8_t j
+){
+  uint64_t var = (uint64_t)variances[i] + variances[j];
+  double widen =
+    COLOR_NOISE_SIGMAS * sqrt((double)var / (1 << COLOR_VAR_FRAC_BITS));
+  if(widen > COLOR_NOISE_MAX_WIDEN)
+    widen = COLOR_NOISE_MAX_WIDEN;
+
+  return wb_deviation + widen;
+}
+
+static const uint32_t color_no_variances[4] = {0, 0, 0, 0};
+
+uint32_t color_raw_variance(int raw){
+  if(raw <= 0)
+    return COLOR_VAR_UNKNOWN;
+
+  // Quantisation, 1/12 us^2, plus (raw * jitter)^2.
+  uint64_t jitter = (uint64_t)raw * COLOR_PERIOD_JITTER_PPT;
+  uint64_t var =
+    ((1 << COLOR_VAR_FRAC_BITS) / 12) +
+    ((jitter * jitter) << COLOR_VAR_FRAC_BITS) / 1000000;
+  if(var > COLOR_VAR_UNKNOWN)
+    return COLOR_VAR_UNKNOWN;
+
+  return (uint32_t)var;
+}
+
+uint32_t color_calibrate_variance(uint32_t raw_variance, uint8_t color_index){
+  if(raw_variance == COLOR_VAR_UNKNOWN)
+    return COLOR_VAR_UNKNOWN;
+
+  // Same slope as color_calibrate_channel(), squared.
+  int64_t span =
+    color_read_calib_vals[color_index][1] -
+    color_read_calib_vals[color_index][0];
+  if(span == 0)
+    return COLOR_VAR_UNKNOWN;
+  uint64_t var =
+    (uint64_t)raw_variance * 255 * 255 / (uint64_t)(span * span);
+  if(var > COLOR_VAR_UNKNOWN)
+    return COLOR_VAR_UNKNOWN;
+
+  return (uint32_t)var;
+}
+
+int color_calibrate_channel(int raw, uint8_t color_index){
+  // Map values to a typical RGB 0-255 format.
+  //  Note the reversal of min/max in the second pair of params is intentional
+  //    as the raw TCS2300 output is reversed from RGB value expectations.
+  //  Same integer math as Arduino's map(), spelled out so this builds off 
+  //    target.
+  long in_min = color_read_calib_vals[color_index][0];
+  long in_max = color_read_calib_vals[color_index][1];
+  long out_min = 255;
+  long out_max = 0;
+
+  return (raw - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+uint8_t color_classify(const int readings[4]){
+  return color_classify_noisy(readings, color_no_variances);
+}
+
+uint8_t color_classify_noisy(
+  const int readings[4],
+  const uint32_t variances[4]
+){
+  //    Testing for outliers (Grubb's test or ESD (extreme studentized deviate))
+  //      Z = ABS(mean - value) / SD  
+  //        Where SD is standard deviation(?)
+  //        Max value of Z can be computed with (N - 1) / SQR(N).
+  //          In our case of N = 3 Zmax = 1.155
+  //      SD = SQR((1 / N) * SUM((Ni - MEAN)^2))
+  //        Explained: 
+  //          Find MEAN (just an average of set N).
+  //          For each value in set N, indexed by i:
+  //            Subtract the mean, square the result.
+  //          Divide the total summation by N to get the mean of the differences
+  //          Take the square root of the result to get the standard deviation.
+
+  bool red_in_bw_rng = false;
+  bool grn_in_bw_rng = false;
+  bool blu_in_bw_rng = false;
+
+  // TODO: think we're currently using the mapped values for calculations here,
+  //  this shouldn't be an issue, but it can throw off some of the calibration
+  //  values we use (like wb_deviation values) when we modify the mapping HI/LOW
+  //  values. Should instead use the raw values, this however does come at the
+  //  cost of inverting the logic, since the mapping is moving the raw from
+  //  0=white to 255=white.
+
+  // Deviation range for each channel pair, widened by the readings' noise.
+  double rg_dev = color_bw_radius(variances, 0, 1);
+  double rb_dev = color_bw_radius(variances, 0, 2);
+  double gb_dev = color_bw_radius(variances, 1, 2);
+
+  // Determine if each color channel's reading is within deviation range for
+  //  eiter black or white.
+  if(
+    abs(readings[0] - readings[1]) < rg_dev &&
+    abs(readings[0] - readings[2]) < rb_dev
+  ){
+    red_in_bw_rng = true;
+  }
+  if(
+    abs(readings[1] - readings[0]) < rg_dev &&
+    abs(readings[1] - readings[2]) < gb_dev
+  ){
+    grn_in_bw_rng = true;
+  }  
+  if(
+    abs(readings[2] - readings[0]) < rb_dev &&
+    abs(readings[2] - readings[1]) < gb_dev
+  ){
+    blu_in_bw_rng = true;
+  }
+
+  // If color is in range of black or white determine which of the two it is.
+  if(red_in_bw_rng && grn_in_bw_rng && blu_in_bw_rng){
+    if(readings[0] + readings[1] + readings[2] > wb_determine)
+      return COLOR_STR_MAP::WHITE_STR;
+    else
+      return COLOR_STR_MAP::BLACK_STR;
+  }
+
+  // Color readings do not indicate black or white, so we need to find which of
+  //  the other three possible colors it is.
+  //  To do so we use an outlier test, assuming a single outlier on a color
+  //    channel is the positive color. This works only with a very limited set 
+  //    of primary colors, i.e. any mixed colors will throw this off 
+  //    significantly and we'd need to go back to something like Euclidean 
+  //    distance for mapping the RGB values to strings instead.
+  double avg = (readings[0] + readings[1] + readings[2]) / 3;
+  double std_dev = 
+    sqrt(
+      (
+        pow(readings[0] - avg, 2) + 
+        pow(readings[1] - avg, 2) + 
+        pow(readings[2] - avg, 2)
+      )
+      / 3
+    );
+  
+  // Compute the actual Grubb's outlier value for each channel.
+  double red_outlier = abs(avg - readings[0]) / std_dev;
+  double grn_outlier = abs(avg - readings[1]) / std_dev;
+  double blu_outlier = abs(avg - readings[2]) / std_dev;   
+
+  // Return the highest outlier found as the color mapping.
+  // Nested if statement checks for the edge case where the outlier is in the
+  //  negative direction (i.e. below the other two readings). This doesn't
+  //  indicate a positive for that color but rather a negative for any color we
+  //  have mapped, so we return the undefined condition signifier.
+  if(red_outlier > grn_outlier && red_outlier > blu_outlier){
+    if(readings[0] < readings[1] || 
+       readings[0] < readings[1])
+        return COLOR_STR_MAP::UNDEF_STR;
+    else
+      return COLOR_STR_MAP::RED_STR;
+  }
+
+  if(grn_outlier > red_outlier && grn_outlier > blu_outlier){
+    if(readings[1] < readings[0] || 
+       readings[1] < readings[2])
+        return COLOR_STR_MAP::UNDEF_STR;
+    else
+      return COLOR_STR_MAP::GREEN_STR;
+  }
+
+  if(blu_outlier > red_outlier && blu_outlier > grn_outlier){
+    if(readings[2] < readings[0] || 
+       readings[2] < readings[1])
+        return COLOR_STR_MAP::UNDEF_STR;
+    else
+      return COLOR_STR_MAP::BLUE_STR;
+  }
+
+  // 255 is color mapping error code, if we reach this we haven't 
+  //  deterministically found a string to map the read in color to and couldn't
+  //  determine that the color was just undefined.
+  //  Note that with how simplistically we're determining color mappings here 
+  //    hitting this condition isn't atypical, just not ideal.
+  return COLOR_MAP_ERR;
+
+  /*
+  // Method using the Euclidean distance formula.
+  //  This method is much more verbose, but also much more dependent on clean
+  //    input data, so it didn't work well.
+  //  Keeping it here as a reference if any future development tries to take 
+  //    this further.
+  //    Math.sqrt(
+  //            Math.pow(targetRgb[0] - reading[0], 2) +
+  //            Math.pow(targetRgb[1] - reading[1], 2) +
+  //            Math.pow(targetRgb[2] - reading[2], 2)
+
+  double min_dist = 99999;
+  uint8_t min_dist_index = 255;
+
+  for(uint8_t i=0; i<RGB_VAL_MAPPING_LEN; i++){
+    // Using Euclidean distance formula to find closest color match.
+    double dist = sqrt(
+      pow(RGB_VALS[i][0] - readings[0], 2) + 
+      pow(RGB_VALS[i][1] - readings[1], 2) + 
+      pow(RGB_VALS[i][2] - readings[2], 2)
+    );
+
+    if(dist < min_dist){
+      min_dist = dist;
+      min_dist_index = i;
+    }
+  }
+
+  return min_dist_index;
+  */
+}
+
+uint8_t color_classify_confidence(const int readings[4], uint8_t class_index){
+  return color_classify_confidence_noisy(
+    readings,
+    color_no_variances,
+    class_index
+  );
+}
+
+uint8_t color_classify_confidence_noisy(
+  const int readings[4],
+  const uint32_t variances[4],
+  uint8_t class_index
+){
+  if(class_index == COLOR_STR_MAP::BLACK_STR ||
+     class_index == COLOR_STR_MAP::WHITE_STR){
+    // Black/white is decided by two thresholds, the channel spread and the
+    //  brightness sum. Confidence is the margin to whichever is closer, the
+    //  spread margin taken for the pair closest to its (noise widened)
+    //  radius.
+    double spread_margin = 1;
+    for(uint8_t i=0; i<3; i++){
+      for(uint8_t j=i+1; j<3; j++){
+        double radius = color_bw_radius(variances, i, j);
+        double margin = (radius - abs(readings[i] - readings[j])) / radius;
+        if(margin < spread_margin)
+          spread_margin = margin;
+      }
+    }
+    double level_margin =
+      fabs((double)(readings[0] + readings[1] + readings[2]) - wb_determine)
+      / (3.0 * wb_deviation);
+
+    double margin = spread_margin < level_margin ? spread_margin : level_margin;
+    if(margin < 0)
+      margin = 0;
+    if(margin > 1)
+      margin = 1;
+    return (uint8_t)(margin * 100 + 0.5);
+  }
+
+  if(class_index == COLOR_STR_MAP::RED_STR ||
+     class_index == COLOR_STR_MAP::GREEN_STR ||
+     class_index == COLOR_STR_MAP::BLUE_STR ||
+     class_index == COLOR_STR_MAP::UNDEF_STR){
+    // Outlier classes are decided by which channel has the largest Grubb's
+    //  value, so confidence is the gap between the largest and the runner up.
+    //  With N = 3 and the population SD used by color_classify() the gap peaks
+    //    at SQR(2) / 2, one channel away from two equal ones.
+    double avg = (readings[0] + readings[1] + readings[2]) / 3;
+    double std_dev =
+      sqrt(
+        (
+          pow(readings[0] - avg, 2) +
+          pow(readings[1] - avg, 2) +
+          pow(readings[2] - avg, 2)
+        )
+        / 3
+      );
+    if(std_dev == 0)
+      return 0;
+
+    double first = 0;
+    double second = 0;
+    for(uint8_t i=0; i<3; i++){
+      double outlier = fabs(avg - readings[i]) / std_dev;
+      if(outlier > first){
+        second = first;
+        first = outlier;
+      }
+      else if(outlier > second){
+        second = outlier;
+      }
+    }
+
+    double margin = (first - second) / (M_SQRT2 / 2);
+    if(margin > 1)
+      margin = 1;
+    return (uint8_t)(margin * 100 + 0.5);
+  }
+
+  return 0;
+}
@@ -0,0 +1,105 @@
+// Portable calibration and classification core.
+//  Everything that turns raw TCS3200 pulse widths into RGB values and a color
+//    class lives here, free of any Arduino includes, so the host tools and the
+//    Python bindings run exactly the logic the firmware does.
+#ifndef COLOR_CORE_H
+#define COLOR_CORE_H
+
+#include <stdint.h>
+
+// Mapping for different color logic paths.
+//  Warning: Order is assumed elsewhere through direct mapping using integers
+//    and should not be modified without significant code review.
+enum COLOR_CHANNELS {
+  RED =   0,
+  GREEN = 1,
+  BLUE =  2,
+  CLEAR=  3
+};
+
+// Number of RGB mapping values we have stored, this is used to link the lengths
+//  of the RGB values array and the string mapping array.
+#define RGB_VAL_MAPPING_LEN 6
+
+// Used for mapping int's to output strings in the arrays that follow.
+enum COLOR_STR_MAP {
+  RED_STR   = 0,
+  GREEN_STR = 1,
+  BLUE_STR  = 2,
+  BLACK_STR = 3,
+  WHITE_STR = 4,
+  UNDEF_STR = 5
+};
+
+// Returned by color_classify() when no class could be determined.
+#define COLOR_MAP_ERR 255
+
+// Min and max reading values used to map each  of the color channels to typical
+//  RGB 0->255 values.
+//  Format is [COLOR_CHANNELS::<COLOR>][{MIN, MAX}]
+//  See color_core.cpp for how these are determined.
+extern int color_read_calib_vals[4][2];
+
+// Maps a raw pulse width reading for the given channel to a typical RGB 0-255
+//  value using color_read_calib_vals.
+//  Matches Arduino's map(), integer math truncating toward zero, and isn't
+//    clamped so out of calibration readings can fall outside [0,255].
+int color_calibrate_channel(int raw, uint8_t color_index);
+
+// Reading variances are fixed point with COLOR_VAR_FRAC_BITS fractional bits,
+//  in squared units of the reading they describe (us^2 for raw pulse widths,
+//  squared 0-255 steps once calibrated).
+#define COLOR_VAR_FRAC_BITS 8
+
+// Variance of a reading that carries no information, e.g. a timed out pulse.
+#define COLOR_VAR_UNKNOWN UINT32_MAX
+
+// Relative period jitter of the TCS3200's output, parts per thousand of the
+//  pulse width, ~1.3us on the ~110us black pulses. Refine it from the spread
+//  of repeated readings of a fixed target under the final lighting.
+#define COLOR_PERIOD_JITTER_PPT 12
+
+// Variance of a raw pulse width.
+//  pulseIn() gates a single LOW half period of the TCS3200's output, counting
+//    whole microseconds, so each reading carries 1/12 us^2 of quantisation
+//    noise. On top of that the light to frequency converter's period jitters
+//    by a roughly fixed fraction of the period, so dark channels, with their
+//    long pulses, are much noisier in absolute terms than bright ones.
+//  Returns COLOR_VAR_UNKNOWN for raw <= 0 (timeouts).
+uint32_t color_raw_variance(int raw);
+
+// Carries a raw variance through color_calibrate_channel()'s linear map for
+//  the given channel, saturating at COLOR_VAR_UNKNOWN.
+uint32_t color_calibrate_variance(uint32_t raw_variance, uint8_t color_index);
+
+// Maps calibrated RGB readings, indexed by enum COLOR_CHANNELS, to the index of
+//  the closest color string (enum COLOR_STR_MAP).
+//  Only the red, green and blue entries are used.
+//  Returns COLOR_MAP_ERR on error.
+uint8_t color_classify(const int readings[4]);
+
+// As color_classify(), with the calibrated readings' variances.
+//  The black/white test compares channel differences against a fixed radius,
+//    so on dark parts counting noise alone pushes readings out of it and the
+//    part comes back as a color or undefined. Here each pair's radius is
+//    widened by COLOR_NOISE_SIGMAS standard deviations of that pair's
+//    difference, capped at COLOR_NOISE_MAX_WIDEN. With all variances 0 it is
+//    exactly color_classify().
+uint8_t color_classify_noisy(
+  const int readings[4],
+  const uint32_t variances[4]
+);
+
+// How clearly the readings fall into class_index, 0 (on a decision boundary)
+//  to 100, from the margin to the thresholds color_classify() used to pick it.
+//  Returns 0 for COLOR_MAP_ERR.
+uint8_t color_classify_confidence(const int readings[4], uint8_t class_index);
+
+// As color_classify_confidence(), for classes from color_classify_noisy().
+uint8_t color_classify_confidence_noisy(
+  const int readings[4],
+  const uint32_t variances[4],
+  uint8_t class_index
+);
+
+#endif
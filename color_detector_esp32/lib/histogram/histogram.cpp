@@ -0,0 +1,90 @@
+#include "histogram.h"
+
+#include <string.h>
+
+void hist_init(raw_histogram &h){
+  h.scale = HIST_LOG;
+  h.shift = 0;
+  h.lo = 0;
+  hist_reset(h);
+
+  return;
+}
+
+bool hist_configure(
+  raw_histogram &h,
+  uint8_t scale,
+  uint16_t lo,
+  uint8_t shift
+){
+  if(scale != HIST_LOG && scale != HIST_LINEAR)
+    return false;
+  if(scale == HIST_LINEAR && shift > 16)
+    return false;
+
+  h.scale = scale;
+  h.lo = scale == HIST_LINEAR ? lo : 0;
+  h.shift = scale == HIST_LINEAR ? shift : 0;
+  hist_reset(h);
+
+  return true;
+}
+
+void hist_reset(raw_histogram &h){
+  memset(h.samples, 0, sizeof(h.samples));
+  memset(h.counts, 0, sizeof(h.counts));
+
+  return;
+}
+
+uint32_t hist_bin_lo(const raw_histogram &h, uint16_t bin){
+  if(h.scale == HIST_LINEAR)
+    return h.lo + ((uint32_t)bin << h.shift);
+
+  if(bin < 2 * HIST_LOG_SUB)
+    return bin;
+  uint8_t octave = bin >> HIST_LOG_SUB_BITS;
+
+  return (uint32_t)(HIST_LOG_SUB + (bin & (HIST_LOG_SUB - 1))) << (octave - 1);
+}
+
+uint32_t hist_bin_width(const raw_histogram &h, uint16_t bin){
+  if(h.scale == HIST_LINEAR)
+    return 1UL << h.shift;
+
+  if(bin < 2 * HIST_LOG_SUB)
+    return 1;
+
+  return 1UL << ((bin >> HIST_LOG_SUB_BITS) - 1);
+}
+
+int32_t hist_percentile(
+  const raw_histogram &h,
+  uint8_t channel,
+  uint16_t permille
+){
+  const uint32_t *counts = h.counts[channel];
+  if(!h.samples[channel])
+    return -1;
+  if(permille > 1000)
+    permille = 1000;
+
+  // Ranks in thousandths of a reading, so nothing is lost to rounding.
+  uint64_t target = (uint64_t)h.samples[channel] * permille;
+  uint64_t below = 0;
+  uint16_t last = 0;
+  for(uint16_t bin=0; bin<HIST_BINS; bin++){
+    if(!counts[bin])
+      continue;
+    uint64_t in_bin = (uint64_t)counts[bin] * 1000;
+    last = bin;
+    if(below + in_bin >= target){
+      uint64_t into = (target - below) * hist_bin_width(h, bin) / in_bin;
+      return hist_bin_lo(h, bin) + (int32_t)into;
+    }
+    below += in_bin;
+  }
+
+  // Only if samples ran ahead of the counts, e.g. read mid update.
+  return hist_bin_lo(h, last) + hist_bin_width(h, last);
+}
@@ -0,0 +1,97 @@
+// Per channel histograms of raw pulse widths, for calibration and diagnostics.
+//  color_min_max_readings only keeps the two most extreme readings since
+//    boot, so a single glitch or a hand passing in front of the sensor sets
+//    the calibration. Counting every reading instead lets a calibration take
+//    robust percentiles (e.g. p1 and p99) and shows the shape of each
+//    channel's distribution.
+//  Adding a reading is a bin lookup and an increment, no loops or divisions:
+//    HIST_LOG bins are log spaced, HIST_LOG_SUB per octave of pulse width
+//      from 2 * HIST_LOG_SUB us up (exact below), found from the reading's
+//      leading bit, so every bin is within 1/HIST_LOG_SUB of its value across
+//      the whole 16 bit range;
+//    HIST_LINEAR bins are 2^shift us wide from lo, for a closer look at one
+//      range, readings outside it pile up in the end bins.
+//  Kept free of any Arduino includes so the host tools compute percentiles
+//    from downloaded histograms with the exact same code.
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_CHANNELS 4
+
+// Log scale bins per octave, a power of two.
+#define HIST_LOG_SUB_BITS 4
+#define HIST_LOG_SUB (1 << HIST_LOG_SUB_BITS)
+
+// Enough log scale bins for 16 bit readings, larger ones are saturated.
+#define HIST_BINS ((16 - HIST_LOG_SUB_BITS + 1) << HIST_LOG_SUB_BITS)
+
+enum HIST_SCALES {
+  HIST_LOG    = 0,
+  HIST_LINEAR = 1
+};
+
+struct raw_histogram {
+  uint8_t scale;            // enum HIST_SCALES.
+  uint8_t shift;            // HIST_LINEAR: bins are 2^shift us wide,
+  uint16_t lo;              //  the first starting at lo.
+  uint32_t samples[HIST_CHANNELS];
+  uint32_t counts[HIST_CHANNELS][HIST_BINS];
+};
+
+// Starts out empty on the log scale.
+void hist_init(raw_histogram &h);
+
+// Switches scale and empties the histogram. Returns false, changing nothing,
+//  for an unknown scale or a shift the 16 bit range can't use.
+bool hist_configure(
+  raw_histogram &h,
+  uint8_t scale,
+  uint16_t lo,
+  uint8_t shift
+);
+
+// Empties every channel, keeping the scale.
+void hist_reset(raw_histogram &h);
+
+// Bin raw falls in.
+static inline uint16_t hist_bin(const raw_histogram &h, uint32_t raw){
+  if(h.scale == HIST_LINEAR){
+    uint32_t bin = raw < h.lo ? 0 : (raw - h.lo) >> h.shift;
+    return bin < HIST_BINS ? bin : HIST_BINS - 1;
+  }
+
+  if(raw > 0xFFFF)
+    raw = 0xFFFF;
+  if(raw < 2 * HIST_LOG_SUB)
+    return raw;
+  // The octave from the leading bit, the bits below it pick the bin in it.
+  uint8_t msb = 31 - __builtin_clz(raw);
+  uint8_t drop = msb - HIST_LOG_SUB_BITS;
+  uint16_t octave = (drop + 1) << HIST_LOG_SUB_BITS;
+
+  return octave | ((raw >> drop) & (HIST_LOG_SUB - 1));
+}
+
+// Counts one reading of a channel. Inline, it runs for every channel read.
+static inline void hist_add(raw_histogram &h, uint8_t channel, uint32_t raw){
+  h.counts[channel][hist_bin(h, raw)]++;
+  h.samples[channel]++;
+}
+
+// Lowest reading a bin holds, and its width. The last bin of either scale
+//  also holds everything above it.
+uint32_t hist_bin_lo(const raw_histogram &h, uint16_t bin);
+uint32_t hist_bin_width(const raw_histogram &h, uint16_t bin);
+
+// Reading below which permille thousandths of a channel's readings fall,
+//  interpolated within the bin it lands in.
+//  Returns -1 if the channel has no readings.
+int32_t hist_percentile(
+  const raw_histogram &h,
+  uint8_t channel,
+  uint16_t permille
+);
+
+#endif
@@ -0,0 +1,87 @@
+#include "illumination.h"
+
+// 255 / 2^(step / 2), rounded.
+const uint8_t illum_step_duty[ILLUM_STEPS] = {
+  255, 180, 128, 90, 64, 45, 32, 23
+};
+
+void illum_controller_init(illum_controller &ctl, uint16_t max_pulse_us){
+  ctl.max_pulse_us = max_pulse_us;
+  ctl.automatic = true;
+  ctl.step = 0;
+  ctl.settled_frames = 0;
+
+  return;
+}
+
+void illum_set_mode(illum_controller &ctl, bool automatic, uint8_t step){
+  ctl.automatic = automatic;
+  if(!automatic && step < ILLUM_STEPS && step != ctl.step){
+    ctl.step = step;
+    ctl.settled_frames = 0;
+  }
+
+  return;
+}
+
+uint8_t illum_update(illum_controller &ctl, const int raw[3]){
+  if(!ctl.automatic)
+    return ctl.step;
+
+  uint8_t next = ctl.step;
+  uint32_t longest = 0;
+  bool timed_out = false;
+  for(uint8_t i=0; i<3; i++){
+    if(raw[i] <= 0)
+      timed_out = true;
+    else if((uint32_t)raw[i] > longest)
+      longest = raw[i];
+  }
+
+  if(timed_out){
+    // Too dark to measure at all, no prediction to go on. Brighten a full
+    //  stop and look again.
+    next = next >= 2 ? next - 2 : 0;
+  }
+  else if(longest > ctl.max_pulse_us || longest * 2 <= ctl.max_pulse_us){
+    // Outside the one stop band under the ceiling. Pulses scale with
+    //  1 / duty, take the dimmest step predicted to stay under it. Steps are
+    //  half a stop apart so that lands inside the band, which is what keeps
+    //  the loop from hunting between neighbouring steps. pulseIn() truncates,
+    //  so predict from the top of the reading's 1us bin.
+    uint32_t scaled = (longest + 1) * illum_step_duty[ctl.step];
+    next = ILLUM_STEPS - 1;
+    while(
+      next > 0 &&
+      scaled > (uint32_t)ctl.max_pulse_us * illum_step_duty[next]
+    ){
+      next--;
+    }
+  }
+
+  if(next != ctl.step){
+    ctl.step = next;
+    ctl.settled_frames = 0;
+  }
+  else if(ctl.settled_frames != 0xFFFF){
+    ctl.settled_frames++;
+  }
+
+  return ctl.step;
+}
+
+void illum_derive_calib(
+  const int full[4][2],
+  uint8_t step,
+  int out[4][2]
+){
+  for(uint8_t i=0; i<4; i++){
+    for(uint8_t j=0; j<2; j++){
+      out[i][j] =
+        (full[i][j] * ILLUM_DUTY_MAX + illum_step_duty[step] / 2) /
+        illum_step_duty[step];
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,56 @@
+// Closed loop brightness control for the sensor module's illumination LEDs.
+//  The TCS3200's output period is inversely proportional to the light
+//    reaching it, so a pulseIn() reading at LED duty d reads roughly
+//    raw_full * 255 / d (ambient light makes it somewhat less). Dim LEDs give
+//    long pulses, which are resolved more finely by pulseIn()'s 1us ticks but
+//    take longer to measure, and bright ones the opposite.
+//  The controller picks the dimmest of ILLUM_STEPS brightness steps (half a
+//    stop apart) that keeps the darkest channel's pulse under
+//    ILLUM_DEFAULT_MAX_PULSE_US: bright targets get dimmed, which saves power
+//    and sharpens the short pulses, dark targets get brightened, which keeps
+//    the frame time bounded.
+//  The jump to the new step is predicted from the frame just read, so the loop
+//    settles in one frame when the LEDs dominate and within a few otherwise.
+//  Readings taken at different steps aren't comparable, so each step has its
+//    own calibration table. Tables not calibrated separately are derived from
+//    the full brightness one with the same inverse model.
+#ifndef ILLUMINATION_H
+#define ILLUMINATION_H
+
+#include <stdint.h>
+
+#define ILLUM_STEPS 8
+
+// Duty cycle of each step out of ILLUM_DUTY_MAX, step 0 is full brightness.
+#define ILLUM_DUTY_MAX 255
+extern const uint8_t illum_step_duty[ILLUM_STEPS];
+
+// Default ceiling for the longest channel pulse, in us.
+#define ILLUM_DEFAULT_MAX_PULSE_US 200
+
+struct illum_controller {
+  uint16_t max_pulse_us;
+  bool automatic;           // Otherwise held at step.
+  uint8_t step;
+  uint16_t settled_frames;  // Frames since the step last changed, saturated.
+};
+
+void illum_controller_init(illum_controller &ctl, uint16_t max_pulse_us);
+
+// Pins the LEDs to step, or hands control back to the loop if automatic.
+void illum_set_mode(illum_controller &ctl, bool automatic, uint8_t step);
+
+// Feeds the controller one frame's raw R, G, B pulse widths, taken at
+//  ctl.step. A 0 reading is a pulseIn() timeout, far darker than any
+//  measurable pulse.
+//  Returns the step to use for the next frame (also left in ctl.step).
+uint8_t illum_update(illum_controller &ctl, const int raw[3]);
+
+// Derives the calibration table for step from the full brightness table.
+void illum_derive_calib(
+  const int full[4][2],
+  uint8_t step,
+  int out[4][2]
+);
+
+#endif
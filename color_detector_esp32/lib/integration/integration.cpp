@@ -0,0 +1,199 @@
+#include "integration.h"
+
+#include "color_core.h"
+
+// Quantisation variance of a whole us pulse width, 1/12 us^2.
+#define INTEG_QUANT_VAR ((1 << COLOR_VAR_FRAC_BITS) / 12)
+
+// Weight of each new jitter estimate in the EWMA, 1/2^shift.
+#define INTEG_JITTER_EWMA_SHIFT 4
+
+void integ_scheduler_init(integ_scheduler &sched, uint32_t budget_us){
+  sched.budget_us = budget_us;
+  for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+    sched.jitter_q32[i] = (uint32_t)(
+      ((uint64_t)COLOR_PERIOD_JITTER_PPT * COLOR_PERIOD_JITTER_PPT << 32) /
+      1000000
+    );
+    sched.pulse_us[i] = 0;
+    sched.pulses[i] = 1;
+  }
+
+  return;
+}
+
+// excess / mean^2 in Q32, for a variance in COLOR_VAR_FRAC_BITS fixed point
+//  and the sum of count pulses. Saturates at UINT32_MAX.
+//  excess n^2 << 24 overflows for a pulse spread of a few ms, which pulses up
+//    to INTEG_TIMEOUT_PERIODS periods long reach. So the ratio is checked
+//    against the saturation point first, then the numerator is shifted as
+//    far as it goes and the denominator takes the rest of the scaling.
+static uint64_t integ_relative_q32(
+  uint64_t excess,
+  uint64_t sum,
+  uint8_t count
+){
+  uint64_t sum_sq = sum * sum;
+  uint64_t count_sq = (uint64_t)count * count;
+  if(excess >= (sum_sq << COLOR_VAR_FRAC_BITS) / count_sq)
+    return UINT32_MAX;
+
+  uint64_t num = excess * count_sq;
+  if(num == 0)
+    return 0;
+  uint8_t shift = 32 - COLOR_VAR_FRAC_BITS;
+  uint8_t room = __builtin_clzll(num);
+  if(room >= shift)
+    return (num << shift) / sum_sq;
+
+  return (num << room) / (sum_sq >> (shift - room));
+}
+
+int integ_observe(
+  integ_scheduler &sched,
+  uint8_t channel,
+  const int *pulses,
+  uint8_t count
+){
+  uint64_t sum = 0;
+  uint64_t sum_sq = 0;
+  for(uint8_t i=0; i<count; i++){
+    if(pulses[i] <= 0){
+      sched.pulse_us[channel] = 0;
+      return 0;
+    }
+    sum += pulses[i];
+    sum_sq += (uint64_t)pulses[i] * pulses[i];
+  }
+
+  uint32_t mean = (uint32_t)((sum + count / 2) / count);
+  sched.pulse_us[channel] = mean > 0xFFFF ? 0xFFFF : mean;
+
+  // Sample variance less the quantisation share, relative to the squared
+  //  mean, folded into the channel's jitter estimate.
+  if(count >= 2){
+    uint64_t spread = count * sum_sq - sum * sum;    // n (n - 1) s^2
+    uint64_t var =
+      (spread << COLOR_VAR_FRAC_BITS) / ((uint64_t)count * (count - 1));
+    uint64_t excess = var > INTEG_QUANT_VAR ? var - INTEG_QUANT_VAR : 0;
+    uint64_t rel = integ_relative_q32(excess, sum, count);
+
+    int64_t diff = (int64_t)rel - sched.jitter_q32[channel];
+    sched.jitter_q32[channel] += diff / (1 << INTEG_JITTER_EWMA_SHIFT);
+  }
+
+  return sched.pulse_us[channel];
+}
+
+uint32_t integ_pulse_timeout_us(uint32_t first_us){
+  // A period is the low half measured plus the high half.
+  return INTEG_TIMEOUT_PERIODS * 2 * first_us + INTEG_TIMEOUT_MARGIN_US;
+}
+
+// Variance of a single pulse of the channel at its last width.
+static uint64_t integ_pulse_variance(
+  const integ_scheduler &sched,
+  uint8_t channel
+){
+  uint64_t pulse = sched.pulse_us[channel];
+
+  return
+    ((sched.jitter_q32[channel] * pulse * pulse) >>
+      (32 - COLOR_VAR_FRAC_BITS)) +
+    INTEG_QUANT_VAR;
+}
+
+// Variance of the average of pulses pulses, rounded to whole us when there is
+//  more than one.
+static uint64_t integ_average_variance(
+  const integ_scheduler &sched,
+  uint8_t channel,
+  uint8_t pulses
+){
+  uint64_t var = integ_pulse_variance(sched, channel) / pulses;
+  if(pulses > 1)
+    var += INTEG_QUANT_VAR;
+
+  return var;
+}
+
+uint32_t integ_reading_variance(const integ_scheduler &sched, uint8_t channel){
+  if(sched.pulse_us[channel] == 0)
+    return COLOR_VAR_UNKNOWN;
+
+  uint64_t var = integ_average_variance(
+    sched,
+    channel,
+    sched.pulses[channel]
+  );
+  if(var > COLOR_VAR_UNKNOWN)
+    return COLOR_VAR_UNKNOWN;
+
+  return (uint32_t)var;
+}
+
+void integ_scale_pulses(integ_scheduler &sched, uint32_t num, uint32_t den){
+  for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+    uint32_t pulse = (sched.pulse_us[i] * num + den / 2) / den;
+    sched.pulse_us[i] = pulse > 0xFFFF ? 0xFFFF : pulse;
+  }
+
+  return;
+}
+
+uint32_t integ_frame_cost_us(const integ_scheduler &sched){
+  uint32_t cost = 0;
+  for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+    uint32_t pulse = sched.pulse_us[i];
+    cost += INTEG_SWITCH_US + pulse * 3 + (sched.pulses[i] - 1) * pulse * 2;
+  }
+
+  return cost;
+}
+
+void integ_plan(integ_scheduler &sched, const uint32_t gain[INTEG_CHANNELS]){
+  // Without a pulse width to go on (a timeout) there's no costing the frame,
+  //  read one pulse each.
+  bool known = true;
+  for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+    sched.pulses[i] = 1;
+    known = known && sched.pulse_us[i] != 0;
+  }
+  if(!known)
+    return;
+
+  uint32_t spent = integ_frame_cost_us(sched);
+  while(true){
+    // The channel with the largest calibrated variance that can still take
+    //  another pulse within the budget and would gain from it. Rounding the
+    //  average costs 1/12 us^2, so channels whose noise is mostly
+    //  quantisation are better off with a single pulse.
+    uint8_t worst = INTEG_CHANNELS;
+    uint64_t worst_var = 0;
+    for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+      uint32_t cost = sched.pulse_us[i] * 2;
+      if(
+        sched.pulses[i] == INTEG_MAX_PULSES ||
+        spent + cost > sched.budget_us
+      ){
+        continue;
+      }
+
+      uint64_t var = integ_average_variance(sched, i, sched.pulses[i]);
+      if(integ_average_variance(sched, i, sched.pulses[i] + 1) >= var)
+        continue;
+      var *= gain[i];
+      if(worst == INTEG_CHANNELS || var > worst_var){
+        worst = i;
+        worst_var = var;
+      }
+    }
+    if(worst == INTEG_CHANNELS)
+      break;
+
+    sched.pulses[worst]++;
+    spent += sched.pulse_us[worst] * 2;
+  }
+
+  return;
+}
@@ -0,0 +1,84 @@
+// Integration time scheduling across the color channels.
+//  Every channel used to get a single pulseIn() per frame, so the channels
+//    were read with very different noise: the blue photodiodes are far less
+//    sensitive, their pulses longer and their period jitter larger in absolute
+//    terms, and the calibration stretches whatever noise each channel has by
+//    a different slope.
+//  The scheduler instead splits a fixed per-frame time budget into a number of
+//    pulses per channel to average. It estimates each channel's relative
+//    period jitter from the spread of the pulses it averaged (an EWMA, seeded
+//    with COLOR_PERIOD_JITTER_PPT), predicts the calibrated variance of the
+//    averaged reading, and hands out pulses greedily to whichever channel is
+//    currently noisiest, until the budget is spent. That drives the
+//    calibrated variances, and so the channels' SNR on the 0-255 scale the
+//    classifier works in, towards equal at the same frame time.
+//  Timing model: a channel's first pulseIn() waits on average half a period
+//    for the line to go high plus a full period (the high then the measured
+//    low half), each further one exactly a period, 2x the pulse width.
+#ifndef INTEGRATION_H
+#define INTEGRATION_H
+
+#include <stdint.h>
+
+// Channels scheduled, red, green and blue. The clear channel isn't read.
+#define INTEG_CHANNELS 3
+
+// Most pulses averaged for one channel in a frame.
+#define INTEG_MAX_PULSES 16
+
+// Settling time after switching the photodiode selection, in us.
+#define INTEG_SWITCH_US 10
+
+// Timeout of a channel's further pulses in a frame, as periods of its first
+//  pulse plus a margin in us. A sensor dropping out mid frame then costs a
+//  few periods rather than pulseIn()'s default second per pulse left.
+#define INTEG_TIMEOUT_PERIODS 4
+#define INTEG_TIMEOUT_MARGIN_US 100
+
+struct integ_scheduler {
+  uint32_t budget_us;
+  // Relative per pulse jitter variance, Q32 of the squared pulse width.
+  uint32_t jitter_q32[INTEG_CHANNELS];
+  // Averaged pulse width of the last frame, 0 after a timeout.
+  uint16_t pulse_us[INTEG_CHANNELS];
+  // Pulses to average in the next frame, at least 1.
+  uint8_t pulses[INTEG_CHANNELS];
+};
+
+// Starts every channel on a single pulse per frame.
+void integ_scheduler_init(integ_scheduler &sched, uint32_t budget_us);
+
+// Records the count pulse widths read for channel this frame and returns their
+//  average, rounded to the nearest us. Returns 0, a timeout, if any of them
+//  timed out.
+int integ_observe(
+  integ_scheduler &sched,
+  uint8_t channel,
+  const int *pulses,
+  uint8_t count
+);
+
+// Timeout for the pulses after one first_us wide in the same frame, in us.
+//  The first pulse of a frame needs the default timeout, the target may have
+//  changed since the last frame.
+uint32_t integ_pulse_timeout_us(uint32_t first_us);
+
+// Variance of the reading integ_observe() last returned for channel, raw
+//  us^2 with COLOR_VAR_FRAC_BITS fractional bits. COLOR_VAR_UNKNOWN after a
+//  timeout. Must be called before integ_plan() changes the pulse count.
+uint32_t integ_reading_variance(const integ_scheduler &sched, uint8_t channel);
+
+// Scales the expected pulse widths by num / den, the old over the new LED duty
+//  after an illumination step change, so the next plan isn't costed with the
+//  last step's pulses.
+void integ_scale_pulses(integ_scheduler &sched, uint32_t num, uint32_t den);
+
+// Plans the next frame's pulses per channel.
+//  gain is each channel's calibrated variance per unit of raw variance in
+//    Q16, the squared slope of its calibration at the current reading.
+void integ_plan(integ_scheduler &sched, const uint32_t gain[INTEG_CHANNELS]);
+
+// Expected read time of the planned frame, in us.
+uint32_t integ_frame_cost_us(const integ_scheduler &sched);
+
+#endif
@@ -0,0 +1,105 @@
+#include "linearize.h"
+
+#include <string.h>
+
+bool lin_table_build(
+  lin_table &table,
+  const uint16_t *raw,
+  const int16_t *value,
+  uint8_t knots
+){
+  memset(&table, 0, sizeof(table));
+  if(knots < 2 || knots > LIN_MAX_KNOTS)
+    return false;
+  for(uint8_t i=1; i<knots; i++){
+    if(raw[i] <= raw[i - 1])
+      return false;
+  }
+
+  for(uint8_t i=0; i<knots - 1; i++){
+    table.raw[i] = raw[i];
+    table.value[i] = value[i];
+    table.slope[i] =
+      (int32_t)(((int64_t)(value[i + 1] - value[i]) * 65536) /
+        (raw[i + 1] - raw[i]));
+  }
+  for(uint8_t i=knots - 1; i<LIN_MAX_KNOTS; i++){
+    table.raw[i] = table.raw[knots - 2];
+    table.value[i] = table.value[knots - 2];
+    table.slope[i] = table.slope[knots - 2];
+  }
+  table.knots = knots;
+
+  return true;
+}
+
+// Last entry with raw[i] <= raw, or 0 below the first knot. Each step adds
+//  step or nothing through a mask rather than a branch.
+static uint32_t lin_segment(const lin_table &table, int raw){
+  uint32_t i = 0;
+  for(uint32_t step=LIN_MAX_KNOTS / 2; step>0; step>>=1)
+    i += step & -(uint32_t)(table.raw[i + step] <= raw);
+
+  return i;
+}
+
+int lin_eval(const lin_table &table, int raw){
+  uint32_t i = lin_segment(table, raw);
+  int64_t offset = (int64_t)(raw - table.raw[i]) * table.slope[i];
+
+  return table.value[i] + (int32_t)((offset + 32768) >> 16);
+}
+
+int32_t lin_eval_q8(const lin_table &table, int raw){
+  uint32_t i = lin_segment(table, raw);
+  int64_t offset = (int64_t)(raw - table.raw[i]) * table.slope[i];
+
+  return (int32_t)table.value[i] * 256 + (int32_t)((offset + 128) >> 8);
+}
+
+int32_t lin_invert_q8(const lin_table &table, int value, uint8_t *segment){
+  uint8_t last = table.knots - 2;
+  uint8_t i = 0;
+  for(; i<last; i++){
+    // Segment i spans value[i] to value[i + 1].
+    int lo = table.value[i];
+    int hi = table.value[i + 1];
+    if(lo > hi){
+      int swap = lo;
+      lo = hi;
+      hi = swap;
+    }
+    if(value >= lo && value <= hi && table.slope[i] != 0)
+      break;
+  }
+  // Nothing spanned it: extrapolate along whichever end segment it's past.
+  //  The last segment has no stored end, it runs on from value[last].
+  if(i == last && last > 0){
+    bool rising = table.slope[0] > 0;
+    if(rising ? value < table.value[0] : value > table.value[0])
+      i = 0;
+  }
+  if(segment)
+    *segment = i;
+
+  if(table.slope[i] == 0)
+    return (int32_t)table.raw[i] << 8;
+
+  int64_t offset = ((int64_t)(value - table.value[i]) << 24) / table.slope[i];
+
+  return ((int32_t)table.raw[i] << 8) + (int32_t)offset;
+}
+
+uint32_t lin_eval_variance(const lin_table &table, int raw, uint32_t variance){
+  int64_t slope = table.slope[lin_segment(table, raw)];
+  uint64_t gain = (uint64_t)(slope * slope);   // Q32
+
+  // variance * gain >> 32 without overflowing, saturating at the top.
+  uint64_t scaled =
+    (uint64_t)variance * (gain >> 32) +
+    (((uint64_t)variance * (gain & 0xFFFFFFFF)) >> 32);
+  if(scaled > UINT32_MAX)
+    return UINT32_MAX;
+
+  return (uint32_t)scaled;
+}
@@ -0,0 +1,55 @@
+// Piecewise linear linearisation of raw pulse widths.
+//  The single {min, max} pair per channel in color_read_calib_vals is a
+//    straight line, the TCS3200's response isn't. A table maps raw pulse
+//    widths through up to LIN_MAX_KNOTS knots fitted on the host from a grey
+//    step target (host tool linfit), extrapolating along the end segments.
+//  Evaluation is a fixed four step branchless search for the segment and one
+//    Q16 fixed point multiply, so it costs the same for every reading.
+#ifndef LINEARIZE_H
+#define LINEARIZE_H
+
+#include <stdint.h>
+
+// Must be a power of two, the search halves it down to 1.
+#define LIN_MAX_KNOTS 16
+
+// Table for one channel.
+//  Entries from knots - 1 on repeat the last segment's, so the search needs no
+//    bounds and readings past the last knot extrapolate along it.
+struct lin_table {
+  uint8_t knots;                // 0 means no table, at least 2 otherwise.
+  uint16_t raw[LIN_MAX_KNOTS];  // Segment start, ascending.
+  int16_t value[LIN_MAX_KNOTS]; // Calibrated value at raw[i].
+  int32_t slope[LIN_MAX_KNOTS]; // Q16 value per raw unit from raw[i] on.
+};
+
+// Builds a table from knots strictly ascending raw values and their calibrated
+//  values. Returns false, leaving table empty, if there are too few or too
+//  many knots or raw isn't strictly ascending.
+bool lin_table_build(
+  lin_table &table,
+  const uint16_t *raw,
+  const int16_t *value,
+  uint8_t knots
+);
+
+// Calibrated value of a raw reading. table must not be empty.
+int lin_eval(const lin_table &table, int raw);
+
+// As lin_eval(), in Q8 rather than rounded to a whole value.
+int32_t lin_eval_q8(const lin_table &table, int raw);
+
+// Raw reading, Q8, that lin_eval() maps to value. segment, if not null,
+//  receives the index of the segment it falls in, table.slope[*segment] being
+//  the local slope there.
+//  Tables are monotonic in practice; where one isn't the first segment
+//    spanning value wins. Values past either end extrapolate along the end
+//    segments. table must not be empty.
+int32_t lin_invert_q8(const lin_table &table, int value, uint8_t *segment);
+
+// Scales the variance of a raw reading by the square of the slope of the
+//  segment the reading falls in, giving the variance of lin_eval()'s result in
+//  the same fixed point format. Saturates at UINT32_MAX.
+uint32_t lin_eval_variance(const lin_table &table, int raw, uint32_t variance);
+
+#endif
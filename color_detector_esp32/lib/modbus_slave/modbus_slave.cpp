@@ -0,0 +1,219 @@
+#include "modbus_slave.h"
+
+#include <string.h>
+
+// Modbus puts everything on the wire big endian, CRC excepted.
+static uint16_t modbus_get_u16(const uint8_t *buf){
+  return (uint16_t)((buf[0] << 8) | buf[1]);
+}
+
+static void modbus_put_u16(uint8_t *buf, uint16_t val){
+  buf[0] = val >> 8;
+  buf[1] = val & 0xFF;
+
+  return;
+}
+
+static uint16_t modbus_exception(
+  modbus_slave &slave,
+  uint8_t function,
+  uint8_t code,
+  uint8_t *resp
+){
+  slave.exceptions++;
+  resp[0] = function | 0x80;
+  resp[1] = code;
+
+  return 2;
+}
+
+void modbus_slave_init(modbus_slave &slave, uint8_t unit_id){
+  slave.unit_id = unit_id;
+  slave.read_input = 0;
+  slave.read_holding = 0;
+  slave.write_holding = 0;
+  slave.ctx = 0;
+  slave.requests = 0;
+  slave.exceptions = 0;
+  slave.crc_errors = 0;
+
+  return;
+}
+
+uint16_t modbus_process_pdu(
+  modbus_slave &slave,
+  const uint8_t *req,
+  uint16_t len,
+  uint8_t *resp
+){
+  if(len < 1)
+    return modbus_exception(slave, 0, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+
+  slave.requests++;
+  uint8_t fc = req[0];
+  uint16_t regs[MODBUS_MAX_READ_REGS];
+  uint8_t ex;
+
+  switch(fc){
+    case MODBUS_FC_READ_HOLDING:
+    case MODBUS_FC_READ_INPUT: {
+      modbus_read_callback read =
+        fc == MODBUS_FC_READ_INPUT ? slave.read_input : slave.read_holding;
+      if(!read)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+      if(len != 5)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+
+      uint16_t start = modbus_get_u16(req + 1);
+      uint16_t count = modbus_get_u16(req + 3);
+      if(count < 1 || count > MODBUS_MAX_READ_REGS)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+      if((uint32_t)start + count > 0x10000)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+
+      ex = read(slave.ctx, start, count, regs);
+      if(ex != MODBUS_EX_NONE)
+        return modbus_exception(slave, fc, ex, resp);
+
+      resp[0] = fc;
+      resp[1] = count * 2;
+      for(uint16_t i=0; i<count; i++)
+        modbus_put_u16(resp + 2 + i * 2, regs[i]);
+      return 2 + count * 2;
+    }
+
+    case MODBUS_FC_WRITE_SINGLE: {
+      if(!slave.write_holding)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+      if(len != 5)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+
+      uint16_t start = modbus_get_u16(req + 1);
+      regs[0] = modbus_get_u16(req + 3);
+
+      ex = slave.write_holding(slave.ctx, start, 1, regs);
+      if(ex != MODBUS_EX_NONE)
+        return modbus_exception(slave, fc, ex, resp);
+
+      // Normal response is an echo of the request.
+      memcpy(resp, req, 5);
+      return 5;
+    }
+
+    case MODBUS_FC_WRITE_MULTIPLE: {
+      if(!slave.write_holding)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+      if(len < 6)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+
+      uint16_t start = modbus_get_u16(req + 1);
+      uint16_t count = modbus_get_u16(req + 3);
+      uint8_t bytes = req[5];
+      if(count < 1 || count > MODBUS_MAX_WRITE_REGS ||
+         bytes != count * 2 || len != 6 + bytes){
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+      }
+      if((uint32_t)start + count > 0x10000)
+        return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+
+      for(uint16_t i=0; i<count; i++)
+        regs[i] = modbus_get_u16(req + 6 + i * 2);
+
+      ex = slave.write_holding(slave.ctx, start, count, regs);
+      if(ex != MODBUS_EX_NONE)
+        return modbus_exception(slave, fc, ex, resp);
+
+      memcpy(resp, req, 5);
+      return 5;
+    }
+  }
+
+  return modbus_exception(slave, fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+}
+
+uint16_t modbus_crc16(const uint8_t *data, uint16_t len){
+  // CRC-16/MODBUS, reflected polynomial 0xA001, init 0xFFFF.
+  uint16_t crc = 0xFFFF;
+  for(uint16_t i=0; i<len; i++){
+    crc ^= data[i];
+    for(uint8_t bit=0; bit<8; bit++){
+      if(crc & 1)
+        crc = (crc >> 1) ^ 0xA001;
+      else
+        crc >>= 1;
+    }
+  }
+
+  return crc;
+}
+
+uint16_t modbus_rtu_process(
+  modbus_slave &slave,
+  const uint8_t *frame,
+  uint16_t len,
+  uint8_t *resp
+){
+  // Unit, function code and CRC at the very least.
+  if(len < 4 || len > MODBUS_RTU_MAX_ADU)
+    return 0;
+
+  uint8_t unit = frame[0];
+  if(unit != slave.unit_id && unit != MODBUS_BROADCAST)
+    return 0;
+
+  uint16_t crc = frame[len - 2] | (frame[len - 1] << 8);
+  if(crc != modbus_crc16(frame, len - 2)){
+    slave.crc_errors++;
+    return 0;
+  }
+
+  uint16_t pdu_len = modbus_process_pdu(slave, frame + 1, len - 3, resp + 1);
+  if(unit == MODBUS_BROADCAST)
+    return 0;
+
+  resp[0] = slave.unit_id;
+  crc = modbus_crc16(resp, pdu_len + 1);
+  resp[pdu_len + 1] = crc & 0xFF;
+  resp[pdu_len + 2] = crc >> 8;
+
+  return pdu_len + 3;
+}
+
+uint32_t modbus_rtu_frame_gap_us(uint32_t baud){
+  if(baud > 19200)
+    return 1750;
+
+  // 11 bits per character (start, 8 data, parity or second stop, stop).
+  return (uint32_t)(35ULL * 11 * 1000000 / (10ULL * baud));
+}
+
+int32_t modbus_tcp_frame_length(const uint8_t *buf, uint16_t len){
+  if(len < MODBUS_TCP_HEADER)
+    return 0;
+
+  uint16_t protocol = modbus_get_u16(buf + 2);
+  uint16_t length = modbus_get_u16(buf + 4);
+  if(protocol != 0 || length < 2 || length > MODBUS_MAX_PDU + 1)
+    return -1;
+
+  return MODBUS_TCP_HEADER - 1 + length;
+}
+
+uint16_t modbus_tcp_process(
+  modbus_slave &slave,
+  const uint8_t *adu,
+  uint16_t len,
+  uint8_t *resp
+){
+  uint16_t pdu_len = modbus_process_pdu(
+    slave, adu + MODBUS_TCP_HEADER, len - MODBUS_TCP_HEADER,
+    resp + MODBUS_TCP_HEADER
+  );
+
+  // Transaction id and unit echoed back, length recomputed.
+  memcpy(resp, adu, 4);
+  modbus_put_u16(resp + 4, pdu_len + 1);
+  resp[6] = adu[6];
+
+  return MODBUS_TCP_HEADER + pdu_len;
+}
@@ -0,0 +1,119 @@
+// Transport independent Modbus slave.
+//  Handles the PDU (function code + data) for register access and the two
+//    framings we serve it over:
+//    RTU: [unit][PDU][CRC16 lo][CRC16 hi], frames delimited by line silence.
+//    TCP: [transaction u16][protocol u16 = 0][length u16][unit][PDU], big
+//      endian, length counting the unit byte and the PDU.
+//  Register contents come from the application through callbacks, the slave
+//    itself keeps no register storage.
+#ifndef MODBUS_SLAVE_H
+#define MODBUS_SLAVE_H
+
+#include <stdint.h>
+
+#define MODBUS_MAX_PDU 253
+#define MODBUS_RTU_MAX_ADU (MODBUS_MAX_PDU + 3)
+#define MODBUS_TCP_HEADER 7
+#define MODBUS_TCP_MAX_ADU (MODBUS_MAX_PDU + MODBUS_TCP_HEADER)
+
+// Largest counts the spec allows per request, both fit in one PDU.
+#define MODBUS_MAX_READ_REGS 125
+#define MODBUS_MAX_WRITE_REGS 123
+
+// Unit id 0 on RTU is a broadcast, executed but never answered.
+#define MODBUS_BROADCAST 0
+
+enum MODBUS_FUNCTIONS {
+  MODBUS_FC_READ_HOLDING   = 0x03,
+  MODBUS_FC_READ_INPUT     = 0x04,
+  MODBUS_FC_WRITE_SINGLE   = 0x06,
+  MODBUS_FC_WRITE_MULTIPLE = 0x10
+};
+
+enum MODBUS_EXCEPTIONS {
+  MODBUS_EX_NONE             = 0x00,
+  MODBUS_EX_ILLEGAL_FUNCTION = 0x01,
+  MODBUS_EX_ILLEGAL_ADDRESS  = 0x02,
+  MODBUS_EX_ILLEGAL_VALUE    = 0x03,
+  MODBUS_EX_DEVICE_FAILURE   = 0x04,
+  MODBUS_EX_DEVICE_BUSY      = 0x06
+};
+
+// Register access callbacks, each returns a MODBUS_EXCEPTIONS code.
+//  A request is only ever passed on whole, so a callback can validate the full
+//    range (and for writes, every value) before touching anything.
+typedef uint8_t (*modbus_read_callback)(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+);
+typedef uint8_t (*modbus_write_callback)(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+);
+
+struct modbus_slave {
+  uint8_t unit_id;
+
+  // Null callbacks answer ILLEGAL_FUNCTION.
+  modbus_read_callback read_input;
+  modbus_read_callback read_holding;
+  modbus_write_callback write_holding;
+  void *ctx;
+
+  // Counters, wrap freely.
+  uint32_t requests;
+  uint32_t exceptions;
+  uint32_t crc_errors;
+};
+
+void modbus_slave_init(modbus_slave &slave, uint8_t unit_id);
+
+// Executes one request PDU and writes the response PDU (normal or exception)
+//  to resp, which must hold MODBUS_MAX_PDU bytes.
+//  Returns the response length.
+uint16_t modbus_process_pdu(
+  modbus_slave &slave,
+  const uint8_t *req,
+  uint16_t len,
+  uint8_t *resp
+);
+
+uint16_t modbus_crc16(const uint8_t *data, uint16_t len);
+
+// Handles one complete RTU frame, writing the response frame to resp (at
+//  least MODBUS_RTU_MAX_ADU bytes).
+//  Returns the response length, 0 if nothing should be sent: bad CRC, another
+//    unit's frame, or a broadcast.
+uint16_t modbus_rtu_process(
+  modbus_slave &slave,
+  const uint8_t *frame,
+  uint16_t len,
+  uint8_t *resp
+);
+
+// Inter-frame silence, in microseconds, that ends an RTU frame at the given
+//  baud rate. 3.5 character times, fixed at 1750us above 19200 baud as the
+//  serial line spec recommends.
+uint32_t modbus_rtu_frame_gap_us(uint32_t baud);
+
+// Length of the TCP ADU starting at buf, once at least the header is there.
+//  Returns 0 if fewer than MODBUS_TCP_HEADER bytes are available, or -1 if
+//    the header is malformed and the connection should be dropped.
+int32_t modbus_tcp_frame_length(const uint8_t *buf, uint16_t len);
+
+// Handles one complete TCP ADU, writing the response ADU to resp (at least
+//  MODBUS_TCP_MAX_ADU bytes). The unit id is echoed, not checked, as is usual
+//  for a device that is the only unit behind its address.
+//  Returns the response length.
+uint16_t modbus_tcp_process(
+  modbus_slave &slave,
+  const uint8_t *adu,
+  uint16_t len,
+  uint8_t *resp
+);
+
+#endif
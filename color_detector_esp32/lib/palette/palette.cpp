@@ -0,0 +1,358 @@
+#include "palette.h"
+
+#include <stddef.h>
+
+// Calibrated channel differences are clamped to this before squaring, so a
+//  wild reading can't overflow the distance. Far beyond any palette.
+#define PALETTE_DIFF_LIMIT 4096
+#define PALETTE_DIFF_LIMIT_Q8 ((int64_t)PALETTE_DIFF_LIMIT << 8)
+
+uint16_t palette_match(
+  const palette &pal,
+  const int readings[3],
+  uint32_t *distance
+){
+  uint16_t best = PALETTE_NO_MATCH;
+  uint32_t best_dist = UINT32_MAX;
+
+  for(uint16_t i=0; i<pal.count; i++){
+    uint32_t dist = 0;
+    for(uint8_t c=0; c<3; c++){
+      int32_t diff = readings[c] - pal.colors[i].rgb[c];
+      if(diff > PALETTE_DIFF_LIMIT)
+        diff = PALETTE_DIFF_LIMIT;
+      if(diff < -PALETTE_DIFF_LIMIT)
+        diff = -PALETTE_DIFF_LIMIT;
+      dist += diff * diff;
+    }
+    if(dist < best_dist){
+      best = i;
+      best_dist = dist;
+    }
+  }
+
+  if(distance)
+    *distance = best_dist;
+
+  return best;
+}
+
+void palette_raw_begin(
+  palette_raw &praw,
+  const palette &pal,
+  palette_raw_color *colors,
+  const int calib[4][2],
+  const lin_table *tables
+){
+  praw.pal = &pal;
+  praw.colors = colors;
+  praw.built = 0;
+  for(uint8_t c=0; c<3; c++){
+    praw.calib[c][0] = calib[c][0];
+    praw.calib[c][1] = calib[c][1];
+  }
+  praw.tables = tables;
+
+  return;
+}
+
+bool palette_raw_build(palette_raw &praw, uint16_t max_colors){
+  while(praw.built < praw.pal->count && max_colors--){
+    const palette_color &color = praw.pal->colors[praw.built];
+    palette_raw_color &out = praw.colors[praw.built];
+
+    for(uint8_t c=0; c<3; c++){
+      if(praw.tables && praw.tables[c].knots){
+        uint8_t segment;
+        out.raw_q8[c] = lin_invert_q8(praw.tables[c], color.rgb[c], &segment);
+        out.slope_q16[c] = praw.tables[c].slope[segment];
+        continue;
+      }
+
+      // Inverse of color_calibrate_channel(), 255 at min down to 0 at max.
+      int32_t in_min = praw.calib[c][0];
+      int32_t span = praw.calib[c][1] - in_min;
+      if(span == 0)
+        span = 1;
+      out.raw_q8[c] = in_min * 256 + (int32_t)(
+        (((int64_t)(255 - color.rgb[c]) * span << 8) + 127) / 255
+      );
+      out.slope_q16[c] = (int32_t)(-(255L << 16) / span);
+    }
+
+    praw.built++;
+  }
+
+  return praw.built == praw.pal->count;
+}
+
+uint16_t palette_raw_match(
+  const palette_raw &praw,
+  const int raw[3],
+  uint32_t *distance
+){
+  int32_t raw_q8[3];
+  for(uint8_t c=0; c<3; c++)
+    raw_q8[c] = raw[c] << 8;
+
+  uint16_t best = PALETTE_NO_MATCH;
+  uint64_t best_dist = UINT64_MAX;
+
+  for(uint16_t i=0; i<praw.built; i++){
+    const palette_raw_color &color = praw.colors[i];
+    uint64_t dist = 0;
+    for(uint8_t c=0; c<3; c++){
+      // Calibrated difference, Q8.
+      int64_t diff =
+        ((int64_t)(raw_q8[c] - color.raw_q8[c]) * color.slope_q16[c]) >> 16;
+      if(diff > PALETTE_DIFF_LIMIT_Q8)
+        diff = PALETTE_DIFF_LIMIT_Q8;
+      if(diff < -PALETTE_DIFF_LIMIT_Q8)
+        diff = -PALETTE_DIFF_LIMIT_Q8;
+      dist += (uint64_t)(diff * diff);
+    }
+    if(dist < best_dist){
+      best = i;
+      best_dist = dist;
+    }
+  }
+
+  if(distance)
+    *distance = best == PALETTE_NO_MATCH ? UINT32_MAX : (best_dist >> 16);
+
+  return best;
+}
+
+// Calibrated coordinates are clamped to this range before the squared
+//  difference tables are built, keeping three of them inside 32 bits in Q8.
+#define PALETTE_SET_COORD_MIN (-1024L * 256)
+#define PALETTE_SET_COORD_MAX (1280L * 256)
+
+void palette_set_init(
+  palette_set &set,
+  palette_set_color *colors,
+  uint16_t capacity
+){
+  set.colors = colors;
+  set.capacity = capacity;
+  set.count = 0;
+  set.palettes = 0;
+  for(uint8_t m=0; m<=(1 << PALETTE_SET_MAX); m++)
+    set.group[m] = 0;
+  for(uint8_t c=0; c<3; c++){
+    set.calib[c][0] = 0;
+    set.calib[c][1] = 255;
+  }
+  set.tables = NULL;
+
+  return;
+}
+
+int palette_set_add(palette_set &set, const palette &pal, uint16_t tolerance){
+  if(set.palettes == PALETTE_SET_MAX)
+    return -1;
+
+  uint8_t p = set.palettes;
+  uint8_t bit = 1 << p;
+  uint16_t old_count = set.count;
+
+  for(uint16_t i=0; i<pal.count; i++){
+    const uint8_t *rgb = pal.colors[i].rgb;
+
+    uint16_t j = 0;
+    while(
+      j < set.count &&
+      (set.colors[j].rgb[0] != rgb[0] ||
+       set.colors[j].rgb[1] != rgb[1] ||
+       set.colors[j].rgb[2] != rgb[2])
+    ){
+      j++;
+    }
+
+    if(j == set.count){
+      if(set.count == set.capacity){
+        // Out of room, take the palette back out.
+        for(uint16_t k=0; k<old_count; k++)
+          set.colors[k].palettes &= ~bit;
+        set.count = old_count;
+        return -1;
+      }
+      set.colors[j].rgb[0] = rgb[0];
+      set.colors[j].rgb[1] = rgb[1];
+      set.colors[j].rgb[2] = rgb[2];
+      set.colors[j].palettes = 0;
+      set.count++;
+    }
+
+    // A color repeated within the palette keeps its first index.
+    if(!(set.colors[j].palettes & bit)){
+      set.colors[j].palettes |= bit;
+      set.colors[j].index[p] = i;
+    }
+  }
+
+  set.pals[p] = &pal;
+  set.tolerance[p] = tolerance;
+  set.palettes++;
+
+  // Regroup by membership. Insertion sort, stable and in place, only ever run
+  //  while setting up.
+  for(uint16_t i=1; i<set.count; i++){
+    palette_set_color color = set.colors[i];
+    uint16_t j = i;
+    while(j > 0 && set.colors[j - 1].palettes > color.palettes){
+      set.colors[j] = set.colors[j - 1];
+      j--;
+    }
+    set.colors[j] = color;
+  }
+  uint16_t i = 0;
+  for(uint8_t m=0; m<=(1 << PALETTE_SET_MAX); m++){
+    while(i < set.count && set.colors[i].palettes < m)
+      i++;
+    set.group[m] = i;
+  }
+
+  return p;
+}
+
+void palette_set_calibrate(
+  palette_set &set,
+  const int calib[4][2],
+  const lin_table *tables
+){
+  for(uint8_t c=0; c<3; c++){
+    set.calib[c][0] = calib[c][0];
+    set.calib[c][1] = calib[c][1];
+  }
+  set.tables = tables;
+
+  return;
+}
+
+// The fused pass over every palette, from the reading's calibrated
+//  coordinates in Q8.
+static void palette_set_match_q8(
+  const palette_set &set,
+  const int64_t coords[3],
+  palette_set_result &result
+){
+  uint32_t sq[3][256];
+  for(uint8_t c=0; c<3; c++){
+    int64_t coord = coords[c];
+    if(coord < PALETTE_SET_COORD_MIN)
+      coord = PALETTE_SET_COORD_MIN;
+    if(coord > PALETTE_SET_COORD_MAX)
+      coord = PALETTE_SET_COORD_MAX;
+
+    // Squared differences to every value, Q8, stepping
+    //  (e - 256)^2 = e^2 - 512 e + 65536 rather than multiplying each.
+    int64_t diff = coord;
+    int64_t diff_sq = diff * diff;
+    for(uint16_t v=0; v<256; v++){
+      sq[c][v] = (uint32_t)(diff_sq >> 8);
+      diff_sq += 65536 - 512 * diff;
+      diff -= 256;
+    }
+  }
+
+  uint32_t best[PALETTE_SET_MAX];
+  for(uint8_t p=0; p<PALETTE_SET_MAX; p++){
+    best[p] = UINT32_MAX;
+    result.index[p] = PALETTE_NO_MATCH;
+  }
+
+  for(uint8_t m=1; m<(1 << set.palettes); m++){
+    if(m & (m - 1)){
+      // Shared between palettes.
+      for(uint16_t i=set.group[m]; i<set.group[m + 1]; i++){
+        const palette_set_color &color = set.colors[i];
+        uint32_t dist =
+          sq[0][color.rgb[0]] + sq[1][color.rgb[1]] + sq[2][color.rgb[2]];
+
+        for(uint8_t p=0; p<set.palettes; p++){
+          if(!(m & (1 << p)))
+            continue;
+          if(
+            dist < best[p] ||
+            (dist == best[p] && color.index[p] < result.index[p])
+          ){
+            best[p] = dist;
+            result.index[p] = color.index[p];
+          }
+        }
+      }
+      continue;
+    }
+
+    // Only in palette p.
+    uint8_t p = 0;
+    while(!(m & (1 << p)))
+      p++;
+    uint32_t group_best = best[p];
+    uint16_t group_index = result.index[p];
+    for(uint16_t i=set.group[m]; i<set.group[m + 1]; i++){
+      const palette_set_color &color = set.colors[i];
+      uint32_t dist =
+        sq[0][color.rgb[0]] + sq[1][color.rgb[1]] + sq[2][color.rgb[2]];
+      if(
+        dist < group_best ||
+        (dist == group_best && color.index[p] < group_index)
+      ){
+        group_best = dist;
+        group_index = color.index[p];
+      }
+    }
+    best[p] = group_best;
+    result.index[p] = group_index;
+  }
+
+  result.within = 0;
+  for(uint8_t p=0; p<set.palettes; p++){
+    result.distance[p] = best[p] >> 8;
+    uint64_t limit = (uint64_t)set.tolerance[p] * set.tolerance[p] << 8;
+    if(
+      result.index[p] != PALETTE_NO_MATCH &&
+      (set.tolerance[p] == 0 || best[p] <= limit)
+    ){
+      result.within |= 1 << p;
+    }
+  }
+
+  return;
+}
+
+void palette_set_match(
+  const palette_set &set,
+  const int raw[3],
+  palette_set_result &result
+){
+  // The reading in calibrated coordinates, Q8, once for every palette.
+  int64_t coords[3];
+  for(uint8_t c=0; c<3; c++){
+    if(set.tables && set.tables[c].knots){
+      coords[c] = lin_eval_q8(set.tables[c], raw[c]);
+      continue;
+    }
+    int64_t span = set.calib[c][1] - set.calib[c][0];
+    if(span == 0)
+      span = 1;
+    coords[c] = 255 * 256 - (raw[c] - set.calib[c][0]) * 255LL * 256 / span;
+  }
+  palette_set_match_q8(set, coords, result);
+
+  return;
+}
+
+void palette_set_match_calibrated(
+  const palette_set &set,
+  const int readings[3],
+  palette_set_result &result
+){
+  int64_t coords[3];
+  for(uint8_t c=0; c<3; c++)
+    coords[c] = (int64_t)readings[c] * 256;
+  palette_set_match_q8(set, coords, result);
+
+  return;
+}
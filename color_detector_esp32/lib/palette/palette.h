@@ -0,0 +1,168 @@
+// Nearest color matching against a palette of named colors.
+//  A palette is a list of target colors in calibrated RGB, 0-255 per channel
+//    as in colors.csv and colors_short.csv. A reading matches the color at
+//    the smallest Euclidean distance.
+//  The obvious way calibrates each reading and then measures distances,
+//    palette_match(). palette_raw instead carries the palette back into raw
+//    pulse width space through the inverse of the current calibration, once
+//    per calibration change, keeping each axis' calibration slope alongside.
+//    Readings are then matched straight from their raw pulse widths: the
+//    per reading divisions of the calibration disappear, leaving a multiply
+//    per channel per color. That only pays off where readings aren't
+//    calibrated for anything else, and palbench times it against
+//    palette_match().
+//  With the {min, max} calibration the raw space distance is the calibrated
+//    one. A channel with a linearisation table uses the slope of the segment
+//    each color falls in, exact around the color and close between.
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+
+#include "linearize.h"
+
+// Returned when there is nothing to match against.
+#define PALETTE_NO_MATCH 0xFFFF
+
+struct palette_color {
+  const char *name;
+  uint8_t rgb[3];
+};
+
+struct palette {
+  const char *name;
+  const palette_color *colors;
+  uint16_t count;
+};
+
+// Index of the color nearest to calibrated R, G, B readings. distance, if not
+//  null, receives the squared distance.
+uint16_t palette_match(
+  const palette &pal,
+  const int readings[3],
+  uint32_t *distance
+);
+
+// A palette color in raw space: pulse widths in Q8 us and the calibration's
+//  slope at them, Q16 calibrated units per us.
+struct palette_raw_color {
+  int32_t raw_q8[3];
+  int32_t slope_q16[3];
+};
+
+// A palette carried into raw space for one calibration.
+//  Built incrementally with palette_raw_begin() and palette_raw_build(), so a
+//    large palette can be spread over several frames while the previous
+//    palette_raw stays in use.
+struct palette_raw {
+  const palette *pal;
+  palette_raw_color *colors;  // pal->count entries, owned by the caller.
+  uint16_t built;             // Colors converted so far.
+  int calib[3][2];
+  const lin_table *tables;    // Per channel, or null. knots 0 means none.
+};
+
+// Starts converting pal for the given {min, max} calibration and, if tables
+//  isn't null, per channel linearisation tables (which take precedence where
+//  a channel has one). The calibration is copied, tables must outlive the
+//  build. colors needs room for pal.count entries.
+void palette_raw_begin(
+  palette_raw &praw,
+  const palette &pal,
+  palette_raw_color *colors,
+  const int calib[4][2],
+  const lin_table *tables
+);
+
+// Converts up to max_colors more colors. Returns true once all are done.
+bool palette_raw_build(palette_raw &praw, uint16_t max_colors);
+
+// As palette_match(), from raw R, G, B pulse widths. praw must be complete.
+uint16_t palette_raw_match(
+  const palette_raw &praw,
+  const int raw[3],
+  uint32_t *distance
+);
+
+//------------------------------------------------------------------------------
+// Matching against several palettes at once
+//------------------------------------------------------------------------------
+// Most palettes a palette_set holds.
+#define PALETTE_SET_MAX 4
+
+// A distinct color across a set's palettes, with its index in each palette it
+//  appears in (bit p of palettes set for palette p).
+struct palette_set_color {
+  uint8_t rgb[3];
+  uint8_t palettes;
+  uint16_t index[PALETTE_SET_MAX];
+};
+
+// Several palettes matched in one fused pass.
+//  Matching each palette separately transforms the reading once per palette
+//    and measures every color of every palette. A set merges its palettes'
+//    colors, so a color shared between palettes (colors_short.csv's are all
+//    in colors.csv too) is measured once, transforms the reading into
+//    calibrated coordinates once, and from those builds per channel tables of
+//    squared differences to every 0-255 value. Each color's distance is then
+//    three table lookups and two adds, shared by every palette it's in, and
+//    the best color per palette falls out of the same pass.
+//  Colors are kept grouped by the palettes they belong to, so the bulk that
+//    is in a single palette is scanned by a tight loop with one running best.
+//  Ties go to the lower index within a palette, as with palette_match().
+struct palette_set {
+  palette_set_color *colors;  // Owned by the caller, grouped by palettes.
+  uint16_t capacity;
+  uint16_t count;
+  // Colors whose palettes bits are m run from group[m] to group[m + 1].
+  uint16_t group[(1 << PALETTE_SET_MAX) + 1];
+  uint8_t palettes;
+  const palette *pals[PALETTE_SET_MAX];
+  // Acceptance radius per palette, in calibrated units, 0 for none.
+  uint16_t tolerance[PALETTE_SET_MAX];
+  int calib[3][2];
+  const lin_table *tables;
+};
+
+struct palette_set_result {
+  uint16_t index[PALETTE_SET_MAX];      // PALETTE_NO_MATCH if empty.
+  uint32_t distance[PALETTE_SET_MAX];   // Squared, calibrated units.
+  // Bit p set if palette p's best color is within its tolerance, e.g. a QC
+  //  pass against a product palette.
+  uint8_t within;
+};
+
+void palette_set_init(
+  palette_set &set,
+  palette_set_color *colors,
+  uint16_t capacity
+);
+
+// Adds pal to the set with the given acceptance radius (0 accepts anything).
+//  Returns its palette number, or -1 if the set is full or colors ran out of
+//  room, in which case the set is unchanged.
+int palette_set_add(palette_set &set, const palette &pal, uint16_t tolerance);
+
+// Sets the calibration readings are transformed with, as palette_raw_begin().
+void palette_set_calibrate(
+  palette_set &set,
+  const int calib[4][2],
+  const lin_table *tables
+);
+
+// Best color per palette for raw R, G, B pulse widths.
+void palette_set_match(
+  const palette_set &set,
+  const int raw[3],
+  palette_set_result &result
+);
+
+// As palette_set_match(), for readings already calibrated, e.g. the r, g, b
+//  of a head's reading records. The set's calibration isn't used.
+void palette_set_match_calibrated(
+  const palette_set &set,
+  const int readings[3],
+  palette_set_result &result
+);
+
+#endif
@@ -0,0 +1,168 @@
+#include "sensor_registers.h"
+
+#include "can_output.h"
+
+static uint16_t sensor_registers_input(
+  const sensor_snapshot &snap,
+  uint16_t reg
+){
+  if(reg >= SENSOR_IREG_RAW && reg < SENSOR_IREG_RAW + 4)
+    return snap.raw[reg - SENSOR_IREG_RAW];
+  if(reg >= SENSOR_IREG_MAPPED && reg < SENSOR_IREG_MAPPED + 4)
+    return (uint16_t)snap.mapped[reg - SENSOR_IREG_MAPPED];
+
+  if(reg >= SENSOR_IREG_SPC_ALARMS && reg < SENSOR_IREG_SPC_ALARMS + 4)
+    return snap.spc_alarms[reg - SENSOR_IREG_SPC_ALARMS];
+
+  // Frame counter up to the process control status is all 32 bit, high word
+  //  first.
+  if(reg >= SENSOR_IREG_FRAME && reg < SENSOR_IREG_SPC_STATUS){
+    uint32_t vals[] = {
+      snap.frame,
+      snap.sensor_timeouts,
+      snap.map_errors,
+      snap.warm_restarts,
+      snap.uptime_s,
+      snap.spc_alarm_events
+    };
+    uint32_t val = vals[(reg - SENSOR_IREG_FRAME) / 2];
+    return (reg - SENSOR_IREG_FRAME) % 2 ? val & 0xFFFF : val >> 16;
+  }
+
+  switch(reg){
+    case SENSOR_IREG_VERSION:    return SENSOR_REGISTERS_VERSION;
+    case SENSOR_IREG_FAULTS:     return snap.faults;
+    case SENSOR_IREG_CLASS:      return snap.class_index;
+    case SENSOR_IREG_CONFIDENCE: return snap.confidence;
+    case SENSOR_IREG_SPC_STATUS: return snap.spc_armed ? 1 : 0;
+    case SENSOR_IREG_ILLUM_STEP: return snap.illum_step;
+    case SENSOR_IREG_ILLUM_DUTY: return snap.illum_duty;
+    case SENSOR_IREG_ILLUM_SETTLED: return snap.illum_settled_frames;
+    case SENSOR_IREG_PALETTE: return snap.palette_index;
+  }
+
+  if(reg >= SENSOR_IREG_CACHE_HITS && reg < SENSOR_IREG_COUNT){
+    uint32_t val =
+      reg < SENSOR_IREG_CACHE_MISSES ?
+        snap.class_cache_hits : snap.class_cache_misses;
+    return (reg - SENSOR_IREG_CACHE_HITS) % 2 ? val & 0xFFFF : val >> 16;
+  }
+
+  return 0;
+}
+
+uint8_t sensor_registers_read_input(
+  const sensor_snapshot &snap,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  if((uint32_t)start + count > SENSOR_IREG_COUNT)
+    return SENSOR_REG_BAD_ADDRESS;
+
+  for(uint16_t i=0; i<count; i++)
+    out[i] = sensor_registers_input(snap, start + i);
+
+  return SENSOR_REG_OK;
+}
+
+uint8_t sensor_registers_read_holding(
+  const sensor_config &config,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  if((uint32_t)start + count > SENSOR_HREG_COUNT)
+    return SENSOR_REG_BAD_ADDRESS;
+
+  for(uint16_t i=0; i<count; i++){
+    uint16_t reg = start + i;
+    uint16_t cal = reg - SENSOR_HREG_CALIB;
+    if(cal < 8)
+      out[i] = (uint16_t)config.calib[config.calib_bank][cal / 2][cal % 2];
+    else if(reg == SENSOR_HREG_LOOP_DELAY_MS)
+      out[i] = config.loop_delay_ms;
+    else if(reg == SENSOR_HREG_SPC_GENERATION)
+      out[i] = config.spc_generation;
+    else if(reg == SENSOR_HREG_ILLUM_MODE)
+      out[i] = config.illum_mode;
+    else if(reg == SENSOR_HREG_CALIB_BANK)
+      out[i] = config.calib_bank;
+    else if(reg == SENSOR_HREG_CAN_CYCLIC_ID)
+      out[i] = config.can_cyclic_id;
+    else if(reg == SENSOR_HREG_CAN_EVENT_ID)
+      out[i] = config.can_event_id;
+    else if(reg == SENSOR_HREG_CAN_PERIOD_MS)
+      out[i] = config.can_period_ms;
+    else
+      out[i] = config.can_inhibit_ms;
+  }
+
+  return SENSOR_REG_OK;
+}
+
+uint8_t sensor_registers_write_holding(
+  sensor_config &config,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+){
+  if((uint32_t)start + count > SENSOR_HREG_COUNT)
+    return SENSOR_REG_BAD_ADDRESS;
+
+  // Work on a copy so a rejected write leaves nothing half applied.
+  //  Calibration pairs are validated as a whole, a master updating a range
+  //    writes both registers of the pair in one request.
+  sensor_config next = config;
+
+  // The bank goes first so calibration registers in the same write land in
+  //  the bank it selects.
+  uint16_t bank = SENSOR_HREG_CALIB_BANK;
+  if(bank >= start && bank < start + count){
+    if(values[bank - start] >= ILLUM_STEPS)
+      return SENSOR_REG_BAD_VALUE;
+    next.calib_bank = values[bank - start];
+  }
+
+  for(uint16_t i=0; i<count; i++){
+    uint16_t reg = start + i;
+    uint16_t cal = reg - SENSOR_HREG_CALIB;
+    if(cal < 8)
+      next.calib[next.calib_bank][cal / 2][cal % 2] = (int16_t)values[i];
+    else if(reg == SENSOR_HREG_LOOP_DELAY_MS)
+      next.loop_delay_ms = values[i];
+    else if(reg == SENSOR_HREG_SPC_GENERATION)
+      next.spc_generation = values[i];
+    else if(reg == SENSOR_HREG_ILLUM_MODE){
+      if(values[i] > ILLUM_STEPS)
+        return SENSOR_REG_BAD_VALUE;
+      next.illum_mode = values[i];
+    }
+    else if(reg == SENSOR_HREG_CAN_CYCLIC_ID)
+      next.can_cyclic_id = values[i];
+    else if(reg == SENSOR_HREG_CAN_EVENT_ID)
+      next.can_event_id = values[i];
+    else if(reg == SENSOR_HREG_CAN_PERIOD_MS)
+      next.can_period_ms = values[i];
+    else if(reg == SENSOR_HREG_CAN_INHIBIT_MS)
+      next.can_inhibit_ms = values[i];
+  }
+
+  for(uint8_t i=0; i<4; i++){
+    if(next.calib[next.calib_bank][i][0] >= next.calib[next.calib_bank][i][1])
+      return SENSOR_REG_BAD_VALUE;
+  }
+  if(next.loop_delay_ms > SENSOR_MAX_LOOP_DELAY_MS)
+    return SENSOR_REG_BAD_VALUE;
+  if(
+    next.can_cyclic_id > CAN_OUTPUT_MAX_ID ||
+    next.can_event_id > CAN_OUTPUT_MAX_ID ||
+    next.can_period_ms > CAN_OUTPUT_MAX_PERIOD_MS ||
+    next.can_inhibit_ms > CAN_OUTPUT_MAX_PERIOD_MS
+  )
+    return SENSOR_REG_BAD_VALUE;
+
+  config = next;
+
+  return SENSOR_REG_OK;
+}
@@ -0,0 +1,125 @@
+// Register map the field bus servers expose.
+//  16 bit registers, 32 bit values span two registers high word first (the
+//    usual PLC "big endian word order"). Signed values are two's complement.
+//  Input registers, read only, come from the latest sensor_snapshot:
+//    0       map version, SENSOR_REGISTERS_VERSION
+//    1       fault flags, enum SENSOR_FAULTS
+//    2       class index, enum COLOR_STR_MAP or COLOR_MAP_ERR
+//    3       confidence, 0-100
+//    4-7     raw pulse widths R, G, B, C
+//    8-11    calibrated R, G, B, C (signed, can fall outside 0-255)
+//    12-13   frame counter
+//    14-15   sensor read timeouts
+//    16-17   classification errors
+//    18-19   warm restarts since cold boot
+//    20-21   uptime, seconds
+//    22-23   process control alarm events
+//    24      process control status, bit 0 set once baselines are learned
+//    25-28   process control alarms of the last frame for R, G, B and
+//            distance to target, enum SPC_ALARMS
+//    29      illumination step of the last frame, 0 is full brightness
+//    30      LED duty of that step, out of 255
+//    31      frames since the illumination step last changed, saturated
+//    32      nearest colors_short.csv color, its row from 0, 0xFFFF if the
+//            frame timed out
+//    33-34   classification cache hits since boot
+//    35-36   classification cache misses since boot
+//  Holding registers, read/write, map onto sensor_config:
+//    0-7     calibration min/max pairs R, G, B, C (signed) of the
+//            illumination step selected by register 11
+//    8       delay between frames, ms
+//    9       process control baseline generation, write any new value to
+//            relearn the baselines
+//    10      illumination mode, 0 automatic, 1-8 hold step 0-7
+//    11      calibration bank, the illumination step registers 0-7 address.
+//            Applied before the rest of a write that includes it.
+//    12      CAN cyclic frame identifier, 11 bit
+//    13      CAN event frame identifier, 11 bit
+//    14      CAN cyclic frame period, ms, 0 for events only
+//    15      CAN event inhibit time, ms
+#ifndef SENSOR_REGISTERS_H
+#define SENSOR_REGISTERS_H
+
+#include <stdint.h>
+
+#include "sensor_snapshot.h"
+
+// Bump whenever registers move or change meaning, masters can check it.
+#define SENSOR_REGISTERS_VERSION 6
+
+enum SENSOR_INPUT_REGS {
+  SENSOR_IREG_VERSION         = 0,
+  SENSOR_IREG_FAULTS          = 1,
+  SENSOR_IREG_CLASS           = 2,
+  SENSOR_IREG_CONFIDENCE      = 3,
+  SENSOR_IREG_RAW             = 4,
+  SENSOR_IREG_MAPPED          = 8,
+  SENSOR_IREG_FRAME           = 12,
+  SENSOR_IREG_SENSOR_TIMEOUTS = 14,
+  SENSOR_IREG_MAP_ERRORS      = 16,
+  SENSOR_IREG_WARM_RESTARTS   = 18,
+  SENSOR_IREG_UPTIME          = 20,
+  SENSOR_IREG_SPC_EVENTS      = 22,
+  SENSOR_IREG_SPC_STATUS      = 24,
+  SENSOR_IREG_SPC_ALARMS      = 25,
+  SENSOR_IREG_ILLUM_STEP      = 29,
+  SENSOR_IREG_ILLUM_DUTY      = 30,
+  SENSOR_IREG_ILLUM_SETTLED   = 31,
+  SENSOR_IREG_PALETTE         = 32,
+  SENSOR_IREG_CACHE_HITS      = 33,
+  SENSOR_IREG_CACHE_MISSES    = 35,
+  SENSOR_IREG_COUNT           = 37
+};
+
+enum SENSOR_HOLDING_REGS {
+  SENSOR_HREG_CALIB          = 0,
+  SENSOR_HREG_LOOP_DELAY_MS  = 8,
+  SENSOR_HREG_SPC_GENERATION = 9,
+  SENSOR_HREG_ILLUM_MODE     = 10,
+  SENSOR_HREG_CALIB_BANK     = 11,
+  SENSOR_HREG_CAN_CYCLIC_ID  = 12,
+  SENSOR_HREG_CAN_EVENT_ID   = 13,
+  SENSOR_HREG_CAN_PERIOD_MS  = 14,
+  SENSOR_HREG_CAN_INHIBIT_MS = 15,
+  SENSOR_HREG_COUNT          = 16
+};
+
+// Upper bound accepted for SENSOR_HREG_LOOP_DELAY_MS.
+#define SENSOR_MAX_LOOP_DELAY_MS 10000
+
+enum SENSOR_REG_RESULTS {
+  SENSOR_REG_OK          = 0,
+  SENSOR_REG_BAD_ADDRESS = 1,
+  SENSOR_REG_BAD_VALUE   = 2
+};
+
+// Fills out with count input registers starting at start.
+//  Returns SENSOR_REG_BAD_ADDRESS if any of them is outside the map.
+uint8_t sensor_registers_read_input(
+  const sensor_snapshot &snap,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+);
+
+uint8_t sensor_registers_read_holding(
+  const sensor_config &config,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+);
+
+// Applies count holding register writes starting at start to config.
+//  All or nothing: config is left untouched unless every register is in the
+//    map and the resulting configuration is valid (each calibration min below
+//    its max, frame delay within SENSOR_MAX_LOOP_DELAY_MS, illumination mode
+//    and calibration bank naming existing steps, CAN identifiers within
+//    CAN_OUTPUT_MAX_ID and times within CAN_OUTPUT_MAX_PERIOD_MS).
+uint8_t sensor_registers_write_holding(
+  sensor_config &config,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+);
+
+#endif
@@ -0,0 +1,144 @@
+// Lock-free hand-off of the latest pipeline results to the field bus servers.
+//  The acquisition loop publishes one sensor_snapshot per frame, the Modbus
+//    (and any other) server task copies it out whenever a master polls. A
+//    latched sequence lock keeps the two decoupled: two copies of the data,
+//    the writer updates one while readers are pointed at the other, so the
+//    writer never waits and a reader only has to copy again if a whole publish
+//    completed underneath it. Even a writer interrupted part way through a
+//    publish doesn't hold readers up.
+//  Configuration travels the other way through the same mechanism, written by
+//    the server task when a master writes a register and picked up by the loop
+//    at the start of the next frame.
+#ifndef SENSOR_SNAPSHOT_H
+#define SENSOR_SNAPSHOT_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "illumination.h"
+
+// Bits of sensor_snapshot::faults.
+enum SENSOR_FAULTS {
+  SENSOR_FAULT_TIMEOUT   = 0x0001,  // A channel read timed out this frame.
+  SENSOR_FAULT_MAP_ERR   = 0x0002,  // No class could be determined.
+  SENSOR_FAULT_UNSYNCED  = 0x0004,  // No host clock estimate yet.
+  SENSOR_FAULT_DISPLAY   = 0x0008,  // OLED failed to initialize.
+  SENSOR_FAULT_SPC       = 0x0010   // A process control alarm is held.
+};
+
+// Results of one acquisition frame plus running counters.
+//  Plain data, copied as a whole.
+struct sensor_snapshot {
+  uint32_t frame;
+  uint16_t raw[4];
+  int16_t mapped[4];
+  uint8_t class_index;
+  uint8_t confidence;
+  uint16_t faults;
+
+  uint32_t sensor_timeouts;
+  uint32_t map_errors;
+  uint32_t warm_restarts;
+  uint32_t uptime_s;
+
+  // Process control: alarms raised by this frame per chart channel (enum
+  //  SPC_ALARMS), whether the baselines are learned yet, and alarm events
+  //  since boot.
+  uint8_t spc_alarms[4];
+  bool spc_armed;
+  uint32_t spc_alarm_events;
+
+  // Illumination step the frame was read at, its LED duty, and frames since
+  //  the step last changed.
+  uint8_t illum_step;
+  uint8_t illum_duty;
+  uint16_t illum_settled_frames;
+
+  // Nearest colors_short.csv color to the frame, PALETTE_NO_MATCH if the frame
+  //  timed out.
+  uint16_t palette_index;
+
+  // Classification cache lookups that hit and missed since boot.
+  uint32_t class_cache_hits;
+  uint32_t class_cache_misses;
+};
+
+// Runtime configuration the masters are allowed to change.
+struct sensor_config {
+  // Calibration tables per illumination step, see illumination.h.
+  int16_t calib[ILLUM_STEPS][4][2];
+  uint16_t loop_delay_ms;
+
+  // Changing this makes the process control charts learn a new baseline.
+  uint16_t spc_generation;
+
+  // 0 for automatic illumination, otherwise the LEDs are held at step
+  //  illum_mode - 1.
+  uint8_t illum_mode;
+
+  // Calibration table the calibration registers read and write.
+  uint8_t calib_bank;
+
+  // CAN output identifiers and timing, see can_output_config.
+  uint16_t can_cyclic_id;
+  uint16_t can_event_id;
+  uint16_t can_period_ms;
+  uint16_t can_inhibit_ms;
+};
+
+// Latch sequence, bumped twice per write. Its low bit is the copy readers
+//  should take.
+//  Single writer per lock, any number of readers.
+struct sensor_seqlock {
+  std::atomic<uint32_t> seq;
+};
+
+struct sensor_snapshot_channel {
+  sensor_seqlock lock;
+  sensor_snapshot data[2];
+};
+
+struct sensor_config_channel {
+  sensor_seqlock lock;
+  sensor_config data[2];
+};
+
+void sensor_snapshot_channel_init(sensor_snapshot_channel &chan);
+void sensor_config_channel_init(
+  sensor_config_channel &chan,
+  const sensor_config &initial
+);
+
+// Publishes snap. Never blocks.
+void sensor_snapshot_publish(
+  sensor_snapshot_channel &chan,
+  const sensor_snapshot &snap
+);
+
+// Copies the latest snapshot into out.
+//  Returns false if every one of max_tries attempts raced a complete publish,
+//    in which case out is unspecified. Publishes are milliseconds apart and a
+//    copy takes well under a microsecond, so in practice the first attempt
+//    succeeds.
+bool sensor_snapshot_read(
+  const sensor_snapshot_channel &chan,
+  sensor_snapshot &out,
+  uint8_t max_tries
+);
+
+void sensor_config_publish(
+  sensor_config_channel &chan,
+  const sensor_config &config
+);
+
+// As sensor_snapshot_read(). seq, if not null, receives the sequence number
+//  the copy was taken at, so the caller can tell whether anything changed
+//  since last time without comparing contents.
+bool sensor_config_read(
+  const sensor_config_channel &chan,
+  sensor_config &out,
+  uint32_t *seq,
+  uint8_t max_tries
+);
+
+#endif
@@ -0,0 +1,699 @@
+#include "serial_link.h"
+
+// Decoder states, in wire order.
+enum LINK_DECODE_STATES {
+  LINK_WAIT_SYNC  = 0,
+  LINK_WAIT_TYPE  = 1,
+  LINK_WAIT_LEN   = 2,
+  LINK_WAIT_DATA  = 3,
+  LINK_WAIT_CRC   = 4
+};
+
+// CRC-8, polynomial 0x07 (ATM/SMBus), bitwise.
+//  Frames are short and the link is 115200 baud so a table isn't worth the
+//    flash.
+uint8_t link_crc8(uint8_t crc, uint8_t data){
+  crc ^= data;
+  for(uint8_t i=0; i<8; i++){
+    if(crc & 0x80)
+      crc = (crc << 1) ^ 0x07;
+    else
+      crc <<= 1;
+  }
+
+  return crc;
+}
+
+size_t link_encode(
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len,
+  uint8_t *out
+){
+  if(len > LINK_MAX_PAYLOAD)
+    return 0;
+
+  uint8_t crc = 0;
+  out[0] = LINK_SYNC_BYTE;
+  out[1] = type;
+  out[2] = len;
+  crc = link_crc8(crc, type);
+  crc = link_crc8(crc, len);
+  for(uint8_t i=0; i<len; i++){
+    out[3 + i] = payload[i];
+    crc = link_crc8(crc, payload[i]);
+  }
+  out[3 + len] = crc;
+
+  return len + LINK_FRAME_OVERHEAD;
+}
+
+void link_decoder_reset(link_decoder &dec){
+  dec.state = LINK_WAIT_SYNC;
+  dec.type = 0;
+  dec.len = 0;
+  dec.pos = 0;
+  dec.crc = 0;
+
+  return;
+}
+
+bool link_decode_byte(link_decoder &dec, uint8_t data){
+  switch(dec.state){
+    case LINK_WAIT_SYNC:
+      if(data == LINK_SYNC_BYTE){
+        dec.crc = 0;
+        dec.state = LINK_WAIT_TYPE;
+      }
+      return false;
+
+    case LINK_WAIT_TYPE:
+      dec.type = data;
+      dec.crc = link_crc8(dec.crc, data);
+      dec.state = LINK_WAIT_LEN;
+      return false;
+
+    case LINK_WAIT_LEN:
+      // Oversized length can only be line noise, start hunting again.
+      if(data > LINK_MAX_PAYLOAD){
+        dec.state = LINK_WAIT_SYNC;
+        return false;
+      }
+      dec.len = data;
+      dec.pos = 0;
+      dec.crc = link_crc8(dec.crc, data);
+      dec.state = (data == 0) ? LINK_WAIT_CRC : LINK_WAIT_DATA;
+      return false;
+
+    case LINK_WAIT_DATA:
+      dec.payload[dec.pos++] = data;
+      dec.crc = link_crc8(dec.crc, data);
+      if(dec.pos >= dec.len)
+        dec.state = LINK_WAIT_CRC;
+      return false;
+
+    case LINK_WAIT_CRC:
+      dec.state = LINK_WAIT_SYNC;
+      if(data == dec.crc)
+        return true;
+      dec.crc_errors++;
+      return false;
+  }
+
+  dec.state = LINK_WAIT_SYNC;
+  return false;
+}
+
+void link_put_u16(uint8_t *buf, uint16_t val){
+  buf[0] = val & 0xFF;
+  buf[1] = (val >> 8) & 0xFF;
+
+  return;
+}
+
+void link_put_u32(uint8_t *buf, uint32_t val){
+  for(uint8_t i=0; i<4; i++)
+    buf[i] = (val >> (8 * i)) & 0xFF;
+
+  return;
+}
+
+void link_put_u64(uint8_t *buf, uint64_t val){
+  for(uint8_t i=0; i<8; i++)
+    buf[i] = (val >> (8 * i)) & 0xFF;
+
+  return;
+}
+
+uint16_t link_get_u16(const uint8_t *buf){
+  return (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+}
+
+uint32_t link_get_u32(const uint8_t *buf){
+  uint32_t val = 0;
+  for(uint8_t i=0; i<4; i++)
+    val |= (uint32_t)buf[i] << (8 * i);
+
+  return val;
+}
+
+uint64_t link_get_u64(const uint8_t *buf){
+  uint64_t val = 0;
+  for(uint8_t i=0; i<8; i++)
+    val |= (uint64_t)buf[i] << (8 * i);
+
+  return val;
+}
+
+uint8_t link_pack_reading(const link_reading &msg, uint8_t *buf){
+  link_put_u16(&buf[0], msg.seq);
+  buf[2] = msg.flags;
+  buf[3] = msg.class_index;
+  link_put_u64(&buf[4], (uint64_t)msg.host_time_us);
+  link_put_u32(&buf[12], msg.uncertainty_us);
+  for(uint8_t i=0; i<4; i++){
+    link_put_u16(&buf[16 + 2 * i], msg.raw[i]);
+    link_put_u16(&buf[24 + 2 * i], (uint16_t)msg.mapped[i]);
+  }
+
+  return LINK_READING_LEN;
+}
+
+bool link_unpack_reading(const uint8_t *buf, uint8_t len, link_reading &msg){
+  if(len != LINK_READING_LEN)
+    return false;
+
+  msg.seq = link_get_u16(&buf[0]);
+  msg.flags = buf[2];
+  msg.class_index = buf[3];
+  msg.host_time_us = (int64_t)link_get_u64(&buf[4]);
+  msg.uncertainty_us = link_get_u32(&buf[12]);
+  for(uint8_t i=0; i<4; i++){
+    msg.raw[i] = link_get_u16(&buf[16 + 2 * i]);
+    msg.mapped[i] = (int16_t)link_get_u16(&buf[24 + 2 * i]);
+  }
+
+  return true;
+}
+
+uint8_t link_pack_sync_req(const link_sync_req &msg, uint8_t *buf){
+  link_put_u64(&buf[0], (uint64_t)msg.t1);
+
+  return LINK_SYNC_REQ_LEN;
+}
+
+bool link_unpack_sync_req(const uint8_t *buf, uint8_t len, link_sync_req &msg){
+  if(len != LINK_SYNC_REQ_LEN)
+    return false;
+
+  msg.t1 = (int64_t)link_get_u64(&buf[0]);
+
+  return true;
+}
+
+uint8_t link_pack_sync_resp(const link_sync_resp &msg, uint8_t *buf){
+  link_put_u64(&buf[0], (uint64_t)msg.t1);
+  link_put_u64(&buf[8], (uint64_t)msg.t2);
+  link_put_u64(&buf[16], (uint64_t)msg.t3);
+
+  return LINK_SYNC_RESP_LEN;
+}
+
+bool link_unpack_sync_resp(
+  const uint8_t *buf,
+  uint8_t len,
+  link_sync_resp &msg
+){
+  if(len != LINK_SYNC_RESP_LEN)
+    return false;
+
+  msg.t1 = (int64_t)link_get_u64(&buf[0]);
+  msg.t2 = (int64_t)link_get_u64(&buf[8]);
+  msg.t3 = (int64_t)link_get_u64(&buf[16]);
+
+  return true;
+}
+
+uint8_t link_pack_sync_status(const link_sync_status &msg, uint8_t *buf){
+  link_put_u64(&buf[0], msg.device_id);
+  link_put_u64(&buf[8], (uint64_t)msg.offset_us);
+  link_put_u64(&buf[16], (uint64_t)msg.device_time_us);
+  link_put_u32(&buf[24], (uint32_t)msg.drift_ppb);
+  link_put_u32(&buf[28], msg.uncertainty_us);
+  link_put_u16(&buf[32], msg.samples);
+  link_put_u16(&buf[34], msg.rtt_us);
+
+  return LINK_SYNC_STATUS_LEN;
+}
+
+bool link_unpack_sync_status(
+  const uint8_t *buf,
+  uint8_t len,
+  link_sync_status &msg
+){
+  if(len != LINK_SYNC_STATUS_LEN)
+    return false;
+
+  msg.device_id = link_get_u64(&buf[0]);
+  msg.offset_us = (int64_t)link_get_u64(&buf[8]);
+  msg.device_time_us = (int64_t)link_get_u64(&buf[16]);
+  msg.drift_ppb = (int32_t)link_get_u32(&buf[24]);
+  msg.uncertainty_us = link_get_u32(&buf[28]);
+  msg.samples = link_get_u16(&buf[32]);
+  msg.rtt_us = link_get_u16(&buf[34]);
+
+  return true;
+}
+
+uint8_t link_pack_spc_alarm(const link_spc_alarm &msg, uint8_t *buf){
+  link_put_u16(&buf[0], msg.frame);
+  buf[2] = msg.channel;
+  buf[3] = msg.alarms;
+  link_put_u32(&buf[4], (uint32_t)msg.mean);
+  link_put_u32(&buf[8], (uint32_t)msg.sigma);
+  link_put_u32(&buf[12], (uint32_t)msg.ewma);
+  link_put_u32(&buf[16], (uint32_t)msg.cusum_high);
+  link_put_u32(&buf[20], (uint32_t)msg.cusum_low);
+  link_put_u32(&buf[24], (uint32_t)msg.xbar);
+  link_put_u32(&buf[28], (uint32_t)msg.range);
+
+  return LINK_SPC_ALARM_LEN;
+}
+
+bool link_unpack_spc_alarm(
+  const uint8_t *buf,
+  uint8_t len,
+  link_spc_alarm &msg
+){
+  if(len != LINK_SPC_ALARM_LEN)
+    return false;
+
+  msg.frame = link_get_u16(&buf[0]);
+  msg.channel = buf[2];
+  msg.alarms = buf[3];
+  msg.mean = (int32_t)link_get_u32(&buf[4]);
+  msg.sigma = (int32_t)link_get_u32(&buf[8]);
+  msg.ewma = (int32_t)link_get_u32(&buf[12]);
+  msg.cusum_high = (int32_t)link_get_u32(&buf[16]);
+  msg.cusum_low = (int32_t)link_get_u32(&buf[20]);
+  msg.xbar = (int32_t)link_get_u32(&buf[24]);
+  msg.range = (int32_t)link_get_u32(&buf[28]);
+
+  return true;
+}
+
+uint8_t link_pack_profile_header(
+  const link_profile_header &msg,
+  uint8_t *buf
+){
+  link_put_u16(&buf[0], msg.window);
+  link_put_u32(&buf[2], msg.sample_hz);
+  link_put_u32(&buf[6], msg.samples);
+  link_put_u32(&buf[10], msg.isr_samples);
+  link_put_u32(&buf[14], msg.other_samples);
+  link_put_u32(&buf[18], msg.dropped_stacks);
+  link_put_u16(&buf[22], msg.bucket_frames);
+  link_put_u16(&buf[24], msg.stack_frames);
+  for(uint8_t i=0; i<LINK_PROFILE_REGIONS; i++){
+    uint8_t *region = &buf[26 + i * 11];
+    link_put_u32(&region[0], msg.regions[i].start);
+    link_put_u32(&region[4], msg.regions[i].end);
+    link_put_u16(&region[8], msg.regions[i].first_bucket);
+    region[10] = msg.regions[i].shift;
+  }
+
+  return LINK_PROFILE_HEADER_LEN;
+}
+
+bool link_unpack_profile_header(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_header &msg
+){
+  if(len != LINK_PROFILE_HEADER_LEN)
+    return false;
+
+  msg.window = link_get_u16(&buf[0]);
+  msg.sample_hz = link_get_u32(&buf[2]);
+  msg.samples = link_get_u32(&buf[6]);
+  msg.isr_samples = link_get_u32(&buf[10]);
+  msg.other_samples = link_get_u32(&buf[14]);
+  msg.dropped_stacks = link_get_u32(&buf[18]);
+  msg.bucket_frames = link_get_u16(&buf[22]);
+  msg.stack_frames = link_get_u16(&buf[24]);
+  for(uint8_t i=0; i<LINK_PROFILE_REGIONS; i++){
+    const uint8_t *region = &buf[26 + i * 11];
+    msg.regions[i].start = link_get_u32(&region[0]);
+    msg.regions[i].end = link_get_u32(&region[4]);
+    msg.regions[i].first_bucket = link_get_u16(&region[8]);
+    msg.regions[i].shift = region[10];
+  }
+
+  return true;
+}
+
+uint8_t link_pack_profile_buckets(
+  const link_profile_buckets &msg,
+  uint8_t *buf
+){
+  link_put_u16(&buf[0], msg.window);
+  buf[2] = msg.count;
+  for(uint8_t i=0; i<msg.count; i++){
+    link_put_u16(&buf[3 + i * 4], msg.entries[i].bucket);
+    link_put_u16(&buf[5 + i * 4], msg.entries[i].count);
+  }
+
+  return 3 + msg.count * 4;
+}
+
+bool link_unpack_profile_buckets(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_buckets &msg
+){
+  if(len < 3 || buf[2] > LINK_PROFILE_BUCKET_ENTRIES || len != 3 + buf[2] * 4)
+    return false;
+
+  msg.window = link_get_u16(&buf[0]);
+  msg.count = buf[2];
+  for(uint8_t i=0; i<msg.count; i++){
+    msg.entries[i].bucket = link_get_u16(&buf[3 + i * 4]);
+    msg.entries[i].count = link_get_u16(&buf[5 + i * 4]);
+  }
+
+  return true;
+}
+
+uint8_t link_pack_profile_stack(const link_profile_stack &msg, uint8_t *buf){
+  link_put_u16(&buf[0], msg.window);
+  link_put_u16(&buf[2], msg.count);
+  buf[4] = msg.depth;
+  for(uint8_t i=0; i<msg.depth; i++)
+    link_put_u32(&buf[5 + i * 4], msg.pcs[i]);
+
+  return 5 + msg.depth * 4;
+}
+
+bool link_unpack_profile_stack(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_stack &msg
+){
+  if(len < 5 || buf[4] > LINK_PROFILE_STACK_DEPTH || len != 5 + buf[4] * 4)
+    return false;
+
+  msg.window = link_get_u16(&buf[0]);
+  msg.count = link_get_u16(&buf[2]);
+  msg.depth = buf[4];
+  for(uint8_t i=0; i<msg.depth; i++)
+    msg.pcs[i] = link_get_u32(&buf[5 + i * 4]);
+
+  return true;
+}
+
+uint8_t link_pack_log(const link_log &msg, uint8_t *buf){
+  link_put_u32(&buf[0], msg.site);
+  link_put_u64(&buf[4], (uint64_t)msg.device_time_us);
+  buf[12] = msg.count;
+  for(uint8_t i=0; i<msg.count; i++)
+    link_put_u32(&buf[13 + i * 4], msg.words[i]);
+
+  return 13 + msg.count * 4;
+}
+
+bool link_unpack_log(const uint8_t *buf, uint8_t len, link_log &msg){
+  if(len < 13 || buf[12] > LINK_LOG_MAX_WORDS || len != 13 + buf[12] * 4)
+    return false;
+
+  msg.site = link_get_u32(&buf[0]);
+  msg.device_time_us = (int64_t)link_get_u64(&buf[4]);
+  msg.count = buf[12];
+  for(uint8_t i=0; i<msg.count; i++)
+    msg.words[i] = link_get_u32(&buf[13 + i * 4]);
+
+  return true;
+}
+
+uint8_t link_pack_subscribe(const link_subscribe &msg, uint8_t *buf){
+  buf[0] = msg.sub;
+  buf[1] = msg.mode;
+  link_put_u16(&buf[2], msg.fields);
+  link_put_u16(&buf[4], msg.decimation);
+  link_put_u16(&buf[6], msg.period_ms);
+
+  return LINK_SUBSCRIBE_LEN;
+}
+
+bool link_unpack_subscribe(
+  const uint8_t *buf,
+  uint8_t len,
+  link_subscribe &msg
+){
+  if(len != LINK_SUBSCRIBE_LEN)
+    return false;
+
+  msg.sub = buf[0];
+  msg.mode = buf[1];
+  msg.fields = link_get_u16(&buf[2]);
+  msg.decimation = link_get_u16(&buf[4]);
+  msg.period_ms = link_get_u16(&buf[6]);
+
+  return true;
+}
+
+uint8_t link_pack_subscribe_ack(const link_subscribe_ack &msg, uint8_t *buf){
+  buf[0] = msg.sub;
+  buf[1] = msg.status;
+
+  return LINK_SUBSCRIBE_ACK_LEN;
+}
+
+bool link_unpack_subscribe_ack(
+  const uint8_t *buf,
+  uint8_t len,
+  link_subscribe_ack &msg
+){
+  if(len != LINK_SUBSCRIBE_ACK_LEN)
+    return false;
+
+  msg.sub = buf[0];
+  msg.status = buf[1];
+
+  return true;
+}
+
+uint8_t link_pack_telemetry(const link_telemetry &msg, uint8_t *buf){
+  buf[0] = msg.sub;
+  link_put_u16(&buf[1], msg.seq);
+  link_put_u16(&buf[3], msg.samples);
+  link_put_u64(&buf[5], (uint64_t)msg.device_time_us);
+  link_put_u16(&buf[13], msg.fields);
+  uint8_t count = __builtin_popcount(msg.fields);
+  for(uint8_t i=0; i<count; i++)
+    link_put_u16(&buf[15 + i * 2], msg.values[i]);
+
+  return 15 + count * 2;
+}
+
+bool link_unpack_telemetry(
+  const uint8_t *buf,
+  uint8_t len,
+  link_telemetry &msg
+){
+  if(len < 15)
+    return false;
+  uint16_t fields = link_get_u16(&buf[13]);
+  uint8_t count = __builtin_popcount(fields);
+  if(len != 15 + count * 2)
+    return false;
+
+  msg.sub = buf[0];
+  msg.seq = link_get_u16(&buf[1]);
+  msg.samples = link_get_u16(&buf[3]);
+  msg.device_time_us = (int64_t)link_get_u64(&buf[5]);
+  msg.fields = fields;
+  for(uint8_t i=0; i<count; i++)
+    msg.values[i] = link_get_u16(&buf[15 + i * 2]);
+
+  return true;
+}
+
+uint8_t link_pack_capture_cmd(const link_capture_cmd &msg, uint8_t *buf){
+  buf[0] = msg.op;
+  buf[1] = msg.slot;
+  buf[2] = msg.pre;
+  buf[3] = msg.post;
+  buf[4] = msg.causes;
+
+  return LINK_CAPTURE_CMD_LEN;
+}
+
+bool link_unpack_capture_cmd(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_cmd &msg
+){
+  if(len != LINK_CAPTURE_CMD_LEN)
+    return false;
+
+  msg.op = buf[0];
+  msg.slot = buf[1];
+  msg.pre = buf[2];
+  msg.post = buf[3];
+  msg.causes = buf[4];
+
+  return true;
+}
+
+uint8_t link_pack_capture_info(const link_capture_info &msg, uint8_t *buf){
+  buf[0] = msg.slot;
+  link_put_u16(&buf[1], msg.id);
+  buf[3] = msg.causes;
+  buf[4] = msg.pre;
+  buf[5] = msg.post;
+  link_put_u32(&buf[6], msg.trigger_frame);
+  link_put_u64(&buf[10], (uint64_t)msg.trigger_time_us);
+  link_put_u32(&buf[18], msg.captures);
+  link_put_u32(&buf[22], msg.missed);
+
+  return LINK_CAPTURE_INFO_LEN;
+}
+
+bool link_unpack_capture_info(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_info &msg
+){
+  if(len != LINK_CAPTURE_INFO_LEN)
+    return false;
+
+  msg.slot = buf[0];
+  msg.id = link_get_u16(&buf[1]);
+  msg.causes = buf[3];
+  msg.pre = buf[4];
+  msg.post = buf[5];
+  msg.trigger_frame = link_get_u32(&buf[6]);
+  msg.trigger_time_us = (int64_t)link_get_u64(&buf[10]);
+  msg.captures = link_get_u32(&buf[18]);
+  msg.missed = link_get_u32(&buf[22]);
+
+  return true;
+}
+
+uint8_t link_pack_capture_data(const link_capture_data &msg, uint8_t *buf){
+  buf[0] = msg.slot;
+  link_put_u16(&buf[1], msg.id);
+  buf[3] = msg.first;
+  buf[4] = msg.count;
+  for(uint8_t i=0; i<msg.count; i++){
+    const link_capture_sample &sample = msg.samples[i];
+    uint8_t *out = &buf[5 + i * 15];
+    link_put_u32(&out[0], (uint32_t)sample.offset_us);
+    for(uint8_t ch=0; ch<4; ch++)
+      link_put_u16(&out[4 + ch * 2], sample.raw[ch]);
+    link_put_u16(&out[12], sample.faults);
+    out[14] = sample.class_index;
+  }
+
+  return 5 + msg.count * 15;
+}
+
+bool link_unpack_capture_data(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_data &msg
+){
+  if(
+    len < 5 ||
+    buf[4] > LINK_CAPTURE_DATA_SAMPLES ||
+    len != 5 + buf[4] * 15
+  ){
+    return false;
+  }
+
+  msg.slot = buf[0];
+  msg.id = link_get_u16(&buf[1]);
+  msg.first = buf[3];
+  msg.count = buf[4];
+  for(uint8_t i=0; i<msg.count; i++){
+    link_capture_sample &sample = msg.samples[i];
+    const uint8_t *in = &buf[5 + i * 15];
+    sample.offset_us = (int32_t)link_get_u32(&in[0]);
+    for(uint8_t ch=0; ch<4; ch++)
+      sample.raw[ch] = link_get_u16(&in[4 + ch * 2]);
+    sample.faults = link_get_u16(&in[12]);
+    sample.class_index = in[14];
+  }
+
+  return true;
+}
+
+uint8_t link_pack_hist_cmd(const link_hist_cmd &msg, uint8_t *buf){
+  buf[0] = msg.op;
+  buf[1] = msg.scale;
+  buf[2] = msg.shift;
+  link_put_u16(&buf[3], msg.lo);
+
+  return LINK_HIST_CMD_LEN;
+}
+
+bool link_unpack_hist_cmd(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_cmd &msg
+){
+  if(len != LINK_HIST_CMD_LEN)
+    return false;
+
+  msg.op = buf[0];
+  msg.scale = buf[1];
+  msg.shift = buf[2];
+  msg.lo = link_get_u16(&buf[3]);
+
+  return true;
+}
+
+uint8_t link_pack_hist_info(const link_hist_info &msg, uint8_t *buf){
+  buf[0] = msg.step;
+  buf[1] = msg.scale;
+  buf[2] = msg.shift;
+  link_put_u16(&buf[3], msg.lo);
+  link_put_u16(&buf[5], msg.bins);
+  link_put_u32(&buf[7], msg.age_ms);
+  for(uint8_t ch=0; ch<4; ch++)
+    link_put_u32(&buf[11 + ch * 4], msg.samples[ch]);
+
+  return LINK_HIST_INFO_LEN;
+}
+
+bool link_unpack_hist_info(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_info &msg
+){
+  if(len != LINK_HIST_INFO_LEN)
+    return false;
+
+  msg.step = buf[0];
+  msg.scale = buf[1];
+  msg.shift = buf[2];
+  msg.lo = link_get_u16(&buf[3]);
+  msg.bins = link_get_u16(&buf[5]);
+  msg.age_ms = link_get_u32(&buf[7]);
+  for(uint8_t ch=0; ch<4; ch++)
+    msg.samples[ch] = link_get_u32(&buf[11 + ch * 4]);
+
+  return true;
+}
+
+uint8_t link_pack_hist_data(const link_hist_data &msg, uint8_t *buf){
+  buf[0] = msg.channel;
+  link_put_u16(&buf[1], msg.first);
+  buf[3] = msg.count;
+  for(uint8_t i=0; i<msg.count; i++)
+    link_put_u32(&buf[4 + i * 4], msg.counts[i]);
+
+  return 4 + msg.count * 4;
+}
+
+bool link_unpack_hist_data(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_data &msg
+){
+  if(
+    len < 4 ||
+    buf[3] > LINK_HIST_DATA_BINS ||
+    len != 4 + buf[3] * 4
+  ){
+    return false;
+  }
+
+  msg.channel = buf[0];
+  msg.first = link_get_u16(&buf[1]);
+  msg.count = buf[3];
+  for(uint8_t i=0; i<msg.count; i++)
+    msg.counts[i] = link_get_u32(&buf[4 + i * 4]);
+
+  return true;
+}
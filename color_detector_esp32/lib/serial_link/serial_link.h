@@ -0,0 +1,453 @@
+// Binary framing used between a sensor head and the host over the serial port.
+//  Kept free of any Arduino includes so the host tools can link the exact same
+//  encoder/decoder the firmware uses.
+//
+// Frame layout on the wire:
+//  [SYNC 0xA5][TYPE][LEN][PAYLOAD ... LEN bytes][CRC8]
+//  The CRC covers TYPE, LEN and the payload. All multi-byte payload fields are
+//    little-endian.
+//  Text written with Serial.print() can share the port, the decoder just hunts
+//    for the next SYNC byte and drops anything that fails the CRC.
+#ifndef SERIAL_LINK_H
+#define SERIAL_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LINK_SYNC_BYTE 0xA5
+
+// Largest payload any frame type may carry.
+#define LINK_MAX_PAYLOAD 64
+
+// SYNC + TYPE + LEN + CRC.
+#define LINK_FRAME_OVERHEAD 4
+
+#define LINK_MAX_FRAME (LINK_MAX_PAYLOAD + LINK_FRAME_OVERHEAD)
+
+// Frame type identifiers.
+//  Warning: these are part of the wire format, never renumber an existing
+//    entry, only append.
+enum LINK_FRAME_TYPES {
+  LINK_READING      = 0x01,   // Device->host, one classified frame.
+  LINK_SYNC_REQ     = 0x10,   // Device->host, clock sync request.
+  LINK_SYNC_RESP    = 0x11,   // Host->device, clock sync response.
+  LINK_SYNC_STATUS  = 0x12,   // Device->host, current clock estimate.
+  LINK_SPC_ALARM    = 0x13,   // Device->host, process control alarm.
+  LINK_PROFILE_HEADER  = 0x14,  // Device->host, start of a profile dump.
+  LINK_PROFILE_BUCKETS = 0x15,  // Device->host, PC histogram entries.
+  LINK_PROFILE_STACK   = 0x16,  // Device->host, one sampled call stack.
+  LINK_LOG             = 0x17,  // Device->host, one binary log record.
+  LINK_SUBSCRIBE       = 0x18,  // Host->device, set up a telemetry stream.
+  LINK_SUBSCRIBE_ACK   = 0x19,  // Device->host, outcome of a subscribe.
+  LINK_TELEMETRY       = 0x1A,  // Device->host, one telemetry stream record.
+  LINK_CAPTURE_CMD     = 0x1B,  // Host->device, pre-trigger capture control.
+  LINK_CAPTURE_INFO    = 0x1C,  // Device->host, a held capture or the setup.
+  LINK_CAPTURE_DATA    = 0x1D,  // Device->host, samples of a held capture.
+  LINK_HIST_CMD        = 0x1E,  // Host->device, raw histogram control.
+  LINK_HIST_INFO       = 0x1F,  // Device->host, raw histogram setup, totals.
+  LINK_HIST_DATA       = 0x20   // Device->host, raw histogram bin counts.
+};
+
+// Bit flags for link_reading::flags.
+#define LINK_READING_FLAG_SYNCED 0x01
+
+// Bits 4-6 of link_reading::flags hold the illumination step the frame was
+//  read at (see illumination.h), raw pulse widths scale with it.
+#define LINK_READING_ILLUM_SHIFT 4
+#define LINK_READING_ILLUM_MASK 0x70
+
+// One classified sensor frame.
+//  host_time_us is the device's estimate of the host clock at the time the
+//    channels were read, +-uncertainty_us. Only meaningful when the SYNCED
+//    flag is set, otherwise it holds raw device time.
+struct link_reading {
+  uint16_t seq;
+  uint8_t flags;
+  uint8_t class_index;
+  int64_t host_time_us;
+  uint32_t uncertainty_us;
+  uint16_t raw[4];
+  int16_t mapped[4];
+};
+#define LINK_READING_LEN 32
+
+// NTP style exchange.
+//  t1: device clock when the request was sent.
+//  t2: host clock when the request was received.
+//  t3: host clock when the response was sent.
+//  The device records t4 itself on reception of the response.
+struct link_sync_req {
+  int64_t t1;
+};
+#define LINK_SYNC_REQ_LEN 8
+
+struct link_sync_resp {
+  int64_t t1;
+  int64_t t2;
+  int64_t t3;
+};
+#define LINK_SYNC_RESP_LEN 24
+
+// Device's current view of the device->host clock mapping, sent after every
+//  accepted sync exchange so the host can track each head.
+struct link_sync_status {
+  uint64_t device_id;
+  int64_t offset_us;        // host - device, at device_time_us.
+  int64_t device_time_us;
+  int32_t drift_ppb;        // Rate of change of offset, parts per billion.
+  uint32_t uncertainty_us;  // Offset uncertainty at device_time_us.
+  uint16_t samples;         // Exchanges used in the current estimate.
+  uint16_t rtt_us;          // Best round trip in the window, saturated.
+};
+#define LINK_SYNC_STATUS_LEN 36
+
+// Raised when a process control chart on the head signals, one per channel
+//  with new alarms. Statistics are Q16.16 in calibrated RGB units, see spc.h.
+//  frame is the low 16 bits of the frame number the alarm was raised on, as
+//    in the snapshot registers and capture samples. Not a reading record seq:
+//    no records are sent for frames covered by telemetry subscriptions.
+struct link_spc_alarm {
+  uint16_t frame;
+  uint8_t channel;          // R, G, B, or 3 for distance to target.
+  uint8_t alarms;           // enum SPC_ALARMS bits.
+  int32_t mean;             // Baseline.
+  int32_t sigma;
+  int32_t ewma;
+  int32_t cusum_high;       // Including the value that signalled.
+  int32_t cusum_low;
+  int32_t xbar;             // Last completed subgroup.
+  int32_t range;
+};
+#define LINK_SPC_ALARM_LEN 32
+
+// Sampling profiler dumps, see profiler.h on the firmware side.
+//  A dump is one header followed by exactly bucket_frames bucket frames and
+//    stack_frames stack frames, all tagged with the same window number.
+#define LINK_PROFILE_REGIONS 3
+#define LINK_PROFILE_BUCKET_ENTRIES 15
+#define LINK_PROFILE_STACK_DEPTH 14
+
+// A code address range the PC histogram covers. Bucket first_bucket + i
+//  counts PCs in [start + (i << shift), start + ((i + 1) << shift)).
+struct link_profile_region {
+  uint32_t start;
+  uint32_t end;
+  uint16_t first_bucket;
+  uint8_t shift;
+};
+
+struct link_profile_header {
+  uint16_t window;
+  uint32_t sample_hz;
+  uint32_t samples;         // Every timer tick in the window.
+  uint32_t isr_samples;     // Ticks that landed in another interrupt.
+  uint32_t other_samples;   // PCs outside every region.
+  uint32_t dropped_stacks;  // Stacks that didn't fit the stack table.
+  uint16_t bucket_frames;
+  uint16_t stack_frames;
+  link_profile_region regions[LINK_PROFILE_REGIONS];
+};
+#define LINK_PROFILE_HEADER_LEN 59
+
+struct link_profile_bucket {
+  uint16_t bucket;
+  uint16_t count;
+};
+
+struct link_profile_buckets {
+  uint16_t window;
+  uint8_t count;
+  link_profile_bucket entries[LINK_PROFILE_BUCKET_ENTRIES];
+};
+// Variable length, 3 + 4 per entry.
+
+// One distinct call stack and how often it was sampled. pcs[0] is the
+//  interrupted PC, the rest are return addresses, outermost last.
+struct link_profile_stack {
+  uint16_t window;
+  uint16_t count;
+  uint8_t depth;
+  uint32_t pcs[LINK_PROFILE_STACK_DEPTH];
+};
+// Variable length, 5 + 4 per PC.
+
+// Binary log record, see binlog.h on the firmware side.
+//  site is the address of the call site's binlog_site in the firmware image,
+//    which the host looks its format string up by. Arguments travel as 32 bit
+//    words in call order, 64 bit ones as two words low first.
+#define LINK_LOG_MAX_WORDS 12
+
+struct link_log {
+  uint32_t site;
+  int64_t device_time_us;
+  uint8_t count;
+  uint32_t words[LINK_LOG_MAX_WORDS];
+};
+// Variable length, 13 + 4 per word.
+
+// Telemetry subscriptions, see telemetry.h on the firmware side.
+//  fields is a mask of enum TELEMETRY_FIELDS bits, mode an enum
+//    TELEMETRY_MODES.
+struct link_subscribe {
+  uint8_t sub;              // Subscription slot, 0-TELEMETRY_MAX_SUBS-1.
+  uint8_t mode;
+  uint16_t fields;
+  uint16_t decimation;      // Frames per record or window.
+  uint16_t period_ms;       // Time per record or window, or change holdoff.
+};
+#define LINK_SUBSCRIBE_LEN 8
+
+struct link_subscribe_ack {
+  uint8_t sub;
+  uint8_t status;           // enum TELEMETRY_STATUS.
+};
+#define LINK_SUBSCRIBE_ACK_LEN 2
+
+// One record of a stream. values holds the subscribed fields in bit order,
+//  16 bits each, read as signed or unsigned per field.
+#define LINK_TELEMETRY_MAX_VALUES 16
+
+struct link_telemetry {
+  uint8_t sub;
+  uint16_t seq;             // Per subscription, lets the host detect drops.
+  uint16_t samples;         // Frames the record covers.
+  int64_t device_time_us;   // Read time of the last of them.
+  uint16_t fields;
+  uint16_t values[LINK_TELEMETRY_MAX_VALUES];
+};
+// Variable length, 15 + 2 per set bit of fields.
+
+// Pre-trigger captures, see capture.h on the firmware side.
+//  The head announces each capture with LINK_CAPTURE_INFO when it completes.
+enum LINK_CAPTURE_OPS {
+  LINK_CAPTURE_LIST      = 0,   // Info for the setup and every held capture.
+  LINK_CAPTURE_TRIGGER   = 1,   // Trigger on the last frame.
+  LINK_CAPTURE_READ      = 2,   // Send slot's samples as LINK_CAPTURE_DATA.
+  LINK_CAPTURE_RELEASE   = 3,   // Free slot for a new capture.
+  LINK_CAPTURE_CONFIGURE = 4    // Set pre, post and causes, then as LIST.
+};
+
+struct link_capture_cmd {
+  uint8_t op;               // enum LINK_CAPTURE_OPS.
+  uint8_t slot;
+  uint8_t pre;
+  uint8_t post;
+  uint8_t causes;           // enum CAPTURE_CAUSES bits.
+};
+#define LINK_CAPTURE_CMD_LEN 5
+
+// slot LINK_CAPTURE_SETUP reports the configuration instead of a capture:
+//  id the next capture's, pre, post and the causes enabled, no trigger.
+#define LINK_CAPTURE_SETUP 0xFF
+
+struct link_capture_info {
+  uint8_t slot;
+  uint16_t id;
+  uint8_t causes;
+  uint8_t pre;              // Samples before the trigger frame.
+  uint8_t post;             // Samples after it.
+  uint32_t trigger_frame;
+  int64_t trigger_time_us;  // Device time.
+  uint32_t captures;        // Totals since boot.
+  uint32_t missed;
+};
+#define LINK_CAPTURE_INFO_LEN 26
+
+// Frame numbers run on by one per sample, so a sample's is the trigger
+//  frame's plus its index less pre.
+struct link_capture_sample {
+  int32_t offset_us;        // Read time less the trigger frame's.
+  uint16_t raw[4];
+  uint16_t faults;
+  uint8_t class_index;
+};
+#define LINK_CAPTURE_DATA_SAMPLES 3
+
+struct link_capture_data {
+  uint8_t slot;
+  uint16_t id;
+  uint8_t first;            // Index of samples[0] in the capture.
+  uint8_t count;
+  link_capture_sample samples[LINK_CAPTURE_DATA_SAMPLES];
+};
+// Variable length, 5 + 15 per sample.
+
+// Raw reading histograms, see histogram.h on the firmware side.
+//  A READ is answered with LINK_HIST_INFO, then every bin of every channel
+//    as LINK_HIST_DATA, counts frozen until the last is sent.
+enum LINK_HIST_OPS {
+  LINK_HIST_READ      = 0,
+  LINK_HIST_RESET     = 1,  // Empty, restart at the current illumination step.
+  LINK_HIST_CONFIGURE = 2   // Set the scale and reset, then as READ's info.
+};
+
+struct link_hist_cmd {
+  uint8_t op;               // enum LINK_HIST_OPS.
+  uint8_t scale;            // enum HIST_SCALES.
+  uint8_t shift;
+  uint16_t lo;
+};
+#define LINK_HIST_CMD_LEN 5
+
+struct link_hist_info {
+  uint8_t step;             // Illumination step the readings were taken at.
+  uint8_t scale;
+  uint8_t shift;
+  uint16_t lo;
+  uint16_t bins;            // Per channel.
+  uint32_t age_ms;          // Since the last reset.
+  uint32_t samples[4];
+};
+#define LINK_HIST_INFO_LEN 27
+
+#define LINK_HIST_DATA_BINS 14
+
+struct link_hist_data {
+  uint8_t channel;
+  uint16_t first;           // Bin of counts[0].
+  uint8_t count;
+  uint32_t counts[LINK_HIST_DATA_BINS];
+};
+// Variable length, 4 + 4 per bin.
+
+// Streaming frame decoder state. Zero-initialize or call link_decoder_reset()
+//  before first use.
+struct link_decoder {
+  uint8_t state;
+  uint8_t type;
+  uint8_t len;
+  uint8_t pos;
+  uint8_t crc;
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint32_t crc_errors;
+};
+
+uint8_t link_crc8(uint8_t crc, uint8_t data);
+
+// Writes a complete frame into out, which must hold at least
+//  len + LINK_FRAME_OVERHEAD bytes.
+// Returns the number of bytes written, 0 if len is too large.
+size_t link_encode(
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len,
+  uint8_t *out
+);
+
+void link_decoder_reset(link_decoder &dec);
+
+// Feeds one received byte into the decoder.
+// Returns true when a complete, CRC valid frame is available in dec.type,
+//  dec.len and dec.payload. The frame stays valid until the next call.
+bool link_decode_byte(link_decoder &dec, uint8_t data);
+
+// Little-endian field helpers.
+void link_put_u16(uint8_t *buf, uint16_t val);
+void link_put_u32(uint8_t *buf, uint32_t val);
+void link_put_u64(uint8_t *buf, uint64_t val);
+uint16_t link_get_u16(const uint8_t *buf);
+uint32_t link_get_u32(const uint8_t *buf);
+uint64_t link_get_u64(const uint8_t *buf);
+
+// Message (de)serialization. pack functions return the payload length, unpack
+//  functions return false if the payload length doesn't match.
+uint8_t link_pack_reading(const link_reading &msg, uint8_t *buf);
+bool link_unpack_reading(const uint8_t *buf, uint8_t len, link_reading &msg);
+uint8_t link_pack_sync_req(const link_sync_req &msg, uint8_t *buf);
+bool link_unpack_sync_req(const uint8_t *buf, uint8_t len, link_sync_req &msg);
+uint8_t link_pack_sync_resp(const link_sync_resp &msg, uint8_t *buf);
+bool link_unpack_sync_resp(const uint8_t *buf, uint8_t len, link_sync_resp &msg);
+uint8_t link_pack_sync_status(const link_sync_status &msg, uint8_t *buf);
+bool link_unpack_sync_status(
+  const uint8_t *buf,
+  uint8_t len,
+  link_sync_status &msg
+);
+uint8_t link_pack_spc_alarm(const link_spc_alarm &msg, uint8_t *buf);
+bool link_unpack_spc_alarm(
+  const uint8_t *buf,
+  uint8_t len,
+  link_spc_alarm &msg
+);
+uint8_t link_pack_profile_header(
+  const link_profile_header &msg,
+  uint8_t *buf
+);
+bool link_unpack_profile_header(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_header &msg
+);
+uint8_t link_pack_profile_buckets(
+  const link_profile_buckets &msg,
+  uint8_t *buf
+);
+bool link_unpack_profile_buckets(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_buckets &msg
+);
+uint8_t link_pack_profile_stack(const link_profile_stack &msg, uint8_t *buf);
+bool link_unpack_profile_stack(
+  const uint8_t *buf,
+  uint8_t len,
+  link_profile_stack &msg
+);
+uint8_t link_pack_log(const link_log &msg, uint8_t *buf);
+bool link_unpack_log(const uint8_t *buf, uint8_t len, link_log &msg);
+uint8_t link_pack_subscribe(const link_subscribe &msg, uint8_t *buf);
+bool link_unpack_subscribe(
+  const uint8_t *buf,
+  uint8_t len,
+  link_subscribe &msg
+);
+uint8_t link_pack_subscribe_ack(const link_subscribe_ack &msg, uint8_t *buf);
+bool link_unpack_subscribe_ack(
+  const uint8_t *buf,
+  uint8_t len,
+  link_subscribe_ack &msg
+);
+uint8_t link_pack_telemetry(const link_telemetry &msg, uint8_t *buf);
+bool link_unpack_telemetry(
+  const uint8_t *buf,
+  uint8_t len,
+  link_telemetry &msg
+);
+uint8_t link_pack_capture_cmd(const link_capture_cmd &msg, uint8_t *buf);
+bool link_unpack_capture_cmd(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_cmd &msg
+);
+uint8_t link_pack_capture_info(const link_capture_info &msg, uint8_t *buf);
+bool link_unpack_capture_info(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_info &msg
+);
+uint8_t link_pack_capture_data(const link_capture_data &msg, uint8_t *buf);
+bool link_unpack_capture_data(
+  const uint8_t *buf,
+  uint8_t len,
+  link_capture_data &msg
+);
+uint8_t link_pack_hist_cmd(const link_hist_cmd &msg, uint8_t *buf);
+bool link_unpack_hist_cmd(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_cmd &msg
+);
+uint8_t link_pack_hist_info(const link_hist_info &msg, uint8_t *buf);
+bool link_unpack_hist_info(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_info &msg
+);
+uint8_t link_pack_hist_data(const link_hist_data &msg, uint8_t *buf);
+bool link_unpack_hist_data(
+  const uint8_t *buf,
+  uint8_t len,
+  link_hist_data &msg
+);
+
+#endif
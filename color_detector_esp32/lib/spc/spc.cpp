@@ -0,0 +1,272 @@
+#include "spc.h"
+
+// Shewhart constants for subgroup sizes 2-10, Q16.
+//  d2: expected range of n normal samples, in sigmas.
+//  A2: X-bar limit width, in average ranges.
+//  D3, D4: lower and upper range limits, in average ranges.
+static const int32_t spc_d2[SPC_SUBGROUP_MAX + 1] = {
+  0, 0, 73925, 110952, 134939, 152437, 166068, 177209, 186581, 194642, 201720
+};
+static const int32_t spc_a2[SPC_SUBGROUP_MAX + 1] = {
+  0, 0, 123208, 67043, 47776, 37814, 31654, 27460, 24445, 22086, 20185
+};
+static const int32_t spc_d3[SPC_SUBGROUP_MAX + 1] = {
+  0, 0, 0, 0, 0, 0, 0, 4981, 8913, 12059, 14615
+};
+static const int32_t spc_d4[SPC_SUBGROUP_MAX + 1] = {
+  0, 0, 214106, 168690, 149553, 138543, 131334, 126091, 122159, 119013, 116457
+};
+
+uint32_t spc_isqrt64(uint64_t val){
+  // Bit by bit, always 32 rounds so the time doesn't depend on the input.
+  uint64_t root = 0;
+  uint64_t bit = 1ULL << 62;
+  for(uint8_t i=0; i<32; i++){
+    uint64_t trial = root + bit;
+    uint64_t take = val >= trial;
+    val -= trial & (0 - take);
+    root = (root >> 1) + (bit & (0 - take));
+    bit >>= 2;
+  }
+
+  return (uint32_t)root;
+}
+
+static int32_t spc_mul(int32_t a, int32_t b){
+  return (int32_t)(((int64_t)a * b) >> SPC_Q);
+}
+
+static void spc_channel_reset(spc_channel &ch){
+  ch.armed = false;
+  ch.mean = 0;
+  ch.sigma = 0;
+  ch.ewma_limit = 0;
+  ch.cusum_k = 0;
+  ch.cusum_h = 0;
+  ch.xbar_limit = 0;
+  ch.range_lcl = 0;
+  ch.range_ucl = 0;
+  ch.learn_count = 0;
+  ch.learn_sum = 0;
+  ch.learn_sum_sq = 0;
+  ch.ewma = 0;
+  ch.cusum_high = 0;
+  ch.cusum_low = 0;
+  ch.group_sum = 0;
+  ch.group_min = 0;
+  ch.group_max = 0;
+  ch.group_count = 0;
+  ch.xbar = 0;
+  ch.range = 0;
+  ch.alarms = 0;
+
+  return;
+}
+
+// Turns the learning sums into a baseline and derives every limit from it.
+static void spc_channel_arm(spc_channel &ch, const spc_params &params){
+  int64_t n = ch.learn_count;
+
+  ch.mean = (int32_t)((ch.learn_sum << 8) / n);
+
+  // Sample variance, the Q8 sums square to Q16.
+  int64_t num = n * ch.learn_sum_sq - ch.learn_sum * ch.learn_sum;
+  if(num < 0)
+    num = 0;
+  int64_t var = num / (n * (n - 1));
+  ch.sigma = (int32_t)spc_isqrt64((uint64_t)var << SPC_Q);
+  if(ch.sigma < SPC_SIGMA_FLOOR)
+    ch.sigma = SPC_SIGMA_FLOOR;
+
+  // Asymptotic EWMA limits, L * sigma * SQR(lambda / (2 - lambda)).
+  int64_t ratio =
+    ((int64_t)params.ewma_lambda << SPC_Q) / (2 * SPC_ONE - params.ewma_lambda);
+  int32_t spread = (int32_t)spc_isqrt64((uint64_t)ratio << SPC_Q);
+  ch.ewma_limit = spc_mul(spc_mul(params.ewma_l, ch.sigma), spread);
+
+  ch.cusum_k = spc_mul(params.cusum_k, ch.sigma);
+  ch.cusum_h = spc_mul(params.cusum_h, ch.sigma);
+
+  // Average range implied by sigma, then the usual Shewhart limits.
+  uint8_t size = params.subgroup;
+  int32_t range_bar = spc_mul(spc_d2[size], ch.sigma);
+  ch.xbar_limit = spc_mul(spc_a2[size], range_bar);
+  ch.range_lcl = spc_mul(spc_d3[size], range_bar);
+  ch.range_ucl = spc_mul(spc_d4[size], range_bar);
+
+  ch.ewma = ch.mean;
+  ch.cusum_high = 0;
+  ch.cusum_low = 0;
+  ch.group_count = 0;
+  ch.armed = true;
+
+  return;
+}
+
+// One sample, in Q16, through every chart.
+// Returns the alarms it raised.
+static uint8_t spc_channel_update(
+  spc_channel &ch,
+  const spc_params &params,
+  int32_t x
+){
+  uint8_t previous = ch.alarms;
+  ch.alarms = 0;
+
+  if(!ch.armed){
+    int64_t x8 = x >> 8;
+    ch.learn_sum += x8;
+    ch.learn_sum_sq += x8 * x8;
+    ch.learn_count++;
+    if(ch.learn_count >= params.learn_samples)
+      spc_channel_arm(ch, params);
+    return 0;
+  }
+
+  // EWMA, level alarm for as long as it stays outside.
+  ch.ewma += (int32_t)(((int64_t)params.ewma_lambda * (x - ch.ewma)) >> SPC_Q);
+  if(ch.ewma > ch.mean + ch.ewma_limit)
+    ch.alarms |= SPC_ALARM_EWMA_HIGH;
+  else if(ch.ewma < ch.mean - ch.ewma_limit)
+    ch.alarms |= SPC_ALARM_EWMA_LOW;
+
+  // CUSUM. The sums restart after a signal so they can't grow without bound
+  //  while the process stays off. The reset is deferred to the next sample so
+  //    the value that signalled can still be reported.
+  if(previous & SPC_ALARM_CUSUM_HIGH)
+    ch.cusum_high = 0;
+  if(previous & SPC_ALARM_CUSUM_LOW)
+    ch.cusum_low = 0;
+  int64_t high = (int64_t)ch.cusum_high + x - ch.mean - ch.cusum_k;
+  int64_t low = (int64_t)ch.cusum_low + ch.mean - ch.cusum_k - x;
+  ch.cusum_high = high > 0 ? (int32_t)high : 0;
+  ch.cusum_low = low > 0 ? (int32_t)low : 0;
+  if(ch.cusum_high > ch.cusum_h)
+    ch.alarms |= SPC_ALARM_CUSUM_HIGH;
+  if(ch.cusum_low > ch.cusum_h)
+    ch.alarms |= SPC_ALARM_CUSUM_LOW;
+
+  // X-bar/R, checked as each subgroup completes.
+  if(ch.group_count == 0){
+    ch.group_sum = 0;
+    ch.group_min = x;
+    ch.group_max = x;
+  }
+  ch.group_sum += x;
+  if(x < ch.group_min)
+    ch.group_min = x;
+  if(x > ch.group_max)
+    ch.group_max = x;
+  ch.group_count++;
+  if(ch.group_count >= params.subgroup){
+    ch.xbar = (int32_t)(ch.group_sum / params.subgroup);
+    ch.range = ch.group_max - ch.group_min;
+    ch.group_count = 0;
+
+    int32_t offset = ch.xbar - ch.mean;
+    if(offset > ch.xbar_limit || offset < -ch.xbar_limit)
+      ch.alarms |= SPC_ALARM_XBAR;
+    if(ch.range > ch.range_ucl || ch.range < ch.range_lcl)
+      ch.alarms |= SPC_ALARM_RANGE;
+  }
+
+  // Count new alarms only, a held EWMA alarm is one event.
+  if(ch.alarms & ~previous)
+    ch.alarm_events++;
+
+  return ch.alarms;
+}
+
+void spc_params_default(spc_params &params){
+  params.ewma_lambda = SPC_ONE / 5;
+  params.ewma_l = 3 * SPC_ONE;
+  params.cusum_k = SPC_ONE / 2;
+  params.cusum_h = 5 * SPC_ONE;
+  params.subgroup = 5;
+  params.learn_samples = 256;
+
+  return;
+}
+
+void spc_monitor_init(spc_monitor &mon, const spc_params &params){
+  mon.params = params;
+
+  // Out of range settings would index past the constant tables or divide by
+  //  zero, pull them back in.
+  if(mon.params.subgroup < SPC_SUBGROUP_MIN)
+    mon.params.subgroup = SPC_SUBGROUP_MIN;
+  if(mon.params.subgroup > SPC_SUBGROUP_MAX)
+    mon.params.subgroup = SPC_SUBGROUP_MAX;
+  if(mon.params.learn_samples < 2)
+    mon.params.learn_samples = 2;
+  if(mon.params.learn_samples > SPC_LEARN_MAX)
+    mon.params.learn_samples = SPC_LEARN_MAX;
+  if(mon.params.ewma_lambda <= 0 || mon.params.ewma_lambda > SPC_ONE)
+    mon.params.ewma_lambda = SPC_ONE;
+
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    spc_channel_reset(mon.channels[i]);
+    mon.channels[i].alarm_events = 0;
+  }
+  mon.target_set = false;
+
+  return;
+}
+
+void spc_monitor_relearn(spc_monitor &mon){
+  for(uint8_t i=0; i<SPC_CHANNELS; i++)
+    spc_channel_reset(mon.channels[i]);
+  mon.target_set = false;
+
+  return;
+}
+
+uint8_t spc_monitor_update(spc_monitor &mon, const int readings[3]){
+  uint8_t alarms = 0;
+  int32_t x[3];
+
+  for(uint8_t i=0; i<3; i++){
+    int32_t val = readings[i];
+    if(val > SPC_INPUT_LIMIT)
+      val = SPC_INPUT_LIMIT;
+    if(val < -SPC_INPUT_LIMIT)
+      val = -SPC_INPUT_LIMIT;
+    x[i] = val * SPC_ONE;
+
+    alarms |= spc_channel_update(mon.channels[i], mon.params, x[i]);
+  }
+
+  if(!mon.target_set){
+    if(!mon.channels[0].armed ||
+       !mon.channels[1].armed ||
+       !mon.channels[2].armed){
+      return alarms;
+    }
+    for(uint8_t i=0; i<3; i++)
+      mon.target[i] = mon.channels[i].mean;
+    mon.target_set = true;
+  }
+
+  // Distance to target, squared in Q16 (Q8 differences) then rooted back
+  //  to Q16.
+  uint64_t dist_sq = 0;
+  for(uint8_t i=0; i<3; i++){
+    int64_t diff = (int64_t)(x[i] - mon.target[i]) >> 8;
+    dist_sq += (uint64_t)(diff * diff);
+  }
+  int32_t dist = (int32_t)spc_isqrt64(dist_sq << SPC_Q);
+  alarms |= spc_channel_update(
+    mon.channels[SPC_CHANNEL_DISTANCE], mon.params, dist
+  );
+
+  return alarms;
+}
+
+bool spc_monitor_armed(const spc_monitor &mon){
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    if(!mon.channels[i].armed)
+      return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,133 @@
+// Streaming statistical process control.
+//  Watches each calibrated channel, plus the distance from the learned target
+//    color, for a process drifting off colour using three classic charts:
+//    EWMA:    exponentially weighted mean against asymptotic +-L sigma limits,
+//             good at small sustained shifts.
+//    CUSUM:   tabular upper/lower cumulative sums with reference value k and
+//             decision interval h (both in sigmas), reset after each signal.
+//    X-bar/R: subgroup means and ranges against Shewhart limits from the
+//             usual A2/D3/D4 constants, good at large or sudden shifts.
+//  The in-control mean and sigma are learned from the first learn_samples
+//    samples after init, or after spc_monitor_relearn().
+//  Everything is fixed point (Q16.16 in int32, int64 intermediates) and every
+//    update is constant time and memory: no sample history is kept, subgroups
+//    are a running sum/min/max.
+#ifndef SPC_H
+#define SPC_H
+
+#include <stdint.h>
+
+#define SPC_Q 16
+#define SPC_ONE (1L << SPC_Q)
+
+// Channels monitored: calibrated red, green, blue, then the Euclidean distance
+//  in calibrated RGB from the learned target color.
+//  ΔE would need a Lab conversion per sample, RGB distance does the same job
+//    for a fixed target and stays integer.
+#define SPC_CHANNELS 4
+#define SPC_CHANNEL_DISTANCE 3
+
+// Supported X-bar/R subgroup sizes.
+#define SPC_SUBGROUP_MIN 2
+#define SPC_SUBGROUP_MAX 10
+
+// Largest baseline, keeps the learning sums inside int64.
+#define SPC_LEARN_MAX 4096
+
+// Readings are clamped to this range before use, a wild out of calibration
+//  value still counts as far off target without overflowing anything.
+#define SPC_INPUT_LIMIT 1023
+
+// Smallest sigma accepted from learning, in Q16. Integer readings that never
+//  changed during learning would otherwise alarm on the first count of noise.
+#define SPC_SIGMA_FLOOR (SPC_ONE / 2)
+
+// Alarm bits, per channel.
+enum SPC_ALARMS {
+  SPC_ALARM_EWMA_HIGH  = 0x01,
+  SPC_ALARM_EWMA_LOW   = 0x02,
+  SPC_ALARM_CUSUM_HIGH = 0x04,
+  SPC_ALARM_CUSUM_LOW  = 0x08,
+  SPC_ALARM_XBAR       = 0x10,
+  SPC_ALARM_RANGE      = 0x20
+};
+
+// Chart settings, all sigma multiples and weights in Q16.
+struct spc_params {
+  int32_t ewma_lambda;    // EWMA weight, 0 < lambda <= 1.
+  int32_t ewma_l;         // EWMA limit width, sigmas.
+  int32_t cusum_k;        // CUSUM reference value (allowed slack), sigmas.
+  int32_t cusum_h;        // CUSUM decision interval, sigmas.
+  uint8_t subgroup;       // X-bar/R subgroup size.
+  uint16_t learn_samples; // Baseline length.
+};
+
+struct spc_channel {
+  // Baseline, valid once armed.
+  bool armed;
+  int32_t mean;
+  int32_t sigma;
+
+  // Limits derived from the baseline.
+  int32_t ewma_limit;     // +- around mean.
+  int32_t cusum_k;
+  int32_t cusum_h;
+  int32_t xbar_limit;     // +- around mean.
+  int32_t range_lcl;
+  int32_t range_ucl;
+
+  // Learning sums, in Q8 to keep the sum of squares inside int64.
+  uint16_t learn_count;
+  int64_t learn_sum;
+  int64_t learn_sum_sq;
+
+  // Chart state.
+  int32_t ewma;
+  int32_t cusum_high;
+  int32_t cusum_low;
+  int64_t group_sum;
+  int32_t group_min;
+  int32_t group_max;
+  uint8_t group_count;
+
+  // Last completed subgroup, for telemetry.
+  int32_t xbar;
+  int32_t range;
+
+  // Alarms raised by the latest sample, and events since init.
+  uint8_t alarms;
+  uint32_t alarm_events;
+};
+
+struct spc_monitor {
+  spc_params params;
+  spc_channel channels[SPC_CHANNELS];
+
+  // Target for the distance channel, the R/G/B baseline means in Q16. Set
+  //  when the color channels arm, the distance channel learns from then on.
+  bool target_set;
+  int32_t target[3];
+};
+
+// Defaults: lambda 0.2 with L 3, k 0.5 and h 5, subgroups of 5, 256 sample
+//  baseline. All textbook values.
+void spc_params_default(spc_params &params);
+
+void spc_monitor_init(spc_monitor &mon, const spc_params &params);
+
+// Drops every baseline and starts learning again, e.g. after a product or
+//  lighting change.
+void spc_monitor_relearn(spc_monitor &mon);
+
+// Feeds one frame's calibrated readings (R, G, B) to every chart.
+//  Returns the OR of every channel's alarms for this sample, the per channel
+//    bits are left in mon.channels[i].alarms.
+uint8_t spc_monitor_update(spc_monitor &mon, const int readings[3]);
+
+// True once every channel has a baseline.
+bool spc_monitor_armed(const spc_monitor &mon);
+
+// Integer square root, floor, constant time.
+uint32_t spc_isqrt64(uint64_t val);
+
+#endif
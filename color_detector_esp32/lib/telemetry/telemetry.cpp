@@ -0,0 +1,276 @@
+#include "telemetry.h"
+
+#include <string.h>
+
+#define TELEMETRY_RING_MASK (TELEMETRY_RING_SIZE - 1)
+
+static const char *telemetry_field_names[TELEMETRY_FIELD_COUNT] = {
+  "raw_r", "raw_g", "raw_b", "raw_c",
+  "r", "g", "b", "c",
+  "class", "confidence", "palette", "faults", "illum_step"
+};
+
+void telemetry_init(telemetry_streams &t, telemetry_write_fn write){
+  memset(&t, 0, sizeof(t));
+  t.write = write;
+
+  return;
+}
+
+uint8_t telemetry_subscribe(
+  telemetry_streams &t,
+  const link_subscribe &req,
+  uint32_t now_ms
+){
+  if(req.sub >= TELEMETRY_MAX_SUBS)
+    return TELEMETRY_BAD_SUB;
+
+  telemetry_sub &sub = t.subs[req.sub];
+  if(req.mode == TELEMETRY_OFF){
+    sub.config.mode = TELEMETRY_OFF;
+    return TELEMETRY_OK;
+  }
+
+  if(req.mode > TELEMETRY_ON_CHANGE)
+    return TELEMETRY_BAD_MODE;
+  if(req.fields == 0 || (req.fields & ~TELEMETRY_ALL_FIELDS))
+    return TELEMETRY_BAD_FIELDS;
+  if(
+    req.mode != TELEMETRY_ON_CHANGE &&
+    req.decimation == 0 &&
+    req.period_ms == 0
+  )
+    return TELEMETRY_BAD_INTERVAL;
+
+  // Renewal of the subscription already running.
+  if(
+    sub.config.mode == req.mode &&
+    sub.config.fields == req.fields &&
+    sub.config.decimation == req.decimation &&
+    sub.config.period_ms == req.period_ms
+  ){
+    sub.renewed_ms = now_ms;
+    return TELEMETRY_OK;
+  }
+
+  memset(&sub, 0, sizeof(sub));
+  sub.config = req;
+  sub.renewed_ms = now_ms;
+  sub.cursor = t.head;
+  sub.window_start_ms = now_ms;
+
+  return TELEMETRY_OK;
+}
+
+bool telemetry_active(const telemetry_streams &t){
+  for(uint8_t i=0; i<TELEMETRY_MAX_SUBS; i++){
+    if(t.subs[i].config.mode != TELEMETRY_OFF)
+      return true;
+  }
+
+  return false;
+}
+
+void telemetry_push(telemetry_streams &t, const telemetry_sample &sample){
+  t.ring[t.head & TELEMETRY_RING_MASK] = sample;
+  t.head++;
+
+  return;
+}
+
+// Writes one record of the subscribed fields of values, and starts the next
+//  interval.
+static void telemetry_record(
+  telemetry_streams &t,
+  uint8_t index,
+  const int32_t *values,
+  uint32_t now_ms
+){
+  telemetry_sub &sub = t.subs[index];
+
+  link_telemetry rec;
+  rec.sub = index;
+  rec.seq = sub.seq++;
+  rec.samples = sub.samples;
+  rec.device_time_us = sub.latest.device_time_us;
+  rec.fields = sub.config.fields;
+  uint8_t count = 0;
+  for(uint8_t f=0; f<TELEMETRY_FIELD_COUNT; f++){
+    if(sub.config.fields & (1 << f))
+      rec.values[count++] = (uint16_t)values[f];
+  }
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t len = link_pack_telemetry(rec, payload);
+  t.write(LINK_TELEMETRY, payload, len);
+
+  sub.records++;
+  sub.bytes += len + LINK_FRAME_OVERHEAD;
+  sub.samples = 0;
+  memset(sub.sums, 0, sizeof(sub.sums));
+  sub.faults = 0;
+  sub.last_record_ms = now_ms;
+
+  return;
+}
+
+// Mean of a window, rounded half away from zero.
+static int32_t telemetry_mean(int64_t sum, uint16_t count){
+  if(sum >= 0)
+    return (sum + count / 2) / count;
+
+  return -((-sum + count / 2) / count);
+}
+
+static void telemetry_record_mean(
+  telemetry_streams &t,
+  uint8_t index,
+  uint32_t now_ms
+){
+  telemetry_sub &sub = t.subs[index];
+
+  int32_t values[TELEMETRY_FIELD_COUNT];
+  for(uint8_t f=0; f<TELEMETRY_FIELD_COUNT; f++)
+    values[f] = telemetry_mean(sub.sums[f], sub.samples);
+  values[TELEMETRY_FIELD_CLASS] = sub.latest.values[TELEMETRY_FIELD_CLASS];
+  values[TELEMETRY_FIELD_PALETTE] = sub.latest.values[TELEMETRY_FIELD_PALETTE];
+  values[TELEMETRY_FIELD_FAULTS] = sub.faults;
+  values[TELEMETRY_FIELD_ILLUM_STEP] =
+    sub.latest.values[TELEMETRY_FIELD_ILLUM_STEP];
+  telemetry_record(t, index, values, now_ms);
+
+  return;
+}
+
+// True if a subscribed field of sample differs from the last record.
+static bool telemetry_changed(
+  const telemetry_sub &sub,
+  const telemetry_sample &sample
+){
+  if(!sub.sent_any)
+    return true;
+  for(uint8_t f=0; f<TELEMETRY_FIELD_COUNT; f++){
+    if((sub.config.fields & (1 << f)) && sample.values[f] != sub.last[f])
+      return true;
+  }
+
+  return false;
+}
+
+// Takes one sample into a subscription, writing a record if it completes a
+//  frame counted interval.
+static void telemetry_take(
+  telemetry_streams &t,
+  uint8_t index,
+  const telemetry_sample &sample,
+  uint32_t now_ms
+){
+  telemetry_sub &sub = t.subs[index];
+  if(sub.samples < 0xFFFF)
+    sub.samples++;
+  sub.latest = sample;
+
+  switch(sub.config.mode){
+    case TELEMETRY_EVERY_N:
+      if(sub.config.decimation && sub.samples >= sub.config.decimation)
+        telemetry_record(t, index, sample.values, now_ms);
+      break;
+
+    case TELEMETRY_MEAN:
+      for(uint8_t f=0; f<TELEMETRY_FIELD_COUNT; f++)
+        sub.sums[f] += sample.values[f];
+      sub.faults |= sample.values[TELEMETRY_FIELD_FAULTS];
+      if(sub.config.decimation && sub.samples >= sub.config.decimation)
+        telemetry_record_mean(t, index, now_ms);
+      break;
+
+    case TELEMETRY_ON_CHANGE:
+      if(telemetry_changed(sub, sample))
+        sub.change_pending = true;
+      break;
+  }
+
+  return;
+}
+
+// Writes the records due on time rather than on a sample.
+static void telemetry_due(telemetry_streams &t, uint8_t index, uint32_t now_ms){
+  telemetry_sub &sub = t.subs[index];
+
+  if(sub.config.mode == TELEMETRY_ON_CHANGE){
+    if(!sub.change_pending)
+      return;
+    if(
+      sub.sent_any &&
+      now_ms - sub.last_record_ms < sub.config.period_ms
+    )
+      return;
+
+    // Changed and changed back while held off, nothing to report.
+    sub.change_pending = false;
+    if(!telemetry_changed(sub, sub.latest))
+      return;
+    telemetry_record(t, index, sub.latest.values, now_ms);
+    memcpy(sub.last, sub.latest.values, sizeof(sub.last));
+    sub.sent_any = true;
+    return;
+  }
+
+  if(
+    sub.config.decimation ||
+    sub.samples == 0 ||
+    now_ms - sub.window_start_ms < sub.config.period_ms
+  )
+    return;
+
+  // Keep to the period's grid, unless a stall put us whole periods behind.
+  sub.window_start_ms += sub.config.period_ms;
+  if(now_ms - sub.window_start_ms >= sub.config.period_ms)
+    sub.window_start_ms = now_ms;
+
+  if(sub.config.mode == TELEMETRY_MEAN)
+    telemetry_record_mean(t, index, now_ms);
+  else
+    telemetry_record(t, index, sub.latest.values, now_ms);
+
+  return;
+}
+
+void telemetry_poll(telemetry_streams &t, uint32_t now_ms){
+  for(uint8_t i=0; i<TELEMETRY_MAX_SUBS; i++){
+    telemetry_sub &sub = t.subs[i];
+    if(sub.config.mode == TELEMETRY_OFF)
+      continue;
+
+    if(now_ms - sub.renewed_ms > TELEMETRY_LEASE_MS){
+      sub.config.mode = TELEMETRY_OFF;
+      continue;
+    }
+
+    uint32_t behind = t.head - sub.cursor;
+    if(behind > TELEMETRY_RING_SIZE){
+      sub.overruns += behind - TELEMETRY_RING_SIZE;
+      sub.cursor = t.head - TELEMETRY_RING_SIZE;
+    }
+    while(sub.cursor != t.head){
+      const telemetry_sample &sample = t.ring[sub.cursor & TELEMETRY_RING_MASK];
+      sub.cursor++;
+      telemetry_take(t, i, sample, now_ms);
+    }
+
+    telemetry_due(t, i, now_ms);
+  }
+
+  return;
+}
+
+const char *telemetry_field_name(uint8_t field){
+  if(field >= TELEMETRY_FIELD_COUNT)
+    return NULL;
+
+  return telemetry_field_names[field];
+}
+
+bool telemetry_field_signed(uint8_t field){
+  return field >= TELEMETRY_FIELD_MAPPED && field < TELEMETRY_FIELD_MAPPED + 4;
+}
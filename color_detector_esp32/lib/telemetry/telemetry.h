@@ -0,0 +1,153 @@
+// Host selected telemetry streams, instead of every field of every frame.
+//  The host subscribes (LINK_SUBSCRIBE) to a set of fields in one of a few
+//    modes, and the head sends only those as LINK_TELEMETRY records:
+//      TELEMETRY_EVERY_N    one frame's fields per interval, decimating.
+//      TELEMETRY_MEAN       one record per interval window: channel readings
+//                           and confidence averaged (rounded to the nearest
+//                           unit), faults OR'd together, class, palette color
+//                           and illumination step the window's last.
+//      TELEMETRY_ON_CHANGE  a frame's fields whenever one of them differs from
+//                           the last record sent, at most one record per
+//                           period_ms with faster changes folded into it.
+//    An interval is decimation frames, or period_ms if decimation is 0.
+//  Every frame goes into one ring of samples shared by all subscriptions,
+//    each reading it from its own cursor, so a subscription costs its own
+//    aggregation and records but nothing per field it doesn't ask for.
+//  While any subscription is active the head stops streaming full reading
+//    records. Subscriptions lapse TELEMETRY_LEASE_MS after they were last
+//    (re)sent, so a host that goes away doesn't leave the head muted;
+//    sending an unchanged subscription again just renews it.
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+#include "serial_link.h"
+
+// Samples kept, a power of two. Subscriptions further behind lose the oldest.
+#define TELEMETRY_RING_BITS 5
+#define TELEMETRY_RING_SIZE (1 << TELEMETRY_RING_BITS)
+
+#define TELEMETRY_MAX_SUBS 4
+
+#define TELEMETRY_LEASE_MS 30000
+
+// Fields a subscription can select, bits of link_subscribe::fields.
+enum TELEMETRY_FIELDS {
+  TELEMETRY_RAW_R      = 0x0001,  // Raw pulse widths, us, unsigned.
+  TELEMETRY_RAW_G      = 0x0002,
+  TELEMETRY_RAW_B      = 0x0004,
+  TELEMETRY_RAW_C      = 0x0008,
+  TELEMETRY_R          = 0x0010,  // Calibrated, signed.
+  TELEMETRY_G          = 0x0020,
+  TELEMETRY_B          = 0x0040,
+  TELEMETRY_C          = 0x0080,
+  TELEMETRY_CLASS      = 0x0100,  // enum COLOR_STR_MAP or COLOR_MAP_ERR.
+  TELEMETRY_CONFIDENCE = 0x0200,  // 0-100.
+  TELEMETRY_PALETTE    = 0x0400,  // colors_short.csv row, PALETTE_NO_MATCH.
+  TELEMETRY_FAULTS     = 0x0800,  // enum SENSOR_FAULTS.
+  TELEMETRY_ILLUM_STEP = 0x1000
+};
+#define TELEMETRY_FIELD_COUNT 13
+
+// Indices of telemetry_sample::values, the bit positions of the fields.
+#define TELEMETRY_FIELD_RAW 0
+#define TELEMETRY_FIELD_MAPPED 4
+#define TELEMETRY_FIELD_CLASS 8
+#define TELEMETRY_FIELD_CONFIDENCE 9
+#define TELEMETRY_FIELD_PALETTE 10
+#define TELEMETRY_FIELD_FAULTS 11
+#define TELEMETRY_FIELD_ILLUM_STEP 12
+#define TELEMETRY_ALL_FIELDS ((1 << TELEMETRY_FIELD_COUNT) - 1)
+
+enum TELEMETRY_MODES {
+  TELEMETRY_OFF       = 0,
+  TELEMETRY_EVERY_N   = 1,
+  TELEMETRY_MEAN      = 2,
+  TELEMETRY_ON_CHANGE = 3
+};
+
+enum TELEMETRY_STATUS {
+  TELEMETRY_OK           = 0,
+  TELEMETRY_BAD_SUB      = 1, // No such slot.
+  TELEMETRY_BAD_FIELDS   = 2, // None, or unknown bits.
+  TELEMETRY_BAD_MODE     = 3,
+  TELEMETRY_BAD_INTERVAL = 4  // EVERY_N or MEAN without an interval.
+};
+
+// One frame, every field.
+struct telemetry_sample {
+  int64_t device_time_us;
+  int32_t values[TELEMETRY_FIELD_COUNT];
+};
+
+struct telemetry_sub {
+  link_subscribe config;    // mode TELEMETRY_OFF when the slot is free.
+  uint32_t renewed_ms;
+
+  // Ring position of the next sample to take.
+  uint32_t cursor;
+
+  // Samples taken since the last record (saturated), the latest of them,
+  //  the time the current interval started, and window sums for
+  //  TELEMETRY_MEAN.
+  uint16_t samples;
+  telemetry_sample latest;
+  uint32_t window_start_ms;
+  int64_t sums[TELEMETRY_FIELD_COUNT];
+  int32_t faults;
+
+  // TELEMETRY_ON_CHANGE: last values sent, whether a change is waiting out
+  //  the holdoff, and when the last record went.
+  bool sent_any;
+  int32_t last[TELEMETRY_FIELD_COUNT];
+  bool change_pending;
+  uint32_t last_record_ms;
+
+  uint16_t seq;
+  uint32_t records;
+  uint32_t bytes;           // Frames sent, including link overhead.
+  uint32_t overruns;        // Samples lost to falling behind the ring.
+};
+
+typedef void (*telemetry_write_fn)(
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len
+);
+
+struct telemetry_streams {
+  telemetry_sample ring[TELEMETRY_RING_SIZE];
+  uint32_t head;            // Samples pushed since init.
+  telemetry_sub subs[TELEMETRY_MAX_SUBS];
+  telemetry_write_fn write;
+};
+
+void telemetry_init(telemetry_streams &t, telemetry_write_fn write);
+
+// Applies a subscribe request and returns its enum TELEMETRY_STATUS. Mode
+//  TELEMETRY_OFF cancels the slot. A new or changed subscription starts from
+//  the next sample pushed.
+uint8_t telemetry_subscribe(
+  telemetry_streams &t,
+  const link_subscribe &req,
+  uint32_t now_ms
+);
+
+// True if any subscription is active.
+bool telemetry_active(const telemetry_streams &t);
+
+// Adds a frame to the ring.
+void telemetry_push(telemetry_streams &t, const telemetry_sample &sample);
+
+// Runs every subscription over the samples pushed since the last poll and
+//  writes the records due. Also lapses subscriptions whose lease ran out.
+void telemetry_poll(telemetry_streams &t, uint32_t now_ms);
+
+// Field names, e.g. "raw_r", "class", for the host tools. NULL past the end.
+const char *telemetry_field_name(uint8_t field);
+
+// True if the field's 16 bit values are signed.
+bool telemetry_field_signed(uint8_t field);
+
+#endif
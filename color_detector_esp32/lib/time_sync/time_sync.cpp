@@ -0,0 +1,203 @@
+#include "time_sync.h"
+
+#include <math.h>
+
+// Saturating conversion for the unsigned uncertainty fields.
+static uint32_t time_sync_clamp_u32(double val){
+  if(val < 0)
+    return 0;
+  if(val >= 4294967295.0)
+    return UINT32_MAX;
+
+  return (uint32_t)val;
+}
+
+// Refits offset and drift over the usable samples in the window.
+//  Runs once per exchange (seconds apart) so doubles are fine here even though
+//    they're soft-float on the ESP32, the per-record path stays integer only.
+static void time_sync_refit(time_sync_state &state){
+  uint32_t best_rtt = UINT32_MAX;
+  for(uint8_t i=0; i<state.count; i++){
+    if(state.samples[i].rtt_us < best_rtt)
+      best_rtt = state.samples[i].rtt_us;
+  }
+  uint32_t rtt_limit = best_rtt * TIME_SYNC_RTT_GATE + TIME_SYNC_RTT_SLACK_US;
+
+  // Use the newest usable sample as the origin to keep the sums small.
+  int64_t newest_local = INT64_MIN;
+  int64_t origin_offset = 0;
+  uint8_t n = 0;
+  for(uint8_t i=0; i<state.count; i++){
+    if(state.samples[i].rtt_us > rtt_limit)
+      continue;
+    n++;
+    if(state.samples[i].local_us > newest_local){
+      newest_local = state.samples[i].local_us;
+      origin_offset = state.samples[i].offset_us;
+    }
+  }
+
+  double sum_x = 0, sum_y = 0;
+  for(uint8_t i=0; i<state.count; i++){
+    if(state.samples[i].rtt_us > rtt_limit)
+      continue;
+    sum_x += (double)(state.samples[i].local_us - newest_local);
+    sum_y += (double)(state.samples[i].offset_us - origin_offset);
+  }
+  double mean_x = sum_x / n;
+  double mean_y = sum_y / n;
+
+  double sxx = 0, sxy = 0;
+  for(uint8_t i=0; i<state.count; i++){
+    if(state.samples[i].rtt_us > rtt_limit)
+      continue;
+    double dx = (double)(state.samples[i].local_us - newest_local) - mean_x;
+    double dy = (double)(state.samples[i].offset_us - origin_offset) - mean_y;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+
+  // Half the best round trip bounds the path asymmetry, which averaging can't
+  //  remove, so it is always part of the uncertainty.
+  double half_rtt = best_rtt / 2.0;
+
+  // A drift fit needs the samples spread over at least a second, otherwise the
+  //  slope is all noise and the seeded drift (by default none, bounded by the
+  //    crystal tolerance) is the better estimate.
+  if(n < 2 || sxx < 1e12){
+    double seed = state.seed_drift_ppb / 1e9;
+    state.ref_local_us = newest_local;
+    state.ref_offset_us =
+      origin_offset + (int64_t)llround(mean_y - seed * mean_x);
+    state.drift_ppb = state.seed_drift_ppb;
+    state.drift_uncertainty_ppb = state.seed_drift_uncertainty_ppb;
+    state.ref_uncertainty_us = time_sync_clamp_u32(half_rtt + 0.5);
+  }
+  else {
+    double slope = sxy / sxx;
+
+    // Residual scatter, with n - 2 degrees of freedom. Never trust it below
+    //  the round trip bound of a single sample.
+    double sse = 0;
+    for(uint8_t i=0; i<state.count; i++){
+      if(state.samples[i].rtt_us > rtt_limit)
+        continue;
+      double dx = (double)(state.samples[i].local_us - newest_local) - mean_x;
+      double dy = (double)(state.samples[i].offset_us - origin_offset) - mean_y;
+      double r = dy - slope * dx;
+      sse += r * r;
+    }
+    double sigma = (n > 2) ? sqrt(sse / (n - 2)) : 0;
+    if(sigma < half_rtt)
+      sigma = half_rtt;
+
+    double slope_err = sigma / sqrt(sxx);
+    double pred_err = sigma * sqrt(1.0 / n + (mean_x * mean_x) / sxx);
+
+    state.ref_local_us = newest_local;
+    state.ref_offset_us =
+      origin_offset + (int64_t)llround(mean_y - slope * mean_x);
+    state.drift_ppb = (int32_t)llround(slope * 1e9);
+    state.drift_uncertainty_ppb = time_sync_clamp_u32(slope_err * 1e9 + 0.5);
+    if(state.drift_uncertainty_ppb > state.seed_drift_uncertainty_ppb){
+      state.drift_ppb = state.seed_drift_ppb;
+      state.drift_uncertainty_ppb = state.seed_drift_uncertainty_ppb;
+    }
+    state.ref_uncertainty_us = time_sync_clamp_u32(half_rtt + pred_err + 0.5);
+  }
+
+  state.best_rtt_us = best_rtt;
+  state.fit_samples = n;
+  state.valid = true;
+
+  return;
+}
+
+void time_sync_init(time_sync_state &state){
+  state.count = 0;
+  state.head = 0;
+  state.valid = false;
+  state.fit_samples = 0;
+  state.ref_local_us = 0;
+  state.ref_offset_us = 0;
+  state.drift_ppb = 0;
+  state.ref_uncertainty_us = UINT32_MAX;
+  state.drift_uncertainty_ppb = TIME_SYNC_DEFAULT_DRIFT_UNC_PPB;
+  state.best_rtt_us = UINT32_MAX;
+  state.seed_drift_ppb = 0;
+  state.seed_drift_uncertainty_ppb = TIME_SYNC_DEFAULT_DRIFT_UNC_PPB;
+  state.rejected = 0;
+
+  return;
+}
+
+void time_sync_seed_drift(
+  time_sync_state &state,
+  int32_t drift_ppb,
+  uint32_t drift_uncertainty_ppb
+){
+  state.seed_drift_ppb = drift_ppb;
+  state.seed_drift_uncertainty_ppb = drift_uncertainty_ppb;
+
+  return;
+}
+
+bool time_sync_add_exchange(
+  time_sync_state &state,
+  int64_t t1,
+  int64_t t2,
+  int64_t t3,
+  int64_t t4
+){
+  // Out of order or stale responses, host turnaround longer than the whole
+  //  exchange, or a congested link. None of these carry usable timing.
+  int64_t rtt = (t4 - t1) - (t3 - t2);
+  if(t4 < t1 || t3 < t2 || rtt > TIME_SYNC_MAX_RTT_US){
+    state.rejected++;
+    return false;
+  }
+  // Host timestamps are coarser than ours, so a tiny negative round trip is
+  //  just quantization.
+  if(rtt < 0)
+    rtt = 0;
+
+  time_sync_sample &sample = state.samples[state.head];
+  sample.local_us = t1 + (t4 - t1) / 2;
+  sample.offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+  sample.rtt_us = (uint32_t)rtt;
+
+  state.head = (state.head + 1) % TIME_SYNC_WINDOW;
+  if(state.count < TIME_SYNC_WINDOW)
+    state.count++;
+
+  time_sync_refit(state);
+
+  return true;
+}
+
+int64_t time_sync_to_host(
+  const time_sync_state &state,
+  int64_t local_us,
+  uint32_t *uncertainty_us
+){
+  if(!state.valid){
+    if(uncertainty_us)
+      *uncertainty_us = UINT32_MAX;
+    return local_us;
+  }
+
+  int64_t elapsed = local_us - state.ref_local_us;
+  int64_t host =
+    local_us + state.ref_offset_us +
+    elapsed * state.drift_ppb / 1000000000LL;
+
+  if(uncertainty_us){
+    uint64_t span = (uint64_t)(elapsed < 0 ? -elapsed : elapsed);
+    uint64_t unc =
+      state.ref_uncertainty_us +
+      span * state.drift_uncertainty_ppb / 1000000000ULL;
+    *uncertainty_us = unc > UINT32_MAX ? UINT32_MAX : (uint32_t)unc;
+  }
+
+  return host;
+}
@@ -0,0 +1,91 @@
+// Device->host clock estimation from NTP style request/response exchanges.
+//  Each exchange gives an offset sample, ((t2 - t1) + (t3 - t4)) / 2, that is
+//    correct to within half the round trip. The estimator keeps a short window
+//    of samples, drops the ones with congested round trips, and fits a line
+//    through the rest so both the offset and the crystal drift are tracked.
+//  All times are microseconds. Device times come from the free-running 64 bit
+//    esp_timer, host times from whatever clock the host ingest serves (wall
+//    clock by default), so the two never wrap in practice.
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdint.h>
+
+// Number of exchanges kept for the drift fit.
+#define TIME_SYNC_WINDOW 8
+
+// Drift uncertainty, in ppb, assumed until the window spans enough time to
+//  measure it. Generous bound on the Huzzah32's 40MHz crystal over temperature.
+#define TIME_SYNC_DEFAULT_DRIFT_UNC_PPB 50000
+
+// Exchanges with a round trip longer than this are thrown away outright, these
+//  are host scheduler stalls or USB bursts, not clock information.
+#define TIME_SYNC_MAX_RTT_US 50000
+
+// Samples whose round trip exceeds the best in the window by more than this
+//  multiple (plus TIME_SYNC_RTT_SLACK_US) are excluded from the fit.
+#define TIME_SYNC_RTT_GATE 2
+#define TIME_SYNC_RTT_SLACK_US 250
+
+struct time_sync_sample {
+  int64_t local_us;   // Device time at the midpoint of the exchange.
+  int64_t offset_us;  // host - device.
+  uint32_t rtt_us;
+};
+
+struct time_sync_state {
+  time_sync_sample samples[TIME_SYNC_WINDOW];
+  uint8_t count;
+  uint8_t head;
+
+  // Fitted mapping: host = local + ref_offset + (local - ref_local) * drift.
+  bool valid;
+  uint8_t fit_samples;
+  int64_t ref_local_us;
+  int64_t ref_offset_us;
+  int32_t drift_ppb;
+  uint32_t ref_uncertainty_us;
+  uint32_t drift_uncertainty_ppb;
+  uint32_t best_rtt_us;
+
+  // Drift used until the window spans enough time for its own fit, e.g. the
+  //  estimate from before a warm restart. Crystal drift is a property of the
+  //  board so it stays useful even though the offset has to be remeasured.
+  int32_t seed_drift_ppb;
+  uint32_t seed_drift_uncertainty_ppb;
+
+  // Exchanges refused by the sanity checks since init.
+  uint32_t rejected;
+};
+
+void time_sync_init(time_sync_state &state);
+
+// Seeds the drift used before the window has its own fit.
+void time_sync_seed_drift(
+  time_sync_state &state,
+  int32_t drift_ppb,
+  uint32_t drift_uncertainty_ppb
+);
+
+// Adds one completed exchange and refits the estimate.
+// Returns false if the exchange was rejected.
+bool time_sync_add_exchange(
+  time_sync_state &state,
+  int64_t t1,
+  int64_t t2,
+  int64_t t3,
+  int64_t t4
+);
+
+// Converts a device timestamp into host time.
+//  uncertainty_us, if not null, receives the +- bound on the result. It grows
+//    with the distance from the last fit by the drift uncertainty.
+//  Before the first exchange the local time is returned unchanged with an
+//    uncertainty of UINT32_MAX.
+int64_t time_sync_to_host(
+  const time_sync_state &state,
+  int64_t local_us,
+  uint32_t *uncertainty_us
+);
+
+#endif
@@ -0,0 +1,169 @@
+#include "can_server.h"
+
+#ifdef CAN_OUTPUT_BITRATE
+
+#include <Arduino.h>
+#include <driver/twai.h>
+
+#include "can_output.h"
+
+// Transceiver wiring.
+#define CAN_TX_PIN 27
+#define CAN_RX_PIN 4
+
+#if CAN_OUTPUT_BITRATE == 125000
+#define CAN_TIMING_CONFIG TWAI_TIMING_CONFIG_125KBITS
+#elif CAN_OUTPUT_BITRATE == 250000
+#define CAN_TIMING_CONFIG TWAI_TIMING_CONFIG_250KBITS
+#elif CAN_OUTPUT_BITRATE == 500000
+#define CAN_TIMING_CONFIG TWAI_TIMING_CONFIG_500KBITS
+#elif CAN_OUTPUT_BITRATE == 1000000
+#define CAN_TIMING_CONFIG TWAI_TIMING_CONFIG_1MBITS
+#else
+#error "CAN_OUTPUT_BITRATE must be 125000, 250000, 500000 or 1000000"
+#endif
+
+// Frames the controller queues. A couple of cyclic frames plus an event.
+#define CAN_TX_QUEUE_LEN 4
+
+#define CAN_SNAPSHOT_TRIES 4
+
+// loop() runs on core 1, keep the bus off it.
+#define CAN_TASK_CORE 0
+#define CAN_TASK_STACK 3072
+#define CAN_TASK_PRIORITY 1
+
+struct can_server_state {
+  sensor_snapshot_channel *snapshots;
+  sensor_config_channel *config_chan;
+
+  // Sequence number of the configuration in use.
+  uint32_t config_seq;
+
+  can_output out;
+};
+
+can_server_state can_server;
+
+static bool can_server_send(void *ctx, const can_frame_data &frame){
+  twai_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.identifier = frame.id;
+  msg.data_length_code = frame.len;
+  memcpy(msg.data, frame.data, frame.len);
+
+  return twai_transmit(&msg, 0) == ESP_OK;
+}
+
+static void can_server_load_config(
+  const sensor_config &config,
+  can_output_config &out
+){
+  out.cyclic_id = config.can_cyclic_id;
+  out.event_id = config.can_event_id;
+  out.period_ms = config.can_period_ms;
+  out.inhibit_ms = config.can_inhibit_ms;
+
+  return;
+}
+
+// Picks up register writes. Changes are rare, one attempt per tick is plenty.
+static void can_server_poll_config(can_server_state &server){
+  sensor_config config;
+  uint32_t seq;
+  if(
+    !sensor_config_read(*server.config_chan, config, &seq, 1) ||
+    seq == server.config_seq
+  )
+    return;
+
+  server.config_seq = seq;
+  can_output_config out_config;
+  can_server_load_config(config, out_config);
+  can_output_configure(server.out, out_config, millis());
+
+  return;
+}
+
+// Puts the controller back on the bus after too many errors took it off.
+//  Recovery waits out 128 runs of 11 recessive bits, then the controller
+//  has to be started again.
+static void can_server_check_bus(){
+  twai_status_info_t status;
+  if(twai_get_status_info(&status) != ESP_OK)
+    return;
+
+  if(status.state == TWAI_STATE_BUS_OFF)
+    twai_initiate_recovery();
+  else if(status.state == TWAI_STATE_STOPPED)
+    twai_start();
+
+  return;
+}
+
+static void can_server_task(void *arg){
+  can_server_state &server = *(can_server_state *)arg;
+  sensor_snapshot snap;
+  bool have_snap = false;
+
+  while(true){
+    can_server_poll_config(server);
+    can_server_check_bus();
+
+    // Keep the last good copy if this one raced a publish.
+    sensor_snapshot next;
+    if(sensor_snapshot_read(*server.snapshots, next, CAN_SNAPSHOT_TRIES)){
+      snap = next;
+      have_snap = true;
+    }
+    if(have_snap)
+      can_output_poll(server.out, snap, millis());
+
+    vTaskDelay(1);
+  }
+}
+
+void can_server_start(
+  sensor_snapshot_channel &snapshots,
+  sensor_config_channel &config
+){
+  can_server.snapshots = &snapshots;
+  can_server.config_chan = &config;
+
+  sensor_config initial;
+  sensor_config_read(
+    config, initial, &can_server.config_seq, CAN_SNAPSHOT_TRIES
+  );
+  can_output_config out_config;
+  can_server_load_config(initial, out_config);
+  can_hal hal;
+  hal.send = can_server_send;
+  hal.ctx = NULL;
+  can_output_init(can_server.out, out_config, hal, millis());
+
+  twai_general_config_t general = TWAI_GENERAL_CONFIG_DEFAULT(
+    (gpio_num_t)CAN_TX_PIN, (gpio_num_t)CAN_RX_PIN, TWAI_MODE_NORMAL
+  );
+  general.tx_queue_len = CAN_TX_QUEUE_LEN;
+  // Nothing is received, the controller only has to acknowledge.
+  general.rx_queue_len = 1;
+  twai_timing_config_t timing = CAN_TIMING_CONFIG();
+  twai_filter_config_t filter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+  if(twai_driver_install(&general, &timing, &filter) != ESP_OK)
+    return;
+  twai_start();
+
+  xTaskCreatePinnedToCore(
+    can_server_task,
+    "can",
+    CAN_TASK_STACK,
+    &can_server,
+    CAN_TASK_PRIORITY,
+    NULL,
+    CAN_TASK_CORE
+  );
+
+  return;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#include "i2c_server.h"
+
+#ifdef I2C_PERIPHERAL_ADDR
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#include "sensor_registers.h"
+
+// Second bus wiring, on the Feather's A0/A1 pins. The OLED keeps Wire.
+#define I2C_PERIPHERAL_SDA_PIN 26
+#define I2C_PERIPHERAL_SCL_PIN 25
+
+// Attempts at copying a consistent snapshot before answering with the last
+//  reply's snapshot.
+#define I2C_SNAPSHOT_TRIES 4
+
+struct i2c_server_state {
+  sensor_snapshot_channel *snapshots;
+
+  // Last snapshot copied, kept for when a copy races the loop's publishes.
+  sensor_snapshot snap;
+};
+
+i2c_server_state i2c_server;
+
+// A register pointer write. Loads the reply from the pointer to the end of
+//  the map straight away, the master's read comes too quickly to do it then.
+//  slaveWrite() replaces whatever is left of a reply the master never read.
+static void i2c_server_on_receive(int len){
+  if(len < 1)
+    return;
+
+  uint8_t start = Wire1.read();
+  while(Wire1.available())
+    Wire1.read();
+
+  sensor_snapshot snap;
+  if(sensor_snapshot_read(*i2c_server.snapshots, snap, I2C_SNAPSHOT_TRIES))
+    i2c_server.snap = snap;
+
+  uint8_t reply[SENSOR_IREG_COUNT * 2];
+  uint16_t count = start < SENSOR_IREG_COUNT ? SENSOR_IREG_COUNT - start : 0;
+  uint16_t regs[SENSOR_IREG_COUNT];
+  if(count)
+    sensor_registers_read_input(i2c_server.snap, start, count, regs);
+  for(uint16_t i=0; i<count; i++){
+    reply[i * 2] = regs[i] >> 8;
+    reply[i * 2 + 1] = regs[i] & 0xFF;
+  }
+
+  if(count)
+    Wire1.slaveWrite(reply, count * 2);
+
+  return;
+}
+
+void i2c_server_start(sensor_snapshot_channel &snapshots){
+  i2c_server.snapshots = &snapshots;
+  memset(&i2c_server.snap, 0, sizeof(i2c_server.snap));
+
+  Wire1.onReceive(i2c_server_on_receive);
+  Wire1.begin(
+    (uint8_t)I2C_PERIPHERAL_ADDR,
+    I2C_PERIPHERAL_SDA_PIN,
+    I2C_PERIPHERAL_SCL_PIN,
+    0
+  );
+
+  return;
+}
+
+#endif
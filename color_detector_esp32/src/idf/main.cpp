@@ -0,0 +1,537 @@
+// Sensor head firmware on ESP-IDF directly, pio run -e featheresp32_idf.
+//  The same read, calibrate, classify and report pipeline as the Arduino
+//    build in ../main.cpp, driven by the IDF drivers instead of the Arduino
+//    core's polling:
+//      Frames are paced by a gptimer alarm, not by loop() plus a delay, so the
+//        frame period is fixed whatever a frame costs, and a frame task on
+//        core 1 blocks on it rather than spinning.
+//      Channels are read on the PCNT peripheral, see pcnt_sensor.h.
+//      The host link runs on the UART driver's event queue, see uart_link.h,
+//        and clock sync no longer stalls a frame waiting for the response.
+//  Reading records, sync frames, SPC alarms and binary logs are as the Arduino
+//    build sends them, so ingest, framerate and the other host tools work
+//    unchanged. Left to the Arduino build for now: the display, the field bus
+//    servers, palette matching, the classification cache, telemetry
+//    subscriptions, captures, warm restarts and the profiler.
+#include <stdio.h>
+#include <string.h>
+
+#include <driver/gpio.h>
+#include <driver/gptimer.h>
+#include <driver/ledc.h>
+#include <esp_attr.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Calibration and classification
+#include "color_core.h"
+#include "class_tree.h"
+
+// Host link
+#include "serial_link.h"
+#include "time_sync.h"
+#include "uart_link.h"
+
+// Sensor readings
+#include "pcnt_sensor.h"
+
+// Fault bits, as reported by the Arduino build
+#include "sensor_snapshot.h"
+
+// Process control
+#include "spc.h"
+
+// Illumination
+#include "illumination.h"
+
+// Linearisation tables, generated by the host linfit tool
+#include "linearize.h"
+#include "linearize_tables.h"
+
+// Binary logging, formatted on the host
+#include "binlog.h"
+
+//------------------------------------------------------------------------------
+// Function declarations
+//------------------------------------------------------------------------------
+static void read_color_channel(uint8_t color_index);
+static void time_sync_request();
+static void host_link_poll();
+static void handle_sync_resp(const uart_link_frame &frame);
+static void send_reading_record(uint8_t class_index, int64_t read_time_us);
+static void update_process_control();
+static void send_spc_alarm(uint8_t channel);
+static void apply_illumination();
+static void update_illumination();
+static void run_frame();
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Frame timing
+//------------------------------------------------------------------------------
+// Frame period, in us. Three channels at PCNT_SENSOR_GATE_US each plus the
+//  host link fit with room to spare. -DFRAME_PERIOD_US=... to change it.
+#ifndef FRAME_PERIOD_US
+#define FRAME_PERIOD_US 10000
+#endif
+
+// Frame task. Highest application priority, on the core the receive task and
+//  the WiFi/BT stacks aren't on.
+#define FRAME_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#define FRAME_TASK_STACK 6144
+#define FRAME_TASK_CORE 1
+
+static TaskHandle_t frame_task_handle = NULL;
+
+// Frames run, and those the timer fired for while the previous one was still
+//  running.
+static uint32_t frame_count = 0;
+static uint32_t frame_overruns = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Color sensor
+//------------------------------------------------------------------------------
+// As in the Arduino build, indexed by enum COLOR_CHANNELS.
+static int color_readings[4];
+static int color_raw_readings[4];
+static uint32_t color_variances[4];
+
+static uint32_t sensor_timeouts = 0;
+static uint32_t map_errors = 0;
+
+// SENSOR_FAULTS bits raised while reading the current frame.
+static uint16_t frame_faults = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Host link
+//------------------------------------------------------------------------------
+// Interval between clock sync exchanges with the host, as the Arduino build.
+#define TIME_SYNC_FAST_INTERVAL_US 1000000
+#define TIME_SYNC_SLOW_INTERVAL_US 10000000
+
+// A response this late is dropped, in us. Matches the Arduino build's
+//  TIME_SYNC_TIMEOUT_MS, so the estimator sees the same exchanges.
+#define TIME_SYNC_TIMEOUT_US 30000
+
+static uint64_t device_id = 0;
+static time_sync_state clock_sync;
+static uint16_t reading_seq = 0;
+
+// Time of the last sync request, and its t1 while a response is due, else 0.
+static int64_t last_sync_us = 0;
+static int64_t sync_pending_t1 = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Process control
+//------------------------------------------------------------------------------
+// As in the Arduino build.
+#define SPC_ALARM_PIN GPIO_NUM_13
+#define SPC_ALARM_HOLD_FRAMES 20
+
+static spc_monitor spc;
+static uint8_t spc_frame_alarms[SPC_CHANNELS];
+static uint8_t spc_last_alarms[SPC_CHANNELS];
+static uint16_t spc_alarm_hold = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Illumination
+//------------------------------------------------------------------------------
+// As in the Arduino build, on the LEDC driver.
+#define ILLUM_LED_PIN GPIO_NUM_14
+#define ILLUM_LEDC_MODE LEDC_HIGH_SPEED_MODE
+#define ILLUM_LEDC_TIMER LEDC_TIMER_0
+#define ILLUM_LEDC_CHANNEL LEDC_CHANNEL_0
+#define ILLUM_PWM_HZ 312500
+#define ILLUM_PWM_BITS LEDC_TIMER_8_BIT
+
+static illum_controller illum;
+static int illum_calib_vals[ILLUM_STEPS][4][2];
+//------------------------------------------------------------------------------
+
+
+// Wakes the frame task. Notifications it hasn't taken yet add up, which is
+//  how it counts overruns.
+static bool IRAM_ATTR frame_timer_on_alarm(
+  gptimer_handle_t timer,
+  const gptimer_alarm_event_data_t *edata,
+  void *ctx
+){
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(frame_task_handle, &woken);
+
+  return woken == pdTRUE;
+}
+
+static void frame_task(void *arg){
+  while(true){
+    uint32_t due = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if(due > 1){
+      frame_overruns += due - 1;
+      BINLOG_WARN("%u frames overran, %u overruns", due - 1, frame_overruns);
+    }
+
+    run_frame();
+  }
+}
+
+static bool start_frame_timer(){
+  gptimer_handle_t timer;
+  gptimer_config_t config = {};
+  config.clk_src = GPTIMER_CLK_SRC_DEFAULT;
+  config.direction = GPTIMER_COUNT_UP;
+  config.resolution_hz = 1000000;
+
+  gptimer_event_callbacks_t callbacks = {};
+  callbacks.on_alarm = frame_timer_on_alarm;
+
+  gptimer_alarm_config_t alarm = {};
+  alarm.alarm_count = FRAME_PERIOD_US;
+  alarm.reload_count = 0;
+  alarm.flags.auto_reload_on_alarm = true;
+
+  return
+    gptimer_new_timer(&config, &timer) == ESP_OK &&
+    gptimer_register_event_callbacks(timer, &callbacks, NULL) == ESP_OK &&
+    gptimer_set_alarm_action(timer, &alarm) == ESP_OK &&
+    gptimer_enable(timer) == ESP_OK &&
+    gptimer_start(timer) == ESP_OK;
+}
+
+static bool start_illumination(){
+  ledc_timer_config_t timer = {};
+  timer.speed_mode = ILLUM_LEDC_MODE;
+  timer.duty_resolution = ILLUM_PWM_BITS;
+  timer.timer_num = ILLUM_LEDC_TIMER;
+  timer.freq_hz = ILLUM_PWM_HZ;
+  timer.clk_cfg = LEDC_AUTO_CLK;
+
+  ledc_channel_config_t channel = {};
+  channel.gpio_num = ILLUM_LED_PIN;
+  channel.speed_mode = ILLUM_LEDC_MODE;
+  channel.channel = ILLUM_LEDC_CHANNEL;
+  channel.timer_sel = ILLUM_LEDC_TIMER;
+  channel.duty = 0;
+  channel.hpoint = 0;
+
+  return
+    ledc_timer_config(&timer) == ESP_OK &&
+    ledc_channel_config(&channel) == ESP_OK;
+}
+
+extern "C" void app_main(){
+  // The same id ESP.getEfuseMac() gives the Arduino build.
+  esp_efuse_mac_get_default((uint8_t *)&device_id);
+
+  if(!uart_link_start()){
+    printf("UART link failed to start\n");
+    return;
+  }
+  binlog_start(uart_link_write_frame, esp_timer_get_time);
+  time_sync_init(clock_sync);
+
+  gpio_reset_pin(SPC_ALARM_PIN);
+  gpio_set_direction(SPC_ALARM_PIN, GPIO_MODE_OUTPUT);
+  gpio_set_level(SPC_ALARM_PIN, 0);
+  spc_params params;
+  spc_params_default(params);
+  spc_monitor_init(spc, params);
+
+  // color_read_calib_vals starts out as the full brightness table, the other
+  //  steps are derived from it.
+  if(!start_illumination() || !pcnt_sensor_start()){
+    printf("Sensor drivers failed to start\n");
+    return;
+  }
+  illum_controller_init(illum, ILLUM_DEFAULT_MAX_PULSE_US);
+  for(uint8_t i=0; i<ILLUM_STEPS; i++)
+    illum_derive_calib(color_read_calib_vals, i, illum_calib_vals[i]);
+  apply_illumination();
+
+  // Sync with the host on the first frame rather than a full interval in.
+  last_sync_us = esp_timer_get_time() - TIME_SYNC_FAST_INTERVAL_US;
+
+  if(
+    xTaskCreatePinnedToCore(
+      frame_task,
+      "frame",
+      FRAME_TASK_STACK,
+      NULL,
+      FRAME_TASK_PRIORITY,
+      &frame_task_handle,
+      FRAME_TASK_CORE
+    ) != pdPASS ||
+    !start_frame_timer()
+  ){
+    printf("Frame task failed to start\n");
+    return;
+  }
+
+  printf("Initialization finished, frames every %d us\n", FRAME_PERIOD_US);
+
+  return;
+}
+
+static void run_frame(){
+  // Take the host's responses and keep the clock mapping fresh.
+  host_link_poll();
+  int64_t now = esp_timer_get_time();
+  int64_t sync_interval =
+    clock_sync.count < TIME_SYNC_WINDOW ?
+      TIME_SYNC_FAST_INTERVAL_US : TIME_SYNC_SLOW_INTERVAL_US;
+  if(now - last_sync_us >= sync_interval){
+    last_sync_us = now;
+    time_sync_request();
+  }
+
+  // Device time the readings for this frame were started at.
+  int64_t frame_time_us = esp_timer_get_time();
+  frame_faults = 0;
+
+  for(uint8_t color=0; color<3; color++)
+    read_color_channel(color);
+
+#if CLASS_TREES
+  uint8_t confidence;
+  uint8_t class_index = class_tree_classify(color_readings, &confidence);
+#else
+  uint8_t class_index = color_classify_noisy(color_readings, color_variances);
+#endif
+  if(class_index == COLOR_MAP_ERR){
+    map_errors++;
+    frame_faults |= SENSOR_FAULT_MAP_ERR;
+  }
+  send_reading_record(class_index, frame_time_us);
+  update_process_control();
+  update_illumination();
+  frame_count++;
+
+  return;
+}
+
+// Reads a channel and carries it through the calibration, or linearisation
+//  table, as read_color_channel() in the Arduino build does.
+static void read_color_channel(uint8_t color_index){
+  pcnt_reading reading;
+  pcnt_sensor_read(color_index, reading);
+  color_raw_readings[color_index] = reading.width_us;
+
+  if(reading.width_us == 0){
+    sensor_timeouts++;
+    frame_faults |= SENSOR_FAULT_TIMEOUT;
+    BINLOG_WARN(
+      "channel %u timed out, %u timeouts", color_index, sensor_timeouts
+    );
+  }
+
+  const lin_table &lin = linearize_tables[illum.step][color_index];
+  if(lin.knots){
+    color_variances[color_index] =
+      reading.variance == COLOR_VAR_UNKNOWN ?
+        COLOR_VAR_UNKNOWN :
+        lin_eval_variance(lin, reading.width_us, reading.variance);
+    color_readings[color_index] = lin_eval(lin, reading.width_us);
+  }
+  else {
+    color_variances[color_index] =
+      color_calibrate_variance(reading.variance, color_index);
+    color_readings[color_index] =
+      color_calibrate_channel(reading.width_us, color_index);
+  }
+
+  return;
+}
+
+// Sends a clock sync request. The response is picked up by host_link_poll()
+//  on a later frame, stamped with the time it arrived.
+static void time_sync_request(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_sync_req req;
+  req.t1 = esp_timer_get_time();
+  sync_pending_t1 = req.t1;
+  uart_link_write_frame(
+    LINK_SYNC_REQ,
+    payload,
+    link_pack_sync_req(req, payload)
+  );
+
+  return;
+}
+
+// Handles whatever the host sent since the last frame. Only sync responses
+//  for now, the commands the Arduino build takes are for subsystems not
+//  ported.
+static void host_link_poll(){
+  uart_link_frame frame;
+  while(uart_link_receive(frame)){
+    if(frame.type == LINK_SYNC_RESP)
+      handle_sync_resp(frame);
+  }
+
+  return;
+}
+
+// Feeds a sync response to the estimator and reports the updated estimate
+//  back, as time_sync_exchange() in the Arduino build does.
+static void handle_sync_resp(const uart_link_frame &frame){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_sync_resp resp;
+  if(
+    !link_unpack_sync_resp(frame.payload, frame.len, resp) ||
+    sync_pending_t1 == 0 ||
+    resp.t1 != sync_pending_t1
+  ){
+    return;
+  }
+  sync_pending_t1 = 0;
+  if(frame.rx_time_us - resp.t1 > TIME_SYNC_TIMEOUT_US)
+    return;
+
+  if(
+    !time_sync_add_exchange(
+      clock_sync,
+      resp.t1,
+      resp.t2,
+      resp.t3,
+      frame.rx_time_us
+    )
+  ){
+    return;
+  }
+
+  link_sync_status status;
+  status.device_id = device_id;
+  status.device_time_us = clock_sync.ref_local_us;
+  status.offset_us = clock_sync.ref_offset_us;
+  status.drift_ppb = clock_sync.drift_ppb;
+  status.uncertainty_us = clock_sync.ref_uncertainty_us;
+  status.samples = clock_sync.fit_samples;
+  status.rtt_us =
+    clock_sync.best_rtt_us > 0xFFFF ? 0xFFFF : clock_sync.best_rtt_us;
+  uart_link_write_frame(
+    LINK_SYNC_STATUS,
+    payload,
+    link_pack_sync_status(status, payload)
+  );
+
+  return;
+}
+
+// Sends the current frame's readings and classification to the host, stamped
+//  in host time.
+static void send_reading_record(uint8_t class_index, int64_t read_time_us){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_reading rec;
+  rec.seq = reading_seq++;
+  rec.flags = clock_sync.valid ? LINK_READING_FLAG_SYNCED : 0;
+  rec.flags |= illum.step << LINK_READING_ILLUM_SHIFT;
+  rec.class_index = class_index;
+  rec.host_time_us =
+    time_sync_to_host(clock_sync, read_time_us, &rec.uncertainty_us);
+  for(uint8_t i=0; i<4; i++){
+    rec.raw[i] =
+      color_raw_readings[i] > 0xFFFF ? 0xFFFF : color_raw_readings[i];
+    rec.mapped[i] = color_readings[i];
+  }
+  uart_link_write_frame(
+    LINK_READING,
+    payload,
+    link_pack_reading(rec, payload)
+  );
+
+  return;
+}
+
+// Runs the frame through the process control charts, drives the alarm output
+//  and reports new alarms to the host.
+static void update_process_control(){
+  memcpy(spc_last_alarms, spc_frame_alarms, sizeof(spc_last_alarms));
+
+  uint8_t alarms = 0;
+  if(frame_faults & SENSOR_FAULT_TIMEOUT){
+    memset(spc_frame_alarms, 0, sizeof(spc_frame_alarms));
+  }
+  else {
+    alarms = spc_monitor_update(spc, color_readings);
+    for(uint8_t i=0; i<SPC_CHANNELS; i++)
+      spc_frame_alarms[i] = spc.channels[i].alarms;
+  }
+
+  if(alarms)
+    spc_alarm_hold = SPC_ALARM_HOLD_FRAMES;
+  else if(spc_alarm_hold)
+    spc_alarm_hold--;
+  gpio_set_level(SPC_ALARM_PIN, spc_alarm_hold ? 1 : 0);
+
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    if(spc_frame_alarms[i] & ~spc_last_alarms[i])
+      send_spc_alarm(i);
+  }
+
+  return;
+}
+
+static void send_spc_alarm(uint8_t channel){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  const spc_channel &ch = spc.channels[channel];
+
+  link_spc_alarm msg;
+  msg.frame = frame_count;
+  msg.channel = channel;
+  msg.alarms = ch.alarms;
+  msg.mean = ch.mean;
+  msg.sigma = ch.sigma;
+  msg.ewma = ch.ewma;
+  msg.cusum_high = ch.cusum_high;
+  msg.cusum_low = ch.cusum_low;
+  msg.xbar = ch.xbar;
+  msg.range = ch.range;
+  uart_link_write_frame(
+    LINK_SPC_ALARM,
+    payload,
+    link_pack_spc_alarm(msg, payload)
+  );
+
+  return;
+}
+
+// Drives the LEDs at the current illumination step and switches to its
+//  calibration table.
+static void apply_illumination(){
+  ledc_set_duty(
+    ILLUM_LEDC_MODE,
+    ILLUM_LEDC_CHANNEL,
+    illum_step_duty[illum.step]
+  );
+  ledc_update_duty(ILLUM_LEDC_MODE, ILLUM_LEDC_CHANNEL);
+  memcpy(
+    color_read_calib_vals,
+    illum_calib_vals[illum.step],
+    sizeof(color_read_calib_vals)
+  );
+
+  return;
+}
+
+static void update_illumination(){
+  uint8_t step = illum.step;
+  if(illum_update(illum, color_raw_readings) != step){
+    BINLOG_INFO("illumination step %u -> %u", step, illum.step);
+    apply_illumination();
+  }
+
+  return;
+}
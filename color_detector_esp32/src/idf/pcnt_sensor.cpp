@@ -0,0 +1,160 @@
+#include "pcnt_sensor.h"
+
+#include <driver/gpio.h>
+#include <driver/pulse_cnt.h>
+#include <esp_attr.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "color_core.h"
+#include "integration.h"
+
+#define PCNT_SENSOR_OUT_PIN GPIO_NUM_32
+#define PCNT_SENSOR_S2_PIN GPIO_NUM_15
+#define PCNT_SENSOR_S3_PIN GPIO_NUM_33
+
+// Shortest pulse accepted as an edge, in ns. The brightest channels run
+//  around a microsecond per half period.
+#define PCNT_SENSOR_GLITCH_NS 100
+
+// Edges per reading before a channel has been read.
+#define PCNT_SENSOR_START_EDGES 17
+
+// S2, S3 levels per enum COLOR_CHANNELS, as color_read_pin_maps.
+static const uint8_t pcnt_sensor_filters[4][2] = {
+  {0, 0},   // Red
+  {1, 1},   // Green
+  {0, 1},   // Blue
+  {1, 0}    // Clear
+};
+
+static pcnt_unit_handle_t pcnt_unit = NULL;
+static SemaphoreHandle_t pcnt_done = NULL;
+
+// Watch point ending the reading, and the edges each channel reads next.
+static int pcnt_watch = 0;
+static uint16_t pcnt_edges[4];
+
+// Times of the first and the last edge of the reading, from the interrupt.
+static volatile int64_t pcnt_first_us = 0;
+static volatile int64_t pcnt_last_us = 0;
+
+static bool IRAM_ATTR pcnt_sensor_on_reach(
+  pcnt_unit_handle_t unit,
+  const pcnt_watch_event_data_t *edata,
+  void *ctx
+){
+  int64_t now = esp_timer_get_time();
+  if(edata->watch_point_value == 1){
+    pcnt_first_us = now;
+    return false;
+  }
+
+  pcnt_last_us = now;
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(pcnt_done, &woken);
+
+  return woken == pdTRUE;
+}
+
+bool pcnt_sensor_start(){
+  gpio_config_t pins = {};
+  pins.pin_bit_mask =
+    (1ULL << PCNT_SENSOR_S2_PIN) | (1ULL << PCNT_SENSOR_S3_PIN);
+  pins.mode = GPIO_MODE_OUTPUT;
+  if(gpio_config(&pins) != ESP_OK)
+    return false;
+
+  pcnt_done = xSemaphoreCreateBinary();
+  if(!pcnt_done)
+    return false;
+
+  pcnt_unit_config_t unit_config = {};
+  unit_config.low_limit = -1;
+  unit_config.high_limit = PCNT_SENSOR_MAX_EDGES;
+  if(pcnt_new_unit(&unit_config, &pcnt_unit) != ESP_OK)
+    return false;
+
+  pcnt_glitch_filter_config_t filter = {};
+  filter.max_glitch_ns = PCNT_SENSOR_GLITCH_NS;
+
+  pcnt_chan_config_t chan_config = {};
+  chan_config.edge_gpio_num = PCNT_SENSOR_OUT_PIN;
+  chan_config.level_gpio_num = -1;
+  pcnt_channel_handle_t chan;
+
+  pcnt_event_callbacks_t callbacks = {};
+  callbacks.on_reach = pcnt_sensor_on_reach;
+
+  for(uint8_t i=0; i<4; i++)
+    pcnt_edges[i] = PCNT_SENSOR_START_EDGES;
+  pcnt_watch = PCNT_SENSOR_START_EDGES;
+
+  return
+    pcnt_unit_set_glitch_filter(pcnt_unit, &filter) == ESP_OK &&
+    pcnt_new_channel(pcnt_unit, &chan_config, &chan) == ESP_OK &&
+    pcnt_channel_set_edge_action(
+      chan,
+      PCNT_CHANNEL_EDGE_ACTION_INCREASE,
+      PCNT_CHANNEL_EDGE_ACTION_INCREASE
+    ) == ESP_OK &&
+    pcnt_unit_add_watch_point(pcnt_unit, 1) == ESP_OK &&
+    pcnt_unit_add_watch_point(pcnt_unit, pcnt_watch) == ESP_OK &&
+    pcnt_unit_register_event_callbacks(
+      pcnt_unit,
+      &callbacks,
+      NULL
+    ) == ESP_OK &&
+    pcnt_unit_enable(pcnt_unit) == ESP_OK;
+}
+
+void pcnt_sensor_read(uint8_t channel, pcnt_reading &out){
+  uint16_t edges = pcnt_edges[channel];
+  if(edges != pcnt_watch){
+    pcnt_unit_remove_watch_point(pcnt_unit, pcnt_watch);
+    pcnt_unit_add_watch_point(pcnt_unit, edges);
+    pcnt_watch = edges;
+  }
+
+  gpio_set_level(PCNT_SENSOR_S2_PIN, pcnt_sensor_filters[channel][0]);
+  gpio_set_level(PCNT_SENSOR_S3_PIN, pcnt_sensor_filters[channel][1]);
+  esp_rom_delay_us(INTEG_SWITCH_US);
+
+  xSemaphoreTake(pcnt_done, 0);
+  pcnt_unit_clear_count(pcnt_unit);
+  pcnt_unit_start(pcnt_unit);
+  bool done =
+    xSemaphoreTake(pcnt_done, pdMS_TO_TICKS(PCNT_SENSOR_TIMEOUT_MS)) == pdTRUE;
+  pcnt_unit_stop(pcnt_unit);
+
+  out.edges = edges;
+  if(!done){
+    out.width_us = 0;
+    out.variance = COLOR_VAR_UNKNOWN;
+    pcnt_edges[channel] = PCNT_SENSOR_MIN_EDGES;
+    return;
+  }
+
+  // Rounded to whole microseconds like pulseIn(), which is also about the
+  //  quantisation color_raw_variance() allows for. The period jitter averages
+  //  down over the half periods.
+  uint32_t halves = edges - 1;
+  int64_t elapsed = pcnt_last_us - pcnt_first_us;
+  out.width_us = (elapsed + halves / 2) / halves;
+  out.variance = color_raw_variance(out.width_us);
+  if(out.variance != COLOR_VAR_UNKNOWN)
+    out.variance /= halves;
+
+  // Aim the next reading of the channel at the gate time, whole periods.
+  uint32_t next = out.width_us ? PCNT_SENSOR_GATE_US / out.width_us : 0;
+  next &= ~1UL;
+  if(next < PCNT_SENSOR_MIN_EDGES - 1)
+    next = PCNT_SENSOR_MIN_EDGES - 1;
+  if(next > PCNT_SENSOR_MAX_EDGES - 1)
+    next = PCNT_SENSOR_MAX_EDGES - 1;
+  pcnt_edges[channel] = next + 1;
+
+  return;
+}
@@ -0,0 +1,152 @@
+#include "uart_link.h"
+
+#include <string.h>
+
+#include <driver/uart.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#define UART_LINK_PORT UART_NUM_0
+#define UART_LINK_BAUD 115200
+
+// Driver ring buffers, in bytes, and depth of its event queue.
+#define UART_LINK_RX_BUF 1024
+#define UART_LINK_TX_BUF 2048
+#define UART_LINK_EVENTS 16
+
+// Decoded frames waiting for the frame task.
+#define UART_LINK_FRAMES 8
+
+// Idle time, in symbols, after which the driver hands over what's in the
+//  receive FIFO. The default of 10 would hold a sync response's last bytes
+//  back by about a millisecond at 115200.
+#define UART_LINK_RX_TIMEOUT 2
+
+// Below the frame task, which must never wait on it, but above the idle
+//  tasks. Core 0, away from the frame task on core 1.
+#define UART_LINK_TASK_PRIORITY 10
+#define UART_LINK_TASK_STACK 3072
+#define UART_LINK_TASK_CORE 0
+
+static QueueHandle_t uart_link_events = NULL;
+static QueueHandle_t uart_link_frames = NULL;
+static link_decoder uart_link_decoder;
+static volatile uint32_t uart_link_drops = 0;
+
+// Decodes the bytes the event reports as they're read out of the driver.
+//  All frames completed by one event share its dequeue time, which is as
+//    close to their arrival as the driver lets the task get.
+static void uart_link_read(size_t pending){
+  uint8_t buf[128];
+  int64_t now = esp_timer_get_time();
+
+  while(pending > 0){
+    size_t want = pending < sizeof(buf) ? pending : sizeof(buf);
+    int got = uart_read_bytes(UART_LINK_PORT, buf, want, 0);
+    if(got <= 0)
+      break;
+    pending -= got;
+
+    for(int i=0; i<got; i++){
+      if(!link_decode_byte(uart_link_decoder, buf[i]))
+        continue;
+
+      uart_link_frame frame;
+      frame.rx_time_us = now;
+      frame.type = uart_link_decoder.type;
+      frame.len = uart_link_decoder.len;
+      memcpy(frame.payload, uart_link_decoder.payload, frame.len);
+      if(xQueueSend(uart_link_frames, &frame, 0) != pdTRUE)
+        uart_link_drops++;
+    }
+  }
+
+  return;
+}
+
+static void uart_link_task(void *arg){
+  uart_event_t event;
+
+  while(true){
+    if(xQueueReceive(uart_link_events, &event, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    switch(event.type){
+      case UART_DATA:
+        uart_link_read(event.size);
+        break;
+
+      // The host outran us. What's buffered is part frames at best, start
+      //  clean and let the decoder hunt for the next start byte.
+      case UART_FIFO_OVF:
+      case UART_BUFFER_FULL:
+        uart_flush_input(UART_LINK_PORT);
+        xQueueReset(uart_link_events);
+        link_decoder_reset(uart_link_decoder);
+        uart_link_drops++;
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+bool uart_link_start(){
+  uart_config_t config = {};
+  config.baud_rate = UART_LINK_BAUD;
+  config.data_bits = UART_DATA_8_BITS;
+  config.parity = UART_PARITY_DISABLE;
+  config.stop_bits = UART_STOP_BITS_1;
+  config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+  config.source_clk = UART_SCLK_DEFAULT;
+
+  link_decoder_reset(uart_link_decoder);
+  uart_link_frames = xQueueCreate(UART_LINK_FRAMES, sizeof(uart_link_frame));
+  if(!uart_link_frames)
+    return false;
+
+  if(
+    uart_driver_install(
+      UART_LINK_PORT,
+      UART_LINK_RX_BUF,
+      UART_LINK_TX_BUF,
+      UART_LINK_EVENTS,
+      &uart_link_events,
+      0
+    ) != ESP_OK ||
+    uart_param_config(UART_LINK_PORT, &config) != ESP_OK ||
+    uart_set_rx_timeout(UART_LINK_PORT, UART_LINK_RX_TIMEOUT) != ESP_OK
+  ){
+    return false;
+  }
+
+  return xTaskCreatePinnedToCore(
+    uart_link_task,
+    "uart_link",
+    UART_LINK_TASK_STACK,
+    NULL,
+    UART_LINK_TASK_PRIORITY,
+    NULL,
+    UART_LINK_TASK_CORE
+  ) == pdPASS;
+}
+
+void uart_link_write_frame(uint8_t type, const uint8_t *payload, uint8_t len){
+  uint8_t frame[LINK_MAX_FRAME];
+  size_t frame_len = link_encode(type, payload, len, frame);
+
+  uart_write_bytes(UART_LINK_PORT, frame, frame_len);
+
+  return;
+}
+
+bool uart_link_receive(uart_link_frame &frame){
+  return xQueueReceive(uart_link_frames, &frame, 0) == pdTRUE;
+}
+
+uint32_t uart_link_dropped(){
+  return uart_link_drops;
+}
@@ -1,19 +1,109 @@
 #include <Arduino.h>
 
-// OLED display libraries
+// OLED display libraries, not in headless builds (-DHEADLESS)
+#ifndef HEADLESS
 #include <Wire.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
+#endif
+
+// Calibration and classification
+#include "color_core.h"
+
+// Host link
+#include <esp_timer.h>
+#include "serial_link.h"
+#include "time_sync.h"
+
+// State carried across resets
+#include "warm_restart.h"
+
+// Field bus
+#include "sensor_snapshot.h"
+#include "modbus_server.h"
+#include "i2c_server.h"
+#include "can_server.h"
+#include "can_output.h"
+
+// Process control
+#include "spc.h"
+
+// Illumination
+#include "illumination.h"
+
+// Pulses averaged per channel
+#include "integration.h"
+
+// Linearisation tables, generated by the host linfit tool
+#include "linearize.h"
+#include "linearize_tables.h"
+
+// Decision tree classifier, generated by the host treefit tool
+#include "class_tree.h"
+
+// Palette matching
+#include "palette.h"
+#include "palettes.h"
+
+// Per frame results cached by reading
+#include "class_cache.h"
+
+// Binary logging, formatted on the host
+#include "binlog.h"
+
+// Sampling profiler, only with -DPROFILER
+#include "profiler.h"
+
+// Host selected telemetry streams
+#include "telemetry.h"
+
+// Frames around QC events, for download by the host
+#include "capture.h"
+
+// Raw reading histograms, for calibration
+#include "histogram.h"
 
 //------------------------------------------------------------------------------
 // Function declarations
 //------------------------------------------------------------------------------
+#ifndef HEADLESS
 void display_init();
 void display_refresh();
-int read_color_channel(uint8_t &color_index);
+void display_frame();
 void write_color_to_display(uint8_t &color_index);
-uint8_t map_color_vals();
 void display_splash_screen();
+#endif
+int read_color_channel(uint8_t &color_index);
+uint8_t map_color_vals();
+void host_link_write_frame(uint8_t type, const uint8_t *payload, uint8_t len);
+void time_sync_exchange();
+void host_link_poll();
+void handle_host_frame();
+void handle_subscribe();
+void handle_capture_cmd();
+void stream_telemetry(uint8_t class_index, int64_t read_time_us);
+void send_reading_record(uint8_t class_index, int64_t read_time_us);
+void record_capture(uint8_t class_index, int64_t read_time_us);
+void send_capture_info(uint8_t slot);
+void send_capture_data();
+void handle_hist_cmd();
+void send_hist_info();
+void send_hist_data();
+bool restore_pipeline_state();
+void checkpoint_pipeline_state();
+void start_field_bus();
+void apply_bus_config();
+void publish_snapshot(uint8_t class_index);
+void update_process_control();
+void send_spc_alarm(uint8_t channel);
+void apply_illumination();
+void update_illumination();
+void plan_integration();
+#ifdef PALETTE_RAW_MATCH
+void update_palette(uint16_t max_colors);
+#endif
+uint16_t match_palette();
+uint8_t classify_frame();
 //------------------------------------------------------------------------------
 
 
@@ -30,20 +120,20 @@ void display_splash_screen();
 #define S3 33
 #define color_sensor_in 32
 
-// Mapping for different color logic paths.
-//  Warning: Order is assumed elsewhere through direct mapping using integers 
-//    and should not be modified without significant code review.
-enum COLOR_CHANNELS {
-  RED =   0,
-  GREEN = 1,
-  BLUE =  2,
-  CLEAR=  3
-};
-
 // Used to store the last reading for each color channel.
 //  Intended use is for the enum COLOR_CHANNELS to be the access key.
 int color_readings[4];
 
+// Raw (unmapped) pulse width of the last reading for each color channel, in
+//  microseconds. Same indexing as color_readings.
+int color_raw_readings[4];
+
+// Variance of each calibrated reading in color_readings, fixed point with
+//  COLOR_VAR_FRAC_BITS fractional bits. Estimated per reading from its pulse
+//  width and carried through the calibration, so the classifier can tell a
+//  noisy dark reading from a genuinely off color one.
+uint32_t color_variances[4];
+
 // Stores the minimum and maximum readings taken since last power on for each
 //  color channel.
 //  Note that these are raw values, direct from the sensor, and do not have any
@@ -56,6 +146,19 @@ int color_min_max_readings[4][2]{
   {32767, -32768}
 };
 
+// Per frame time budget for reading the channels, in us. What a single pulse
+//  per channel can take at the illumination ceiling, so frames take no longer
+//  than they did with one pulseIn() per channel; the scheduler spends it on
+//  extra pulses for the noisiest channels.
+#define INTEG_FRAME_BUDGET_US \
+  (INTEG_CHANNELS * (INTEG_SWITCH_US + 3 * ILLUM_DEFAULT_MAX_PULSE_US))
+
+// Pulses averaged per channel each frame.
+integ_scheduler integ;
+
+// pulseIn() timeout of a channel's first pulse in a frame, Arduino's default.
+#define PULSE_TIMEOUT_US 1000000UL
+
 // Photodiode selection pin logic values for each color channel.
 //  Intended use is to use the enum COLOR_CHANNELS to access the row.
 //  Read columns as output pins mapped to color sensor S2 and S3.
@@ -66,28 +169,7 @@ int color_read_pin_maps[4][2]{
   {HIGH,  LOW}    // Clear
 };
 
-// Min and max reading values used to map each  of the color channels to typical
-//  RGB 0->255 values.
-//  Format is [COLOR_CHANNELS::<COLOR>][{MIN, MAX}]
-//  Note: these values are determined empirically, and for a cheap sensor like
-//    the TCS2300 (w/o mountains of effort at least) these are nothing but a 
-//    vain attempt at real calibration.
-//    To calibrate though use whatever power source the final circuit intends to
-//      use, in lighting conditions similar to the use case environment, and 
-//      read in a few readings using known red, green, and blue colored objects
-//      in front of the sensor. Note down the lowest and highest values, then
-//      plug those two values in to this array.
-//  Think the best reasonable result here is to find the absolute min/max values
-//    possible and use those, that way the values mapped will never exceed the
-//    [0,255] range.
-//  Final values we chose the lowest/highest for each between the two tests.
-int color_read_calib_vals[4][2]{
-  {1, 111}, 
-  {2, 125},
-  {1, 101},
-  {0, 255}
-};
-
+#ifndef HEADLESS
 // Cursor locations for the color output lines on the OLED display.
 //  These are mapped using starting location for each color segment, i.e. the
 //    direct values are where the text denoting each color is placed.
@@ -113,30 +195,17 @@ char color_display_text[][3] = {
   "B:",
   "C:"
 };
+#endif
 //------------------------------------------------------------------------------
 
 
 //------------------------------------------------------------------------------
 // Definitions
 //------------------------------------------------------------------------------
-// Number of RGB mapping values we have stored, this is used to link the lengths
-//  of the RGB values array and the string mapping array.
-#define RGB_VAL_MAPPING_LEN 6
-
 // Max length of the display strings used to map RGB values to human readable
 //  values, plus the null terminator.
 #define RGB_DISPLAY_STR_MAX_LEN 6
 
-// Used for mapping int's to output strings in the arrays that follow.
-enum COLOR_STR_MAP {
-  RED_STR   = 0,
-  GREEN_STR = 1,
-  BLUE_STR  = 2,
-  BLACK_STR = 3,
-  WHITE_STR = 4,
-  UNDEF_STR = 5
-};
-
 // RGB values for the nearest match color mapping.
 //  Warning: this is index locked with the rgb string mapping array.
 // TODO: with the inclusion of 'Undef' as an output string in the display map
@@ -151,6 +220,7 @@ uint8_t RGB_VALS[RGB_VAL_MAPPING_LEN][3]{
   {255,255,255}   // White
 };
 
+#ifndef HEADLESS
 // Display string mappings for the RGB value array.
 //  Warning: this is index locked to the RGB values array.
 char RGB_DISPLAY_MAP[RGB_VAL_MAPPING_LEN][RGB_DISPLAY_STR_MAX_LEN] = {
@@ -161,16 +231,242 @@ char RGB_DISPLAY_MAP[RGB_VAL_MAPPING_LEN][RGB_DISPLAY_STR_MAX_LEN] = {
   "White",
   "Undef"
 };
+#endif
 //------------------------------------------------------------------------------
 
 
 //------------------------------------------------------------------------------
 // OLED Display
 //------------------------------------------------------------------------------
+// Headless builds (-DHEADLESS) are for heads mounted where nobody can see a
+//  screen. They leave out the display, its framebuffer and the splash screen,
+//  and spend the time it took per frame on a shorter frame delay instead.
+#ifndef HEADLESS
 #define OLED_WIDTH 128
 #define OLED_HEIGHT 64
 
 Adafruit_SSD1306 screen(OLED_WIDTH, OLED_HEIGHT, &Wire, -1);
+#endif
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Host link
+//------------------------------------------------------------------------------
+// Interval between clock sync exchanges with the host, in ms.
+//  The fast interval is used until the sync window is full so timestamps become
+//    trustworthy quickly after boot, after that the slow one is plenty to track
+//    crystal drift.
+#define TIME_SYNC_FAST_INTERVAL_MS 1000
+#define TIME_SYNC_SLOW_INTERVAL_MS 10000
+
+// How long to wait for the host's sync response before giving up, in ms.
+//  The response is polled for directly, rather than picked up on the next
+//    loop(), so the receive timestamp isn't inflated by the display update.
+#define TIME_SYNC_TIMEOUT_MS 30
+
+// Unique ID for this sensor head, reported to the host in sync status frames.
+//  Taken from the factory programmed MAC address.
+uint64_t device_id;
+
+// Device->host clock estimate used to stamp outgoing records.
+time_sync_state clock_sync;
+
+// Decoder for frames received from the host.
+link_decoder host_link_decoder;
+
+// Sequence number of the next reading record, lets the host detect drops.
+uint16_t reading_seq = 0;
+
+// millis() of the last sync exchange attempt.
+uint32_t last_sync_ms = 0;
+
+// Streams the host subscribed to, see telemetry.h. Reading records are only
+//  sent while there are none.
+telemetry_streams host_telemetry;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Field bus
+//------------------------------------------------------------------------------
+// Latest frame results, published every loop for the Modbus server.
+sensor_snapshot_channel bus_snapshots;
+
+// Configuration written by Modbus masters, applied at the top of each loop.
+sensor_config_channel bus_config;
+
+// Sequence number of the last configuration applied from bus_config.
+uint32_t bus_config_seq = 0;
+
+// Delay between frames, in ms. Configurable over the bus.
+#ifdef HEADLESS
+#define LOOP_DELAY_DEFAULT_MS 20
+#else
+#define LOOP_DELAY_DEFAULT_MS 100
+#endif
+uint16_t loop_delay_ms = LOOP_DELAY_DEFAULT_MS;
+
+// CAN output identifiers and timing, configurable over the bus. Kept here
+//  even in builds without CAN output so the registers read back consistently.
+can_output_config can_config = {
+  CAN_OUTPUT_DEFAULT_CYCLIC_ID,
+  CAN_OUTPUT_DEFAULT_EVENT_ID,
+  CAN_OUTPUT_DEFAULT_PERIOD_MS,
+  CAN_OUTPUT_DEFAULT_INHIBIT_MS
+};
+
+// Frame counter and fault counters reported over the bus.
+uint32_t frame_count = 0;
+uint32_t sensor_timeouts = 0;
+uint32_t map_errors = 0;
+
+// SENSOR_FAULTS bits raised while reading the current frame.
+uint16_t frame_faults = 0;
+
+// Set if the OLED failed to come up. Never in headless builds.
+bool display_failed = false;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Process control
+//------------------------------------------------------------------------------
+// Output driven HIGH while a process control alarm is held.
+//  GPIO13 is also the Feather's red LED, so alarms show on the board itself.
+#define SPC_ALARM_PIN 13
+
+// Frames an alarm is held for after the last chart signal, so a PLC input or
+//  stack light scanned slower than the frame rate still catches it.
+#define SPC_ALARM_HOLD_FRAMES 20
+
+// EWMA, CUSUM and X-bar/R charts over the calibrated channels.
+spc_monitor spc;
+
+// Alarms raised by this frame and the previous one, per chart channel. Only
+//  newly raised alarms are sent to the host.
+uint8_t spc_frame_alarms[SPC_CHANNELS];
+uint8_t spc_last_alarms[SPC_CHANNELS];
+
+// Frames left on the alarm output hold.
+uint16_t spc_alarm_hold = 0;
+
+// Baseline generation, see sensor_config::spc_generation.
+uint16_t spc_generation = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Illumination
+//------------------------------------------------------------------------------
+// Sensor module LED enable, driven with PWM.
+#define ILLUM_LED_PIN 14
+
+// LEDC channel and PWM setup. At 312.5kHz (the fastest 8 bit LEDC rate) a PWM
+//  period is ~3us, short against the pulses being timed, so the ripple
+//  averages out within each pulseIn().
+#define ILLUM_LEDC_CHANNEL 0
+#define ILLUM_PWM_HZ 312500
+#define ILLUM_PWM_BITS 8
+
+illum_controller illum;
+
+// Calibration table per illumination step, the active one is copied into
+//  color_read_calib_vals whenever the step changes.
+int illum_calib_vals[ILLUM_STEPS][4][2];
+
+// Bumped by apply_illumination() whenever the calibration in use may have
+//  changed.
+uint32_t calib_generation = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Palette
+//------------------------------------------------------------------------------
+#ifdef PALETTE_RAW_MATCH
+// Colors carried into raw space per frame while a palette rebuild is running.
+#define PALETTE_BUILD_CHUNK 16
+
+#define PALETTE_SHORT_COLORS \
+  (sizeof(palette_short_colors) / sizeof(palette_short_colors[0]))
+
+// colors_short.csv in raw space, double buffered. Frames are matched against
+//  palette_active while a rebuild for a new calibration fills the other
+//  buffer, palette_building.
+palette_raw_color palette_raw_colors[2][PALETTE_SHORT_COLORS];
+palette_raw palette_raw_bufs[2];
+palette_raw *palette_active = NULL;
+palette_raw *palette_building = NULL;
+
+// calib_generation each of them was built from.
+uint32_t palette_active_generation = 0;
+uint32_t palette_building_generation = 0;
+#endif
+
+// Nearest palette color of the last frame.
+uint16_t palette_index = PALETTE_NO_MATCH;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Classification cache
+//------------------------------------------------------------------------------
+// Frame results by quantised reading, see class_cache.h. Invalidated whenever
+//  the calibration or the active palette changes.
+class_cache frame_cache;
+
+// Classification confidence of the last frame.
+uint8_t frame_confidence = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Captures
+//------------------------------------------------------------------------------
+// Faults that trigger a capture when raised. The others are standing
+//  conditions rather than events.
+#define CAPTURE_FAULT_TRIGGERS (SENSOR_FAULT_TIMEOUT | SENSOR_FAULT_MAP_ERR)
+
+// LINK_CAPTURE_DATA frames sent per loop while a capture is downloaded, so a
+//  download doesn't stall the frame it's requested in.
+#define CAPTURE_DOWNLOAD_FRAMES 4
+
+// Recent frames and held captures, see capture.h.
+capture_recorder captures;
+
+// Faults of the previous frame, to trigger only on newly raised ones.
+uint16_t capture_last_faults = 0;
+
+// Capture being downloaded, its id and the next sample to send.
+//  capture_download_slot is LINK_CAPTURE_SETUP when there's none.
+uint8_t capture_download_slot = LINK_CAPTURE_SETUP;
+uint16_t capture_download_id = 0;
+uint16_t capture_download_next = 0;
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Raw histograms
+//------------------------------------------------------------------------------
+// LINK_HIST_DATA frames sent per loop while the histograms are downloaded.
+#define HIST_DOWNLOAD_FRAMES 4
+
+// Frames a download takes, all channels' bins.
+#define HIST_DATA_FRAMES \
+  (HIST_CHANNELS * \
+    ((HIST_BINS + LINK_HIST_DATA_BINS - 1) / LINK_HIST_DATA_BINS))
+
+// Every raw reading per channel, see histogram.h. Pulse widths scale with
+//  the illumination, so only readings taken at raw_hist_step are counted,
+//  the step the histograms were last reset at.
+raw_histogram raw_hist;
+uint8_t raw_hist_step = 0;
+uint32_t raw_hist_reset_ms = 0;
+
+// Next LINK_HIST_DATA frame of a download, HIST_DATA_FRAMES when there's
+//  none. Counting pauses during one, so the host gets a single snapshot.
+uint16_t hist_download_next = HIST_DATA_FRAMES;
 //------------------------------------------------------------------------------
 
 
@@ -195,9 +491,48 @@ void setup() {
   // Start serial communication
   Serial.begin(115200);
 
+  device_id = ESP.getEfuseMac();
+  binlog_start(host_link_write_frame, esp_timer_get_time);
+  time_sync_init(clock_sync);
+  link_decoder_reset(host_link_decoder);
+  telemetry_init(host_telemetry, host_link_write_frame);
+  capture_init(captures);
+
+  pinMode(SPC_ALARM_PIN, OUTPUT);
+  digitalWrite(SPC_ALARM_PIN, LOW);
+  spc_params params;
+  spc_params_default(params);
+  spc_monitor_init(spc, params);
+
+  // color_read_calib_vals starts out as the full brightness table, the other
+  //  steps are derived from it until calibrated separately.
+  ledcSetup(ILLUM_LEDC_CHANNEL, ILLUM_PWM_HZ, ILLUM_PWM_BITS);
+  ledcAttachPin(ILLUM_LED_PIN, ILLUM_LEDC_CHANNEL);
+  illum_controller_init(illum, ILLUM_DEFAULT_MAX_PULSE_US);
+  integ_scheduler_init(integ, INTEG_FRAME_BUDGET_US);
+  class_cache_init(frame_cache);
+  hist_init(raw_hist);
+  for(uint8_t i=0; i<ILLUM_STEPS; i++)
+    illum_derive_calib(color_read_calib_vals, i, illum_calib_vals[i]);
+
+  // After a watchdog reset or deep sleep wake pick the pipeline back up from
+  //  its RTC checkpoint, skipping the boot delays so the first classified frame
+  //  goes out on the first loop.
+  bool warm_start = restore_pipeline_state();
+  apply_illumination();
+  raw_hist_step = illum.step;
+#ifdef PALETTE_RAW_MATCH
+  update_palette(PALETTE_SHORT_COLORS);
+#endif
+
+  // Sync with the host on the first loop rather than a full interval in.
+  last_sync_ms = millis() - TIME_SYNC_FAST_INTERVAL_MS;
+
   // Delay to give Serial time to boot
-  delay(500);
+  if(!warm_start)
+    delay(500);
 
+#ifndef HEADLESS
   Serial.println("Initializing OLED display...");
   // OLED Monitor bootup and failure check
   // TODO: should probably do something if this fails but it's unreportable if
@@ -205,60 +540,116 @@ void setup() {
   //  fault LED or something similar.
   if(!screen.begin(SSD1306_SWITCHCAPVCC, 0x3C)){
     Serial.println("OLED Monitor init failed...");
+    display_failed = true;
   }
 
   // Initialize the OLED monitor
   display_init();
+#endif
+
+  if(warm_start){
+    Serial.print("Warm restart #");
+    Serial.print(warm_restart_count());
+    Serial.println(", pipeline state restored.");
+  }
+#ifndef HEADLESS
+  else {
+    display_splash_screen();
+  }
+#endif
 
-  display_splash_screen();
+  // Serve the PLCs, after the restore so the bus starts out with the
+  //  calibration actually in use.
+  start_field_bus();
+
+#ifdef PROFILER
+  profiler_start(host_link_write_frame);
+#endif
 
   Serial.println("Initialization finished, starting main program loop...");
 }
 
 void loop() {
-  // Refresh the OLED display to clear old data.
-  display_refresh();
+  // Pick up any configuration the PLCs wrote since the last frame, and any
+  //  requests from the host.
+  apply_bus_config();
+  host_link_poll();
+
+  // Keep the device->host clock mapping fresh.
+  uint32_t sync_interval = 
+    clock_sync.count < TIME_SYNC_WINDOW ? 
+      TIME_SYNC_FAST_INTERVAL_MS : TIME_SYNC_SLOW_INTERVAL_MS;
+  if(millis() - last_sync_ms >= sync_interval){
+    last_sync_ms = millis();
+    time_sync_exchange();
+  }
+
+  // Device time the readings for this frame were started at.
+  int64_t frame_time_us = esp_timer_get_time();
+  frame_faults = 0;
 
   // Read the color sensor for all 4 channels.
   for(uint8_t color=0; color<3; color++){
       // Read the color.
       color_readings[color] = read_color_channel(color);
-
-      // Write the color to the OLED display.
-      write_color_to_display(color);
   }
 
-  // Update OLED display
-  screen.display();
-
-  /*
-  // Data for manual calibration setting. 
-  Serial.println("------------------------------");
-  Serial.print("R-min: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::RED][0]);
-  Serial.print(" ");
-  Serial.print("R-max: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::RED][1]);
-  Serial.println();
-
-  Serial.print("G-min: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::GREEN][0]);
-  Serial.print(" ");
-  Serial.print("G-max: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::GREEN][1]);
-  Serial.println();
-
-  Serial.print("B-min: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::BLUE][0]);
-  Serial.print(" ");
-  Serial.print("B-max: ");
-  Serial.print(color_min_max_readings[COLOR_CHANNELS::BLUE][1]);
-  Serial.println();
-  */
+#ifndef HEADLESS
+  // Show the readings on the OLED display.
+  display_frame();
+#endif
+
+  // Stream the classified frame to the host and hand it to the field bus.
+  uint8_t class_index = classify_frame();
+  if(!telemetry_active(host_telemetry))
+    send_reading_record(class_index, frame_time_us);
+  update_process_control();
+  publish_snapshot(class_index);
+  stream_telemetry(class_index, frame_time_us);
+  record_capture(class_index, frame_time_us);
+  send_hist_data();
+
+  // Pick the LED brightness, then the pulses per channel, for the next frame.
+  update_illumination();
+  plan_integration();
+
+#ifdef PALETTE_RAW_MATCH
+  // Carry the palette over to any new calibration, a chunk per frame.
+  update_palette(PALETTE_BUILD_CHUNK);
+#endif
+
+  // Save the frame's state in case the next one never finishes.
+  checkpoint_pipeline_state();
+
+#ifdef PROFILER
+  profiler_poll();
+#endif
+
+  // Data for manual calibration setting, the local extrema of the raw readings.
+  //  Built in with -DBINLOG_LEVEL=0.
+  BINLOG_DEBUG(
+    "R min %d max %d, G min %d max %d, B min %d max %d",
+    color_min_max_readings[COLOR_CHANNELS::RED][0],
+    color_min_max_readings[COLOR_CHANNELS::RED][1],
+    color_min_max_readings[COLOR_CHANNELS::GREEN][0],
+    color_min_max_readings[COLOR_CHANNELS::GREEN][1],
+    color_min_max_readings[COLOR_CHANNELS::BLUE][0],
+    color_min_max_readings[COLOR_CHANNELS::BLUE][1]
+  );
+  BINLOG_DEBUG(
+    "R p1 %d p99 %d, G p1 %d p99 %d, B p1 %d p99 %d",
+    hist_percentile(raw_hist, COLOR_CHANNELS::RED, 10),
+    hist_percentile(raw_hist, COLOR_CHANNELS::RED, 990),
+    hist_percentile(raw_hist, COLOR_CHANNELS::GREEN, 10),
+    hist_percentile(raw_hist, COLOR_CHANNELS::GREEN, 990),
+    hist_percentile(raw_hist, COLOR_CHANNELS::BLUE, 10),
+    hist_percentile(raw_hist, COLOR_CHANNELS::BLUE, 990)
+  );
 
-  delay(100);
+  delay(loop_delay_ms);
 }
 
+#ifndef HEADLESS
 // Handles any one-time OLED display initialization logic.
 void display_init(){
   screen.clearDisplay();
@@ -282,6 +673,18 @@ void display_refresh(){
   return;
 }
 
+// Draws the frame's readings over the refreshed static content and sends the
+//  framebuffer to the display.
+void display_frame(){
+  display_refresh();
+  for(uint8_t color=0; color<3; color++)
+    write_color_to_display(color);
+  screen.display();
+
+  return;
+}
+#endif
+
 // Takes a color index, mapped to enum COLOR_CHANNELS, and reads that channel,
 //  performing any sanitization and mapping, and returns that value.
 // Optional arg determines the number of readings to average together to produce
@@ -293,8 +696,39 @@ int read_color_channel(uint8_t &color_index){
   digitalWrite(S2, color_read_pin_maps[color_index][0]);
   digitalWrite(S3, color_read_pin_maps[color_index][1]);
 
-  // Read the color channel.
-  ret_val = pulseIn(color_sensor_in, LOW);
+  // Read the color channel, averaging as many pulses as the scheduler gave it.
+  uint32_t raw_variance;
+  if(color_index < INTEG_CHANNELS){
+    // Stop at the first timeout, integ_observe() reports it as one. Pulses
+    //  after the first time out after a few of its periods.
+    int pulses[INTEG_MAX_PULSES];
+    uint8_t count = integ.pulses[color_index];
+    uint8_t read = 0;
+    unsigned long timeout_us = PULSE_TIMEOUT_US;
+    delayMicroseconds(INTEG_SWITCH_US);
+    while(read < count){
+      pulses[read] = pulseIn(color_sensor_in, LOW, timeout_us);
+      if(pulses[read++] == 0)
+        break;
+      timeout_us = integ_pulse_timeout_us(pulses[0]);
+    }
+    ret_val = integ_observe(integ, color_index, pulses, read);
+    raw_variance = integ_reading_variance(integ, color_index);
+  }
+  else {
+    ret_val = pulseIn(color_sensor_in, LOW, PULSE_TIMEOUT_US);
+    raw_variance = color_raw_variance(ret_val);
+  }
+  color_raw_readings[color_index] = ret_val;
+
+  // pulseIn() returns 0 when no pulse arrived within its timeout.
+  if(ret_val == 0){
+    sensor_timeouts++;
+    frame_faults |= SENSOR_FAULT_TIMEOUT;
+    BINLOG_WARN(
+      "channel %u timed out, %u timeouts", color_index, sensor_timeouts
+    );
+  }
 
   // TODO: on the first pass this could technically update both min and max 
   //  values with the same reading. This shouldn't be an issue but if it is just
@@ -311,20 +745,36 @@ int read_color_channel(uint8_t &color_index){
     color_min_max_readings[color_index][1] = ret_val;
   }
 
-  // Map values to a typical RGB 0-255 format.
-  //  Note the reversal of min/max in the second pair of params is intentional
-  //    as the raw TCS2300 output is reversed from RGB value expectations.
-  ret_val = map(
-    ret_val,
-    color_read_calib_vals[color_index][0],
-    color_read_calib_vals[color_index][1],
-    255,
-    0
-  );
+  // And count it, for calibrating from percentiles rather than the extrema.
+  //  Timeouts are counted in sensor_timeouts instead.
+  if(
+    ret_val > 0 &&
+    illum.step == raw_hist_step &&
+    hist_download_next >= HIST_DATA_FRAMES
+  ){
+    hist_add(raw_hist, color_index, ret_val);
+  }
+
+  // Map values to a typical RGB 0-255 format, through the channel's
+  //  linearisation table at this illumination step if it has one, along with
+  //  the reading's variance.
+  const lin_table &lin = linearize_tables[illum.step][color_index];
+  if(lin.knots){
+    color_variances[color_index] =
+      raw_variance == COLOR_VAR_UNKNOWN ?
+        COLOR_VAR_UNKNOWN : lin_eval_variance(lin, ret_val, raw_variance);
+    ret_val = lin_eval(lin, ret_val);
+  }
+  else {
+    color_variances[color_index] =
+      color_calibrate_variance(raw_variance, color_index);
+    ret_val = color_calibrate_channel(ret_val, color_index);
+  }
 
   return ret_val;
 }
 
+#ifndef HEADLESS
 // Takes a color index, mapped to enum COLOR_CHANNELS, and displays that 
 //  channel's static and variable output data in the OLED display.
 void write_color_to_display(uint8_t &color_index){
@@ -361,6 +811,7 @@ void write_color_to_display(uint8_t &color_index){
 
   return;
 }
+#endif
 
 // Helper function that reads the current values in the global color reading
 //  storage array and maps them to an index that can be used to lookup the 
@@ -368,176 +819,21 @@ void write_color_to_display(uint8_t &color_index){
 // Returns the index of the closest color match, mapping to the constant display
 //  string map.
 //  Returns 255 on error.
+//  The classification itself lives in color_core so it can be shared with the
+//    host tools.
+//  The readings' variances widen the black/white radius, so dark parts whose
+//    channels are merely noisy aren't rejected as a color or undefined.
+//  With trees fitted by treefit in class_tree.h they classify instead.
 uint8_t map_color_vals(){
-  //    Testing for outliers (Grubb's test or ESD (extreme studentized deviate))
-  //      Z = ABS(mean - value) / SD  
-  //        Where SD is standard deviation(?)
-  //        Max value of Z can be computed with (N - 1) / SQR(N).
-  //          In our case of N = 3 Zmax = 1.155
-  //      SD = SQR((1 / N) * SUM((Ni - MEAN)^2))
-  //        Explained: 
-  //          Find MEAN (just an average of set N).
-  //          For each value in set N, indexed by i:
-  //            Subtract the mean, square the result.
-  //          Divide the total summation by N to get the mean of the differences
-  //          Take the square root of the result to get the standard deviation.
-
-  // +- value determining spread of values that indicate the read color is 
-  //  either black or white (closest match of the 5 alloted colors we have 
-  //  mapped).
-  // Note that this value is radial, meaning full deviation range can be twice
-  //  this value.
-  // To determine an appropriate value here we need to finalize our test samples
-  //  test each, find the smallest deviation between the RGB tests and the 
-  //  readings, i.e. for each color tested figure out what the smallest range
-  //  between the positive RGB color reading is and the negative RGB colors then
-  //  that value, minus some tolerance, is this value.
-  //  Ex. Red paper: RGB reads 255,200,200.
-  //      Grn paper: RGB reads 200,245,200.
-  //      Blu paper: RGB reads 200,200,235.
-  //        Blue's 235 is the smallest difference between the red and green for
-  //          its reading, so our b/w threshold determiner is 35.
-  uint8_t wb_deviation = 8;
-
-  // Threshold for determining whether a positive black/white reading is either
-  //  black or white.
-  //  Note that we are currently defining this as a multiplicative value for 
-  //    ease of transcription.
-  //    i.e. if each channel returns a value greater than N, where N * 3 = deter
-  //      then we assume white, else black.
-  uint16_t wb_determine = 220 * 3;
-
-  bool red_in_bw_rng = false;
-  bool grn_in_bw_rng = false;
-  bool blu_in_bw_rng = false;
-
-  // TODO: think we're currently using the mapped values for calculations here,
-  //  this shouldn't be an issue, but it can throw off some of the calibration
-  //  values we use (like wb_deviation values) when we modify the mapping HI/LOW
-  //  values. Should instead use the raw values, this however does come at the
-  //  cost of inverting the logic, since the mapping is moving the raw from
-  //  0=white to 255=white.
-
-  // Determine if each color channel's reading is within deviation range for
-  //  eiter black or white.
-  if(
-    abs(color_readings[0] - color_readings[1]) < wb_deviation &&
-    abs(color_readings[0] - color_readings[2]) < wb_deviation
-  ){
-    red_in_bw_rng = true;
-  }
-  if(
-    abs(color_readings[1] - color_readings[0]) < wb_deviation &&
-    abs(color_readings[1] - color_readings[2]) < wb_deviation
-  ){
-    grn_in_bw_rng = true;
-  }  
-  if(
-    abs(color_readings[2] - color_readings[0]) < wb_deviation &&
-    abs(color_readings[2] - color_readings[1]) < wb_deviation
-  ){
-    blu_in_bw_rng = true;
-  }
-
-  // If color is in range of black or white determine which of the two it is.
-  if(red_in_bw_rng && grn_in_bw_rng && blu_in_bw_rng){
-    if(color_readings[0] + color_readings[1] + color_readings[2] > wb_determine)
-      return COLOR_STR_MAP::WHITE_STR;
-    else
-      return COLOR_STR_MAP::BLACK_STR;
-  }
-
-  // Color readings do not indicate black or white, so we need to find which of
-  //  the other three possible colors it is.
-  //  To do so we use an outlier test, assuming a single outlier on a color
-  //    channel is the positive color. This works only with a very limited set 
-  //    of primary colors, i.e. any mixed colors will throw this off 
-  //    significantly and we'd need to go back to something like Euclidean 
-  //    distance for mapping the RGB values to strings instead.
-  double avg = (color_readings[0] + color_readings[1] + color_readings[2]) / 3;
-  double std_dev = 
-    sqrt(
-      (
-        pow(color_readings[0] - avg, 2) + 
-        pow(color_readings[1] - avg, 2) + 
-        pow(color_readings[2] - avg, 2)
-      )
-      / 3
-    );
-  
-  // Compute the actual Grubb's outlier value for each channel.
-  double red_outlier = abs(avg - color_readings[0]) / std_dev;
-  double grn_outlier = abs(avg - color_readings[1]) / std_dev;
-  double blu_outlier = abs(avg - color_readings[2]) / std_dev;   
-
-  // Return the highest outlier found as the color mapping.
-  // Nested if statement checks for the edge case where the outlier is in the
-  //  negative direction (i.e. below the other two readings). This doesn't
-  //  indicate a positive for that color but rather a negative for any color we
-  //  have mapped, so we return the undefined condition signifier.
-  if(red_outlier > grn_outlier && red_outlier > blu_outlier){
-    if(color_readings[0] < color_readings[1] || 
-       color_readings[0] < color_readings[1])
-        return COLOR_STR_MAP::UNDEF_STR;
-    else
-      return COLOR_STR_MAP::RED_STR;
-  }
-
-  if(grn_outlier > red_outlier && grn_outlier > blu_outlier){
-    if(color_readings[1] < color_readings[0] || 
-       color_readings[1] < color_readings[2])
-        return COLOR_STR_MAP::UNDEF_STR;
-    else
-      return COLOR_STR_MAP::GREEN_STR;
-  }
-
-  if(blu_outlier > red_outlier && blu_outlier > grn_outlier){
-    if(color_readings[2] < color_readings[0] || 
-       color_readings[2] < color_readings[1])
-        return COLOR_STR_MAP::UNDEF_STR;
-    else
-      return COLOR_STR_MAP::BLUE_STR;
-  }
-
-  // 255 is color mapping error code, if we reach this we haven't 
-  //  deterministically found a string to map the read in color to and couldn't
-  //  determine that the color was just undefined.
-  //  Note that with how simplistically we're determining color mappings here 
-  //    hitting this condition isn't atypical, just not ideal.
-  return 255;
-
-  /*
-  // Method using the Euclidean distance formula.
-  //  This method is much more verbose, but also much more dependent on clean
-  //    input data, so it didn't work well.
-  //  Keeping it here as a reference if any future development tries to take 
-  //    this further.
-  //    Math.sqrt(
-  //            Math.pow(targetRgb[0] - reading[0], 2) +
-  //            Math.pow(targetRgb[1] - reading[1], 2) +
-  //            Math.pow(targetRgb[2] - reading[2], 2)
-
-  double min_dist = 99999;
-  uint8_t min_dist_index = 255;
-
-  for(uint8_t i=0; i<RGB_VAL_MAPPING_LEN; i++){
-    // Using Euclidean distance formula to find closest color match.
-    double dist = sqrt(
-      pow(RGB_VALS[i][0] - color_readings[0], 2) + 
-      pow(RGB_VALS[i][1] - color_readings[1], 2) + 
-      pow(RGB_VALS[i][2] - color_readings[2], 2)
-    );
-
-    if(dist < min_dist){
-      min_dist = dist;
-      min_dist_index = i;
-    }
-  }
-
-  return min_dist_index;
-  */
+#if CLASS_TREES
+  uint8_t confidence;
+  return class_tree_classify(color_readings, &confidence);
+#else
+  return color_classify_noisy(color_readings, color_variances);
+#endif
 }
 
+#ifndef HEADLESS
 // Helper function for displaying the boot-up splash screen.
 void display_splash_screen(){
   // Delay, in ms, between each . displayed during the "Initializing..." display
@@ -577,4 +873,827 @@ void display_splash_screen(){
   delay(500);
 
   return;
-}
\ No newline at end of file
+}
+#endif
+// Frames and writes a single message to the host over Serial.
+void host_link_write_frame(uint8_t type, const uint8_t *payload, uint8_t len){
+  uint8_t frame[LINK_MAX_FRAME];
+  size_t frame_len = link_encode(type, payload, len, frame);
+
+  Serial.write(frame, frame_len);
+
+  return;
+}
+
+// Runs one NTP style clock sync exchange with the host.
+//  Sends our current time, then polls for the host's response for up to
+//    TIME_SYNC_TIMEOUT_MS. On success the exchange is fed to the estimator and
+//    the updated estimate is reported back so the host can track this head.
+//  Anything else the host sends in the meantime is handled as host_link_poll()
+//    would.
+void time_sync_exchange(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_sync_req req;
+  req.t1 = esp_timer_get_time();
+  host_link_write_frame(
+    LINK_SYNC_REQ, 
+    payload, 
+    link_pack_sync_req(req, payload)
+  );
+
+  uint32_t start_ms = millis();
+  while(millis() - start_ms < TIME_SYNC_TIMEOUT_MS){
+    if(!Serial.available())
+      continue;
+
+    if(!link_decode_byte(host_link_decoder, Serial.read()))
+      continue;
+
+    // Timestamp as soon as the frame completes.
+    int64_t t4 = esp_timer_get_time();
+
+    link_sync_resp resp;
+    if(
+      host_link_decoder.type != LINK_SYNC_RESP ||
+      !link_unpack_sync_resp(
+        host_link_decoder.payload, 
+        host_link_decoder.len, 
+        resp
+      ) ||
+      resp.t1 != req.t1
+    ){
+      handle_host_frame();
+      continue;
+    }
+
+    if(!time_sync_add_exchange(clock_sync, resp.t1, resp.t2, resp.t3, t4))
+      return;
+
+    link_sync_status status;
+    status.device_id = device_id;
+    status.device_time_us = clock_sync.ref_local_us;
+    status.offset_us = clock_sync.ref_offset_us;
+    status.drift_ppb = clock_sync.drift_ppb;
+    status.uncertainty_us = clock_sync.ref_uncertainty_us;
+    status.samples = clock_sync.fit_samples;
+    status.rtt_us = 
+      clock_sync.best_rtt_us > 0xFFFF ? 0xFFFF : clock_sync.best_rtt_us;
+    host_link_write_frame(
+      LINK_SYNC_STATUS, 
+      payload, 
+      link_pack_sync_status(status, payload)
+    );
+
+    return;
+  }
+
+  return;
+}
+
+// Handles whatever the host sent since the last frame.
+void host_link_poll(){
+  while(Serial.available()){
+    if(link_decode_byte(host_link_decoder, Serial.read()))
+      handle_host_frame();
+  }
+
+  return;
+}
+
+// Acts on a frame from the host, other than the sync responses
+//  time_sync_exchange() waits for. Stray responses are ignored.
+void handle_host_frame(){
+  if(host_link_decoder.type == LINK_SUBSCRIBE)
+    handle_subscribe();
+  else if(host_link_decoder.type == LINK_CAPTURE_CMD)
+    handle_capture_cmd();
+  else if(host_link_decoder.type == LINK_HIST_CMD)
+    handle_hist_cmd();
+
+  return;
+}
+
+// Applies a telemetry subscription and acknowledges it.
+void handle_subscribe(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_subscribe req;
+  if(
+    !link_unpack_subscribe(
+      host_link_decoder.payload,
+      host_link_decoder.len,
+      req
+    )
+  ){
+    return;
+  }
+
+  link_subscribe_ack ack;
+  ack.sub = req.sub;
+  ack.status = telemetry_subscribe(host_telemetry, req, millis());
+  host_link_write_frame(
+    LINK_SUBSCRIBE_ACK,
+    payload,
+    link_pack_subscribe_ack(ack, payload)
+  );
+
+  return;
+}
+
+// Adds the frame to the telemetry ring and sends the subscribed records due.
+//  After publish_snapshot(), so the frame's faults are complete.
+void stream_telemetry(uint8_t class_index, int64_t read_time_us){
+  telemetry_sample sample;
+  sample.device_time_us = read_time_us;
+  for(uint8_t i=0; i<4; i++){
+    sample.values[TELEMETRY_FIELD_RAW + i] =
+      color_raw_readings[i] > 0xFFFF ? 0xFFFF : color_raw_readings[i];
+    sample.values[TELEMETRY_FIELD_MAPPED + i] = color_readings[i];
+  }
+  sample.values[TELEMETRY_FIELD_CLASS] = class_index;
+  sample.values[TELEMETRY_FIELD_CONFIDENCE] = frame_confidence;
+  sample.values[TELEMETRY_FIELD_PALETTE] = palette_index;
+  sample.values[TELEMETRY_FIELD_FAULTS] = frame_faults;
+  sample.values[TELEMETRY_FIELD_ILLUM_STEP] = illum.step;
+
+  telemetry_push(host_telemetry, sample);
+  telemetry_poll(host_telemetry, millis());
+
+  return;
+}
+
+// Carries out a capture command from the host. Commands for slots not held
+//  are ignored, a LIST shows the host what is.
+void handle_capture_cmd(){
+  link_capture_cmd cmd;
+  if(
+    !link_unpack_capture_cmd(
+      host_link_decoder.payload,
+      host_link_decoder.len,
+      cmd
+    )
+  ){
+    return;
+  }
+
+  switch(cmd.op){
+    case LINK_CAPTURE_CONFIGURE:
+      // The setup report tells the host whether it was applied.
+      capture_configure(captures, cmd.pre, cmd.post, cmd.causes);
+      // Fall through.
+    case LINK_CAPTURE_LIST:
+      send_capture_info(LINK_CAPTURE_SETUP);
+      for(uint8_t i=0; i<CAPTURE_SEGMENTS; i++){
+        if(capture_held(captures, i))
+          send_capture_info(i);
+      }
+      break;
+
+    case LINK_CAPTURE_TRIGGER:
+      capture_trigger(captures, CAPTURE_CAUSE_COMMAND);
+      break;
+
+    case LINK_CAPTURE_READ:
+      if(capture_held(captures, cmd.slot)){
+        capture_download_slot = cmd.slot;
+        capture_download_id = captures.slots[cmd.slot].id;
+        capture_download_next = 0;
+      }
+      break;
+
+    case LINK_CAPTURE_RELEASE:
+      if(!capture_release(captures, cmd.slot))
+        break;
+      if(cmd.slot == capture_download_slot)
+        capture_download_slot = LINK_CAPTURE_SETUP;
+      break;
+  }
+
+  return;
+}
+
+// Sends the current frame's readings and classification to the host, stamped
+//  in host time.
+void send_reading_record(uint8_t class_index, int64_t read_time_us){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_reading rec;
+  rec.seq = reading_seq++;
+  rec.flags = clock_sync.valid ? LINK_READING_FLAG_SYNCED : 0;
+  rec.flags |= illum.step << LINK_READING_ILLUM_SHIFT;
+  rec.class_index = class_index;
+  rec.host_time_us = 
+    time_sync_to_host(clock_sync, read_time_us, &rec.uncertainty_us);
+  for(uint8_t i=0; i<4; i++){
+    // Raw pulse widths are saturated, a timed out pulseIn() reads as 0 anyway.
+    rec.raw[i] = 
+      color_raw_readings[i] > 0xFFFF ? 0xFFFF : color_raw_readings[i];
+    rec.mapped[i] = color_readings[i];
+  }
+
+  host_link_write_frame(
+    LINK_READING, 
+    payload, 
+    link_pack_reading(rec, payload)
+  );
+
+  return;
+}
+
+// Records the frame's raw readings into the capture history, triggers on new
+//  process control alarms and faults, and sends the host what it's owed.
+//  After publish_snapshot(), so the frame's faults are complete.
+void record_capture(uint8_t class_index, int64_t read_time_us){
+  // Written in place, in the live segment of the history.
+  capture_sample &sample = capture_next(captures);
+  sample.device_time_us = read_time_us;
+  sample.frame = frame_count - 1;
+  for(uint8_t i=0; i<4; i++){
+    sample.raw[i] =
+      color_raw_readings[i] > 0xFFFF ? 0xFFFF : color_raw_readings[i];
+  }
+  sample.faults = frame_faults;
+  sample.class_index = class_index;
+  capture_commit(captures);
+
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    if(spc_frame_alarms[i] & ~spc_last_alarms[i]){
+      capture_trigger(captures, CAPTURE_CAUSE_SPC);
+      break;
+    }
+  }
+  if(frame_faults & ~capture_last_faults & CAPTURE_FAULT_TRIGGERS)
+    capture_trigger(captures, CAPTURE_CAUSE_FAULT);
+  capture_last_faults = frame_faults;
+
+  int slot = capture_completed(captures);
+  if(slot >= 0)
+    send_capture_info(slot);
+  send_capture_data();
+
+  return;
+}
+
+// Sends a held capture's details, or the setup for LINK_CAPTURE_SETUP.
+void send_capture_info(uint8_t slot){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_capture_info info;
+  info.slot = slot;
+  info.captures = captures.captures;
+  info.missed = captures.missed;
+
+  const capture_slot *held = capture_held(captures, slot);
+  if(held){
+    const capture_sample &trigger = capture_at(captures, slot, held->pre);
+    info.id = held->id;
+    info.causes = held->causes;
+    info.pre = held->pre;
+    info.post = held->post;
+    info.trigger_frame = trigger.frame;
+    info.trigger_time_us = trigger.device_time_us;
+  }
+  else {
+    info.id = captures.next_id;
+    info.causes = captures.causes;
+    info.pre = captures.pre;
+    info.post = captures.post;
+    info.trigger_frame = 0;
+    info.trigger_time_us = 0;
+  }
+
+  host_link_write_frame(
+    LINK_CAPTURE_INFO,
+    payload,
+    link_pack_capture_info(info, payload)
+  );
+
+  return;
+}
+
+// Sends the next few frames of the capture being downloaded.
+void send_capture_data(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  const capture_slot *held = capture_held(captures, capture_download_slot);
+  if(!held || held->id != capture_download_id){
+    capture_download_slot = LINK_CAPTURE_SETUP;
+    return;
+  }
+
+  const capture_sample &trigger =
+    capture_at(captures, capture_download_slot, held->pre);
+  uint16_t length = capture_length(*held);
+  for(uint8_t f=0; f<CAPTURE_DOWNLOAD_FRAMES; f++){
+    link_capture_data msg;
+    msg.slot = capture_download_slot;
+    msg.id = held->id;
+    msg.first = capture_download_next;
+    msg.count = 0;
+    while(
+      msg.count < LINK_CAPTURE_DATA_SAMPLES &&
+      capture_download_next < length
+    ){
+      const capture_sample &sample =
+        capture_at(captures, capture_download_slot, capture_download_next++);
+      link_capture_sample &out = msg.samples[msg.count++];
+      out.offset_us = sample.device_time_us - trigger.device_time_us;
+      memcpy(out.raw, sample.raw, sizeof(out.raw));
+      out.faults = sample.faults;
+      out.class_index = sample.class_index;
+    }
+
+    host_link_write_frame(
+      LINK_CAPTURE_DATA,
+      payload,
+      link_pack_capture_data(msg, payload)
+    );
+
+    if(capture_download_next >= length){
+      capture_download_slot = LINK_CAPTURE_SETUP;
+      break;
+    }
+  }
+
+  return;
+}
+
+// Carries out a raw histogram command from the host. A configuration the
+//  histograms can't take is reported unchanged.
+void handle_hist_cmd(){
+  link_hist_cmd cmd;
+  if(
+    !link_unpack_hist_cmd(
+      host_link_decoder.payload,
+      host_link_decoder.len,
+      cmd
+    )
+  ){
+    return;
+  }
+
+  switch(cmd.op){
+    case LINK_HIST_CONFIGURE:
+      if(hist_configure(raw_hist, cmd.scale, cmd.lo, cmd.shift)){
+        raw_hist_step = illum.step;
+        raw_hist_reset_ms = millis();
+        hist_download_next = HIST_DATA_FRAMES;
+      }
+      send_hist_info();
+      break;
+
+    case LINK_HIST_RESET:
+      hist_reset(raw_hist);
+      raw_hist_step = illum.step;
+      raw_hist_reset_ms = millis();
+      hist_download_next = HIST_DATA_FRAMES;
+      break;
+
+    case LINK_HIST_READ:
+      send_hist_info();
+      hist_download_next = 0;
+      break;
+  }
+
+  return;
+}
+
+// Sends the histograms' setup and per channel totals.
+void send_hist_info(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+
+  link_hist_info info;
+  info.step = raw_hist_step;
+  info.scale = raw_hist.scale;
+  info.shift = raw_hist.shift;
+  info.lo = raw_hist.lo;
+  info.bins = HIST_BINS;
+  info.age_ms = millis() - raw_hist_reset_ms;
+  for(uint8_t i=0; i<HIST_CHANNELS; i++)
+    info.samples[i] = raw_hist.samples[i];
+
+  host_link_write_frame(
+    LINK_HIST_INFO,
+    payload,
+    link_pack_hist_info(info, payload)
+  );
+
+  return;
+}
+
+// Sends the next few frames of bin counts while a download is under way.
+void send_hist_data(){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  const uint16_t frames_per_channel = HIST_DATA_FRAMES / HIST_CHANNELS;
+
+  for(
+    uint8_t f=0;
+    f<HIST_DOWNLOAD_FRAMES && hist_download_next < HIST_DATA_FRAMES;
+    f++
+  ){
+    link_hist_data msg;
+    msg.channel = hist_download_next / frames_per_channel;
+    msg.first =
+      (hist_download_next % frames_per_channel) * LINK_HIST_DATA_BINS;
+    msg.count = 0;
+    while(
+      msg.count < LINK_HIST_DATA_BINS &&
+      msg.first + msg.count < HIST_BINS
+    ){
+      msg.counts[msg.count] =
+        raw_hist.counts[msg.channel][msg.first + msg.count];
+      msg.count++;
+    }
+    hist_download_next++;
+
+    host_link_write_frame(
+      LINK_HIST_DATA,
+      payload,
+      link_pack_hist_data(msg, payload)
+    );
+  }
+
+  return;
+}
+
+// Restores the pipeline from the RTC checkpoint, if the last reset kept one.
+// Returns true on a warm start.
+bool restore_pipeline_state(){
+  warm_restart_state state;
+  if(!warm_restart_restore(state))
+    return false;
+
+  reading_seq = state.reading_seq;
+  memcpy(
+    color_min_max_readings, 
+    state.color_min_max_readings, 
+    sizeof(color_min_max_readings)
+  );
+  memcpy(illum_calib_vals, state.illum_calib_vals, sizeof(illum_calib_vals));
+  illum = state.illum;
+  integ = state.integ;
+  loop_delay_ms = state.loop_delay_ms;
+  can_config = state.can_config;
+  frame_count = state.frame_count;
+  spc = state.spc;
+  spc_generation = state.spc_generation;
+  if(state.drift_valid){
+    time_sync_seed_drift(
+      clock_sync, 
+      state.drift_ppb, 
+      state.drift_uncertainty_ppb
+    );
+  }
+
+  return true;
+}
+
+// Snapshots the pipeline state into RTC memory.
+void checkpoint_pipeline_state(){
+  warm_restart_state state;
+
+  state.reading_seq = reading_seq;
+  memcpy(
+    state.color_min_max_readings, 
+    color_min_max_readings, 
+    sizeof(color_min_max_readings)
+  );
+  memcpy(state.illum_calib_vals, illum_calib_vals, sizeof(illum_calib_vals));
+  state.illum = illum;
+  state.integ = integ;
+  state.loop_delay_ms = loop_delay_ms;
+  state.can_config = can_config;
+  state.frame_count = frame_count;
+  state.spc = spc;
+  state.spc_generation = spc_generation;
+
+  // Carry the best drift estimate available, the fitted one once there is a
+  //  fit, otherwise whatever was seeded from the previous checkpoint.
+  if(clock_sync.valid){
+    state.drift_ppb = clock_sync.drift_ppb;
+    state.drift_uncertainty_ppb = clock_sync.drift_uncertainty_ppb;
+  }
+  else {
+    state.drift_ppb = clock_sync.seed_drift_ppb;
+    state.drift_uncertainty_ppb = clock_sync.seed_drift_uncertainty_ppb;
+  }
+  state.drift_valid = 
+    state.drift_uncertainty_ppb < TIME_SYNC_DEFAULT_DRIFT_UNC_PPB;
+
+  warm_restart_checkpoint(state);
+
+  return;
+}
+
+// Publishes the current configuration and starts the field bus servers.
+void start_field_bus(){
+  sensor_config config;
+  for(uint8_t step=0; step<ILLUM_STEPS; step++){
+    for(uint8_t i=0; i<4; i++){
+      config.calib[step][i][0] = illum_calib_vals[step][i][0];
+      config.calib[step][i][1] = illum_calib_vals[step][i][1];
+    }
+  }
+  config.loop_delay_ms = loop_delay_ms;
+  config.spc_generation = spc_generation;
+  config.illum_mode = illum.automatic ? 0 : illum.step + 1;
+  config.calib_bank = 0;
+  config.can_cyclic_id = can_config.cyclic_id;
+  config.can_event_id = can_config.event_id;
+  config.can_period_ms = can_config.period_ms;
+  config.can_inhibit_ms = can_config.inhibit_ms;
+
+  sensor_snapshot_channel_init(bus_snapshots);
+  sensor_config_channel_init(bus_config, config);
+  bus_config_seq = 0;
+
+  modbus_server_start(bus_snapshots, bus_config);
+#ifdef I2C_PERIPHERAL_ADDR
+  i2c_server_start(bus_snapshots);
+#endif
+#ifdef CAN_OUTPUT_BITRATE
+  can_server_start(bus_snapshots, bus_config);
+#endif
+
+  return;
+}
+
+// Applies the bus configuration if a master changed it since the last frame.
+//  A copy that races a write is simply picked up on the next loop.
+void apply_bus_config(){
+  sensor_config config;
+  uint32_t seq;
+  if(!sensor_config_read(bus_config, config, &seq, 1) || seq == bus_config_seq)
+    return;
+
+  bus_config_seq = seq;
+  for(uint8_t step=0; step<ILLUM_STEPS; step++){
+    for(uint8_t i=0; i<4; i++){
+      illum_calib_vals[step][i][0] = config.calib[step][i][0];
+      illum_calib_vals[step][i][1] = config.calib[step][i][1];
+    }
+  }
+  illum_set_mode(illum, config.illum_mode == 0, config.illum_mode - 1);
+  apply_illumination();
+  loop_delay_ms = config.loop_delay_ms;
+  can_config.cyclic_id = config.can_cyclic_id;
+  can_config.event_id = config.can_event_id;
+  can_config.period_ms = config.can_period_ms;
+  can_config.inhibit_ms = config.can_inhibit_ms;
+  if(config.spc_generation != spc_generation){
+    spc_generation = config.spc_generation;
+    spc_monitor_relearn(spc);
+  }
+
+  return;
+}
+
+// Hands this frame's results to the field bus servers.
+void publish_snapshot(uint8_t class_index){
+  sensor_snapshot snap;
+
+  if(class_index == COLOR_MAP_ERR){
+    map_errors++;
+    frame_faults |= SENSOR_FAULT_MAP_ERR;
+  }
+  if(!clock_sync.valid)
+    frame_faults |= SENSOR_FAULT_UNSYNCED;
+  if(display_failed)
+    frame_faults |= SENSOR_FAULT_DISPLAY;
+  if(spc_alarm_hold)
+    frame_faults |= SENSOR_FAULT_SPC;
+
+  snap.frame = frame_count++;
+  for(uint8_t i=0; i<4; i++){
+    snap.raw[i] =
+      color_raw_readings[i] > 0xFFFF ? 0xFFFF : color_raw_readings[i];
+    snap.mapped[i] = color_readings[i];
+  }
+  snap.class_index = class_index;
+  snap.confidence = frame_confidence;
+  snap.faults = frame_faults;
+  snap.sensor_timeouts = sensor_timeouts;
+  snap.map_errors = map_errors;
+  snap.warm_restarts = warm_restart_count();
+  snap.uptime_s = millis() / 1000;
+  snap.spc_armed = spc_monitor_armed(spc);
+  snap.spc_alarm_events = 0;
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    snap.spc_alarms[i] = spc_frame_alarms[i];
+    snap.spc_alarm_events += spc.channels[i].alarm_events;
+  }
+  snap.illum_step = illum.step;
+  snap.illum_duty = illum_step_duty[illum.step];
+  snap.illum_settled_frames = illum.settled_frames;
+  snap.palette_index = palette_index;
+  snap.class_cache_hits = frame_cache.hits;
+  snap.class_cache_misses = frame_cache.misses;
+
+  sensor_snapshot_publish(bus_snapshots, snap);
+
+  return;
+}
+
+// Runs the frame through the process control charts, drives the alarm output
+//  and reports new alarms to the host.
+void update_process_control(){
+  memcpy(spc_last_alarms, spc_frame_alarms, sizeof(spc_last_alarms));
+
+  // A timed out channel says nothing about the process, leave it out rather
+  //  than let it skew the baseline or trip the charts.
+  uint8_t alarms = 0;
+  if(frame_faults & SENSOR_FAULT_TIMEOUT){
+    memset(spc_frame_alarms, 0, sizeof(spc_frame_alarms));
+  }
+  else {
+    alarms = spc_monitor_update(spc, color_readings);
+    for(uint8_t i=0; i<SPC_CHANNELS; i++)
+      spc_frame_alarms[i] = spc.channels[i].alarms;
+  }
+
+  if(alarms)
+    spc_alarm_hold = SPC_ALARM_HOLD_FRAMES;
+  else if(spc_alarm_hold)
+    spc_alarm_hold--;
+  digitalWrite(SPC_ALARM_PIN, spc_alarm_hold ? HIGH : LOW);
+
+  for(uint8_t i=0; i<SPC_CHANNELS; i++){
+    if(spc_frame_alarms[i] & ~spc_last_alarms[i])
+      send_spc_alarm(i);
+  }
+
+  return;
+}
+
+// Sends a chart channel's alarm and statistics to the host, tagged with the
+//  frame, before publish_snapshot() counts it.
+void send_spc_alarm(uint8_t channel){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  const spc_channel &ch = spc.channels[channel];
+
+  link_spc_alarm msg;
+  msg.frame = frame_count;
+  msg.channel = channel;
+  msg.alarms = ch.alarms;
+  msg.mean = ch.mean;
+  msg.sigma = ch.sigma;
+  msg.ewma = ch.ewma;
+  msg.cusum_high = ch.cusum_high;
+  msg.cusum_low = ch.cusum_low;
+  msg.xbar = ch.xbar;
+  msg.range = ch.range;
+
+  host_link_write_frame(
+    LINK_SPC_ALARM,
+    payload,
+    link_pack_spc_alarm(msg, payload)
+  );
+
+  return;
+}
+
+// Drives the LEDs at the current illumination step and switches to its
+//  calibration table.
+void apply_illumination(){
+  ledcWrite(ILLUM_LEDC_CHANNEL, illum_step_duty[illum.step]);
+  memcpy(
+    color_read_calib_vals,
+    illum_calib_vals[illum.step],
+    sizeof(color_read_calib_vals)
+  );
+  calib_generation++;
+  class_cache_invalidate(frame_cache);
+
+  return;
+}
+
+// Runs the brightness loop on this frame's raw readings, the step it picks
+//  applies from the next frame on. The scheduler's expected pulse widths
+//  follow the change of LED duty.
+void update_illumination(){
+  uint8_t step = illum.step;
+  if(illum_update(illum, color_raw_readings) != step){
+    BINLOG_INFO("illumination step %u -> %u", step, illum.step);
+    apply_illumination();
+    integ_scale_pulses(
+      integ,
+      illum_step_duty[step],
+      illum_step_duty[illum.step]
+    );
+  }
+
+  return;
+}
+
+// Splits the next frame's read time across the channels so their calibrated
+//  readings come out about equally noisy, see integration.h.
+//  Each channel's noise is weighed by the squared slope of its calibration, or
+//    linearisation table, at its last reading.
+void plan_integration(){
+  uint32_t gain[INTEG_CHANNELS];
+  for(uint8_t i=0; i<INTEG_CHANNELS; i++){
+    const lin_table &lin = linearize_tables[illum.step][i];
+    if(lin.knots)
+      gain[i] = lin_eval_variance(lin, integ.pulse_us[i], 1UL << 16);
+    else
+      gain[i] = color_calibrate_variance(1UL << 16, i);
+  }
+  integ_plan(integ, gain);
+
+  return;
+}
+
+#ifdef PALETTE_RAW_MATCH
+// Keeps the raw space palette in step with the calibration.
+//  A calibration change starts a rebuild into the spare buffer, converting up
+//    to max_colors colors per call. Once complete it replaces the active
+//    palette with a single pointer store, so a frame is never matched against
+//    a half converted palette. A change part way through starts over.
+//  Frames keep matching against the old calibration's palette until then,
+//    which for colors_short.csv is never more than the next frame.
+void update_palette(uint16_t max_colors){
+  if(palette_building && palette_building_generation != calib_generation)
+    palette_building = NULL;
+
+  if(!palette_building){
+    if(palette_active && palette_active_generation == calib_generation)
+      return;
+
+    uint8_t buf = palette_active == &palette_raw_bufs[0] ? 1 : 0;
+    palette_building = &palette_raw_bufs[buf];
+    palette_building_generation = calib_generation;
+    palette_raw_begin(
+      *palette_building,
+      palette_short,
+      palette_raw_colors[buf],
+      color_read_calib_vals,
+      linearize_tables[illum.step]
+    );
+  }
+
+  if(!palette_raw_build(*palette_building, max_colors))
+    return;
+
+  palette_active = palette_building;
+  palette_active_generation = palette_building_generation;
+  palette_building = NULL;
+  class_cache_invalidate(frame_cache);
+
+  return;
+}
+
+#endif
+
+// Nearest palette color to the frame.
+//  The classifier and SPC need the calibrated readings anyway, so by default
+//    they're matched with palette_match(), on the same integer readings the
+//    class comes from. -DPALETTE_RAW_MATCH (the featheresp32_palette_raw
+//    env) matches the raw pulse widths against a raw space copy of the
+//    palette instead. That saves nothing while frames are calibrated
+//    regardless, and its multiply per channel per color ran at 0.73-0.79x
+//    the calibrated match in palbench: profile both on the head (-DPROFILER)
+//    before deploying it.
+//  Returns PALETTE_NO_MATCH if a channel timed out.
+uint16_t match_palette(){
+  for(uint8_t i=0; i<3; i++){
+    if(color_raw_readings[i] <= 0)
+      return PALETTE_NO_MATCH;
+  }
+
+#ifdef PALETTE_RAW_MATCH
+  return palette_raw_match(*palette_active, color_raw_readings, NULL);
+#else
+  return palette_match(palette_short, color_readings, NULL);
+#endif
+}
+
+// Classifies the frame, its confidence and nearest palette color, from the
+//  cache when a frame like it was classified since the last calibration or
+//  palette change. Timed out frames are always classified afresh.
+//  Returns the class index, as map_color_vals().
+uint8_t classify_frame(){
+  uint32_t key = class_cache_key(color_raw_readings, color_variances);
+  class_cache_value result;
+  if(key == CLASS_CACHE_NO_KEY || !class_cache_get(frame_cache, key, result)){
+#if CLASS_TREES
+    result.class_index =
+      class_tree_classify(color_readings, &result.confidence);
+#else
+    result.class_index = map_color_vals();
+    result.confidence = color_classify_confidence_noisy(
+      color_readings,
+      color_variances,
+      result.class_index
+    );
+#endif
+    result.palette_index = match_palette();
+    if(key != CLASS_CACHE_NO_KEY)
+      class_cache_put(frame_cache, key, result);
+  }
+
+  frame_confidence = result.confidence;
+  palette_index = result.palette_index;
+
+  return result.class_index;
+}
@@ -0,0 +1,287 @@
+#include <Arduino.h>
+
+#include "modbus_server.h"
+#include "modbus_slave.h"
+#include "sensor_registers.h"
+
+#ifdef MODBUS_WIFI_SSID
+#include <WiFi.h>
+#endif
+
+// Unit id answered on the RTU bus.
+#ifndef MODBUS_UNIT_ID
+#define MODBUS_UNIT_ID 1
+#endif
+
+// RS-485 transceiver wiring, Serial2 on the Feather's RX/TX pins with the
+//  driver enable on a spare GPIO.
+#define MODBUS_RTU_BAUD 19200
+#define MODBUS_RTU_RX_PIN 16
+#define MODBUS_RTU_TX_PIN 17
+#define MODBUS_RTU_DE_PIN 21
+
+#define MODBUS_TCP_PORT 502
+#define MODBUS_TCP_MAX_CLIENTS 4
+
+// Attempts at copying a consistent snapshot before answering busy.
+#define MODBUS_SNAPSHOT_TRIES 4
+
+// loop() runs on core 1, keep the bus off it.
+#define MODBUS_TASK_CORE 0
+#define MODBUS_TASK_STACK 4096
+#define MODBUS_TASK_PRIORITY 1
+
+struct modbus_server_state {
+  sensor_snapshot_channel *snapshots;
+  sensor_config_channel *config_chan;
+
+  // Working copy of the configuration, owned by the server task. The config
+  //  channel only ever carries complete, validated configurations.
+  sensor_config config;
+
+  modbus_slave slave;
+
+  // RTU receive buffer and the micros() of its last byte.
+  uint8_t rtu_buf[MODBUS_RTU_MAX_ADU];
+  uint16_t rtu_len;
+  uint32_t rtu_last_us;
+  uint32_t rtu_gap_us;
+  bool rtu_overflow;
+
+#ifdef MODBUS_WIFI_SSID
+  WiFiClient clients[MODBUS_TCP_MAX_CLIENTS];
+  uint8_t tcp_buf[MODBUS_TCP_MAX_CLIENTS][MODBUS_TCP_MAX_ADU];
+  uint16_t tcp_len[MODBUS_TCP_MAX_CLIENTS];
+#endif
+};
+
+modbus_server_state modbus_server;
+
+#ifdef MODBUS_WIFI_SSID
+WiFiServer modbus_tcp_listener(MODBUS_TCP_PORT);
+#endif
+
+static uint8_t modbus_server_error(uint8_t result){
+  if(result == SENSOR_REG_BAD_ADDRESS)
+    return MODBUS_EX_ILLEGAL_ADDRESS;
+  if(result == SENSOR_REG_BAD_VALUE)
+    return MODBUS_EX_ILLEGAL_VALUE;
+
+  return MODBUS_EX_NONE;
+}
+
+static uint8_t modbus_server_read_input(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  modbus_server_state &server = *(modbus_server_state *)ctx;
+
+  sensor_snapshot snap;
+  if(!sensor_snapshot_read(*server.snapshots, snap, MODBUS_SNAPSHOT_TRIES))
+    return MODBUS_EX_DEVICE_BUSY;
+
+  return modbus_server_error(
+    sensor_registers_read_input(snap, start, count, out)
+  );
+}
+
+static uint8_t modbus_server_read_holding(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  modbus_server_state &server = *(modbus_server_state *)ctx;
+
+  return modbus_server_error(
+    sensor_registers_read_holding(server.config, start, count, out)
+  );
+}
+
+static uint8_t modbus_server_write_holding(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+){
+  modbus_server_state &server = *(modbus_server_state *)ctx;
+
+  uint8_t result =
+    sensor_registers_write_holding(server.config, start, count, values);
+  if(result == SENSOR_REG_OK)
+    sensor_config_publish(*server.config_chan, server.config);
+
+  return modbus_server_error(result);
+}
+
+// Collects RTU bytes and handles the frame once the line has gone quiet.
+static void modbus_server_poll_rtu(modbus_server_state &server){
+  while(Serial2.available()){
+    uint8_t byte_in = Serial2.read();
+    if(server.rtu_len < MODBUS_RTU_MAX_ADU)
+      server.rtu_buf[server.rtu_len++] = byte_in;
+    else
+      server.rtu_overflow = true;
+    server.rtu_last_us = micros();
+  }
+
+  if(server.rtu_len == 0 ||
+     micros() - server.rtu_last_us < server.rtu_gap_us){
+    return;
+  }
+
+  // An overlong frame is noise or a collision, drop it whole.
+  if(!server.rtu_overflow){
+    uint8_t resp[MODBUS_RTU_MAX_ADU];
+    uint16_t resp_len = modbus_rtu_process(
+      server.slave, server.rtu_buf, server.rtu_len, resp
+    );
+    if(resp_len){
+      digitalWrite(MODBUS_RTU_DE_PIN, HIGH);
+      Serial2.write(resp, resp_len);
+      // Wait for the last stop bit before releasing the bus.
+      Serial2.flush();
+      digitalWrite(MODBUS_RTU_DE_PIN, LOW);
+    }
+  }
+
+  server.rtu_len = 0;
+  server.rtu_overflow = false;
+
+  return;
+}
+
+#ifdef MODBUS_WIFI_SSID
+// Accepts new connections and handles every complete ADU received.
+static void modbus_server_poll_tcp(modbus_server_state &server){
+  if(WiFi.status() != WL_CONNECTED)
+    return;
+
+  if(modbus_tcp_listener.hasClient()){
+    WiFiClient client = modbus_tcp_listener.accept();
+    bool placed = false;
+    for(uint8_t i=0; i<MODBUS_TCP_MAX_CLIENTS && !placed; i++){
+      if(server.clients[i].connected())
+        continue;
+      server.clients[i] = client;
+      server.clients[i].setNoDelay(true);
+      server.tcp_len[i] = 0;
+      placed = true;
+    }
+    if(!placed)
+      client.stop();
+  }
+
+  for(uint8_t i=0; i<MODBUS_TCP_MAX_CLIENTS; i++){
+    WiFiClient &client = server.clients[i];
+    if(!client.connected())
+      continue;
+
+    while(client.available() && server.tcp_len[i] < MODBUS_TCP_MAX_ADU){
+      int got = client.read(
+        server.tcp_buf[i] + server.tcp_len[i],
+        MODBUS_TCP_MAX_ADU - server.tcp_len[i]
+      );
+      if(got <= 0)
+        break;
+      server.tcp_len[i] += got;
+
+      // Masters may pipeline, handle everything that is complete.
+      for(;;){
+        int32_t adu_len =
+          modbus_tcp_frame_length(server.tcp_buf[i], server.tcp_len[i]);
+        if(adu_len < 0){
+          client.stop();
+          server.tcp_len[i] = 0;
+          break;
+        }
+        if(adu_len == 0 || server.tcp_len[i] < adu_len)
+          break;
+
+        uint8_t resp[MODBUS_TCP_MAX_ADU];
+        uint16_t resp_len =
+          modbus_tcp_process(server.slave, server.tcp_buf[i], adu_len, resp);
+        client.write(resp, resp_len);
+
+        server.tcp_len[i] -= adu_len;
+        memmove(
+          server.tcp_buf[i],
+          server.tcp_buf[i] + adu_len,
+          server.tcp_len[i]
+        );
+      }
+    }
+  }
+
+  return;
+}
+#endif
+
+static void modbus_server_task(void *arg){
+  modbus_server_state &server = *(modbus_server_state *)arg;
+
+  for(;;){
+    modbus_server_poll_rtu(server);
+#ifdef MODBUS_WIFI_SSID
+    modbus_server_poll_tcp(server);
+#endif
+
+    // One tick, well under the RTU frame gap at our baud rate.
+    vTaskDelay(1);
+  }
+}
+
+void modbus_server_start(
+  sensor_snapshot_channel &snapshots,
+  sensor_config_channel &config
+){
+  modbus_server.snapshots = &snapshots;
+  modbus_server.config_chan = &config;
+  sensor_config_read(
+    config, modbus_server.config, NULL, MODBUS_SNAPSHOT_TRIES
+  );
+  modbus_server.rtu_len = 0;
+  modbus_server.rtu_last_us = 0;
+  modbus_server.rtu_gap_us = modbus_rtu_frame_gap_us(MODBUS_RTU_BAUD);
+  modbus_server.rtu_overflow = false;
+
+  modbus_slave_init(modbus_server.slave, MODBUS_UNIT_ID);
+  modbus_server.slave.read_input = modbus_server_read_input;
+  modbus_server.slave.read_holding = modbus_server_read_holding;
+  modbus_server.slave.write_holding = modbus_server_write_holding;
+  modbus_server.slave.ctx = &modbus_server;
+
+  pinMode(MODBUS_RTU_DE_PIN, OUTPUT);
+  digitalWrite(MODBUS_RTU_DE_PIN, LOW);
+  // Modbus RTU defaults to even parity.
+  Serial2.begin(
+    MODBUS_RTU_BAUD, SERIAL_8E1, MODBUS_RTU_RX_PIN, MODBUS_RTU_TX_PIN
+  );
+
+#ifdef MODBUS_WIFI_SSID
+  for(uint8_t i=0; i<MODBUS_TCP_MAX_CLIENTS; i++)
+    modbus_server.tcp_len[i] = 0;
+
+  // Connection happens in the background, the TCP side starts answering once
+  //  it's up and the WiFi stack reconnects on its own after drops.
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(MODBUS_WIFI_SSID, MODBUS_WIFI_PASS);
+  modbus_tcp_listener.begin();
+  modbus_tcp_listener.setNoDelay(true);
+#endif
+
+  xTaskCreatePinnedToCore(
+    modbus_server_task,
+    "modbus",
+    MODBUS_TASK_STACK,
+    &modbus_server,
+    MODBUS_TASK_PRIORITY,
+    NULL,
+    MODBUS_TASK_CORE
+  );
+
+  return;
+}
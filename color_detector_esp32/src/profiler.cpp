@@ -0,0 +1,383 @@
+#ifdef PROFILER
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "serial_link.h"
+
+// Code address ranges, from the IDF linker scripts.
+extern int _text_start;         // Flash mapped code.
+extern int _text_end;
+extern int _iram_text_start;    // Code placed in IRAM.
+extern int _iram_text_end;
+#define PROFILER_ROM_START 0x40000000
+#define PROFILER_ROM_END   0x40070000
+
+// Histogram buckets given to each range, summing to PROFILER_BUCKETS.
+#define PROFILER_ROM_BUCKETS   512
+#define PROFILER_IRAM_BUCKETS  512
+#define PROFILER_FLASH_BUCKETS 3072
+
+// Where call stack walks give up: stack pointers outside internal DRAM, and
+//  probe length in the stack table.
+#define PROFILER_DRAM_START 0x3FFAE000
+#define PROFILER_DRAM_END   0x40000000
+#define PROFILER_STACK_PROBES 8
+
+// Start of the exception frame the FreeRTOS Xtensa port saves on the
+//  interrupted task's stack (XtExcFrame in xtensa_context.h). On the first
+//  interrupt level the port also points the task's pxTopOfStack, the first
+//  word of its TCB, at it before switching to the interrupt stack.
+struct profiler_exc_frame {
+  uint32_t exit;
+  uint32_t pc;
+  uint32_t ps;
+  uint32_t a0;
+  uint32_t a1;
+};
+
+struct profiler_stack {
+  uint32_t hash;
+  uint16_t count;           // 0 marks a free entry.
+  uint8_t depth;
+  uint32_t pcs[LINK_PROFILE_STACK_DEPTH];
+};
+
+enum PROFILER_STATES {
+  PROFILER_SAMPLING,
+  PROFILER_DUMP_BUCKETS,
+  PROFILER_DUMP_STACKS
+};
+
+static hw_timer_t *profiler_timer = NULL;
+static profiler_write_fn profiler_write = NULL;
+
+static link_profile_region profiler_regions[LINK_PROFILE_REGIONS];
+
+// Written only by the ISR while sampling, only by profiler_poll() otherwise.
+static uint16_t profiler_buckets[PROFILER_BUCKETS];
+static profiler_stack profiler_stacks[PROFILER_STACKS];
+static volatile uint32_t profiler_samples = 0;
+static volatile uint32_t profiler_isr_samples = 0;
+static volatile uint32_t profiler_other_samples = 0;
+static volatile uint32_t profiler_dropped_stacks = 0;
+
+static uint8_t profiler_state = PROFILER_SAMPLING;
+static uint16_t profiler_window = 0;
+static uint32_t profiler_window_start_ms = 0;
+static uint16_t profiler_cursor = 0;
+
+static void profiler_set_region(
+  uint8_t index,
+  uint32_t start,
+  uint32_t end,
+  uint16_t first_bucket,
+  uint16_t buckets
+){
+  uint8_t shift = 2;
+  while(((end - start) >> shift) >= buckets)
+    shift++;
+
+  profiler_regions[index].start = start;
+  profiler_regions[index].end = end;
+  profiler_regions[index].first_bucket = first_bucket;
+  profiler_regions[index].shift = shift;
+
+  return;
+}
+
+static bool IRAM_ATTR profiler_is_code(uint32_t pc){
+  for(uint8_t i=0; i<LINK_PROFILE_REGIONS; i++){
+    if(pc >= profiler_regions[i].start && pc < profiler_regions[i].end)
+      return true;
+  }
+
+  return false;
+}
+
+static void IRAM_ATTR profiler_count_pc(uint32_t pc){
+  for(uint8_t i=0; i<LINK_PROFILE_REGIONS; i++){
+    const link_profile_region &region = profiler_regions[i];
+    if(pc < region.start || pc >= region.end)
+      continue;
+
+    uint16_t &bucket = profiler_buckets[
+      region.first_bucket + ((pc - region.start) >> region.shift)
+    ];
+    if(bucket != 0xFFFF)
+      bucket++;
+    return;
+  }
+
+  profiler_other_samples++;
+
+  return;
+}
+
+// Walks the register window base save areas from the interrupted frame.
+//  Each function's caller's return address and stack pointer sit 16 and 12
+//    bytes below its stack pointer once its windows are spilled, which the
+//    port's context save does on interrupt entry. Return addresses carry the
+//    window increment in their top two bits and point past the call.
+static uint8_t IRAM_ATTR profiler_walk(
+  const profiler_exc_frame *frame,
+  uint32_t *pcs
+){
+  uint32_t sp = frame->a1;
+  uint32_t next_pc = frame->a0;
+  uint8_t depth = 0;
+
+  pcs[depth++] = frame->pc;
+  while(depth < LINK_PROFILE_STACK_DEPTH){
+    if(sp < PROFILER_DRAM_START + 16 || sp >= PROFILER_DRAM_END || (sp & 0xF))
+      break;
+
+    uint32_t pc = ((next_pc & 0x3FFFFFFF) | 0x40000000) - 3;
+    if(!profiler_is_code(pc))
+      break;
+    pcs[depth++] = pc;
+
+    const uint32_t *base_save = (const uint32_t *)(uintptr_t)sp;
+    next_pc = base_save[-4];
+    sp = base_save[-3];
+  }
+
+  return depth;
+}
+
+static void IRAM_ATTR profiler_count_stack(const uint32_t *pcs, uint8_t depth){
+  // FNV-1a over the addresses.
+  uint32_t hash = 2166136261u;
+  for(uint8_t i=0; i<depth; i++){
+    hash ^= pcs[i];
+    hash *= 16777619u;
+  }
+
+  for(uint8_t probe=0; probe<PROFILER_STACK_PROBES; probe++){
+    profiler_stack &entry =
+      profiler_stacks[(hash + probe) & (PROFILER_STACKS - 1)];
+
+    if(entry.count == 0){
+      entry.hash = hash;
+      entry.count = 1;
+      entry.depth = depth;
+      for(uint8_t i=0; i<depth; i++)
+        entry.pcs[i] = pcs[i];
+      return;
+    }
+
+    if(entry.hash != hash || entry.depth != depth)
+      continue;
+
+    bool same = true;
+    for(uint8_t i=0; i<depth && same; i++)
+      same = entry.pcs[i] == pcs[i];
+    if(same){
+      if(entry.count != 0xFFFF)
+        entry.count++;
+      return;
+    }
+  }
+
+  profiler_dropped_stacks++;
+
+  return;
+}
+
+static void IRAM_ATTR profiler_isr(){
+  profiler_samples++;
+
+  // Only the first interrupt level leaves the task's frame at pxTopOfStack.
+  if(xPortInterruptedFromISRContext()){
+    profiler_isr_samples++;
+    return;
+  }
+
+  TaskHandle_t task = xTaskGetCurrentTaskHandleForCPU(xPortGetCoreID());
+  const profiler_exc_frame *frame = *(const profiler_exc_frame **)task;
+
+  uint32_t pcs[LINK_PROFILE_STACK_DEPTH];
+  uint8_t depth = profiler_walk(frame, pcs);
+
+  profiler_count_pc(pcs[0]);
+  profiler_count_stack(pcs, depth);
+
+  return;
+}
+
+static void profiler_clear(){
+  memset(profiler_buckets, 0, sizeof(profiler_buckets));
+  memset(profiler_stacks, 0, sizeof(profiler_stacks));
+  profiler_samples = 0;
+  profiler_isr_samples = 0;
+  profiler_other_samples = 0;
+  profiler_dropped_stacks = 0;
+
+  return;
+}
+
+void profiler_start(profiler_write_fn write){
+  profiler_write = write;
+
+  profiler_set_region(
+    0,
+    PROFILER_ROM_START,
+    PROFILER_ROM_END,
+    0,
+    PROFILER_ROM_BUCKETS
+  );
+  profiler_set_region(
+    1,
+    (uint32_t)(uintptr_t)&_iram_text_start,
+    (uint32_t)(uintptr_t)&_iram_text_end,
+    PROFILER_ROM_BUCKETS,
+    PROFILER_IRAM_BUCKETS
+  );
+  profiler_set_region(
+    2,
+    (uint32_t)(uintptr_t)&_text_start,
+    (uint32_t)(uintptr_t)&_text_end,
+    PROFILER_ROM_BUCKETS + PROFILER_IRAM_BUCKETS,
+    PROFILER_FLASH_BUCKETS
+  );
+
+  profiler_clear();
+  profiler_state = PROFILER_SAMPLING;
+  profiler_window_start_ms = millis();
+
+  // 1 MHz timer ticks. The interrupt is allocated on the calling core.
+  profiler_timer = timerBegin(0, 80, true);
+  timerAttachInterrupt(profiler_timer, &profiler_isr, true);
+  timerAlarmWrite(profiler_timer, 1000000 / PROFILER_SAMPLE_HZ, true);
+  timerAlarmEnable(profiler_timer);
+
+  return;
+}
+
+// Sends the header for the window just ended.
+static void profiler_send_header(){
+  uint16_t used_buckets = 0;
+  for(uint16_t i=0; i<PROFILER_BUCKETS; i++){
+    if(profiler_buckets[i])
+      used_buckets++;
+  }
+  uint16_t used_stacks = 0;
+  for(uint16_t i=0; i<PROFILER_STACKS; i++){
+    if(profiler_stacks[i].count)
+      used_stacks++;
+  }
+
+  link_profile_header msg;
+  msg.window = profiler_window;
+  msg.sample_hz = PROFILER_SAMPLE_HZ;
+  msg.samples = profiler_samples;
+  msg.isr_samples = profiler_isr_samples;
+  msg.other_samples = profiler_other_samples;
+  msg.dropped_stacks = profiler_dropped_stacks;
+  msg.bucket_frames =
+    (used_buckets + LINK_PROFILE_BUCKET_ENTRIES - 1) /
+    LINK_PROFILE_BUCKET_ENTRIES;
+  msg.stack_frames = used_stacks;
+  memcpy(msg.regions, profiler_regions, sizeof(msg.regions));
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t len = link_pack_profile_header(msg, payload);
+  profiler_write(LINK_PROFILE_HEADER, payload, len);
+
+  return;
+}
+
+// Sends the next bucket frame from profiler_cursor.
+//  Returns false once there are none left.
+static bool profiler_send_buckets(){
+  link_profile_buckets msg;
+  msg.window = profiler_window;
+  msg.count = 0;
+
+  while(
+    profiler_cursor < PROFILER_BUCKETS &&
+    msg.count < LINK_PROFILE_BUCKET_ENTRIES
+  ){
+    if(profiler_buckets[profiler_cursor]){
+      msg.entries[msg.count].bucket = profiler_cursor;
+      msg.entries[msg.count].count = profiler_buckets[profiler_cursor];
+      msg.count++;
+    }
+    profiler_cursor++;
+  }
+
+  if(msg.count == 0)
+    return false;
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t len = link_pack_profile_buckets(msg, payload);
+  profiler_write(LINK_PROFILE_BUCKETS, payload, len);
+
+  return true;
+}
+
+// Sends the next stack frame from profiler_cursor.
+//  Returns false once there are none left.
+static bool profiler_send_stack(){
+  while(
+    profiler_cursor < PROFILER_STACKS &&
+    profiler_stacks[profiler_cursor].count == 0
+  ){
+    profiler_cursor++;
+  }
+  if(profiler_cursor == PROFILER_STACKS)
+    return false;
+
+  const profiler_stack &entry = profiler_stacks[profiler_cursor++];
+  link_profile_stack msg;
+  msg.window = profiler_window;
+  msg.count = entry.count;
+  msg.depth = entry.depth;
+  memcpy(msg.pcs, entry.pcs, entry.depth * sizeof(uint32_t));
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t len = link_pack_profile_stack(msg, payload);
+  profiler_write(LINK_PROFILE_STACK, payload, len);
+
+  return true;
+}
+
+void profiler_poll(){
+  if(!profiler_timer)
+    return;
+
+  if(profiler_state == PROFILER_SAMPLING){
+    if(millis() - profiler_window_start_ms < PROFILER_WINDOW_MS)
+      return;
+
+    // Stop sampling so the dump itself doesn't show up in the next window.
+    timerAlarmDisable(profiler_timer);
+    profiler_send_header();
+    profiler_cursor = 0;
+    profiler_state = PROFILER_DUMP_BUCKETS;
+  }
+
+  for(uint8_t frames=0; frames<PROFILER_FRAMES_PER_POLL; frames++){
+    if(profiler_state == PROFILER_DUMP_BUCKETS){
+      if(profiler_send_buckets())
+        continue;
+      profiler_cursor = 0;
+      profiler_state = PROFILER_DUMP_STACKS;
+    }
+
+    if(profiler_send_stack())
+      continue;
+
+    profiler_clear();
+    profiler_window++;
+    profiler_state = PROFILER_SAMPLING;
+    profiler_window_start_ms = millis();
+    timerAlarmEnable(profiler_timer);
+    break;
+  }
+
+  return;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_system.h>
+#include <rom/crc.h>
+
+#include "warm_restart.h"
+
+#define WARM_RESTART_MAGIC 0x314D5257  // "WRM1"
+
+// One checkpoint slot.
+//  crc covers everything before it in the struct.
+struct warm_restart_slot {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;
+  uint32_t sequence;
+  uint32_t restarts;
+  warm_restart_state state;
+  uint32_t crc;
+};
+
+// Left uninitialized by the bootloader so they survive resets and deep sleep.
+RTC_NOINIT_ATTR warm_restart_slot warm_restart_slots[2];
+
+// Sequence number of the newest valid slot, the next write goes to the other.
+uint32_t warm_restart_sequence = 0;
+
+// Consecutive warm restarts, carried forward in every slot.
+uint32_t warm_restart_restarts = 0;
+
+static uint32_t warm_restart_slot_crc(const warm_restart_slot &slot){
+  return crc32_le(0, (const uint8_t *)&slot, offsetof(warm_restart_slot, crc));
+}
+
+static bool warm_restart_slot_valid(const warm_restart_slot &slot){
+  return
+    slot.magic == WARM_RESTART_MAGIC &&
+    slot.version == WARM_RESTART_VERSION &&
+    slot.length == sizeof(warm_restart_state) &&
+    slot.crc == warm_restart_slot_crc(slot);
+}
+
+bool warm_restart_restore(warm_restart_state &state){
+  // Only these resets leave RTC slow memory alone. After a power on or brown
+  //  out the slots hold noise that could, however unlikely, pass the CRC.
+  esp_reset_reason_t reason = esp_reset_reason();
+  bool rtc_kept =
+    reason == ESP_RST_SW ||
+    reason == ESP_RST_PANIC ||
+    reason == ESP_RST_INT_WDT ||
+    reason == ESP_RST_TASK_WDT ||
+    reason == ESP_RST_WDT ||
+    reason == ESP_RST_DEEPSLEEP;
+
+  const warm_restart_slot *newest = NULL;
+  if(rtc_kept){
+    for(uint8_t i=0; i<2; i++){
+      if(!warm_restart_slot_valid(warm_restart_slots[i]))
+        continue;
+      if(!newest ||
+         (int32_t)(warm_restart_slots[i].sequence - newest->sequence) > 0){
+        newest = &warm_restart_slots[i];
+      }
+    }
+  }
+
+  if(!newest){
+    // Make sure stale slots from an older image can't be picked up later.
+    memset(warm_restart_slots, 0, sizeof(warm_restart_slots));
+    warm_restart_sequence = 0;
+    warm_restart_restarts = 0;
+    return false;
+  }
+
+  state = newest->state;
+  warm_restart_sequence = newest->sequence;
+  warm_restart_restarts = newest->restarts + 1;
+
+  return true;
+}
+
+void warm_restart_checkpoint(const warm_restart_state &state){
+  warm_restart_sequence++;
+  warm_restart_slot &slot = warm_restart_slots[warm_restart_sequence & 1];
+
+  // Invalidate first, a reset part way through leaves this slot failing its
+  //  CRC and the other one intact.
+  slot.magic = 0;
+  slot.version = WARM_RESTART_VERSION;
+  slot.length = sizeof(warm_restart_state);
+  slot.sequence = warm_restart_sequence;
+  slot.restarts = warm_restart_restarts;
+  slot.state = state;
+  slot.magic = WARM_RESTART_MAGIC;
+  slot.crc = warm_restart_slot_crc(slot);
+
+  return;
+}
+
+uint32_t warm_restart_count(){
+  return warm_restart_restarts;
+}
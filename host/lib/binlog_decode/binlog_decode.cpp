@@ -0,0 +1,224 @@
+#include "binlog_decode.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "binlog.h"
+
+// binlog_site on the 32 bit target: fmt, file, line, level.
+#define BINLOG_SITE_SIZE 11
+
+bool binlog_decoder_load(binlog_decoder &dec, const char *path){
+  dec.sites.clear();
+
+  return elf_sections_load(dec.image, path);
+}
+
+const binlog_decoded_site &binlog_decoder_site(
+  binlog_decoder &dec,
+  uint32_t site
+){
+  auto found = dec.sites.find(site);
+  if(found != dec.sites.end())
+    return found->second;
+
+  binlog_decoded_site &out = dec.sites[site];
+  uint8_t raw[BINLOG_SITE_SIZE];
+  out.valid =
+    elf_sections_read(dec.image, site, raw, sizeof(raw)) &&
+    elf_sections_string(dec.image, link_get_u32(&raw[0]), out.fmt) &&
+    elf_sections_string(dec.image, link_get_u32(&raw[4]), out.file);
+  out.line = link_get_u16(&raw[8]);
+  out.level = raw[10];
+
+  // Just the file name, __FILE__ carries the build's path.
+  size_t slash = out.file.find_last_of("/\\");
+  if(slash != std::string::npos)
+    out.file.erase(0, slash + 1);
+
+  return out;
+}
+
+// Argument words of a record, consumed in order.
+struct binlog_args {
+  const link_log *msg;
+  uint8_t next;
+};
+
+static bool binlog_word(binlog_args &args, uint32_t &word){
+  if(args.next >= args.msg->count)
+    return false;
+  word = args.msg->words[args.next++];
+
+  return true;
+}
+
+static void binlog_append(std::string &out, const char *spec, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void binlog_append(std::string &out, const char *spec, ...){
+  char buf[512];
+  va_list ap;
+  va_start(ap, spec);
+  vsnprintf(buf, sizeof(buf), spec, ap);
+  va_end(ap);
+  out += buf;
+
+  return;
+}
+
+// Renders one conversion. spec holds the flags, width and precision already
+//  resolved, length the target's length modifier.
+static void binlog_convert(
+  binlog_decoder &dec,
+  std::string &out,
+  std::string spec,
+  const std::string &length,
+  char conv,
+  binlog_args &args
+){
+  bool wide = length == "ll" || length == "q" || length == "j";
+  uint32_t lo;
+  uint32_t hi = 0;
+  if(!binlog_word(args, lo) || (wide && !binlog_word(args, hi))){
+    out += "<?>";
+    return;
+  }
+  uint64_t word = (uint64_t)hi << 32 | lo;
+
+  switch(conv){
+    case 'd':
+    case 'i': {
+      int64_t val = wide ? (int64_t)word : (int64_t)(int32_t)lo;
+      if(length == "h")
+        val = (int16_t)val;
+      else if(length == "hh")
+        val = (int8_t)val;
+      spec += "lld";
+      binlog_append(out, spec.c_str(), (long long)val);
+      break;
+    }
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      uint64_t val = wide ? word : lo;
+      if(length == "h")
+        val = (uint16_t)val;
+      else if(length == "hh")
+        val = (uint8_t)val;
+      spec += "ll";
+      spec += conv;
+      binlog_append(out, spec.c_str(), (unsigned long long)val);
+      break;
+    }
+    case 'c':
+      spec += 'c';
+      binlog_append(out, spec.c_str(), (int)(uint8_t)lo);
+      break;
+    case 'p':
+      binlog_append(out, "0x%08" PRIx32, lo);
+      break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A': {
+      float val;
+      memcpy(&val, &lo, sizeof(val));
+      spec += conv;
+      binlog_append(out, spec.c_str(), (double)val);
+      break;
+    }
+    case 's': {
+      std::string str;
+      if(!elf_sections_string(dec.image, lo, str)){
+        binlog_append(out, "<0x%08" PRIx32 ">", lo);
+        break;
+      }
+      spec += 's';
+      binlog_append(out, spec.c_str(), str.c_str());
+      break;
+    }
+    default:
+      binlog_append(out, "<%%%c?>", conv);
+      break;
+  }
+
+  return;
+}
+
+std::string binlog_decoder_format(binlog_decoder &dec, const link_log &msg){
+  const binlog_decoded_site &site = binlog_decoder_site(dec, msg.site);
+  std::string out;
+  if(!site.valid){
+    binlog_append(out, "<site 0x%08" PRIx32 ">", msg.site);
+    for(uint8_t i=0; i<msg.count; i++)
+      binlog_append(out, " 0x%08" PRIx32, msg.words[i]);
+    return out;
+  }
+
+  binlog_args args;
+  args.msg = &msg;
+  args.next = 0;
+
+  const char *p = site.fmt.c_str();
+  while(*p){
+    if(*p != '%'){
+      out += *p++;
+      continue;
+    }
+    p++;
+    if(*p == '%'){
+      out += *p++;
+      continue;
+    }
+
+    // Flags, width and precision, either given or taken from a word.
+    std::string spec = "%";
+    while(*p && strchr("-+ #0'", *p))
+      spec += *p++;
+    for(int part=0; part<2; part++){
+      if(part == 1){
+        if(*p != '.')
+          break;
+        spec += *p++;
+      }
+      if(*p == '*'){
+        uint32_t val;
+        p++;
+        if(!binlog_word(args, val))
+          val = 0;
+        spec += std::to_string((int32_t)val);
+      }
+      while(*p >= '0' && *p <= '9')
+        spec += *p++;
+    }
+
+    std::string length;
+    while(*p && strchr("hlqjztL", *p))
+      length += *p++;
+    if(!*p)
+      break;
+
+    binlog_convert(dec, out, spec, length, *p++, args);
+  }
+
+  return out;
+}
+
+const char *binlog_level_name(uint8_t level){
+  switch(level){
+    case BINLOG_LEVEL_DEBUG: return "DEBUG";
+    case BINLOG_LEVEL_INFO:  return "INFO";
+    case BINLOG_LEVEL_WARN:  return "WARN";
+    case BINLOG_LEVEL_ERROR: return "ERROR";
+  }
+
+  return "?";
+}
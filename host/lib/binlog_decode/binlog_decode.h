@@ -0,0 +1,47 @@
+// Renders a head's binary log records (LINK_LOG, see binlog.h) as text.
+//  The call sites are read out of the firmware ELF the head runs: each
+//    record's site address gives the format string, file and line, and
+//    printf style conversions are applied to its argument words with the
+//    target's sizes (int and long 32 bit, long long 64). %s arguments are
+//    read from the image too.
+#ifndef BINLOG_DECODE_H
+#define BINLOG_DECODE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "elf_symbols.h"
+#include "serial_link.h"
+
+struct binlog_decoded_site {
+  bool valid;               // False if the address isn't a site in the image.
+  uint8_t level;
+  uint16_t line;
+  std::string file;
+  std::string fmt;
+};
+
+struct binlog_decoder {
+  elf_sections image;
+  std::unordered_map<uint32_t, binlog_decoded_site> sites;
+};
+
+// Loads the firmware image. Fails as elf_sections_load().
+bool binlog_decoder_load(binlog_decoder &dec, const char *path);
+
+// Call site of a record, looked up in the image on first use.
+const binlog_decoded_site &binlog_decoder_site(
+  binlog_decoder &dec,
+  uint32_t site
+);
+
+// The record's text. Missing arguments render as <?>, a site that isn't in
+//  the image as its address and raw words.
+std::string binlog_decoder_format(binlog_decoder &dec, const link_log &msg);
+
+// DEBUG, INFO, WARN, ERROR.
+const char *binlog_level_name(uint8_t level);
+
+#endif
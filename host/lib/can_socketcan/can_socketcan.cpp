@@ -0,0 +1,66 @@
+#include "can_socketcan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+int can_socketcan_open(const char *ifname){
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(fd < 0)
+    return -1;
+
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = if_nametoindex(ifname);
+  if(
+    addr.can_ifindex == 0 ||
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0
+  ){
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+bool can_socketcan_send(int fd, const can_frame_data &frame){
+  struct can_frame out;
+  memset(&out, 0, sizeof(out));
+  out.can_id = frame.id & CAN_SFF_MASK;
+  out.can_dlc = frame.len <= 8 ? frame.len : 8;
+  memcpy(out.data, frame.data, out.can_dlc);
+
+  return write(fd, &out, sizeof(out)) == sizeof(out);
+}
+
+bool can_socketcan_hal_send(void *ctx, const can_frame_data &frame){
+  return can_socketcan_send(*(int *)ctx, frame);
+}
+
+int can_socketcan_recv(int fd, can_frame_data &out){
+  while(true){
+    struct can_frame in;
+    ssize_t got = read(fd, &in, sizeof(in));
+    if(got < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if(got != sizeof(in))
+      continue;
+    if(in.can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+      continue;
+
+    out.id = in.can_id & CAN_SFF_MASK;
+    out.len = in.can_dlc <= 8 ? in.can_dlc : 8;
+    memcpy(out.data, in.data, out.len);
+    return 1;
+  }
+}
@@ -0,0 +1,26 @@
+// Linux SocketCAN backend for lib/can_output, e.g. on a virtual bus:
+//    sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+//  or a USB adapter's can0. Sockets on the same interface see each other's
+//  frames, so one can stand in for a head and another for a controller.
+#ifndef CAN_SOCKETCAN_H
+#define CAN_SOCKETCAN_H
+
+#include "can_output.h"
+
+// Opens a raw CAN socket bound to the interface, non-blocking.
+//  Returns the file descriptor, or -1 with errno set.
+int can_socketcan_open(const char *ifname);
+
+// Queues a frame. Returns false if the interface's queue is full (or the
+//  send failed otherwise, errno tells which).
+bool can_socketcan_send(int fd, const can_frame_data &frame);
+
+// can_hal send for a socket, ctx points to the file descriptor.
+bool can_socketcan_hal_send(void *ctx, const can_frame_data &frame);
+
+// Reads one standard data frame into out. Returns 1 for a frame, 0 if none
+//  is waiting, -1 with errno set on error. Extended, remote and error frames
+//  are skipped.
+int can_socketcan_recv(int fd, can_frame_data &out);
+
+#endif
@@ -0,0 +1,305 @@
+#include "elf_symbols.h"
+
+#include <cxxabi.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// ELF constants used here, from the System V ABI.
+#define ELF_CLASS32 1
+#define ELF_DATA2LSB 1
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHN_UNDEF 0
+#define ELF_SHN_ABS 0xFFF1
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_FUNC 2
+#define ELF_EHDR_SIZE 52
+#define ELF_SHDR_SIZE 40
+#define ELF_SYM_SIZE 16
+
+static uint16_t elf_u16(const std::vector<uint8_t> &image, size_t off){
+  return image[off] | image[off + 1] << 8;
+}
+
+static uint32_t elf_u32(const std::vector<uint8_t> &image, size_t off){
+  return
+    (uint32_t)image[off] |
+    (uint32_t)image[off + 1] << 8 |
+    (uint32_t)image[off + 2] << 16 |
+    (uint32_t)image[off + 3] << 24;
+}
+
+static bool elf_read_file(std::vector<uint8_t> &image, const char *path){
+  FILE *file = fopen(path, "rb");
+  if(!file)
+    return false;
+
+  uint8_t buf[65536];
+  size_t got;
+  while((got = fread(buf, 1, sizeof(buf), file)) > 0)
+    image.insert(image.end(), buf, buf + got);
+
+  bool ok = !ferror(file);
+  fclose(file);
+
+  return ok;
+}
+
+static std::string elf_demangle(const char *name){
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+  if(status != 0 || !demangled)
+    return name;
+
+  std::string result(demangled);
+  free(demangled);
+
+  return result;
+}
+
+// Checks the ELF header and finds the section header table.
+static bool elf_section_table(
+  const std::vector<uint8_t> &image,
+  uint32_t &shoff,
+  uint16_t &shentsize,
+  uint16_t &shnum
+){
+  if(
+    image.size() < ELF_EHDR_SIZE ||
+    memcmp(image.data(), "\x7F" "ELF", 4) != 0 ||
+    image[4] != ELF_CLASS32 ||
+    image[5] != ELF_DATA2LSB
+  ){
+    errno = EINVAL;
+    return false;
+  }
+
+  shoff = elf_u32(image, 32);
+  shentsize = elf_u16(image, 46);
+  shnum = elf_u16(image, 48);
+  if(
+    shentsize < ELF_SHDR_SIZE ||
+    shoff > image.size() ||
+    (uint64_t)shnum * shentsize > image.size() - shoff
+  ){
+    errno = EINVAL;
+    return false;
+  }
+
+  return true;
+}
+
+bool elf_symbols_load(elf_symbols &syms, const char *path){
+  std::vector<uint8_t> image;
+  if(!elf_read_file(image, path))
+    return false;
+
+  uint32_t shoff;
+  uint16_t shentsize;
+  uint16_t shnum;
+  if(!elf_section_table(image, shoff, shentsize, shnum))
+    return false;
+
+  syms.symbols.clear();
+  bool found = false;
+  for(uint16_t i=0; i<shnum; i++){
+    size_t sh = shoff + (size_t)i * shentsize;
+    if(elf_u32(image, sh + 4) != ELF_SHT_SYMTAB)
+      continue;
+
+    uint32_t offset = elf_u32(image, sh + 16);
+    uint32_t size = elf_u32(image, sh + 20);
+    uint32_t link = elf_u32(image, sh + 24);
+    if(link >= shnum || offset > image.size() || size > image.size() - offset)
+      continue;
+
+    size_t strsh = shoff + (size_t)link * shentsize;
+    uint32_t stroff = elf_u32(image, strsh + 16);
+    uint32_t strsize = elf_u32(image, strsh + 20);
+    if(stroff > image.size() || strsize > image.size() - stroff)
+      continue;
+    found = true;
+
+    for(uint32_t off=offset; off + ELF_SYM_SIZE <= offset + size;
+        off+=ELF_SYM_SIZE){
+      uint32_t name = elf_u32(image, off);
+      uint32_t value = elf_u32(image, off + 4);
+      uint32_t sym_size = elf_u32(image, off + 8);
+      uint8_t type = image[off + 12] & 0xF;
+      uint16_t shndx = elf_u16(image, off + 14);
+
+      bool func = type == ELF_STT_FUNC && shndx != ELF_SHN_UNDEF;
+      bool rom = type == ELF_STT_NOTYPE && shndx == ELF_SHN_ABS;
+      if(!func && !rom)
+        continue;
+      if(name >= strsize)
+        continue;
+
+      const char *str = (const char *)&image[stroff + name];
+      if(!memchr(str, 0, strsize - name) || !str[0])
+        continue;
+
+      elf_symbol sym;
+      sym.addr = value;
+      sym.size = func ? sym_size : 0;
+      sym.name = elf_demangle(str);
+      syms.symbols.push_back(sym);
+    }
+  }
+
+  if(!found){
+    errno = EINVAL;
+    return false;
+  }
+
+  // One symbol per address, preferring sized ones over aliases without.
+  std::sort(
+    syms.symbols.begin(),
+    syms.symbols.end(),
+    [](const elf_symbol &a, const elf_symbol &b){
+      if(a.addr != b.addr)
+        return a.addr < b.addr;
+      return a.size > b.size;
+    }
+  );
+  syms.symbols.erase(
+    std::unique(
+      syms.symbols.begin(),
+      syms.symbols.end(),
+      [](const elf_symbol &a, const elf_symbol &b){
+        return a.addr == b.addr;
+      }
+    ),
+    syms.symbols.end()
+  );
+
+  return true;
+}
+
+const elf_symbol *elf_symbols_find(const elf_symbols &syms, uint32_t addr){
+  auto next = std::upper_bound(
+    syms.symbols.begin(),
+    syms.symbols.end(),
+    addr,
+    [](uint32_t value, const elf_symbol &sym){
+      return value < sym.addr;
+    }
+  );
+  if(next == syms.symbols.begin())
+    return NULL;
+
+  const elf_symbol &sym = *(next - 1);
+  if(sym.size && addr - sym.addr >= sym.size)
+    return NULL;
+
+  return &sym;
+}
+
+bool elf_sections_load(elf_sections &secs, const char *path){
+  std::vector<uint8_t> image;
+  if(!elf_read_file(image, path))
+    return false;
+
+  uint32_t shoff;
+  uint16_t shentsize;
+  uint16_t shnum;
+  if(!elf_section_table(image, shoff, shentsize, shnum))
+    return false;
+
+  secs.sections.clear();
+  for(uint16_t i=0; i<shnum; i++){
+    size_t sh = shoff + (size_t)i * shentsize;
+    uint32_t type = elf_u32(image, sh + 4);
+    uint32_t flags = elf_u32(image, sh + 8);
+    uint32_t addr = elf_u32(image, sh + 12);
+    uint32_t offset = elf_u32(image, sh + 16);
+    uint32_t size = elf_u32(image, sh + 20);
+    if(
+      type != ELF_SHT_PROGBITS ||
+      !(flags & ELF_SHF_ALLOC) ||
+      size == 0 ||
+      offset > image.size() ||
+      size > image.size() - offset
+    ){
+      continue;
+    }
+
+    elf_section sec;
+    sec.addr = addr;
+    sec.data.assign(&image[offset], &image[offset] + size);
+    secs.sections.push_back(sec);
+  }
+
+  std::sort(
+    secs.sections.begin(),
+    secs.sections.end(),
+    [](const elf_section &a, const elf_section &b){
+      return a.addr < b.addr;
+    }
+  );
+
+  return true;
+}
+
+// Section holding addr, or NULL.
+static const elf_section *elf_sections_find(
+  const elf_sections &secs,
+  uint32_t addr
+){
+  auto next = std::upper_bound(
+    secs.sections.begin(),
+    secs.sections.end(),
+    addr,
+    [](uint32_t value, const elf_section &sec){
+      return value < sec.addr;
+    }
+  );
+  if(next == secs.sections.begin())
+    return NULL;
+
+  const elf_section &sec = *(next - 1);
+  if(addr - sec.addr >= sec.data.size())
+    return NULL;
+
+  return &sec;
+}
+
+bool elf_sections_read(
+  const elf_sections &secs,
+  uint32_t addr,
+  void *out,
+  size_t len
+){
+  const elf_section *sec = elf_sections_find(secs, addr);
+  if(!sec || len > sec->data.size() - (addr - sec->addr))
+    return false;
+
+  memcpy(out, &sec->data[addr - sec->addr], len);
+
+  return true;
+}
+
+bool elf_sections_string(
+  const elf_sections &secs,
+  uint32_t addr,
+  std::string &out
+){
+  const elf_section *sec = elf_sections_find(secs, addr);
+  if(!sec)
+    return false;
+
+  const uint8_t *start = &sec->data[addr - sec->addr];
+  size_t avail = sec->data.size() - (addr - sec->addr);
+  const void *end = memchr(start, 0, avail);
+  if(!end)
+    return false;
+
+  out.assign((const char *)start, (const uint8_t *)end - start);
+
+  return true;
+}
@@ -0,0 +1,66 @@
+// Function symbols from a 32 bit little endian ELF, for turning firmware code
+//  addresses back into names.
+//  Reads the .symtab of an unstripped image (the firmware.elf PlatformIO
+//    leaves next to firmware.bin). Function symbols are taken with their
+//    sizes, absolute untyped symbols as well since that's how the linker
+//    scripts hand over the mask ROM's entry points (memcpy, ets_delay_us...).
+//    Those have no size and are taken to run up to the next symbol.
+//  The contents of its allocated sections can be loaded too, to read back
+//    constants the firmware keeps in flash (binary log format strings).
+#ifndef ELF_SYMBOLS_H
+#define ELF_SYMBOLS_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct elf_symbol {
+  uint32_t addr;
+  uint32_t size;            // 0 when unknown.
+  std::string name;         // Demangled.
+};
+
+struct elf_symbols {
+  std::vector<elf_symbol> symbols;  // By address, one per address.
+};
+
+// Loads path's symbol table into syms.
+//  Returns false with errno set if the file can't be read or isn't an ELF32
+//    little endian image with a symbol table (EINVAL).
+bool elf_symbols_load(elf_symbols &syms, const char *path);
+
+// Symbol containing addr, or NULL.
+const elf_symbol *elf_symbols_find(const elf_symbols &syms, uint32_t addr);
+
+struct elf_section {
+  uint32_t addr;
+  std::vector<uint8_t> data;
+};
+
+// Initialised sections that occupy memory on the target (code, rodata, data),
+//  by address.
+struct elf_sections {
+  std::vector<elf_section> sections;
+};
+
+// Loads path's allocated sections into secs. Fails as elf_symbols_load().
+bool elf_sections_load(elf_sections &secs, const char *path);
+
+// Copies len bytes at target address addr into out. Returns false unless
+//  they all lie in one section.
+bool elf_sections_read(
+  const elf_sections &secs,
+  uint32_t addr,
+  void *out,
+  size_t len
+);
+
+// Reads the NUL terminated string at target address addr.
+bool elf_sections_string(
+  const elf_sections &secs,
+  uint32_t addr,
+  std::string &out
+);
+
+#endif
@@ -0,0 +1,246 @@
+#include "frame_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(
+  std::atomic<uint64_t>::is_always_lock_free &&
+    std::atomic<int64_t>::is_always_lock_free,
+  "frame_ring needs lock free 64 bit atomics to share them between processes"
+);
+
+// Slots start on the page after the header.
+#define FRAME_RING_SLOTS_OFFSET 4096
+
+static size_t frame_ring_bytes(uint32_t slots){
+  return FRAME_RING_SLOTS_OFFSET + (size_t)slots * sizeof(frame_ring_slot);
+}
+
+static void frame_ring_set_name(frame_ring &ring, const char *name){
+  strncpy(ring.name, name, sizeof(ring.name) - 1);
+  ring.name[sizeof(ring.name) - 1] = '\0';
+
+  return;
+}
+
+bool frame_ring_create(
+  frame_ring &ring,
+  const char *name,
+  uint32_t slots,
+  uint32_t heads
+){
+  memset(&ring, 0, sizeof(ring));
+  if(slots == 0 || (slots & (slots - 1))){
+    errno = EINVAL;
+    return false;
+  }
+
+  // A fresh object each time, so readers still mapping a previous writer's
+  //  ring see it go quiet instead of having it reset under them.
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd < 0)
+    return false;
+
+  size_t bytes = frame_ring_bytes(slots);
+  if(ftruncate(fd, bytes) != 0){
+    int err = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = err;
+    return false;
+  }
+  void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    int err = errno;
+    shm_unlink(name);
+    errno = err;
+    return false;
+  }
+
+  // ftruncate() zero fills, which is every slot's "nothing yet" sequence.
+  ring.header = (frame_ring_header *)map;
+  ring.slots = (frame_ring_slot *)((uint8_t *)map + FRAME_RING_SLOTS_OFFSET);
+  ring.mask = slots - 1;
+  ring.map_bytes = bytes;
+  ring.writer = true;
+  frame_ring_set_name(ring, name);
+
+  frame_ring_header &header = *ring.header;
+  header.version = FRAME_RING_VERSION;
+  header.slots = slots;
+  header.slot_bytes = sizeof(frame_ring_slot);
+  header.heads = heads;
+  header.writer_pid = getpid();
+  header.published.store(0, std::memory_order_relaxed);
+  header.alive_us.store(0, std::memory_order_relaxed);
+
+  // Magic last, readers checking it see the rest of the header.
+  std::atomic_thread_fence(std::memory_order_release);
+  header.magic = FRAME_RING_MAGIC;
+
+  return true;
+}
+
+frame_ring_record &frame_ring_claim(frame_ring &ring){
+  uint64_t n = ring.header->published.load(std::memory_order_relaxed);
+  frame_ring_slot &slot = ring.slots[n & ring.mask];
+
+  slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  return slot.record;
+}
+
+void frame_ring_publish(frame_ring &ring){
+  uint64_t n = ring.header->published.load(std::memory_order_relaxed);
+  frame_ring_slot &slot = ring.slots[n & ring.mask];
+
+  slot.seq.store(2 * n + 2, std::memory_order_release);
+  ring.header->published.store(n + 1, std::memory_order_release);
+
+  return;
+}
+
+void frame_ring_heartbeat(frame_ring &ring, int64_t now_us){
+  ring.header->alive_us.store(now_us, std::memory_order_relaxed);
+
+  return;
+}
+
+bool frame_ring_open(frame_ring &ring, const char *name){
+  memset(&ring, 0, sizeof(ring));
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < FRAME_RING_SLOTS_OFFSET){
+    close(fd);
+    errno = EPROTO;
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return false;
+
+  const frame_ring_header &header = *(const frame_ring_header *)map;
+  bool valid =
+    header.magic == FRAME_RING_MAGIC &&
+    header.version == FRAME_RING_VERSION &&
+    header.slot_bytes == sizeof(frame_ring_slot) &&
+    header.slots && !(header.slots & (header.slots - 1)) &&
+    (size_t)st.st_size >= frame_ring_bytes(header.slots);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if(!valid){
+    munmap(map, st.st_size);
+    errno = EPROTO;
+    return false;
+  }
+
+  ring.header = (frame_ring_header *)map;
+  ring.slots = (frame_ring_slot *)((uint8_t *)map + FRAME_RING_SLOTS_OFFSET);
+  ring.mask = header.slots - 1;
+  ring.map_bytes = st.st_size;
+  ring.writer = false;
+  frame_ring_set_name(ring, name);
+
+  return true;
+}
+
+void frame_ring_reader_init(
+  const frame_ring &ring,
+  frame_ring_reader &reader,
+  bool oldest
+){
+  uint64_t published =
+    ring.header->published.load(std::memory_order_acquire);
+  uint64_t slots = ring.mask + 1;
+
+  reader.next = published;
+  if(oldest)
+    reader.next = published > slots ? published - slots : 0;
+  reader.lost = 0;
+
+  return;
+}
+
+// Puts a lapped cursor back on the oldest record the writer can't be
+//  overwriting yet, counting what it skips.
+static void frame_ring_resync(
+  const frame_ring &ring,
+  frame_ring_reader &reader,
+  uint64_t published
+){
+  // Leave an eighth of the ring as a margin, so the reader isn't lapped again
+  //  straight away.
+  uint64_t slots = ring.mask + 1;
+  uint64_t oldest = published + slots / 8 > slots ?
+    published + slots / 8 - slots : 0;
+  if(oldest > reader.next){
+    reader.lost += oldest - reader.next;
+    reader.next = oldest;
+  }
+
+  return;
+}
+
+const frame_ring_record *frame_ring_peek(
+  const frame_ring &ring,
+  frame_ring_reader &reader
+){
+  while(true){
+    uint64_t published =
+      ring.header->published.load(std::memory_order_acquire);
+    if(reader.next >= published)
+      return NULL;
+    if(published - reader.next > ring.mask + 1){
+      frame_ring_resync(ring, reader, published);
+      continue;
+    }
+
+    const frame_ring_slot &slot = ring.slots[reader.next & ring.mask];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if(seq == 2 * reader.next + 2)
+      return &slot.record;
+
+    // Lapped since the check above, the slot holds a later record.
+    uint64_t before = reader.next;
+    frame_ring_resync(
+      ring,
+      reader,
+      ring.header->published.load(std::memory_order_acquire)
+    );
+    if(reader.next == before)
+      return NULL;
+  }
+}
+
+bool frame_ring_release(const frame_ring &ring, frame_ring_reader &reader){
+  const frame_ring_slot &slot = ring.slots[reader.next & ring.mask];
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  bool intact =
+    slot.seq.load(std::memory_order_relaxed) == 2 * reader.next + 2;
+  if(!intact)
+    reader.lost++;
+  reader.next++;
+
+  return intact;
+}
+
+void frame_ring_close(frame_ring &ring){
+  if(ring.header)
+    munmap(ring.header, ring.map_bytes);
+  if(ring.writer)
+    shm_unlink(ring.name);
+  memset(&ring, 0, sizeof(ring));
+
+  return;
+}
@@ -0,0 +1,136 @@
+// Shared memory ring of decoded link frames, one writer, any number of
+//  readers in other processes.
+//
+// Only one process can have a head's serial port open. The broker tool owns
+//  the ports, decodes each stream once and publishes every frame into a POSIX
+//  shared memory object; loggers, dashboards and QC analytics attach to it by
+//  name instead of to the port.
+//  The ring is a power of two of fixed size slots. Record n lives in slot
+//    n % slots, so a slot is reused once the writer is a whole ring ahead, and
+//    the writer never waits on a reader. Readers keep their own cursor, read
+//    records in place (no copy out of the mapping) and find out afterwards
+//    whether the writer lapped them, from the slot's sequence:
+//      2n + 1    record n is being written,
+//      2n + 2    record n is complete.
+//    A reader that falls more than a ring behind skips ahead and counts the
+//    records it missed.
+//  Record and header layouts are fixed size, plain data and atomics that are
+//    lock free (checked at compile time), so any process built from this
+//    header can map them.
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "serial_link.h"
+
+#define FRAME_RING_MAGIC 0x31474E4952534343ULL  // "CCSRING1"
+#define FRAME_RING_VERSION 1
+
+// Default name of the shared memory object, and slots. 4096 is tens of
+//  seconds of a head's reading records at full rate, plenty of slack for a
+//  reader that's briefly descheduled.
+#define FRAME_RING_DEFAULT_NAME "/color_sensor"
+#define FRAME_RING_DEFAULT_SLOTS 4096
+
+// One decoded frame.
+struct frame_ring_record {
+  int64_t rx_time_us;       // Host time the frame was read off the port.
+  uint64_t device_id;       // From the head's sync status, 0 until known.
+  uint16_t head;            // Index of the head's port on the broker.
+  uint8_t type;             // enum LINK_FRAME_TYPES.
+  uint8_t len;
+  uint8_t payload[LINK_MAX_PAYLOAD];
+};
+
+// Two cache lines, so neighbouring slots never share one.
+struct alignas(64) frame_ring_slot {
+  std::atomic<uint64_t> seq;
+  frame_ring_record record;
+};
+
+struct alignas(64) frame_ring_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slots;           // A power of two.
+  uint32_t slot_bytes;      // sizeof(frame_ring_slot), checked on open.
+  uint32_t heads;
+  int32_t writer_pid;
+
+  // Records published so far, and host time the writer was last alive.
+  alignas(64) std::atomic<uint64_t> published;
+  std::atomic<int64_t> alive_us;
+};
+
+struct frame_ring {
+  frame_ring_header *header;
+  frame_ring_slot *slots;
+  uint64_t mask;
+  size_t map_bytes;
+  bool writer;
+  char name[64];
+};
+
+struct frame_ring_reader {
+  uint64_t next;            // Record to read next.
+  uint64_t lost;            // Records overwritten before they were read.
+};
+
+//------------------------------------------------------------------------------
+// Writer
+//------------------------------------------------------------------------------
+// Creates the shared memory object, replacing any left by a previous writer.
+//  slots must be a power of two.
+//  Returns false with errno set on failure.
+bool frame_ring_create(
+  frame_ring &ring,
+  const char *name,
+  uint32_t slots,
+  uint32_t heads
+);
+
+// The slot for the next record, marked as being written. Fill it in, then
+//  frame_ring_publish() it.
+frame_ring_record &frame_ring_claim(frame_ring &ring);
+void frame_ring_publish(frame_ring &ring);
+
+// Marks the writer alive, for readers to tell a quiet ring from a dead one.
+void frame_ring_heartbeat(frame_ring &ring, int64_t now_us);
+
+//------------------------------------------------------------------------------
+// Reader
+//------------------------------------------------------------------------------
+// Maps an existing ring read only.
+//  Returns false with errno set on failure, EPROTO if it isn't a compatible
+//    ring.
+bool frame_ring_open(frame_ring &ring, const char *name);
+
+// Starts a cursor at the oldest record still held, or at the next one to be
+//  published.
+void frame_ring_reader_init(
+  const frame_ring &ring,
+  frame_ring_reader &reader,
+  bool oldest
+);
+
+// The record at the cursor, in place, or NULL if there's none yet. Skips
+//  ahead, counting lost records, if the writer lapped the cursor.
+//  The record may be overwritten while it's read: copy or unpack what's
+//    needed, then frame_ring_release() it, and only trust it if that returns
+//    true.
+const frame_ring_record *frame_ring_peek(
+  const frame_ring &ring,
+  frame_ring_reader &reader
+);
+
+// Moves the cursor past the record from frame_ring_peek(). Returns false if
+//  it was overwritten meanwhile, counted as lost.
+bool frame_ring_release(const frame_ring &ring, frame_ring_reader &reader);
+
+// Unmaps the ring. The writer also removes the shared memory object, readers
+//  still attached keep their mapping until they close.
+void frame_ring_close(frame_ring &ring);
+
+#endif
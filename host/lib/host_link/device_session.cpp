@@ -0,0 +1,181 @@
+#include "device_session.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "serial_port.h"
+
+void device_session_init(device_session &session, int fd, const char *name){
+  memset(&session, 0, sizeof(session));
+  session.fd = fd;
+  session.name = name;
+  link_decoder_reset(session.decoder);
+
+  return;
+}
+
+// Answers a head's sync request.
+//  t2 is the time the bytes were read off the port, t3 is taken as late as
+//    possible before the write so host processing doesn't count as path delay.
+static void device_session_answer_sync(
+  device_session &session,
+  const link_sync_req &req
+){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t frame[LINK_MAX_FRAME];
+
+  link_sync_resp resp;
+  resp.t1 = req.t1;
+  resp.t2 = session.rx_time_us;
+  resp.t3 = host_time_us();
+  uint8_t len = link_pack_sync_resp(resp, payload);
+  size_t frame_len = link_encode(LINK_SYNC_RESP, payload, len, frame);
+
+  // Short frame on a freshly drained port, a partial write here means the port
+  //  is gone and the next read will report it.
+  ssize_t written = write(session.fd, frame, frame_len);
+  (void)written;
+
+  session.sync_requests++;
+
+  return;
+}
+
+void device_session_handle_frame(
+  device_session &session,
+  const link_decoder &frame,
+  reading_callback on_reading,
+  void *ctx
+){
+  switch(frame.type){
+    case LINK_SYNC_REQ: {
+      link_sync_req req;
+      if(link_unpack_sync_req(frame.payload, frame.len, req))
+        device_session_answer_sync(session, req);
+      break;
+    }
+
+    case LINK_SYNC_STATUS: {
+      link_sync_status status;
+      if(!link_unpack_sync_status(frame.payload, frame.len, status))
+        break;
+      session.clock.known = true;
+      session.clock.device_id = status.device_id;
+      session.clock.offset_us = status.offset_us;
+      session.clock.device_time_us = status.device_time_us;
+      session.clock.drift_ppb = status.drift_ppb;
+      session.clock.uncertainty_us = status.uncertainty_us;
+      session.clock.samples = status.samples;
+      session.clock.rtt_us = status.rtt_us;
+      session.clock.updated_us = session.rx_time_us;
+      break;
+    }
+
+    case LINK_READING: {
+      link_reading rec;
+      if(!link_unpack_reading(frame.payload, frame.len, rec))
+        break;
+      if(session.seq_known && rec.seq != session.next_seq)
+        session.dropped += (uint16_t)(rec.seq - session.next_seq);
+      session.seq_known = true;
+      session.next_seq = rec.seq + 1;
+      session.readings++;
+      if(on_reading)
+        on_reading(session, rec, ctx);
+      break;
+    }
+
+    case LINK_SPC_ALARM: {
+      link_spc_alarm alarm;
+      if(!link_unpack_spc_alarm(frame.payload, frame.len, alarm))
+        break;
+      session.spc_alarms++;
+      if(session.on_spc_alarm)
+        session.on_spc_alarm(session, alarm);
+      break;
+    }
+
+    default:
+      if(session.on_frame)
+        session.on_frame(session, frame, session.frame_ctx);
+      break;
+  }
+
+  return;
+}
+
+bool device_session_poll(
+  device_session &session,
+  reading_callback on_reading,
+  void *ctx
+){
+  uint8_t buf[256];
+
+  while(true){
+    ssize_t count = read(session.fd, buf, sizeof(buf));
+    if(count == 0)
+      return false;
+    if(count < 0){
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+
+    session.rx_time_us = host_time_us();
+    for(ssize_t i=0; i<count; i++){
+      if(link_decode_byte(session.decoder, buf[i]))
+        device_session_handle_frame(session, session.decoder, on_reading, ctx);
+    }
+  }
+}
+
+bool device_session_subscribe(
+  device_session &session,
+  const link_subscribe &req
+){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t frame[LINK_MAX_FRAME];
+
+  uint8_t len = link_pack_subscribe(req, payload);
+  size_t frame_len = link_encode(LINK_SUBSCRIBE, payload, len, frame);
+
+  return write(session.fd, frame, frame_len) == (ssize_t)frame_len;
+}
+
+bool device_session_capture(
+  device_session &session,
+  const link_capture_cmd &cmd
+){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t frame[LINK_MAX_FRAME];
+
+  uint8_t len = link_pack_capture_cmd(cmd, payload);
+  size_t frame_len = link_encode(LINK_CAPTURE_CMD, payload, len, frame);
+
+  return write(session.fd, frame, frame_len) == (ssize_t)frame_len;
+}
+
+bool device_session_histogram(
+  device_session &session,
+  const link_hist_cmd &cmd
+){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t frame[LINK_MAX_FRAME];
+
+  uint8_t len = link_pack_hist_cmd(cmd, payload);
+  size_t frame_len = link_encode(LINK_HIST_CMD, payload, len, frame);
+
+  return write(session.fd, frame, frame_len) == (ssize_t)frame_len;
+}
+
+int64_t device_clock_to_host(const device_clock &clock, int64_t device_us){
+  if(!clock.known)
+    return device_us;
+
+  int64_t elapsed = device_us - clock.device_time_us;
+
+  return device_us + clock.offset_us + elapsed * clock.drift_ppb / 1000000000LL;
+}
@@ -0,0 +1,120 @@
+// Host side of one sensor head's serial link.
+//  Decodes the frame stream, answers the head's clock sync requests with host
+//    timestamps, and keeps the head's latest reported offset and drift so
+//    records from several heads can be put on one timeline.
+#ifndef DEVICE_SESSION_H
+#define DEVICE_SESSION_H
+
+#include <stdint.h>
+
+#include "serial_link.h"
+
+// Latest device->host clock mapping reported by a head.
+struct device_clock {
+  bool known;
+  uint64_t device_id;
+  int64_t offset_us;        // host - device, at device_time_us.
+  int64_t device_time_us;
+  int32_t drift_ppb;
+  uint32_t uncertainty_us;
+  uint16_t samples;
+  uint16_t rtt_us;
+  int64_t updated_us;       // Host time the status arrived.
+};
+
+struct device_session;
+
+typedef void (*spc_alarm_callback)(
+  device_session &session,
+  const link_spc_alarm &alarm
+);
+
+typedef void (*frame_callback)(
+  device_session &session,
+  const link_decoder &frame,
+  void *ctx
+);
+
+struct device_session {
+  int fd;
+  const char *name;
+  link_decoder decoder;
+  device_clock clock;
+
+  // Host receive time of the chunk currently being decoded, used as t2.
+  int64_t rx_time_us;
+
+  // Counters.
+  uint32_t readings;
+  uint32_t dropped;         // Gaps in the reading sequence numbers.
+  uint32_t sync_requests;
+  bool seq_known;
+  uint16_t next_seq;
+
+  // Process control alarms received. on_spc_alarm, if set, is called with
+  //  each one.
+  uint32_t spc_alarms;
+  spc_alarm_callback on_spc_alarm;
+
+  // Frames of any type the session doesn't handle itself go to on_frame, if
+  //  set, with frame_ctx.
+  frame_callback on_frame;
+  void *frame_ctx;
+};
+
+typedef void (*reading_callback)(
+  device_session &session,
+  const link_reading &rec,
+  void *ctx
+);
+
+void device_session_init(device_session &session, int fd, const char *name);
+
+// Reads everything pending on the session's fd and handles complete frames.
+//  Reading records are passed to on_reading, sync requests are answered
+//    immediately.
+// Returns false once the port has closed or errored.
+bool device_session_poll(
+  device_session &session,
+  reading_callback on_reading,
+  void *ctx
+);
+
+// Handles one decoded frame. Split out from device_session_poll() so other
+//  transports can drive a session directly.
+void device_session_handle_frame(
+  device_session &session,
+  const link_decoder &frame,
+  reading_callback on_reading,
+  void *ctx
+);
+
+// Sends a telemetry subscribe request to the head, see telemetry.h. The
+//  outcome arrives as a LINK_SUBSCRIBE_ACK frame through on_frame.
+//  Returns false if the write failed.
+bool device_session_subscribe(
+  device_session &session,
+  const link_subscribe &req
+);
+
+// Sends a pre-trigger capture command to the head, see capture.h. Replies
+//  arrive as LINK_CAPTURE_INFO and LINK_CAPTURE_DATA frames through on_frame.
+//  Returns false if the write failed.
+bool device_session_capture(
+  device_session &session,
+  const link_capture_cmd &cmd
+);
+
+// Sends a raw histogram command to the head, see histogram.h. Replies arrive
+//  as LINK_HIST_INFO and LINK_HIST_DATA frames through on_frame.
+//  Returns false if the write failed.
+bool device_session_histogram(
+  device_session &session,
+  const link_hist_cmd &cmd
+);
+
+// Host side view of a device timestamp using the head's reported mapping.
+//  Returns device_us unchanged if no status has been received yet.
+int64_t device_clock_to_host(const device_clock &clock, int64_t device_us);
+
+#endif
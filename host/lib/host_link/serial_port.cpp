@@ -0,0 +1,61 @@
+#include "serial_port.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Maps a numeric baud rate onto the termios constant.
+//  Returns 0 for rates termios doesn't know.
+static speed_t serial_port_speed(uint32_t baud){
+  switch(baud){
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 921600:  return B921600;
+  }
+
+  return 0;
+}
+
+int serial_port_open(const char *path, uint32_t baud){
+  speed_t speed = serial_port_speed(baud);
+  if(speed == 0){
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return -1;
+
+  // Ptys reject some of these settings, that's fine, they don't have a baud
+  //  rate to get wrong anyway.
+  struct termios tio;
+  if(tcgetattr(fd, &tio) == 0){
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    // VMIN 1 so a drained port reads as EAGAIN, with VMIN 0 it reads as 0
+    //  bytes, which is indistinguishable from the port having closed.
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  return fd;
+}
+
+int64_t host_time_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,16 @@
+// Minimal POSIX serial port setup for talking to sensor heads.
+#ifndef SERIAL_PORT_H
+#define SERIAL_PORT_H
+
+#include <stdint.h>
+
+// Opens path as a raw 8N1 port at the given baud rate, non-blocking.
+//  Works equally for real USB-UART ports and ptys.
+// Returns the file descriptor, or -1 with errno set.
+int serial_port_open(const char *path, uint32_t baud);
+
+// Current host clock, in microseconds since the Unix epoch.
+//  This is the time base every head is synchronised to.
+int64_t host_time_us();
+
+#endif
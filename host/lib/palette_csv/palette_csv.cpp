@@ -0,0 +1,94 @@
+#include "palette_csv.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Splits a CSV line into fields, honouring double quoted fields (which may
+//  contain commas, "" being a literal quote).
+static std::vector<std::string> palette_csv_split(const char *line){
+  std::vector<std::string> fields(1);
+  bool quoted = false;
+  for(const char *c=line; *c && *c != '\r' && *c != '\n'; c++){
+    if(quoted){
+      if(*c == '"' && c[1] == '"'){
+        fields.back() += '"';
+        c++;
+      }
+      else if(*c == '"'){
+        quoted = false;
+      }
+      else {
+        fields.back() += *c;
+      }
+    }
+    else if(*c == '"'){
+      quoted = true;
+    }
+    else if(*c == ','){
+      fields.emplace_back();
+    }
+    else {
+      fields.back() += *c;
+    }
+  }
+
+  return fields;
+}
+
+static bool palette_csv_channel(const std::string &field, uint8_t &out){
+  char *end;
+  long val = strtol(field.c_str(), &end, 10);
+  if(field.empty() || *end || val < 0 || val > 255)
+    return false;
+  out = (uint8_t)val;
+
+  return true;
+}
+
+bool palette_csv_load(palette_csv &out, const char *path, int *line){
+  FILE *file = fopen(path, "r");
+  if(!file)
+    return false;
+
+  const char *base = strrchr(path, '/');
+  out.name = base ? base + 1 : path;
+  out.names.clear();
+  out.colors.clear();
+
+  char buf[512];
+  int line_no = 0;
+  while(fgets(buf, sizeof(buf), file)){
+    line_no++;
+    std::vector<std::string> fields = palette_csv_split(buf);
+    if(fields.size() == 1 && fields[0].empty())
+      continue;
+
+    palette_color color;
+    if(
+      fields.size() != 6 ||
+      !palette_csv_channel(fields[3], color.rgb[0]) ||
+      !palette_csv_channel(fields[4], color.rgb[1]) ||
+      !palette_csv_channel(fields[5], color.rgb[2])
+    ){
+      fclose(file);
+      if(line)
+        *line = line_no;
+      errno = EINVAL;
+      return false;
+    }
+    out.names.push_back(fields[1]);
+    out.colors.push_back(color);
+  }
+  fclose(file);
+
+  // Names last, the vector is done growing.
+  for(size_t i=0; i<out.colors.size(); i++)
+    out.colors[i].name = out.names[i].c_str();
+  out.pal.name = out.name.c_str();
+  out.pal.colors = out.colors.data();
+  out.pal.count = out.colors.size();
+
+  return true;
+}
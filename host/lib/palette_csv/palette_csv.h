@@ -0,0 +1,25 @@
+// Palettes read from CSV, in the format of the repository's colors.csv and
+//  colors_short.csv: key,"Display Name",#hex,r,g,b per line, no header.
+#ifndef PALETTE_CSV_H
+#define PALETTE_CSV_H
+
+#include <string>
+#include <vector>
+
+#include "palette.h"
+
+// A palette and the storage behind it. Don't copy it once loaded, pal points
+//  into the vectors.
+struct palette_csv {
+  std::string name;
+  std::vector<std::string> names;   // Display names.
+  std::vector<palette_color> colors;
+  palette pal;
+};
+
+// Loads path into out, named after the file.
+//  Returns false with errno set if the file can't be read, or EINVAL if a line
+//    doesn't parse (line, if not null, receives its number).
+bool palette_csv_load(palette_csv &out, const char *path, int *line);
+
+#endif
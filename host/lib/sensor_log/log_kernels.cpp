@@ -0,0 +1,188 @@
+#include "log_kernels.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Blocks of this many vectors are summed in 32 bit lanes before being widened
+//  into the 64 bit total. 8192 * 2 * 65535 still fits a u32 lane.
+#define KERNEL_SUM_BLOCK 8192
+
+uint64_t kernel_sum_u16(const uint16_t *vals, size_t n){
+  uint64_t total = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  while(i + 8 <= n){
+    __m128i acc = zero;
+    size_t block_end = i + 8 * KERNEL_SUM_BLOCK;
+    if(block_end > n)
+      block_end = n;
+    for(; i + 8 <= block_end; i += 8){
+      __m128i v = _mm_loadu_si128((const __m128i *)(vals + i));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  while(i + 8 <= n){
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t block_end = i + 8 * KERNEL_SUM_BLOCK;
+    if(block_end > n)
+      block_end = n;
+    for(; i + 8 <= block_end; i += 8)
+      acc = vpadalq_u16(acc, vld1q_u16(vals + i));
+    total += vaddlvq_u32(acc);
+  }
+#endif
+
+  for(; i<n; i++)
+    total += vals[i];
+
+  return total;
+}
+
+void kernel_min_max_u16(
+  const uint16_t *vals,
+  size_t n,
+  uint16_t &min_val,
+  uint16_t &max_val
+){
+  uint16_t lo = 0xFFFF;
+  uint16_t hi = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // SSE2 only has signed 16 bit min/max, flipping the sign bit maps unsigned
+  //  order onto signed order.
+  if(n >= 8){
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i vmin = _mm_set1_epi16(0x7FFF);
+    __m128i vmax = _mm_set1_epi16((short)0x8000);
+    for(; i + 8 <= n; i += 8){
+      __m128i v = _mm_xor_si128(
+        _mm_loadu_si128((const __m128i *)(vals + i)),
+        bias
+      );
+      vmin = _mm_min_epi16(vmin, v);
+      vmax = _mm_max_epi16(vmax, v);
+    }
+    uint16_t mins[8], maxs[8];
+    _mm_storeu_si128((__m128i *)mins, _mm_xor_si128(vmin, bias));
+    _mm_storeu_si128((__m128i *)maxs, _mm_xor_si128(vmax, bias));
+    for(uint8_t l=0; l<8; l++){
+      if(mins[l] < lo)
+        lo = mins[l];
+      if(maxs[l] > hi)
+        hi = maxs[l];
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  if(n >= 8){
+    uint16x8_t vmin = vdupq_n_u16(0xFFFF);
+    uint16x8_t vmax = vdupq_n_u16(0);
+    for(; i + 8 <= n; i += 8){
+      uint16x8_t v = vld1q_u16(vals + i);
+      vmin = vminq_u16(vmin, v);
+      vmax = vmaxq_u16(vmax, v);
+    }
+    lo = vminvq_u16(vmin);
+    hi = vmaxvq_u16(vmax);
+  }
+#endif
+
+  for(; i<n; i++){
+    if(vals[i] < lo)
+      lo = vals[i];
+    if(vals[i] > hi)
+      hi = vals[i];
+  }
+
+  min_val = lo;
+  max_val = hi;
+
+  return;
+}
+
+size_t kernel_count_eq_u8(const uint8_t *vals, size_t n, uint8_t match){
+  size_t count = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // Matches become 0x01 bytes, SAD against zero sums each 8 byte half.
+  const __m128i key = _mm_set1_epi8((char)match);
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for(; i + 16 <= n; i += 16){
+    __m128i v = _mm_loadu_si128((const __m128i *)(vals + i));
+    __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(v, key), one);
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(hits, zero));
+  }
+  uint64_t halves[2];
+  _mm_storeu_si128((__m128i *)halves, acc);
+  count = halves[0] + halves[1];
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t key = vdupq_n_u8(match);
+  for(; i + 16 <= n; i += 16){
+    uint8x16_t hits = vshrq_n_u8(vceqq_u8(vld1q_u8(vals + i), key), 7);
+    count += vaddlvq_u8(hits);
+  }
+#endif
+
+  for(; i<n; i++)
+    count += (vals[i] == match);
+
+  return count;
+}
+
+void kernel_histogram_u8(const uint8_t *vals, size_t n, uint32_t *hist){
+  // Consecutive parts are usually the same class, four interleaved tables keep
+  //  back to back increments off the same counter.
+  uint32_t sub[4][256];
+  memset(sub, 0, sizeof(sub));
+
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    sub[0][vals[i]]++;
+    sub[1][vals[i + 1]]++;
+    sub[2][vals[i + 2]]++;
+    sub[3][vals[i + 3]]++;
+  }
+  for(; i<n; i++)
+    sub[0][vals[i]]++;
+
+  for(uint16_t b=0; b<256; b++)
+    hist[b] += sub[0][b] + sub[1][b] + sub[2][b] + sub[3][b];
+
+  return;
+}
+
+void kernel_histogram_u16(const uint16_t *vals, size_t n, uint32_t *hist){
+  // Table is too big to replicate, pair the increments to break the
+  //  dependency when neighbouring values repeat.
+  size_t i = 0;
+  for(; i + 2 <= n; i += 2){
+    uint16_t a = vals[i];
+    uint16_t b = vals[i + 1];
+    if(a == b){
+      hist[a] += 2;
+    }
+    else {
+      hist[a]++;
+      hist[b]++;
+    }
+  }
+  if(i < n)
+    hist[vals[i]]++;
+
+  return;
+}
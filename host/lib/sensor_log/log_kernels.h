@@ -0,0 +1,32 @@
+// Aggregation kernels run directly over mmap'ed log columns.
+//  The sum, extrema and match count kernels use SSE2 on x86-64 and NEON on
+//    AArch64 (both are baseline on those targets, so no runtime dispatch) with
+//    a scalar fallback elsewhere. Histogram kernels are scatter bound, those
+//    spread the increments over several sub-histograms instead.
+#ifndef LOG_KERNELS_H
+#define LOG_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sum of n unsigned 16 bit values.
+uint64_t kernel_sum_u16(const uint16_t *vals, size_t n);
+
+// Minimum and maximum of n unsigned 16 bit values. n must be > 0.
+void kernel_min_max_u16(
+  const uint16_t *vals,
+  size_t n,
+  uint16_t &min_val,
+  uint16_t &max_val
+);
+
+// Number of entries equal to match.
+size_t kernel_count_eq_u8(const uint8_t *vals, size_t n, uint8_t match);
+
+// Adds the n byte values into hist[256].
+void kernel_histogram_u8(const uint8_t *vals, size_t n, uint32_t *hist);
+
+// Adds the n 16 bit values into hist[65536].
+void kernel_histogram_u16(const uint16_t *vals, size_t n, uint32_t *hist);
+
+#endif
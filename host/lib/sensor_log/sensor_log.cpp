@@ -0,0 +1,354 @@
+#include "sensor_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static off_t sensor_log_chunk_offset(uint32_t chunk_index){
+  return SENSOR_LOG_HEADER_BYTES + (off_t)chunk_index * SENSOR_LOG_CHUNK_BYTES;
+}
+
+static bool sensor_log_pwrite_all(
+  int fd,
+  const uint8_t *buf,
+  size_t len,
+  off_t offset
+){
+  while(len > 0){
+    ssize_t written = pwrite(fd, buf, len, offset);
+    if(written < 0){
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += written;
+    len -= written;
+    offset += written;
+  }
+
+  return true;
+}
+
+static bool sensor_log_pread_all(
+  int fd,
+  uint8_t *buf,
+  size_t len,
+  off_t offset
+){
+  while(len > 0){
+    ssize_t got = pread(fd, buf, len, offset);
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return false;
+    buf += got;
+    len -= got;
+    offset += got;
+  }
+
+  return true;
+}
+
+bool sensor_log_writer_open(
+  sensor_log_writer &log,
+  const char *path,
+  uint64_t device_id
+){
+  memset(&log, 0, sizeof(log));
+  log.fd = -1;
+  log.device_id = device_id;
+  log.flush_every = 64;
+  log.last_time = INT64_MIN;
+
+  log.chunk = (uint8_t *)calloc(1, SENSOR_LOG_CHUNK_BYTES);
+  if(!log.chunk)
+    return false;
+
+  log.fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(log.fd < 0){
+    free(log.chunk);
+    log.chunk = NULL;
+    return false;
+  }
+
+  struct stat st;
+  if(fstat(log.fd, &st) != 0){
+    sensor_log_writer_close(log);
+    return false;
+  }
+
+  uint8_t header_page[SENSOR_LOG_HEADER_BYTES];
+  sensor_log_file_header header;
+
+  // New file, write the header and start at chunk 0.
+  if(st.st_size == 0){
+    memset(header_page, 0, sizeof(header_page));
+    memset(&header, 0, sizeof(header));
+    header.magic = SENSOR_LOG_MAGIC;
+    header.version = SENSOR_LOG_VERSION;
+    header.chunk_records = SENSOR_LOG_CHUNK_RECORDS;
+    header.chunk_bytes = SENSOR_LOG_CHUNK_BYTES;
+    header.device_id = device_id;
+    memcpy(header_page, &header, sizeof(header));
+    if(!sensor_log_pwrite_all(log.fd, header_page, sizeof(header_page), 0)){
+      sensor_log_writer_close(log);
+      return false;
+    }
+    return true;
+  }
+
+  // Existing file, check it's ours and pick up from the last chunk.
+  if(
+    !sensor_log_pread_all(log.fd, (uint8_t *)&header, sizeof(header), 0) ||
+    header.magic != SENSOR_LOG_MAGIC ||
+    header.version != SENSOR_LOG_VERSION ||
+    header.chunk_records != SENSOR_LOG_CHUNK_RECORDS ||
+    header.chunk_bytes != SENSOR_LOG_CHUNK_BYTES ||
+    header.device_id != device_id
+  ){
+    sensor_log_writer_close(log);
+    errno = EINVAL;
+    return false;
+  }
+
+  off_t data_bytes = st.st_size - SENSOR_LOG_HEADER_BYTES;
+  uint32_t chunks = data_bytes / SENSOR_LOG_CHUNK_BYTES;
+  if(chunks == 0)
+    return true;
+
+  log.chunk_index = chunks - 1;
+  if(!sensor_log_pread_all(
+    log.fd,
+    log.chunk,
+    SENSOR_LOG_CHUNK_BYTES,
+    sensor_log_chunk_offset(log.chunk_index)
+  )){
+    sensor_log_writer_close(log);
+    errno = EINVAL;
+    return false;
+  }
+
+  sensor_log_chunk_header *chunk_header = (sensor_log_chunk_header *)log.chunk;
+  if(chunk_header->count > 0)
+    log.last_time = chunk_header->t_max;
+
+  // Last chunk is full, the next record starts a fresh one.
+  if(chunk_header->count >= SENSOR_LOG_CHUNK_RECORDS){
+    log.chunk_index++;
+    memset(log.chunk, 0, SENSOR_LOG_CHUNK_BYTES);
+  }
+
+  return true;
+}
+
+bool sensor_log_flush(sensor_log_writer &log){
+  if(log.fd < 0)
+    return false;
+
+  log.unflushed = 0;
+  sensor_log_chunk_header *chunk_header = (sensor_log_chunk_header *)log.chunk;
+  if(chunk_header->count == 0)
+    return true;
+
+  return sensor_log_pwrite_all(
+    log.fd,
+    log.chunk,
+    SENSOR_LOG_CHUNK_BYTES,
+    sensor_log_chunk_offset(log.chunk_index)
+  );
+}
+
+bool sensor_log_append(sensor_log_writer &log, const link_reading &rec){
+  if(log.fd < 0)
+    return false;
+
+  sensor_log_chunk_header *chunk_header = (sensor_log_chunk_header *)log.chunk;
+  uint32_t i = chunk_header->count;
+
+  // Clock corrections can step a head's timestamps back by a few hundred us,
+  //  hold the time instead so the file stays sorted.
+  int64_t t = rec.host_time_us;
+  if(t < log.last_time)
+    t = log.last_time;
+  log.last_time = t;
+
+  ((int64_t *)(log.chunk + SENSOR_LOG_COL_TIME))[i] = t;
+  ((uint32_t *)(log.chunk + SENSOR_LOG_COL_UNC))[i] = rec.uncertainty_us;
+  (log.chunk + SENSOR_LOG_COL_CLASS)[i] = rec.class_index;
+  for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+    ((uint16_t *)(log.chunk + SENSOR_LOG_COL_RAW(ch)))[i] = rec.raw[ch];
+    ((int16_t *)(log.chunk + SENSOR_LOG_COL_MAPPED(ch)))[i] = rec.mapped[ch];
+  }
+
+  if(i == 0)
+    chunk_header->t_min = t;
+  chunk_header->t_max = t;
+  chunk_header->count = i + 1;
+  log.unflushed++;
+
+  if(chunk_header->count >= SENSOR_LOG_CHUNK_RECORDS){
+    if(!sensor_log_flush(log))
+      return false;
+    log.chunk_index++;
+    memset(log.chunk, 0, SENSOR_LOG_CHUNK_BYTES);
+  }
+  else if(log.unflushed >= log.flush_every){
+    return sensor_log_flush(log);
+  }
+
+  return true;
+}
+
+void sensor_log_writer_close(sensor_log_writer &log){
+  if(log.fd >= 0){
+    sensor_log_flush(log);
+    close(log.fd);
+  }
+  free(log.chunk);
+  log.fd = -1;
+  log.chunk = NULL;
+
+  return;
+}
+
+bool sensor_log_reader_open(sensor_log_reader &log, const char *path){
+  log.fd = -1;
+  log.base = NULL;
+  log.size = 0;
+  log.index.clear();
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < SENSOR_LOG_HEADER_BYTES){
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(base == MAP_FAILED){
+    close(fd);
+    return false;
+  }
+
+  const sensor_log_file_header *header = (const sensor_log_file_header *)base;
+  if(
+    header->magic != SENSOR_LOG_MAGIC ||
+    header->version != SENSOR_LOG_VERSION ||
+    header->chunk_records != SENSOR_LOG_CHUNK_RECORDS ||
+    header->chunk_bytes != SENSOR_LOG_CHUNK_BYTES
+  ){
+    munmap(base, st.st_size);
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  log.fd = fd;
+  log.base = (const uint8_t *)base;
+  log.size = st.st_size;
+  log.device_id = header->device_id;
+
+  // A chunk that's still being written may be cut short at the end of the
+  //  file, only whole chunks are indexed.
+  size_t chunks = (log.size - SENSOR_LOG_HEADER_BYTES) / SENSOR_LOG_CHUNK_BYTES;
+  log.index.reserve(chunks);
+  for(size_t c=0; c<chunks; c++){
+    const sensor_log_chunk_header *chunk_header =
+      (const sensor_log_chunk_header *)(log.base + sensor_log_chunk_offset(c));
+    sensor_log_index_entry entry;
+    entry.t_min = chunk_header->t_min;
+    entry.t_max = chunk_header->t_max;
+    entry.count = chunk_header->count;
+    if(entry.count > SENSOR_LOG_CHUNK_RECORDS)
+      entry.count = 0;
+    log.index.push_back(entry);
+  }
+
+  return true;
+}
+
+void sensor_log_reader_close(sensor_log_reader &log){
+  if(log.base)
+    munmap((void *)log.base, log.size);
+  if(log.fd >= 0)
+    close(log.fd);
+  log.base = NULL;
+  log.fd = -1;
+  log.index.clear();
+
+  return;
+}
+
+size_t sensor_log_lower_bound(const int64_t *t, size_t n, int64_t key){
+  size_t first = 0;
+  while(n > 0){
+    size_t half = n / 2;
+    if(t[first + half] < key){
+      first += half + 1;
+      n -= half + 1;
+    }
+    else {
+      n = half;
+    }
+  }
+
+  return first;
+}
+
+void sensor_log_select(
+  const sensor_log_reader &log,
+  int64_t from,
+  int64_t to,
+  std::vector<sensor_log_span> &spans
+){
+  // First chunk that can contain from.
+  size_t lo = 0, hi = log.index.size();
+  while(lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if(log.index[mid].t_max < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for(size_t c=lo; c<log.index.size(); c++){
+    const sensor_log_index_entry &entry = log.index[c];
+    if(entry.count == 0)
+      continue;
+    if(entry.t_min >= to)
+      break;
+
+    const uint8_t *chunk = log.base + sensor_log_chunk_offset(c);
+    const int64_t *time = (const int64_t *)(chunk + SENSOR_LOG_COL_TIME);
+
+    // Only the boundary chunks need searching.
+    size_t first = entry.t_min >= from ?
+      0 : sensor_log_lower_bound(time, entry.count, from);
+    size_t last = entry.t_max < to ?
+      entry.count : sensor_log_lower_bound(time, entry.count, to);
+    if(first >= last)
+      continue;
+
+    sensor_log_span span;
+    span.count = last - first;
+    span.time = time + first;
+    span.uncertainty = (const uint32_t *)(chunk + SENSOR_LOG_COL_UNC) + first;
+    span.class_index = chunk + SENSOR_LOG_COL_CLASS + first;
+    for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+      span.raw[ch] = (const uint16_t *)(chunk + SENSOR_LOG_COL_RAW(ch)) + first;
+      span.mapped[ch] =
+        (const int16_t *)(chunk + SENSOR_LOG_COL_MAPPED(ch)) + first;
+    }
+    spans.push_back(span);
+  }
+
+  return;
+}
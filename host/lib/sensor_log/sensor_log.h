@@ -0,0 +1,147 @@
+// Columnar on-disk log of a head's reading records.
+//
+// One file per head. After a one page file header the file is a sequence of
+//  fixed size chunks, each holding up to SENSOR_LOG_CHUNK_RECORDS records
+//  stored column by column:
+//    [chunk header][time i64][uncertainty u32][class u8][raw u16 x4][mapped i16 x4]
+//  Every column is 64 byte aligned and sized for a full chunk, so a reader can
+//    mmap the file and hand column pointers straight to the aggregation
+//    kernels, and a writer can rewrite its current chunk in place.
+//  Times are host microseconds and never decrease within a file (the writer
+//    clamps small backwards steps from clock sync corrections), so a time range
+//    maps onto a contiguous record range found by binary search.
+//  The sparse index is one {t_min, t_max, count} entry per chunk, built from
+//    the chunk headers when a log is opened.
+#ifndef SENSOR_LOG_H
+#define SENSOR_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "serial_link.h"
+
+#define SENSOR_LOG_MAGIC 0x31474F4C53435343ULL  // "CSCSLOG1"
+#define SENSOR_LOG_VERSION 1
+
+// Records per chunk. 4096 is ~7 minutes of a head at its 10Hz loop rate.
+#define SENSOR_LOG_CHUNK_RECORDS 4096
+
+#define SENSOR_LOG_HEADER_BYTES 4096
+#define SENSOR_LOG_CHUNK_HEADER_BYTES 64
+#define SENSOR_LOG_CHANNELS 4
+
+// Byte offsets of each column within a chunk.
+#define SENSOR_LOG_COL_TIME \
+  SENSOR_LOG_CHUNK_HEADER_BYTES
+#define SENSOR_LOG_COL_UNC \
+  (SENSOR_LOG_COL_TIME + 8 * SENSOR_LOG_CHUNK_RECORDS)
+#define SENSOR_LOG_COL_CLASS \
+  (SENSOR_LOG_COL_UNC + 4 * SENSOR_LOG_CHUNK_RECORDS)
+#define SENSOR_LOG_COL_RAW(ch) \
+  (SENSOR_LOG_COL_CLASS + SENSOR_LOG_CHUNK_RECORDS + \
+    (ch) * 2 * SENSOR_LOG_CHUNK_RECORDS)
+#define SENSOR_LOG_COL_MAPPED(ch) \
+  (SENSOR_LOG_COL_RAW(SENSOR_LOG_CHANNELS) + (ch) * 2 * SENSOR_LOG_CHUNK_RECORDS)
+
+// Whole chunk, rounded up to a page multiple.
+#define SENSOR_LOG_CHUNK_BYTES \
+  ((SENSOR_LOG_COL_MAPPED(SENSOR_LOG_CHANNELS) + 4095) & ~4095)
+
+struct sensor_log_file_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t chunk_records;
+  uint32_t chunk_bytes;
+  uint32_t reserved;
+  uint64_t device_id;
+};
+
+struct sensor_log_chunk_header {
+  uint32_t count;
+  uint32_t reserved;
+  int64_t t_min;
+  int64_t t_max;
+};
+
+//------------------------------------------------------------------------------
+// Writer
+//------------------------------------------------------------------------------
+// Records are staged in a chunk sized buffer and written out whenever the
+//  chunk fills, every flush_every records, and on close.
+struct sensor_log_writer {
+  int fd;
+  uint64_t device_id;
+  uint32_t chunk_index;
+  uint32_t unflushed;
+  uint32_t flush_every;
+  int64_t last_time;
+  uint8_t *chunk;
+};
+
+// Opens (or creates) path for appending records from device_id.
+//  An existing log is continued from its last chunk.
+// Returns false with errno set on failure, or EINVAL if the file isn't a log
+//  for the same device.
+bool sensor_log_writer_open(
+  sensor_log_writer &log,
+  const char *path,
+  uint64_t device_id
+);
+
+bool sensor_log_append(sensor_log_writer &log, const link_reading &rec);
+
+bool sensor_log_flush(sensor_log_writer &log);
+
+void sensor_log_writer_close(sensor_log_writer &log);
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Reader
+//------------------------------------------------------------------------------
+struct sensor_log_index_entry {
+  int64_t t_min;
+  int64_t t_max;
+  uint32_t count;
+};
+
+// Read-only mmap of a log file.
+struct sensor_log_reader {
+  int fd;
+  const uint8_t *base;
+  size_t size;
+  uint64_t device_id;
+  std::vector<sensor_log_index_entry> index;
+};
+
+// Column pointers for a contiguous run of records inside one chunk.
+struct sensor_log_span {
+  size_t count;
+  const int64_t *time;
+  const uint32_t *uncertainty;
+  const uint8_t *class_index;
+  const uint16_t *raw[SENSOR_LOG_CHANNELS];
+  const int16_t *mapped[SENSOR_LOG_CHANNELS];
+};
+
+bool sensor_log_reader_open(sensor_log_reader &log, const char *path);
+
+void sensor_log_reader_close(sensor_log_reader &log);
+
+// First position in time[0, n) with time[i] >= key.
+size_t sensor_log_lower_bound(const int64_t *time, size_t n, int64_t key);
+
+// Collects the record spans with from <= time < to, in time order.
+//  Uses the sparse index to skip chunks and a binary search on the time
+//    column at the two boundary chunks.
+void sensor_log_select(
+  const sensor_log_reader &log,
+  int64_t from,
+  int64_t to,
+  std::vector<sensor_log_span> &spans
+);
+//------------------------------------------------------------------------------
+
+#endif
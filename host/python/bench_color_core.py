@@ -0,0 +1,234 @@
+"""Benchmarks the color_core bindings against a pure NumPy reference.
+
+The reference re-implements color_calibrate_channel(), the reading variance
+estimate and color_classify_noisy() with its confidence in vectorised NumPy,
+so the two can be checked for identical results before being timed.
+
+    python bench_color_core.py [--rows N] [--repeat R]
+"""
+import argparse
+import os
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+
+import color_core
+
+
+def np_calibrate(raw, calib):
+    """Vectorised color_calibrate_channel() for every column of raw."""
+    cols = min(raw.shape[1], 4)
+    lo = calib[:cols, 0]
+    hi = calib[:cols, 1]
+    num = (raw[:, :cols].astype(np.int64) - lo) * (0 - 255)
+    den = hi - lo
+    # C integer division truncates toward zero, NumPy's // floors.
+    quot = np.sign(num) * (np.abs(num) // np.abs(den)) * np.sign(den)
+    return (quot + 255).astype(np.int32)
+
+
+WB_DEVIATION = 8
+WB_DETERMINE = 220 * 3
+PERIOD_JITTER_PPT = 12
+NOISE_SIGMAS = 2
+NOISE_MAX_WIDEN = 24
+
+
+def np_raw_variance(raw):
+    """Vectorised color_raw_variance(), for a single pulse per reading."""
+    cols = min(raw.shape[1], 4)
+    raw = raw[:, :cols].astype(np.int64)
+    jitter = raw * PERIOD_JITTER_PPT
+    var = ((1 << color_core.VAR_FRAC_BITS) // 12
+           + ((jitter * jitter) << color_core.VAR_FRAC_BITS) // 1000000)
+    var = np.minimum(var, color_core.VAR_UNKNOWN)
+    return np.where(raw <= 0, color_core.VAR_UNKNOWN, var).astype(np.uint32)
+
+
+def np_calibrate_variance(var, calib):
+    """Vectorised color_calibrate_variance() for every column of var."""
+    cols = var.shape[1]
+    span = calib[:cols, 1] - calib[:cols, 0]
+    with np.errstate(divide="ignore"):
+        mapped = var.astype(np.int64) * 255 * 255 // (span * span)
+    unknown = (var == color_core.VAR_UNKNOWN) | (span == 0)
+    mapped = np.minimum(mapped, color_core.VAR_UNKNOWN)
+    return np.where(unknown, color_core.VAR_UNKNOWN, mapped).astype(np.uint32)
+
+
+def np_bw_radius(variances, i, j):
+    """color_bw_radius(): the black/white radius of a channel pair."""
+    if variances is None:
+        return np.float64(WB_DEVIATION)
+    var = variances[:, i].astype(np.uint64) + variances[:, j]
+    widen = NOISE_SIGMAS * np.sqrt(var / (1 << color_core.VAR_FRAC_BITS))
+    return WB_DEVIATION + np.minimum(widen, NOISE_MAX_WIDEN)
+
+
+def np_outliers(r, g, b):
+    """The Grubb's values color_classify() compares, per channel."""
+    total = r + g + b
+    avg = (np.sign(total) * (np.abs(total) // 3)).astype(np.float64)
+    std_dev = np.sqrt(((r - avg) ** 2 + (g - avg) ** 2 + (b - avg) ** 2) / 3)
+    with np.errstate(divide="ignore", invalid="ignore"):
+        return (np.abs(avg - r) / std_dev,
+                np.abs(avg - g) / std_dev,
+                np.abs(avg - b) / std_dev)
+
+
+def np_classify(mapped, variances=None):
+    """Vectorised color_classify_noisy(), including its branch order.
+
+    Without variances this is color_classify().
+    """
+    r = mapped[:, 0].astype(np.int64)
+    g = mapped[:, 1].astype(np.int64)
+    b = mapped[:, 2].astype(np.int64)
+    rg_dev = np_bw_radius(variances, 0, 1)
+    rb_dev = np_bw_radius(variances, 0, 2)
+    gb_dev = np_bw_radius(variances, 1, 2)
+
+    red_bw = (np.abs(r - g) < rg_dev) & (np.abs(r - b) < rb_dev)
+    grn_bw = (np.abs(g - r) < rg_dev) & (np.abs(g - b) < gb_dev)
+    blu_bw = (np.abs(b - r) < rb_dev) & (np.abs(b - g) < gb_dev)
+    bw = red_bw & grn_bw & blu_bw
+    white = (r + g + b) > WB_DETERMINE
+
+    red_out, grn_out, blu_out = np_outliers(r, g, b)
+
+    red = (red_out > grn_out) & (red_out > blu_out)
+    grn = (grn_out > red_out) & (grn_out > blu_out)
+    blu = (blu_out > red_out) & (blu_out > grn_out)
+    # The firmware's red check compares against green twice.
+    red_neg = r < g
+    grn_neg = (g < r) | (g < b)
+    blu_neg = (b < r) | (b < g)
+
+    return np.select(
+        [bw & white, bw,
+         red & red_neg, red,
+         grn & grn_neg, grn,
+         blu & blu_neg, blu],
+        [color_core.WHITE_STR, color_core.BLACK_STR,
+         color_core.UNDEF_STR, color_core.RED_STR,
+         color_core.UNDEF_STR, color_core.GREEN_STR,
+         color_core.UNDEF_STR, color_core.BLUE_STR],
+        color_core.MAP_ERR,
+    ).astype(np.uint8)
+
+
+def np_confidence(mapped, classes, variances=None):
+    """Vectorised color_classify_confidence_noisy()."""
+    r = mapped[:, 0].astype(np.int64)
+    g = mapped[:, 1].astype(np.int64)
+    b = mapped[:, 2].astype(np.int64)
+    chans = (r, g, b)
+
+    # Black/white: margin to the nearest of the spread and level thresholds.
+    spread = np.ones(len(r))
+    for i, j in ((0, 1), (0, 2), (1, 2)):
+        radius = np_bw_radius(variances, i, j)
+        spread = np.minimum(
+            spread, (radius - np.abs(chans[i] - chans[j])) / radius
+        )
+    level = np.abs((r + g + b).astype(np.float64) - WB_DETERMINE) / (
+        3.0 * WB_DEVIATION
+    )
+    bw_margin = np.clip(np.minimum(spread, level), 0, 1)
+
+    # Outlier classes: gap between the largest Grubb's value and the next.
+    outliers = np.sort(np.stack(np_outliers(r, g, b), axis=1), axis=1)
+    with np.errstate(invalid="ignore"):
+        gap = (outliers[:, 2] - outliers[:, 1]) / (np.sqrt(2) / 2)
+    gap = np.minimum(gap, 1)
+    gap = np.where(np.isnan(gap), 0, gap)
+
+    bw = (classes == color_core.BLACK_STR) | (classes == color_core.WHITE_STR)
+    outlier = np.isin(
+        classes,
+        [color_core.RED_STR, color_core.GREEN_STR, color_core.BLUE_STR,
+         color_core.UNDEF_STR],
+    )
+    margin = np.select([bw, outlier], [bw_margin, gap], 0)
+    return (margin * 100 + 0.5).astype(np.uint8)
+
+
+def best_of(repeat, fn):
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        fn()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--rows", type=int, default=2_000_000)
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    rng = np.random.default_rng(0)
+    # Pulse widths spanning and slightly exceeding the calibration ranges.
+    raw = rng.integers(0, 130, size=(args.rows, 4), dtype=np.int32)
+    calib = np.array(color_core.get_calibration(), dtype=np.int64)
+    threads = os.cpu_count() or 1
+
+    mapped = color_core.calibrate(raw)
+    assert np.array_equal(mapped, np_calibrate(raw, calib)), "calibrate"
+    classes = color_core.classify(mapped)
+    assert np.array_equal(classes, np_classify(mapped)), "classify"
+    # classify_raw() widens by each pulse's estimated noise, as the heads do.
+    variances = color_core.variances(raw)
+    assert np.array_equal(
+        variances, np_calibrate_variance(np_raw_variance(raw), calib)
+    ), "variances"
+    noisy, confidence = color_core.classify(
+        mapped, variances=variances, return_confidence=True
+    )
+    assert np.array_equal(noisy, np_classify(mapped, variances)), "noisy"
+    assert np.array_equal(
+        confidence, np_confidence(mapped, noisy, variances)
+    ), "confidence"
+    assert np.array_equal(color_core.classify_raw(raw), noisy), "fused"
+    # Strided input is read in place, same answer.
+    assert np.array_equal(
+        color_core.classify_raw(np.asfortranarray(raw)), noisy
+    ), "strided"
+
+    def py_threads():
+        parts = np.array_split(raw, threads)
+        with ThreadPoolExecutor(threads) as pool:
+            return list(pool.map(color_core.classify_raw, parts))
+
+    cases = [
+        ("numpy calibrate+classify",
+         lambda: np_classify(
+             np_calibrate(raw, calib),
+             np_calibrate_variance(np_raw_variance(raw), calib),
+         )),
+        ("color_core calibrate+classify",
+         lambda: color_core.classify(
+             color_core.calibrate(raw), variances=color_core.variances(raw)
+         )),
+        ("color_core classify_raw",
+         lambda: color_core.classify_raw(raw)),
+        (f"color_core classify_raw threads={threads}",
+         lambda: color_core.classify_raw(raw, threads=threads)),
+        (f"color_core classify_raw x{threads} Python threads", py_threads),
+    ]
+
+    print(f"{args.rows} rows, best of {args.repeat}")
+    baseline = None
+    for name, fn in cases:
+        secs = best_of(args.repeat, fn)
+        baseline = baseline or secs
+        print(
+            f"  {name:<45} {secs * 1e3:9.2f} ms "
+            f"{args.rows / secs / 1e6:8.2f} Mrows/s {baseline / secs:6.2f}x"
+        )
+
+
+if __name__ == "__main__":
+    main()
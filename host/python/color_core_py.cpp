@@ -0,0 +1,511 @@
+// Python bindings for the portable calibration and classification core.
+//
+// Batch functions take any buffer protocol object (NumPy arrays in practice)
+//  of shape (n, channels) with a 16, 32 or 64 bit integer dtype and read it in
+//  place through its strides, so slices, transposes and log columns stacked
+//  with np.stack(..., axis=1) are never copied. Only the results are
+//  allocated. The GIL is released for the whole batch, and threads=N further
+//  splits a single call across N native threads.
+// Classification goes through color_classify_noisy() and its confidence, as
+//  on the heads, whenever reading variances are given or, for raw readings,
+//  estimated from the pulse widths.
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "color_core.h"
+
+namespace py = pybind11;
+
+// Class names, index locked to enum COLOR_STR_MAP. Matches the firmware's
+//  RGB_DISPLAY_MAP.
+static const char *class_names[RGB_VAL_MAPPING_LEN] = {
+  "Red",
+  "Green",
+  "Blue",
+  "Black",
+  "White",
+  "Undef"
+};
+
+// Validated view of a caller's (n, channels) integer array.
+struct reading_view {
+  py::buffer_info info;
+  const uint8_t *base;
+  ssize_t rows;
+  ssize_t cols;
+  ssize_t row_stride;
+  ssize_t col_stride;
+  ssize_t itemsize;
+  bool is_signed;
+};
+
+// Checks buf is a 2D integer array with at least min_cols columns.
+//  Raises TypeError/ValueError rather than converting, a conversion would be a
+//    silent copy.
+static reading_view reading_view_from(py::buffer buf, ssize_t min_cols){
+  reading_view view;
+  view.info = buf.request();
+
+  if(view.info.ndim != 2 || view.info.shape[1] < min_cols){
+    throw py::value_error(
+      "expected an array of shape (n, " + std::to_string(min_cols) +
+      ") or (n, 4), got ndim=" + std::to_string(view.info.ndim)
+    );
+  }
+
+  // Struct module format, possibly prefixed with a byte order character.
+  std::string format = view.info.format;
+  char kind = format.empty() ? '?' : format.back();
+  if(format.size() > 1 && format[0] != '<' && format[0] != '=' &&
+     format[0] != '@'){
+    throw py::type_error("only native byte order arrays are supported");
+  }
+  switch(kind){
+    case 'h': case 'i': case 'l': case 'q':
+      view.is_signed = true;
+      break;
+    case 'H': case 'I': case 'L': case 'Q':
+      view.is_signed = false;
+      break;
+    default:
+      throw py::type_error(
+        "expected an integer array (int16/32/64 or uint16/32), got format '" +
+        format + "'"
+      );
+  }
+  view.itemsize = view.info.itemsize;
+  if(
+    view.itemsize != 2 && view.itemsize != 4 &&
+    !(view.itemsize == 8 && view.is_signed)
+  ){
+    throw py::type_error("unsupported integer width");
+  }
+
+  view.base = (const uint8_t *)view.info.ptr;
+  view.rows = view.info.shape[0];
+  view.cols = view.info.shape[1];
+  view.row_stride = view.info.strides[0];
+  view.col_stride = view.info.strides[1];
+
+  return view;
+}
+
+// Where classify_rows() gets each reading's variance from.
+enum VARIANCE_SOURCES {
+  VARIANCE_NONE       = 0,  // color_classify(), no noise widening.
+  VARIANCE_GIVEN      = 1,  // A caller's uint32 array, matching the readings.
+  VARIANCE_FROM_WIDTH = 2   // color_raw_variance() of the raw pulse width.
+};
+
+// Checks buf is a uint32 variance array with a row per reading.
+static reading_view variance_view_from(py::buffer buf, ssize_t rows){
+  reading_view view = reading_view_from(buf, 3);
+  if(view.is_signed || view.itemsize != 4){
+    throw py::type_error(
+      "variances must be uint32, fixed point with VAR_FRAC_BITS fractional "
+      "bits"
+    );
+  }
+  if(view.rows != rows)
+    throw py::value_error("variances need one row per reading");
+
+  return view;
+}
+
+static inline uint32_t variance_at(
+  const reading_view &view,
+  ssize_t row,
+  ssize_t col
+){
+  return *(const uint32_t *)(
+    view.base + row * view.row_stride + col * view.col_stride
+  );
+}
+
+// Reads element (row, col) as an int of element type T.
+template <typename T>
+static inline int reading_at(
+  const reading_view &view,
+  ssize_t row,
+  ssize_t col
+){
+  return (int)*(const T *)(
+    view.base + row * view.row_stride + col * view.col_stride
+  );
+}
+
+// Per-row kernels, instantiated once per input element type so the inner
+//  loops don't branch on dtype.
+template <typename T>
+static void calibrate_rows(
+  const reading_view &view,
+  ssize_t first,
+  ssize_t last,
+  int32_t *out
+){
+  ssize_t cols = view.cols < 4 ? view.cols : 4;
+  for(ssize_t row=first; row<last; row++){
+    for(ssize_t col=0; col<cols; col++){
+      out[row * cols + col] =
+        color_calibrate_channel(reading_at<T>(view, row, col), col);
+    }
+  }
+
+  return;
+}
+
+template <typename T>
+static void variance_rows(
+  const reading_view &view,
+  ssize_t first,
+  ssize_t last,
+  uint32_t *out
+){
+  ssize_t cols = view.cols < 4 ? view.cols : 4;
+  for(ssize_t row=first; row<last; row++){
+    for(ssize_t col=0; col<cols; col++){
+      uint32_t var = color_raw_variance(reading_at<T>(view, row, col));
+      out[row * cols + col] = color_calibrate_variance(var, col);
+    }
+  }
+
+  return;
+}
+
+// Classifies rows as read_color_channel() and classify_frame() do on the
+//  heads. Given variances are raw us^2 when calibrating, calibrated
+//  otherwise. confidence, if not null, receives each row's confidence.
+template <typename T>
+static void classify_rows(
+  const reading_view &view,
+  ssize_t first,
+  ssize_t last,
+  bool calibrate,
+  uint8_t source,
+  const reading_view *variances,
+  uint8_t *out,
+  uint8_t *confidence
+){
+  int readings[4] = {0, 0, 0, 0};
+  uint32_t vars[4] = {0, 0, 0, 0};
+  for(ssize_t row=first; row<last; row++){
+    for(ssize_t col=0; col<3; col++){
+      int val = reading_at<T>(view, row, col);
+      if(source == VARIANCE_GIVEN)
+        vars[col] = variance_at(*variances, row, col);
+      else if(source == VARIANCE_FROM_WIDTH)
+        vars[col] = color_raw_variance(val);
+      if(calibrate){
+        readings[col] = color_calibrate_channel(val, col);
+        if(source != VARIANCE_NONE)
+          vars[col] = color_calibrate_variance(vars[col], col);
+      }
+      else {
+        readings[col] = val;
+      }
+    }
+
+    uint8_t class_index;
+    if(source == VARIANCE_NONE)
+      class_index = color_classify(readings);
+    else
+      class_index = color_classify_noisy(readings, vars);
+    out[row] = class_index;
+    if(!confidence)
+      continue;
+    if(source == VARIANCE_NONE)
+      confidence[row] = color_classify_confidence(readings, class_index);
+    else
+      confidence[row] =
+        color_classify_confidence_noisy(readings, vars, class_index);
+  }
+
+  return;
+}
+
+// Runs fn(first, last) over [0, rows) on up to threads native threads.
+//  Must be called with the GIL released.
+template <typename FN>
+static void parallel_rows(ssize_t rows, int threads, FN fn){
+  if(threads < 1)
+    threads = 1;
+  if(threads > rows)
+    threads = rows > 0 ? rows : 1;
+  if(threads == 1){
+    fn(0, rows);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  ssize_t per = (rows + threads - 1) / threads;
+  for(int t=0; t<threads; t++){
+    ssize_t first = t * per;
+    ssize_t last = first + per < rows ? first + per : rows;
+    if(first >= last)
+      break;
+    workers.emplace_back(fn, first, last);
+  }
+  for(std::thread &worker : workers)
+    worker.join();
+
+  return;
+}
+
+// Calls the kernel instantiation matching the view's dtype.
+#define DISPATCH_DTYPE(view, KERNEL, ...)                               \
+  do {                                                                  \
+    if((view).itemsize == 2 && (view).is_signed)                        \
+      KERNEL<int16_t>(__VA_ARGS__);                                     \
+    else if((view).itemsize == 2)                                       \
+      KERNEL<uint16_t>(__VA_ARGS__);                                    \
+    else if((view).itemsize == 4 && (view).is_signed)                   \
+      KERNEL<int32_t>(__VA_ARGS__);                                     \
+    else if((view).itemsize == 4)                                       \
+      KERNEL<uint32_t>(__VA_ARGS__);                                    \
+    else                                                                \
+      KERNEL<int64_t>(__VA_ARGS__);                                     \
+  } while(0)
+
+static py::array_t<int32_t> py_calibrate(py::buffer raw, int threads){
+  reading_view view = reading_view_from(raw, 1);
+  ssize_t cols = view.cols < 4 ? view.cols : 4;
+  py::array_t<int32_t> out({view.rows, cols});
+  int32_t *out_ptr = out.mutable_data();
+
+  {
+    py::gil_scoped_release release;
+    parallel_rows(view.rows, threads, [&](ssize_t first, ssize_t last){
+      DISPATCH_DTYPE(view, calibrate_rows, view, first, last, out_ptr);
+    });
+  }
+
+  return out;
+}
+
+static py::array_t<uint32_t> py_variances(py::buffer raw, int threads){
+  reading_view view = reading_view_from(raw, 1);
+  ssize_t cols = view.cols < 4 ? view.cols : 4;
+  py::array_t<uint32_t> out({view.rows, cols});
+  uint32_t *out_ptr = out.mutable_data();
+
+  {
+    py::gil_scoped_release release;
+    parallel_rows(view.rows, threads, [&](ssize_t first, ssize_t last){
+      DISPATCH_DTYPE(view, variance_rows, view, first, last, out_ptr);
+    });
+  }
+
+  return out;
+}
+
+// Returns the classes, or (classes, confidence) with return_confidence.
+static py::object py_classify_impl(
+  py::buffer readings,
+  int threads,
+  bool calibrate,
+  py::object variances,
+  bool return_confidence
+){
+  reading_view view = reading_view_from(readings, 3);
+  reading_view var_view;
+  uint8_t source = calibrate ? VARIANCE_FROM_WIDTH : VARIANCE_NONE;
+  if(!variances.is_none()){
+    var_view = variance_view_from(variances.cast<py::buffer>(), view.rows);
+    source = VARIANCE_GIVEN;
+  }
+  py::array_t<uint8_t> out(view.rows);
+  py::array_t<uint8_t> confidence(return_confidence ? view.rows : 0);
+  uint8_t *out_ptr = out.mutable_data();
+  uint8_t *conf_ptr = return_confidence ? confidence.mutable_data() : NULL;
+
+  {
+    py::gil_scoped_release release;
+    parallel_rows(view.rows, threads, [&](ssize_t first, ssize_t last){
+      DISPATCH_DTYPE(
+        view, classify_rows,
+        view, first, last, calibrate, source, &var_view, out_ptr, conf_ptr
+      );
+    });
+  }
+
+  if(return_confidence)
+    return py::make_tuple(out, confidence);
+
+  return out;
+}
+
+static py::object py_classify(
+  py::buffer readings,
+  int threads,
+  py::object variances,
+  bool return_confidence
+){
+  return py_classify_impl(
+    readings, threads, false, variances, return_confidence
+  );
+}
+
+static py::object py_classify_raw(
+  py::buffer raw,
+  int threads,
+  py::object variances,
+  bool return_confidence
+){
+  return py_classify_impl(raw, threads, true, variances, return_confidence);
+}
+
+// Calibrated readings and variances of one frame, padded to four channels.
+static void one_frame(
+  const std::vector<int> &readings,
+  const py::object &variances,
+  int vals[4],
+  uint32_t vars[4]
+){
+  if(readings.size() < 3 || readings.size() > 4)
+    throw py::value_error("expected 3 or 4 channel readings");
+  for(size_t i=0; i<4; i++){
+    vals[i] = i < readings.size() ? readings[i] : 0;
+    vars[i] = 0;
+  }
+  if(variances.is_none())
+    return;
+
+  std::vector<uint32_t> given = variances.cast<std::vector<uint32_t>>();
+  if(given.size() != readings.size())
+    throw py::value_error("expected a variance per reading");
+  for(size_t i=0; i<given.size(); i++)
+    vars[i] = given[i];
+
+  return;
+}
+
+static int py_classify_one(std::vector<int> readings, py::object variances){
+  int vals[4];
+  uint32_t vars[4];
+  one_frame(readings, variances, vals, vars);
+
+  return color_classify_noisy(vals, vars);
+}
+
+static int py_confidence_one(
+  std::vector<int> readings,
+  int class_index,
+  py::object variances
+){
+  int vals[4];
+  uint32_t vars[4];
+  one_frame(readings, variances, vals, vars);
+  if(class_index < 0 || class_index > 255)
+    throw py::value_error("class_index must be 0..255");
+
+  return color_classify_confidence_noisy(vals, vars, class_index);
+}
+
+static uint32_t py_raw_variance(int raw, int channel){
+  if(channel < RED || channel > CLEAR)
+    throw py::value_error("channel must be 0..3");
+
+  return color_calibrate_variance(color_raw_variance(raw), channel);
+}
+
+static int py_calibrate_channel(int raw, int channel){
+  if(channel < RED || channel > CLEAR)
+    throw py::value_error("channel must be 0..3");
+
+  return color_calibrate_channel(raw, channel);
+}
+
+static std::vector<std::vector<int>> py_get_calibration(){
+  std::vector<std::vector<int>> table;
+  for(uint8_t ch=0; ch<4; ch++)
+    table.push_back(
+      {color_read_calib_vals[ch][0], color_read_calib_vals[ch][1]}
+    );
+
+  return table;
+}
+
+static void py_set_calibration(std::vector<std::vector<int>> table){
+  if(table.size() != 4)
+    throw py::value_error("expected 4 [min, max] pairs");
+  for(uint8_t ch=0; ch<4; ch++){
+    if(table[ch].size() != 2 || table[ch][0] == table[ch][1])
+      throw py::value_error("each channel needs a distinct [min, max] pair");
+  }
+  for(uint8_t ch=0; ch<4; ch++){
+    color_read_calib_vals[ch][0] = table[ch][0];
+    color_read_calib_vals[ch][1] = table[ch][1];
+  }
+
+  return;
+}
+
+PYBIND11_MODULE(color_core, m){
+  m.doc() =
+    "Color sensor calibration and classification, the same code the "
+    "firmware runs, noise aware classification included.";
+
+  m.attr("RED") = (int)RED;
+  m.attr("GREEN") = (int)GREEN;
+  m.attr("BLUE") = (int)BLUE;
+  m.attr("CLEAR") = (int)CLEAR;
+  m.attr("RED_STR") = (int)RED_STR;
+  m.attr("GREEN_STR") = (int)GREEN_STR;
+  m.attr("BLUE_STR") = (int)BLUE_STR;
+  m.attr("BLACK_STR") = (int)BLACK_STR;
+  m.attr("WHITE_STR") = (int)WHITE_STR;
+  m.attr("UNDEF_STR") = (int)UNDEF_STR;
+  m.attr("MAP_ERR") = (int)COLOR_MAP_ERR;
+  m.attr("VAR_FRAC_BITS") = (int)COLOR_VAR_FRAC_BITS;
+  m.attr("VAR_UNKNOWN") = (uint32_t)COLOR_VAR_UNKNOWN;
+  py::tuple names(RGB_VAL_MAPPING_LEN);
+  for(uint8_t i=0; i<RGB_VAL_MAPPING_LEN; i++)
+    names[i] = class_names[i];
+  m.attr("CLASS_NAMES") = names;
+
+  m.def("calibrate_channel", &py_calibrate_channel,
+    py::arg("raw"), py::arg("channel"),
+    "Maps one raw pulse width reading to a 0-255 value.");
+  m.def("variance", &py_raw_variance, py::arg("raw"), py::arg("channel"),
+    "Calibrated variance of one raw pulse width reading, fixed point with "
+    "VAR_FRAC_BITS fractional bits.");
+  m.def("classify_one", &py_classify_one, py::arg("readings"),
+    py::arg("variances") = py::none(),
+    "Classifies one set of calibrated [r, g, b(, c)] readings, widening the "
+    "black/white test by their calibrated variances if given.");
+  m.def("confidence_one", &py_confidence_one, py::arg("readings"),
+    py::arg("class_index"), py::arg("variances") = py::none(),
+    "Confidence, 0-100, of one set of calibrated readings in class_index.");
+  m.def("calibrate", &py_calibrate, py::arg("raw"), py::arg("threads") = 1,
+    "Calibrates an (n, channels) array of raw readings. Returns int32 (n, "
+    "min(channels, 4)). The input is read in place.");
+  m.def("variances", &py_variances, py::arg("raw"), py::arg("threads") = 1,
+    "Calibrated variances of an (n, channels) array of raw single pulse "
+    "readings, as the heads estimate them. Returns uint32 (n, "
+    "min(channels, 4)).");
+  m.def("classify", &py_classify, py::arg("readings"), py::arg("threads") = 1,
+    py::arg("variances") = py::none(), py::arg("return_confidence") = false,
+    "Classifies an (n, >=3) array of calibrated readings. Returns uint8 (n,), "
+    "and uint8 (n,) confidence with return_confidence. With a uint32 "
+    "(n, >=3) array of calibrated variances classifies as the heads do, "
+    "otherwise without noise widening. Inputs are read in place.");
+  m.def("classify_raw", &py_classify_raw, py::arg("raw"),
+    py::arg("threads") = 1, py::arg("variances") = py::none(),
+    py::arg("return_confidence") = false,
+    "Calibrates and classifies an (n, >=3) array of raw readings in one "
+    "pass, as the heads do. Variances are raw us^2, estimated from the pulse "
+    "widths if not given (a single pulse per reading). Returns as classify(). "
+    "Inputs are read in place.");
+  m.def("get_calibration", &py_get_calibration,
+    "Current [min, max] raw calibration pair per channel.");
+  m.def("set_calibration", &py_set_calibration, py::arg("table"),
+    "Replaces the calibration table. Not safe to call while a batch is "
+    "running on another thread.");
+}
@@ -0,0 +1,32 @@
+# Builds the color_core Python extension from the firmware's portable core.
+#
+#   pip install ./host/python
+#   python host/python/bench_color_core.py
+import os
+
+from pybind11.setup_helpers import Pybind11Extension, build_ext
+from setuptools import setup
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CORE_DIR = os.path.relpath(
+    os.path.join(HERE, "..", "..", "color_detector_esp32", "lib", "color_core"),
+    HERE,
+)
+
+ext = Pybind11Extension(
+    "color_core",
+    ["color_core_py.cpp", os.path.join(CORE_DIR, "color_core.cpp")],
+    include_dirs=[CORE_DIR],
+    cxx_std=17,
+    extra_compile_args=["-O2"],
+)
+
+setup(
+    name="color_core",
+    version="0.1.0",
+    description="Color sensor calibration and classification core",
+    ext_modules=[ext],
+    cmdclass={"build_ext": build_ext},
+    install_requires=["numpy"],
+    python_requires=">=3.8",
+)
@@ -0,0 +1,218 @@
+// Shares the streams of one or more sensor heads with any number of local
+//  consumers, where only one process can have a serial port open.
+//  Owns the heads' ports and serves their clock sync like ingest, and
+//    publishes every frame they send, decoded once, into a shared memory ring
+//    (see frame_ring.h) named -r, of -n slots. Loggers, dashboards and QC
+//    analytics attach to the ring instead of a port, each at its own pace:
+//    the broker never waits for them, a consumer that falls a whole ring
+//    behind is told how many records it missed. tap is one such consumer.
+//  Records carry the head's index among the ports given, its device id once
+//    its clock status is in and the host time the frame was read.
+//  Reports each head's clock, readings and sequence gaps on stderr every 10s.
+//
+// Usage: broker [-b baud] [-r ring] [-n slots] <port> [port ...]
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "device_session.h"
+#include "frame_ring.h"
+#include "serial_port.h"
+
+#define BROKER_MAX_DEVICES 32
+
+// Interval between reports on stderr, in ms.
+#define BROKER_REPORT_INTERVAL_MS 10000
+
+static volatile sig_atomic_t broker_stop = 0;
+
+static void broker_on_signal(int){
+  broker_stop = 1;
+}
+
+// Reads what's pending on a head's port, publishing each frame as it
+//  completes, after the session has handled it so a sync status frame
+//  already carries the device id it reports.
+//  As device_session_poll(), returns false once the port has closed.
+static bool broker_poll(
+  device_session &session,
+  uint16_t head,
+  frame_ring &ring
+){
+  uint8_t buf[256];
+
+  while(true){
+    ssize_t count = read(session.fd, buf, sizeof(buf));
+    if(count == 0)
+      return false;
+    if(count < 0){
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+
+    session.rx_time_us = host_time_us();
+    for(ssize_t i=0; i<count; i++){
+      if(!link_decode_byte(session.decoder, buf[i]))
+        continue;
+      const link_decoder &frame = session.decoder;
+      device_session_handle_frame(session, frame, NULL, NULL);
+
+      frame_ring_record &rec = frame_ring_claim(ring);
+      rec.rx_time_us = session.rx_time_us;
+      rec.device_id = session.clock.known ? session.clock.device_id : 0;
+      rec.head = head;
+      rec.type = frame.type;
+      rec.len = frame.len;
+      memcpy(rec.payload, frame.payload, frame.len);
+      frame_ring_publish(ring);
+    }
+  }
+}
+
+static void broker_report(
+  const device_session *sessions,
+  int count,
+  const frame_ring &ring
+){
+  fprintf(
+    stderr,
+    "%-4s %-16s %-20s %14s %9s %7s\n",
+    "head", "device", "port", "offset_us", "readings", "dropped"
+  );
+  for(int i=0; i<count; i++){
+    const device_session &s = sessions[i];
+    if(!s.clock.known){
+      fprintf(
+        stderr,
+        "%-4d %-16s %-20s %14s %9u %7u\n",
+        i, "?", s.name, "-", s.readings, s.dropped
+      );
+      continue;
+    }
+    fprintf(
+      stderr,
+      "%-4d %016" PRIx64 " %-20s %14" PRId64 " %9u %7u\n",
+      i,
+      s.clock.device_id,
+      s.name,
+      s.clock.offset_us,
+      s.readings,
+      s.dropped
+    );
+  }
+  fprintf(
+    stderr,
+    "%s: %" PRIu64 " frames published\n",
+    ring.name,
+    ring.header->published.load(std::memory_order_relaxed)
+  );
+
+  return;
+}
+
+int main(int argc, char **argv){
+  uint32_t baud = 115200;
+  const char *name = FRAME_RING_DEFAULT_NAME;
+  uint32_t slots = FRAME_RING_DEFAULT_SLOTS;
+  int opt;
+  while((opt = getopt(argc, argv, "b:r:n:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'r'){
+      name = optarg;
+    }
+    else if(opt == 'n'){
+      slots = strtoul(optarg, NULL, 10);
+    }
+    else {
+      optind = argc;
+      break;
+    }
+  }
+  int count = argc - optind;
+  if(count < 1 || count > BROKER_MAX_DEVICES){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-r ring] [-n slots] <port> [port ...]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  static device_session sessions[BROKER_MAX_DEVICES];
+  struct pollfd fds[BROKER_MAX_DEVICES];
+  for(int i=0; i<count; i++){
+    const char *port = argv[optind + i];
+    int fd = serial_port_open(port, baud);
+    if(fd < 0){
+      fprintf(stderr, "%s: %s\n", port, strerror(errno));
+      return 1;
+    }
+    device_session_init(sessions[i], fd, port);
+    fds[i].fd = fd;
+    fds[i].events = POLLIN;
+  }
+
+  frame_ring ring;
+  if(!frame_ring_create(ring, name, slots, count)){
+    fprintf(
+      stderr,
+      "%s: %s%s\n",
+      name,
+      strerror(errno),
+      errno == EINVAL ? " (slots must be a power of two)" : ""
+    );
+    return 1;
+  }
+
+  signal(SIGINT, broker_on_signal);
+  signal(SIGTERM, broker_on_signal);
+
+  fprintf(
+    stderr,
+    "publishing %d heads into %s, %u slots\n",
+    count,
+    name,
+    slots
+  );
+  int64_t last_report = host_time_us();
+  int open_ports = count;
+  while(!broker_stop && open_ports > 0){
+    int ready = poll(fds, count, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+    frame_ring_heartbeat(ring, host_time_us());
+
+    for(int i=0; i<count; i++){
+      if(fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if(!broker_poll(sessions[i], i, ring)){
+        fprintf(stderr, "%s: closed\n", sessions[i].name);
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open_ports--;
+      }
+    }
+
+    if(host_time_us() - last_report >= BROKER_REPORT_INTERVAL_MS * 1000LL){
+      last_report = host_time_us();
+      broker_report(sessions, count, ring);
+    }
+  }
+
+  broker_report(sessions, count, ring);
+  frame_ring_close(ring);
+
+  return 0;
+}
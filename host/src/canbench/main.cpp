@@ -0,0 +1,512 @@
+// Exercises lib/can_output's encoder and scheduler with simulated heads, on
+//  a simulated bus or a SocketCAN interface, and checks what arrives.
+//  Each head publishes a frame every -f ms whose class changes with
+//    probability -c, and its can_output is polled every millisecond as the
+//    firmware's CAN task does. Head i sends on the cyclic and event
+//    identifiers plus i.
+//  The simulated bus (default) runs in virtual time: every head has a
+//    transmit queue of -q frames like the TWAI controller's, the bus
+//    arbitrates by identifier and holds each frame for its stuffed bit length
+//    at -b bit/s. With -i the frames go out on a SocketCAN interface (e.g.
+//    vcan0) in real time and are read back on a second socket, bus load is
+//    then what the received frames would put on a -b bit/s bus.
+//  Received frames are checked against what the heads published: cyclic
+//    contents against the class they carry, events against the class
+//    history and the previous event, and sequence numbers for gaps. Reports
+//    frames sent and received, refusals (tx_full), coalesced changes, event
+//    latency from the first frame of a new class to its event arriving, bus
+//    load, and the scheduler's cost per poll.
+//
+// Usage: canbench [-i ifname] [-n heads] [-t seconds] [-b bit/s] [-q queue]
+//          [-f frame ms] [-c change probability] [-p period ms]
+//          [-I inhibit ms] [-C cyclic id] [-E event id]
+//  e.g. 16 heads at 50 frames/s on a simulated 250kbit/s bus:
+//    canbench -n 16 -f 20 -b 250000
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "can_output.h"
+#include "can_socketcan.h"
+#include "color_core.h"
+
+#define CANBENCH_DEFAULT_HEADS 1
+#define CANBENCH_DEFAULT_SECONDS 60
+#define CANBENCH_DEFAULT_BITRATE 250000
+#define CANBENCH_DEFAULT_QUEUE 4
+#define CANBENCH_DEFAULT_FRAME_MS 20
+#define CANBENCH_DEFAULT_CHANGE 0.05
+
+// A head's simulated frame results, all derived from its class so a cyclic
+//  frame can be checked on its own.
+struct canbench_head {
+  can_output out;
+  sensor_snapshot snap;
+  int64_t next_frame_us;
+
+  // Class and publish time of every frame.
+  std::vector<uint8_t> classes;
+  std::vector<int64_t> published_us;
+
+  // Receiver side.
+  bool have_cyclic;
+  uint8_t cyclic_seq;
+  bool have_event;
+  uint8_t event_seq;
+  uint8_t event_class;
+  uint32_t cyclic_rx;
+  uint32_t events_rx;
+  uint32_t seq_gaps;
+};
+
+// Simulated bus in virtual time.
+struct canbench_sim_bus {
+  uint32_t bitrate;
+  size_t queue_len;
+  std::vector<std::deque<can_frame_data>> queues;
+  int64_t free_ns;
+};
+
+struct canbench_sim_port {
+  canbench_sim_bus *bus;
+  size_t index;
+};
+
+struct canbench {
+  std::vector<canbench_head> heads;
+  can_output_config config;
+
+  uint32_t bad_frames;
+  uint64_t rx_bits;
+  uint16_t min_bits;
+  uint16_t max_bits;
+  std::vector<float> latency_ms;
+};
+
+static bool canbench_sim_send(void *ctx, const can_frame_data &frame){
+  canbench_sim_port &port = *(canbench_sim_port *)ctx;
+  std::deque<can_frame_data> &queue = port.bus->queues[port.index];
+  if(queue.size() >= port.bus->queue_len)
+    return false;
+  queue.push_back(frame);
+
+  return true;
+}
+
+static uint8_t canbench_confidence(uint8_t class_index){
+  return 40 + class_index * 9;
+}
+
+static void canbench_rgb(uint8_t class_index, int16_t rgb[3]){
+  for(uint8_t c=0; c<3; c++)
+    rgb[c] = (int16_t)((class_index * 71 + c * 97) % 300) - 20;
+
+  return;
+}
+
+static void canbench_publish(
+  canbench_head &head,
+  std::mt19937 &rng,
+  double change,
+  int64_t now_us
+){
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::uniform_int_distribution<int> pick(0, RGB_VAL_MAPPING_LEN - 1);
+
+  uint8_t class_index = head.snap.class_index;
+  if(head.classes.empty() || unit(rng) < change){
+    uint8_t next;
+    do
+      next = pick(rng);
+    while(!head.classes.empty() && next == class_index);
+    class_index = next;
+  }
+
+  head.snap.frame = head.classes.size();
+  head.snap.class_index = class_index;
+  head.snap.confidence = canbench_confidence(class_index);
+  canbench_rgb(class_index, head.snap.mapped);
+  head.snap.faults = 0;
+  head.snap.palette_index = class_index;
+  head.classes.push_back(class_index);
+  head.published_us.push_back(now_us);
+
+  return;
+}
+
+static void canbench_receive(
+  canbench &bench,
+  const can_frame_data &frame,
+  int64_t now_us
+){
+  uint16_t bits = can_frame_bits(frame);
+  bench.rx_bits += bits;
+  bench.min_bits = std::min(bench.min_bits, bits);
+  bench.max_bits = std::max(bench.max_bits, bits);
+
+  size_t count = bench.heads.size();
+  size_t cyclic = frame.id - bench.config.cyclic_id;
+  size_t event = frame.id - bench.config.event_id;
+  if(frame.id >= bench.config.cyclic_id && cyclic < count){
+    canbench_head &head = bench.heads[cyclic];
+    can_output_cyclic msg;
+    int16_t rgb[3];
+    bool good = can_output_decode_cyclic(frame, msg);
+    if(good){
+      canbench_rgb(msg.class_index, rgb);
+      for(uint8_t c=0; c<3; c++)
+        good = good && msg.rgb[c] == std::max(0, std::min(255, (int)rgb[c]));
+      good = good &&
+        msg.confidence == canbench_confidence(msg.class_index) &&
+        msg.palette_index == msg.class_index &&
+        msg.faults == 0;
+    }
+    if(!good){
+      bench.bad_frames++;
+      return;
+    }
+
+    if(head.have_cyclic && msg.seq != (uint8_t)(head.cyclic_seq + 1))
+      head.seq_gaps++;
+    head.have_cyclic = true;
+    head.cyclic_seq = msg.seq;
+    head.cyclic_rx++;
+  }
+  else if(frame.id >= bench.config.event_id && event < count){
+    canbench_head &head = bench.heads[event];
+    uint8_t previous = head.have_event ? head.event_class : head.classes[0];
+    can_output_event msg;
+    bool good =
+      can_output_decode_event(frame, msg) &&
+      msg.frame < head.classes.size() &&
+      head.classes[msg.frame] == msg.class_index &&
+      msg.confidence == canbench_confidence(msg.class_index) &&
+      msg.class_index != msg.previous_class &&
+      msg.previous_class == previous;
+    if(!good){
+      bench.bad_frames++;
+      return;
+    }
+
+    if(head.have_event && msg.seq != (uint8_t)(head.event_seq + 1))
+      head.seq_gaps++;
+    head.have_event = true;
+    head.event_seq = msg.seq;
+    head.event_class = msg.class_index;
+    head.events_rx++;
+    bench.latency_ms.push_back(
+      (now_us - head.published_us[msg.frame]) / 1000.0f
+    );
+  }
+  else
+    bench.bad_frames++;
+
+  return;
+}
+
+// Runs the bus from from_ns to to_ns: whenever it's free, the lowest
+//  identifier at the head of a queue wins arbitration and holds the bus for
+//  its length.
+static void canbench_sim_run(
+  canbench &bench,
+  canbench_sim_bus &bus,
+  int64_t from_ns,
+  int64_t to_ns
+){
+  int64_t t = std::max(bus.free_ns, from_ns);
+  while(t < to_ns){
+    size_t winner = bus.queues.size();
+    for(size_t i=0; i<bus.queues.size(); i++){
+      if(
+        !bus.queues[i].empty() &&
+        (
+          winner == bus.queues.size() ||
+          bus.queues[i].front().id < bus.queues[winner].front().id
+        )
+      )
+        winner = i;
+    }
+    if(winner == bus.queues.size())
+      break;
+
+    can_frame_data frame = bus.queues[winner].front();
+    bus.queues[winner].pop_front();
+    t += (int64_t)can_frame_bits(frame) * 1000000000 / bus.bitrate;
+    canbench_receive(bench, frame, t / 1000);
+  }
+  bus.free_ns = std::max(bus.free_ns, t);
+
+  return;
+}
+
+static int64_t canbench_now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double canbench_percentile(std::vector<float> &vals, double q){
+  if(vals.empty())
+    return NAN;
+  size_t i = (size_t)(q * (vals.size() - 1) + 0.5);
+  std::nth_element(vals.begin(), vals.begin() + i, vals.end());
+
+  return vals[i];
+}
+
+static void canbench_usage(){
+  fprintf(
+    stderr,
+    "usage: canbench [-i ifname] [-n heads] [-t seconds] [-b bit/s] "
+    "[-q queue]\n"
+    "         [-f frame ms] [-c change probability] [-p period ms]\n"
+    "         [-I inhibit ms] [-C cyclic id] [-E event id]\n"
+  );
+
+  return;
+}
+
+int main(int argc, char **argv){
+  const char *ifname = NULL;
+  int count = CANBENCH_DEFAULT_HEADS;
+  double seconds = CANBENCH_DEFAULT_SECONDS;
+  long bitrate = CANBENCH_DEFAULT_BITRATE;
+  int queue_len = CANBENCH_DEFAULT_QUEUE;
+  int frame_ms = CANBENCH_DEFAULT_FRAME_MS;
+  double change = CANBENCH_DEFAULT_CHANGE;
+
+  canbench bench;
+  can_output_config_default(bench.config);
+
+  int opt;
+  bool ok = true;
+  while((opt = getopt(argc, argv, "i:n:t:b:q:f:c:p:I:C:E:")) != -1){
+    if(opt == 'i')
+      ifname = optarg;
+    else if(opt == 'n')
+      count = atoi(optarg);
+    else if(opt == 't')
+      seconds = atof(optarg);
+    else if(opt == 'b')
+      bitrate = atol(optarg);
+    else if(opt == 'q')
+      queue_len = atoi(optarg);
+    else if(opt == 'f')
+      frame_ms = atoi(optarg);
+    else if(opt == 'c')
+      change = atof(optarg);
+    else if(opt == 'p')
+      bench.config.period_ms = atoi(optarg);
+    else if(opt == 'I')
+      bench.config.inhibit_ms = atoi(optarg);
+    else if(opt == 'C')
+      bench.config.cyclic_id = strtol(optarg, NULL, 0);
+    else if(opt == 'E')
+      bench.config.event_id = strtol(optarg, NULL, 0);
+    else
+      ok = false;
+  }
+  ok = ok &&
+    optind == argc &&
+    count > 0 &&
+    seconds > 0 &&
+    bitrate > 0 &&
+    queue_len > 0 &&
+    frame_ms > 0 &&
+    bench.config.cyclic_id + count - 1 <= CAN_OUTPUT_MAX_ID &&
+    bench.config.event_id + count - 1 <= CAN_OUTPUT_MAX_ID &&
+    (
+      bench.config.cyclic_id >= bench.config.event_id + count ||
+      bench.config.event_id >= bench.config.cyclic_id + count
+    );
+  if(!ok){
+    canbench_usage();
+    return 2;
+  }
+
+  int tx_fd = -1, rx_fd = -1;
+  if(ifname){
+    tx_fd = can_socketcan_open(ifname);
+    rx_fd = tx_fd < 0 ? -1 : can_socketcan_open(ifname);
+    if(rx_fd < 0){
+      fprintf(stderr, "%s: %s\n", ifname, strerror(errno));
+      return 1;
+    }
+  }
+
+  canbench_sim_bus bus;
+  bus.bitrate = bitrate;
+  bus.queue_len = queue_len;
+  bus.queues.resize(count);
+  bus.free_ns = 0;
+  std::vector<canbench_sim_port> ports(count);
+
+  bench.heads.resize(count);
+  bench.bad_frames = 0;
+  bench.rx_bits = 0;
+  bench.min_bits = UINT16_MAX;
+  bench.max_bits = 0;
+
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> phase(0, frame_ms * 1000 - 1);
+  for(int i=0; i<count; i++){
+    canbench_head &head = bench.heads[i];
+    memset(&head.snap, 0, sizeof(head.snap));
+    head.next_frame_us = phase(rng);
+    head.have_cyclic = false;
+    head.have_event = false;
+    head.cyclic_rx = 0;
+    head.events_rx = 0;
+    head.seq_gaps = 0;
+
+    can_output_config config = bench.config;
+    config.cyclic_id += i;
+    config.event_id += i;
+    can_hal hal;
+    if(ifname){
+      hal.send = can_socketcan_hal_send;
+      hal.ctx = &tx_fd;
+    }
+    else{
+      ports[i].bus = &bus;
+      ports[i].index = i;
+      hal.send = canbench_sim_send;
+      hal.ctx = &ports[i];
+    }
+    can_output_init(head.out, config, hal, 0);
+  }
+
+  // One millisecond tick at a time, in virtual time on the simulated bus and
+  //  paced to the wall clock on SocketCAN.
+  int64_t ticks = (int64_t)(seconds * 1000);
+  int64_t start_us = canbench_now_us();
+  double poll_ns = 0;
+  uint64_t polls = 0;
+  for(int64_t tick=0; tick<ticks; tick++){
+    int64_t now_us = tick * 1000;
+    if(ifname){
+      int64_t wait_us = start_us + now_us - canbench_now_us();
+      if(wait_us > 0)
+        usleep(wait_us);
+    }
+
+    auto poll_start = std::chrono::steady_clock::now();
+    for(canbench_head &head : bench.heads){
+      while(head.next_frame_us <= now_us){
+        canbench_publish(head, rng, change, head.next_frame_us);
+        head.next_frame_us += frame_ms * 1000;
+      }
+      if(!head.classes.empty())
+        can_output_poll(head.out, head.snap, (uint32_t)tick);
+    }
+    poll_ns += std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - poll_start
+    ).count();
+    polls += count;
+
+    if(ifname){
+      can_frame_data frame;
+      int got;
+      while((got = can_socketcan_recv(rx_fd, frame)) == 1)
+        canbench_receive(bench, frame, canbench_now_us() - start_us);
+      if(got < 0){
+        fprintf(stderr, "%s: %s\n", ifname, strerror(errno));
+        return 1;
+      }
+    }
+    else
+      canbench_sim_run(bench, bus, now_us * 1000, (now_us + 1000) * 1000);
+  }
+
+  // Whatever is still queued or in flight.
+  if(ifname){
+    usleep(100000);
+    can_frame_data frame;
+    while(can_socketcan_recv(rx_fd, frame) == 1)
+      canbench_receive(bench, frame, canbench_now_us() - start_us);
+  }
+  else
+    canbench_sim_run(bench, bus, ticks * 1000000, INT64_MAX);
+
+  // An overloaded simulated bus keeps draining past the end.
+  double elapsed = seconds;
+  if(!ifname)
+    elapsed = std::max(elapsed, bus.free_ns / 1e9);
+
+  uint64_t cyclic_sent = 0, events_sent = 0, tx_full = 0, coalesced = 0;
+  uint64_t cyclic_rx = 0, events_rx = 0, seq_gaps = 0, changes = 0;
+  for(canbench_head &head : bench.heads){
+    cyclic_sent += head.out.cyclic_sent;
+    events_sent += head.out.events_sent;
+    tx_full += head.out.tx_full;
+    coalesced += head.out.coalesced;
+    cyclic_rx += head.cyclic_rx;
+    events_rx += head.events_rx;
+    seq_gaps += head.seq_gaps;
+    for(size_t f=1; f<head.classes.size(); f++)
+      changes += head.classes[f] != head.classes[f - 1];
+  }
+
+  printf(
+    "%d heads, %s, %.0f s, frames every %d ms, class change p %.3f\n",
+    count,
+    ifname ? ifname : "simulated bus",
+    seconds,
+    frame_ms,
+    change
+  );
+  printf(
+    "cyclic: sent %" PRIu64 " received %" PRIu64 "\n",
+    cyclic_sent,
+    cyclic_rx
+  );
+  printf(
+    "events: %" PRIu64 " class changes, sent %" PRIu64 " received %" PRIu64
+    " coalesced %" PRIu64 "\n",
+    changes,
+    events_sent,
+    events_rx,
+    coalesced
+  );
+  printf(
+    "tx_full %" PRIu64 ", sequence gaps %" PRIu64 ", bad frames %" PRIu32 "\n",
+    tx_full,
+    seq_gaps,
+    bench.bad_frames
+  );
+  printf(
+    "event latency ms: p50 %.2f p99 %.2f max %.2f\n",
+    canbench_percentile(bench.latency_ms, 0.5),
+    canbench_percentile(bench.latency_ms, 0.99),
+    canbench_percentile(bench.latency_ms, 1.0)
+  );
+  printf(
+    "bus load at %ld bit/s: %.1f%% (%.0f bit/s), frames %u-%u bits\n",
+    bitrate,
+    100.0 * bench.rx_bits / (bitrate * elapsed),
+    bench.rx_bits / elapsed,
+    bench.min_bits,
+    bench.max_bits
+  );
+  printf("scheduler: %.0f ns per poll\n", poll_ns / polls);
+
+  bool pass =
+    bench.bad_frames == 0 &&
+    cyclic_rx == cyclic_sent &&
+    events_rx == events_sent &&
+    seq_gaps == 0;
+
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,381 @@
+// Downloads pre-trigger captures from a head: the raw frames recorded around
+//  each new process control alarm, newly raised fault or commanded trigger,
+//  see capture.h.
+//  Keeps the head's clock sync answered, asks what it holds, then downloads
+//    every capture as it completes into <prefix>_<id>.csv and releases it on
+//    the head for the next one. Each row is one frame:
+//      frame, offset_us from the trigger frame, host_time_us, raw_r-raw_c,
+//      faults, class and trigger, 1 on the trigger frame.
+//  -p and -a set the frames kept before and after the trigger frame, -c the
+//    causes that trigger (spc, fault, command, comma separated), and -t
+//    triggers a capture straight away. Stops after -n captures, or on Ctrl-C.
+//
+// Usage: capture [-b baud] [-p pre] [-a post] [-c causes] [-t] [-n count]
+//                [-o prefix] <port>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "device_session.h"
+#include "serial_port.h"
+
+// A download that hasn't progressed for this long is asked for again.
+#define CAPTURE_RETRY_US 2000000
+
+static volatile sig_atomic_t capture_stop = 0;
+
+struct capture_state {
+  const char *prefix;
+
+  // Held captures announced by the head, oldest first, and the ids already
+  //  queued or written.
+  std::deque<link_capture_info> queue;
+  std::set<uint16_t> seen;
+
+  // Capture being downloaded, the front of queue.
+  bool downloading;
+  std::vector<link_capture_sample> samples;
+  std::vector<bool> received;
+  uint16_t remaining;
+  int64_t requested_us;
+
+  uint32_t written;
+  uint32_t failed;          // Couldn't be written out.
+  uint32_t retries;
+};
+
+static void capture_on_signal(int){
+  capture_stop = 1;
+}
+
+// Parses a comma separated list of cause names into enum CAPTURE_CAUSES
+//  bits. Returns false on an unknown name.
+static bool capture_parse_causes(const char *arg, uint8_t &causes){
+  causes = 0;
+  std::string list(arg);
+  size_t pos = 0;
+  while(pos <= list.size()){
+    size_t end = list.find(',', pos);
+    if(end == std::string::npos)
+      end = list.size();
+    std::string name = list.substr(pos, end - pos);
+    if(name == "spc")
+      causes |= CAPTURE_CAUSE_SPC;
+    else if(name == "fault")
+      causes |= CAPTURE_CAUSE_FAULT;
+    else if(name == "command")
+      causes |= CAPTURE_CAUSE_COMMAND;
+    else if(name == "all")
+      causes |= CAPTURE_ALL_CAUSES;
+    else
+      return false;
+    pos = end + 1;
+  }
+
+  return true;
+}
+
+static std::string capture_cause_names(uint8_t causes){
+  std::string names;
+  if(causes & CAPTURE_CAUSE_SPC)
+    names += ",spc";
+  if(causes & CAPTURE_CAUSE_FAULT)
+    names += ",fault";
+  if(causes & CAPTURE_CAUSE_COMMAND)
+    names += ",command";
+
+  return names.empty() ? "none" : names.substr(1);
+}
+
+static bool capture_send(
+  device_session &session,
+  uint8_t op,
+  uint8_t slot
+){
+  link_capture_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.op = op;
+  cmd.slot = slot;
+
+  return device_session_capture(session, cmd);
+}
+
+// Asks for the capture at the front of the queue, if not busy with one.
+static void capture_start_download(
+  device_session &session,
+  capture_state &state
+){
+  if(state.downloading || state.queue.empty())
+    return;
+
+  const link_capture_info &info = state.queue.front();
+  uint16_t length = info.pre + 1 + info.post;
+  state.samples.assign(length, link_capture_sample());
+  state.received.assign(length, false);
+  state.remaining = length;
+  state.requested_us = host_time_us();
+  state.downloading = true;
+  capture_send(session, LINK_CAPTURE_READ, info.slot);
+
+  return;
+}
+
+static bool capture_write_csv(
+  const device_session &session,
+  const capture_state &state,
+  const link_capture_info &info
+){
+  std::string path =
+    std::string(state.prefix) + "_" + std::to_string(info.id) + ".csv";
+  FILE *out = fopen(path.c_str(), "w");
+  if(!out){
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  fprintf(
+    out,
+    "frame,offset_us,host_time_us,raw_r,raw_g,raw_b,raw_c,faults,class,"
+    "trigger\n"
+  );
+  for(size_t i=0; i<state.samples.size(); i++){
+    const link_capture_sample &sample = state.samples[i];
+    int64_t host_us = device_clock_to_host(
+      session.clock,
+      info.trigger_time_us + sample.offset_us
+    );
+    fprintf(
+      out,
+      "%" PRIu32 ",%" PRId32 ",%" PRId64 ",%u,%u,%u,%u,%u,%u,%d\n",
+      (uint32_t)(info.trigger_frame + i - info.pre),
+      sample.offset_us,
+      host_us,
+      sample.raw[0], sample.raw[1], sample.raw[2], sample.raw[3],
+      sample.faults,
+      sample.class_index,
+      i == info.pre
+    );
+  }
+  if(fclose(out) != 0){
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  fprintf(
+    stderr,
+    "capture %u (%s) at frame %" PRIu32 ": %u before, %u after -> %s\n",
+    info.id,
+    capture_cause_names(info.causes).c_str(),
+    info.trigger_frame,
+    info.pre,
+    info.post,
+    path.c_str()
+  );
+
+  return true;
+}
+
+static void capture_on_frame(
+  device_session &session,
+  const link_decoder &frame,
+  void *ctx
+){
+  capture_state &state = *(capture_state *)ctx;
+
+  if(frame.type == LINK_CAPTURE_INFO){
+    link_capture_info info;
+    if(!link_unpack_capture_info(frame.payload, frame.len, info))
+      return;
+
+    if(info.slot == LINK_CAPTURE_SETUP){
+      fprintf(
+        stderr,
+        "%s: %u before, %u after, on %s; %" PRIu32 " captures, "
+        "%" PRIu32 " missed\n",
+        session.name,
+        info.pre,
+        info.post,
+        capture_cause_names(info.causes).c_str(),
+        info.captures,
+        info.missed
+      );
+      return;
+    }
+
+    // Announced on completion and listed again, only queue it once.
+    if(!state.seen.insert(info.id).second)
+      return;
+    state.queue.push_back(info);
+    capture_start_download(session, state);
+  }
+  else if(frame.type == LINK_CAPTURE_DATA){
+    link_capture_data msg;
+    if(
+      !state.downloading ||
+      !link_unpack_capture_data(frame.payload, frame.len, msg) ||
+      msg.slot != state.queue.front().slot ||
+      msg.id != state.queue.front().id
+    ){
+      return;
+    }
+
+    for(uint8_t i=0; i<msg.count; i++){
+      size_t index = msg.first + i;
+      if(index >= state.samples.size() || state.received[index])
+        continue;
+      state.samples[index] = msg.samples[i];
+      state.received[index] = true;
+      state.remaining--;
+    }
+    state.requested_us = host_time_us();
+    if(state.remaining)
+      return;
+
+    link_capture_info info = state.queue.front();
+    state.queue.pop_front();
+    state.downloading = false;
+    if(capture_write_csv(session, state, info))
+      state.written++;
+    else
+      state.failed++;
+    capture_send(session, LINK_CAPTURE_RELEASE, info.slot);
+    capture_start_download(session, state);
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  uint32_t baud = 115200;
+  uint32_t count = 0;
+  bool configure = false;
+  bool trigger = false;
+  link_capture_cmd setup;
+  setup.op = LINK_CAPTURE_CONFIGURE;
+  setup.slot = 0;
+  setup.pre = CAPTURE_DEFAULT_PRE;
+  setup.post = CAPTURE_DEFAULT_POST;
+  setup.causes = CAPTURE_ALL_CAUSES;
+  static capture_state state;
+  state.prefix = "capture";
+  bool usage = false;
+  int opt;
+  while((opt = getopt(argc, argv, "b:p:a:c:tn:o:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'p'){
+      setup.pre = strtoul(optarg, NULL, 10);
+      configure = true;
+    }
+    else if(opt == 'a'){
+      setup.post = strtoul(optarg, NULL, 10);
+      configure = true;
+    }
+    else if(opt == 'c'){
+      usage |= !capture_parse_causes(optarg, setup.causes);
+      configure = true;
+    }
+    else if(opt == 't'){
+      trigger = true;
+    }
+    else if(opt == 'n'){
+      count = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'o'){
+      state.prefix = optarg;
+    }
+    else {
+      usage = true;
+    }
+  }
+  if(setup.pre + 1 + setup.post > CAPTURE_DEPTH){
+    fprintf(
+      stderr,
+      "pre + post must be below %d frames\n",
+      CAPTURE_DEPTH
+    );
+    return 2;
+  }
+  if(usage || argc - optind != 1){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-p pre] [-a post] [-c causes] [-t] [-n count]\n"
+      "          [-o prefix] <port>\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  int fd = serial_port_open(argv[optind], baud);
+  if(fd < 0){
+    fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  device_session session;
+  device_session_init(session, fd, argv[optind]);
+  session.on_frame = capture_on_frame;
+  session.frame_ctx = &state;
+
+  signal(SIGINT, capture_on_signal);
+  signal(SIGTERM, capture_on_signal);
+
+  // Either reports the setup and lists what's held already.
+  if(configure)
+    device_session_capture(session, setup);
+  else
+    capture_send(session, LINK_CAPTURE_LIST, 0);
+  if(trigger)
+    capture_send(session, LINK_CAPTURE_TRIGGER, 0);
+
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while(!capture_stop && (!count || state.written + state.failed < count)){
+    int ready = poll(&pfd, 1, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+    if(ready > 0 && !device_session_poll(session, NULL, NULL)){
+      fprintf(stderr, "%s: closed\n", session.name);
+      break;
+    }
+
+    // Lost data frames, or the capture went before it was read: ask again,
+    //  and drop it if the head no longer lists it.
+    if(
+      state.downloading &&
+      host_time_us() - state.requested_us > CAPTURE_RETRY_US
+    ){
+      state.downloading = false;
+      state.seen.erase(state.queue.front().id);
+      state.queue.pop_front();
+      state.retries++;
+      capture_send(session, LINK_CAPTURE_LIST, 0);
+    }
+  }
+  close(fd);
+
+  fprintf(
+    stderr,
+    "%u captures written, %u failed, %u downloads retried\n",
+    state.written,
+    state.failed,
+    state.retries
+  );
+
+  return state.failed ? 1 : 0;
+}
@@ -0,0 +1,655 @@
+// Load tests the host side with a fleet of simulated sensor heads.
+//  Each virtual head gets its own pty and runs the firmware's portable
+//    pipeline on simulated input: parts of colors_short.csv colors pass under
+//    it, pulse widths are derived through the inverse of the default
+//    calibration with the sensor's period jitter and 1us quantisation, then
+//    calibrated, their variances estimated and classified by color_core
+//    exactly as on a head. Heads keep their own drifting crystal, run the
+//    clock sync exchange against the host and stamp records with
+//    time_sync_to_host(), framed by serial_link as on the wire.
+//  The ingest command given is started with every head's pty appended to its
+//    arguments, and its CSV output read back. Matching rows to what each head
+//    sent gives per-head drop rates, end-to-end latency from a record being
+//    written to its row coming out of ingest, and the error of the row's
+//    synchronised timestamp against the true time of the reading.
+//  Heads buffer like a UART's transmit FIFO: a record that doesn't fit in
+//    FLEET_TX_BUFFER because the host isn't reading is dropped at the head
+//    (tx_drop). Records written but never seen in the output are lost.
+//
+// Usage: fleet [-n heads] [-r frames/s] [-x speedup] [-t seconds] [-v]
+//          <ingest> [ingest args ...]
+//  e.g. 300 heads at 10 frames/s, ten times faster than real time, for 60s:
+//    fleet -n 300 -x 10 -t 60 .pio/build/ingest/program
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "color_core.h"
+#include "serial_link.h"
+#include "serial_port.h"
+#include "time_sync.h"
+
+#define FLEET_DEFAULT_HEADS 100
+#define FLEET_DEFAULT_RATE_HZ 10
+#define FLEET_DEFAULT_SECONDS 30
+
+// Clock sync intervals and the response timeout, as the firmware's.
+#define FLEET_SYNC_FAST_INTERVAL_MS 1000
+#define FLEET_SYNC_SLOW_INTERVAL_MS 10000
+#define FLEET_SYNC_TIMEOUT_MS 30
+
+// Head side transmit buffer, bytes.
+#define FLEET_TX_BUFFER 512
+
+// Sent records remembered per head for matching, by seq. Rows arriving after
+//  this many newer records from the same head count as lost.
+#define FLEET_SENT_RING 4096
+
+// How long to keep reading ingest's output after the last record, ms.
+#define FLEET_DRAIN_MS 2000
+
+// Crystal tolerance of the simulated heads, ppm either way.
+#define FLEET_MAX_DRIFT_PPM 50
+
+// Frames a part stays under a head, range.
+#define FLEET_PART_MIN_FRAMES 5
+#define FLEET_PART_MAX_FRAMES 40
+
+// colors_short.csv, the parts running down the simulated lines.
+static const uint8_t fleet_part_colors[][3] = {
+  {  0,   0,   0}, {255, 255, 255}, {255,   0,   0}, {  0,   0, 255},
+  {255, 255,   0}, {  0, 255, 255}, {255,   0, 255}, {192, 192, 192},
+  {128, 128, 128}, {128, 128,   0}, {  0, 128,   0}, {128,   0, 128},
+  {  0, 128, 128}
+};
+#define FLEET_PART_COLORS \
+  (sizeof(fleet_part_colors) / sizeof(fleet_part_colors[0]))
+
+static volatile sig_atomic_t fleet_stop = 0;
+
+struct fleet_sent {
+  uint16_t seq;
+  bool valid;
+  int64_t sent_ns;      // Monotonic, when written.
+  int64_t true_us;      // Host time the frame was read at.
+};
+
+struct fleet_head {
+  int master;
+  int slave;
+  std::string port;
+
+  uint64_t device_id;
+  double drift;         // Fractional crystal error.
+  int64_t boot_ns;      // Monotonic time the head's clock reads 0 at.
+
+  time_sync_state clock_sync;
+  link_decoder decoder;
+  bool sync_pending;
+  int64_t sync_t1;
+  int64_t sync_sent_ns;
+  int64_t next_sync_ns;
+  int64_t next_frame_ns;
+
+  uint8_t part;
+  uint16_t part_frames;
+
+  uint8_t tx[FLEET_TX_BUFFER];
+  size_t tx_len;
+
+  uint16_t seq;
+  fleet_sent sent[FLEET_SENT_RING];
+
+  // Counters and results.
+  uint32_t frames;
+  uint32_t tx_dropped;
+  uint32_t received;
+  uint32_t unmatched;
+  std::vector<float> latency_ms;
+  std::vector<float> stamp_error_us;
+};
+
+static void fleet_on_signal(int){
+  fleet_stop = 1;
+}
+
+static int64_t fleet_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The head's esp_timer_get_time(), running fast or slow by its drift.
+static int64_t fleet_device_us(const fleet_head &head, int64_t now_ns){
+  return (int64_t)((now_ns - head.boot_ns) * (1 + head.drift) / 1000);
+}
+
+static bool fleet_open_pty(fleet_head &head){
+  head.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(head.master < 0 || grantpt(head.master) || unlockpt(head.master))
+    return false;
+  head.port = ptsname(head.master);
+
+  // Holding the slave open keeps the master readable before ingest opens it,
+  //  and raw mode keeps the line discipline off the binary frames from the
+  //  first byte.
+  head.slave = open(head.port.c_str(), O_RDWR | O_NOCTTY);
+  if(head.slave < 0)
+    return false;
+  struct termios tio;
+  if(tcgetattr(head.slave, &tio) == 0){
+    cfmakeraw(&tio);
+    tcsetattr(head.slave, TCSANOW, &tio);
+  }
+
+  return true;
+}
+
+// Queues a frame in the head's transmit buffer, dropping it whole if it
+//  doesn't fit.
+static bool fleet_queue_frame(
+  fleet_head &head,
+  uint8_t type,
+  const uint8_t *payload,
+  uint8_t len
+){
+  uint8_t frame[LINK_MAX_FRAME];
+  size_t frame_len = link_encode(type, payload, len, frame);
+  if(head.tx_len + frame_len > FLEET_TX_BUFFER)
+    return false;
+
+  memcpy(head.tx + head.tx_len, frame, frame_len);
+  head.tx_len += frame_len;
+
+  return true;
+}
+
+static void fleet_flush(fleet_head &head){
+  while(head.tx_len){
+    ssize_t n = write(head.master, head.tx, head.tx_len);
+    if(n <= 0)
+      return;
+    memmove(head.tx, head.tx + n, head.tx_len - n);
+    head.tx_len -= n;
+  }
+
+  return;
+}
+
+// Pulse width for a calibrated value, through the inverse of the default
+//  calibration, with period jitter and pulseIn()'s truncation.
+static int fleet_pulse(
+  uint8_t channel,
+  uint8_t value,
+  std::mt19937 &rng
+){
+  std::normal_distribution<double> noise(0, COLOR_PERIOD_JITTER_PPT / 1000.0);
+  std::uniform_real_distribution<double> phase(0, 1);
+
+  double lo = color_read_calib_vals[channel][0];
+  double hi = color_read_calib_vals[channel][1];
+  double pulse = lo + (255 - value) * (hi - lo) / 255;
+  if(pulse < 1)
+    pulse = 1;
+
+  return (int)floor(pulse * (1 + noise(rng)) + phase(rng));
+}
+
+// One frame of the pipeline: read, calibrate, classify, send.
+static void fleet_frame(fleet_head &head, int64_t now_ns, std::mt19937 &rng){
+  if(head.part_frames == 0){
+    head.part = rng() % FLEET_PART_COLORS;
+    head.part_frames =
+      FLEET_PART_MIN_FRAMES +
+      rng() % (FLEET_PART_MAX_FRAMES - FLEET_PART_MIN_FRAMES + 1);
+  }
+  head.part_frames--;
+
+  int raw[4];
+  int mapped[4];
+  uint32_t variances[4];
+  for(uint8_t i=0; i<3; i++){
+    raw[i] = fleet_pulse(i, fleet_part_colors[head.part][i], rng);
+    mapped[i] = color_calibrate_channel(raw[i], i);
+    variances[i] = color_calibrate_variance(color_raw_variance(raw[i]), i);
+  }
+  raw[CLEAR] = 0;
+  mapped[CLEAR] = 0;
+  variances[CLEAR] = 0;
+
+  link_reading rec;
+  rec.seq = head.seq;
+  rec.flags = head.clock_sync.valid ? LINK_READING_FLAG_SYNCED : 0;
+  rec.class_index = color_classify_noisy(mapped, variances);
+  rec.host_time_us = time_sync_to_host(
+    head.clock_sync,
+    fleet_device_us(head, now_ns),
+    &rec.uncertainty_us
+  );
+  for(uint8_t i=0; i<4; i++){
+    rec.raw[i] = raw[i];
+    rec.mapped[i] = mapped[i];
+  }
+
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  head.frames++;
+  if(!fleet_queue_frame(
+    head, LINK_READING, payload, link_pack_reading(rec, payload)
+  )){
+    head.tx_dropped++;
+    head.seq++;
+    return;
+  }
+
+  fleet_sent &sent = head.sent[head.seq % FLEET_SENT_RING];
+  sent.seq = head.seq;
+  sent.valid = true;
+  sent.sent_ns = fleet_now_ns();
+  sent.true_us = host_time_us();
+  head.seq++;
+
+  return;
+}
+
+static void fleet_send_sync_req(fleet_head &head, int64_t now_ns){
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  link_sync_req req;
+  req.t1 = fleet_device_us(head, now_ns);
+  if(!fleet_queue_frame(
+    head, LINK_SYNC_REQ, payload, link_pack_sync_req(req, payload)
+  )){
+    return;
+  }
+
+  head.sync_pending = true;
+  head.sync_t1 = req.t1;
+  head.sync_sent_ns = now_ns;
+
+  return;
+}
+
+// Handles the host's sync responses, as time_sync_exchange() does.
+static void fleet_read_head(fleet_head &head){
+  uint8_t buf[256];
+  ssize_t n;
+  while((n = read(head.master, buf, sizeof(buf))) > 0){
+    int64_t t4 = fleet_device_us(head, fleet_now_ns());
+    for(ssize_t i=0; i<n; i++){
+      if(!link_decode_byte(head.decoder, buf[i]))
+        continue;
+
+      link_sync_resp resp;
+      if(
+        !head.sync_pending ||
+        head.decoder.type != LINK_SYNC_RESP ||
+        !link_unpack_sync_resp(head.decoder.payload, head.decoder.len, resp) ||
+        resp.t1 != head.sync_t1
+      ){
+        continue;
+      }
+      head.sync_pending = false;
+
+      if(!time_sync_add_exchange(
+        head.clock_sync, resp.t1, resp.t2, resp.t3, t4
+      )){
+        continue;
+      }
+
+      const time_sync_state &cs = head.clock_sync;
+      link_sync_status status;
+      status.device_id = head.device_id;
+      status.device_time_us = cs.ref_local_us;
+      status.offset_us = cs.ref_offset_us;
+      status.drift_ppb = cs.drift_ppb;
+      status.uncertainty_us = cs.ref_uncertainty_us;
+      status.samples = cs.fit_samples;
+      status.rtt_us = cs.best_rtt_us > 0xFFFF ? 0xFFFF : cs.best_rtt_us;
+      uint8_t payload[LINK_MAX_PAYLOAD];
+      fleet_queue_frame(
+        head, LINK_SYNC_STATUS, payload, link_pack_sync_status(status, payload)
+      );
+    }
+  }
+
+  return;
+}
+
+// Matches one row of ingest's CSV to the record it came from.
+static void fleet_on_row(
+  char *line,
+  std::vector<fleet_head> &heads,
+  const std::unordered_map<std::string, size_t> &ports,
+  int64_t now_ns
+){
+  // device_id,port,seq,host_time_us,...
+  char *save = NULL;
+  char *device = strtok_r(line, ",", &save);
+  char *port = strtok_r(NULL, ",", &save);
+  char *seq_str = strtok_r(NULL, ",", &save);
+  char *time_str = strtok_r(NULL, ",", &save);
+  char *unc_str = strtok_r(NULL, ",", &save);
+  char *synced = strtok_r(NULL, ",", &save);
+  if(!device || !port || !seq_str || !time_str || !unc_str || !synced)
+    return;
+
+  auto it = ports.find(port);
+  if(it == ports.end())
+    return;
+  fleet_head &head = heads[it->second];
+
+  uint16_t seq = strtoul(seq_str, NULL, 10);
+  fleet_sent &sent = head.sent[seq % FLEET_SENT_RING];
+  if(!sent.valid || sent.seq != seq){
+    head.unmatched++;
+    return;
+  }
+  sent.valid = false;
+
+  head.received++;
+  head.latency_ms.push_back((now_ns - sent.sent_ns) / 1e6);
+  if(atoi(synced)){
+    head.stamp_error_us.push_back(
+      (float)(strtoll(time_str, NULL, 10) - sent.true_us)
+    );
+  }
+
+  return;
+}
+
+// Value at fraction q of vals, sorted in place. NaN if empty.
+static double fleet_percentile(std::vector<float> &vals, double q){
+  if(vals.empty())
+    return NAN;
+  size_t i = (size_t)(q * (vals.size() - 1) + 0.5);
+  std::nth_element(vals.begin(), vals.begin() + i, vals.end());
+
+  return vals[i];
+}
+
+static void fleet_usage(){
+  fprintf(
+    stderr,
+    "usage: fleet [-n heads] [-r frames/s] [-x speedup] [-t seconds] [-v]\n"
+    "             <ingest> [ingest args ...]\n"
+  );
+
+  return;
+}
+
+int main(int argc, char **argv){
+  int count = FLEET_DEFAULT_HEADS;
+  double rate_hz = FLEET_DEFAULT_RATE_HZ;
+  double speedup = 1;
+  double seconds = FLEET_DEFAULT_SECONDS;
+  bool verbose = false;
+
+  int opt;
+  while((opt = getopt(argc, argv, "+n:r:x:t:v")) != -1){
+    if(opt == 'n')
+      count = atoi(optarg);
+    else if(opt == 'r')
+      rate_hz = atof(optarg);
+    else if(opt == 'x')
+      speedup = atof(optarg);
+    else if(opt == 't')
+      seconds = atof(optarg);
+    else if(opt == 'v')
+      verbose = true;
+    else
+      count = 0;
+  }
+  if(optind >= argc || count <= 0 || rate_hz <= 0 || speedup <= 0){
+    fleet_usage();
+    return 2;
+  }
+
+  // Two descriptors per head, plus ingest's own per head.
+  struct rlimit lim;
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0){
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> drift(
+    -FLEET_MAX_DRIFT_PPM * 1e-6, FLEET_MAX_DRIFT_PPM * 1e-6
+  );
+  std::vector<fleet_head> heads(count);
+  std::unordered_map<std::string, size_t> ports;
+  int64_t start_ns = fleet_now_ns();
+  int64_t frame_ns = (int64_t)(1e9 / (rate_hz * speedup));
+  for(int i=0; i<count; i++){
+    fleet_head &head = heads[i];
+    if(!fleet_open_pty(head)){
+      fprintf(stderr, "pty %d: %s\n", i, strerror(errno));
+      return 1;
+    }
+    ports[head.port] = i;
+
+    head.device_id = 0xF1EE700000000000ULL | i;
+    head.drift = drift(rng);
+    head.boot_ns = start_ns - (int64_t)(rng() % 1000000) * 1000;
+    time_sync_init(head.clock_sync);
+    link_decoder_reset(head.decoder);
+    head.sync_pending = false;
+    head.next_sync_ns = start_ns;
+    // Spread the heads' frames over the interval, as unsynchronised loops.
+    head.next_frame_ns = start_ns + rng() % frame_ns;
+    head.part_frames = 0;
+    head.tx_len = 0;
+    head.seq = 0;
+    memset(head.sent, 0, sizeof(head.sent));
+    head.frames = 0;
+    head.tx_dropped = 0;
+    head.received = 0;
+    head.unmatched = 0;
+  }
+
+  // Start ingest on the heads' ports, reading its stdout.
+  int out_pipe[2];
+  if(pipe(out_pipe)){
+    perror("pipe");
+    return 1;
+  }
+  pid_t ingest = fork();
+  if(ingest == 0){
+    std::vector<char *> args(argv + optind, argv + argc);
+    for(fleet_head &head : heads)
+      args.push_back((char *)head.port.c_str());
+    args.push_back(NULL);
+
+    dup2(out_pipe[1], STDOUT_FILENO);
+    if(!verbose){
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDERR_FILENO);
+    }
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    execvp(args[0], args.data());
+    perror(args[0]);
+    _exit(127);
+  }
+  close(out_pipe[1]);
+  fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+
+  signal(SIGINT, fleet_on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(
+    stderr,
+    "%d heads at %.1f frames/s each (x%.1f), %.0fs, ingest pid %d\n",
+    count, rate_hz * speedup, speedup, seconds, (int)ingest
+  );
+
+  std::vector<struct pollfd> fds(count + 1);
+  std::string pending;
+  int64_t stop_ns = start_ns + (int64_t)(seconds * 1e9);
+  int64_t drain_ns = stop_ns + FLEET_DRAIN_MS * 1000000LL;
+  bool ingest_open = true;
+  while(ingest_open){
+    int64_t now_ns = fleet_now_ns();
+    if(fleet_stop && stop_ns > now_ns){
+      stop_ns = now_ns;
+      drain_ns = now_ns + FLEET_DRAIN_MS * 1000000LL;
+    }
+    if(now_ns >= drain_ns)
+      break;
+
+    // Heads' frames and clock syncs that are due.
+    int64_t next_ns = drain_ns;
+    for(fleet_head &head : heads){
+      if(now_ns < stop_ns){
+        while(head.next_frame_ns <= now_ns){
+          fleet_frame(head, now_ns, rng);
+          head.next_frame_ns += frame_ns;
+        }
+        if(head.sync_pending && now_ns - head.sync_sent_ns >
+            FLEET_SYNC_TIMEOUT_MS * 1000000LL){
+          head.sync_pending = false;
+        }
+        if(!head.sync_pending && head.next_sync_ns <= now_ns){
+          fleet_send_sync_req(head, now_ns);
+          head.next_sync_ns = now_ns + 1000000LL * (
+            head.clock_sync.count < TIME_SYNC_WINDOW ?
+              FLEET_SYNC_FAST_INTERVAL_MS : FLEET_SYNC_SLOW_INTERVAL_MS
+          );
+        }
+        next_ns = std::min(next_ns, head.next_frame_ns);
+        next_ns = std::min(next_ns, head.next_sync_ns);
+      }
+      fleet_flush(head);
+    }
+
+    for(int i=0; i<count; i++){
+      fds[i].fd = heads[i].master;
+      fds[i].events = POLLIN | (heads[i].tx_len ? POLLOUT : 0);
+      fds[i].revents = 0;
+    }
+    fds[count].fd = out_pipe[0];
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+
+    int timeout_ms = (int)((next_ns - now_ns) / 1000000);
+    if(timeout_ms < 0)
+      timeout_ms = 0;
+    if(poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+
+    for(int i=0; i<count; i++){
+      if(fds[i].revents & POLLIN)
+        fleet_read_head(heads[i]);
+    }
+
+    if(fds[count].revents & (POLLIN | POLLHUP)){
+      char buf[65536];
+      ssize_t n;
+      while((n = read(out_pipe[0], buf, sizeof(buf))) > 0)
+        pending.append(buf, n);
+      if(n == 0)
+        ingest_open = false;
+
+      int64_t row_ns = fleet_now_ns();
+      size_t start = 0;
+      size_t end;
+      while((end = pending.find('\n', start)) != std::string::npos){
+        pending[end] = 0;
+        fleet_on_row(&pending[start], heads, ports, row_ns);
+        start = end + 1;
+      }
+      pending.erase(0, start);
+    }
+  }
+
+  kill(ingest, SIGTERM);
+  waitpid(ingest, NULL, 0);
+  double elapsed = (std::min(fleet_now_ns(), stop_ns) - start_ns) / 1e9;
+
+  // Report.
+  printf(
+    "%-12s %8s %8s %8s %7s %8s %8s %8s %9s\n",
+    "port", "frames", "tx_drop", "lost", "drop%",
+    "p50_ms", "p99_ms", "max_ms", "p99_|e|us"
+  );
+  std::vector<float> all_latency;
+  std::vector<float> all_error;
+  uint64_t frames = 0;
+  uint64_t tx_dropped = 0;
+  uint64_t lost = 0;
+  for(fleet_head &head : heads){
+    uint32_t written = head.frames - head.tx_dropped;
+    uint32_t head_lost = written - head.received;
+    frames += head.frames;
+    tx_dropped += head.tx_dropped;
+    lost += head_lost;
+    all_latency.insert(
+      all_latency.end(), head.latency_ms.begin(), head.latency_ms.end()
+    );
+    for(float &err : head.stamp_error_us)
+      err = fabsf(err);
+    all_error.insert(
+      all_error.end(), head.stamp_error_us.begin(), head.stamp_error_us.end()
+    );
+
+    printf(
+      "%-12s %8u %8u %8u %7.2f %8.2f %8.2f %8.2f %9.0f\n",
+      head.port.c_str() + (head.port.rfind('/') + 1),
+      head.frames,
+      head.tx_dropped,
+      head_lost,
+      head.frames ?
+        100.0 * (head.tx_dropped + head_lost) / head.frames : 0.0,
+      fleet_percentile(head.latency_ms, 0.5),
+      fleet_percentile(head.latency_ms, 0.99),
+      fleet_percentile(head.latency_ms, 1.0),
+      fleet_percentile(head.stamp_error_us, 0.99)
+    );
+  }
+
+  printf(
+    "\nfleet: %d heads, %" PRIu64 " frames in %.1fs (%.0f/s), "
+    "%" PRIu64 " dropped at heads, %" PRIu64 " lost (%.3f%%)\n",
+    count, frames, elapsed, frames / elapsed, tx_dropped, lost,
+    frames ? 100.0 * (tx_dropped + lost) / frames : 0.0
+  );
+  printf(
+    "latency ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+    fleet_percentile(all_latency, 0.5),
+    fleet_percentile(all_latency, 0.9),
+    fleet_percentile(all_latency, 0.99),
+    fleet_percentile(all_latency, 0.999),
+    fleet_percentile(all_latency, 1.0)
+  );
+  printf(
+    "timestamp |error| us: p50 %.0f p99 %.0f max %.0f\n",
+    fleet_percentile(all_error, 0.5),
+    fleet_percentile(all_error, 0.99),
+    fleet_percentile(all_error, 1.0)
+  );
+
+  for(fleet_head &head : heads){
+    close(head.master);
+    close(head.slave);
+  }
+
+  return 0;
+}
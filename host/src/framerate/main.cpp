@@ -0,0 +1,239 @@
+// Benchmarks the frame rate of heads running different firmware builds, e.g.
+//  the display build against the headless one (-DHEADLESS), or the Arduino
+//  build against the ESP-IDF one.
+//  Each head is given as <label>=<port>. Serves their clock sync like ingest
+//    and, after a warm-up, times their reading records for the given number
+//    of seconds by the read times they carry, so serial buffering on the way
+//    in doesn't blur the intervals. Then prints per head:
+//      frames    spanned by the records taken, lost ones (sequence gaps)
+//                included.
+//      frames/s  the inverse of the mean interval.
+//      interval  between consecutive frames, mean, p50, p99 and max, in ms.
+//      jitter    standard deviation of the interval, in ms.
+//      x first   frame rate relative to the first head given.
+//  Frame rates include the frame delay (Modbus holding register 8), which
+//    headless builds default lower. Set both heads to the same delay to
+//    compare the per frame cost alone. The ESP-IDF build has no delay, its
+//    frames run on a fixed period instead (-DFRAME_PERIOD_US).
+//
+// Usage: framerate [-b baud] [-w warmup_s] [-t seconds] <label>=<port> ...
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "device_session.h"
+#include "serial_port.h"
+
+#define FRAMERATE_MAX_HEADS 16
+
+static volatile sig_atomic_t framerate_stop = 0;
+
+struct framerate_head {
+  const char *label;
+  int64_t start_us;         // Host time measuring starts.
+
+  // Last record taken.
+  bool started;
+  uint16_t last_seq;
+  int64_t last_time_us;
+  bool last_synced;
+
+  uint32_t frames;          // Frames spanned, lost records included.
+  uint32_t lost;
+  std::vector<int64_t> intervals_us;
+};
+
+static void framerate_on_signal(int){
+  framerate_stop = 1;
+}
+
+static void framerate_on_reading(
+  device_session &session,
+  const link_reading &rec,
+  void *ctx
+){
+  framerate_head &head = *(framerate_head *)ctx;
+
+  if(host_time_us() < head.start_us)
+    return;
+
+  bool synced = rec.flags & LINK_READING_FLAG_SYNCED;
+  if(!head.started){
+    head.started = true;
+    head.frames = 1;
+  }
+  else {
+    uint16_t step = rec.seq - head.last_seq;
+    head.frames += step;
+    head.lost += step - 1;
+
+    // A head gaining its clock sync jumps timelines, skip that interval.
+    int64_t elapsed = rec.host_time_us - head.last_time_us;
+    if(step && synced == head.last_synced)
+      head.intervals_us.push_back(elapsed / step);
+  }
+  head.last_seq = rec.seq;
+  head.last_time_us = rec.host_time_us;
+  head.last_synced = synced;
+
+  return;
+}
+
+static double framerate_percentile(std::vector<int64_t> &values, double p){
+  size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+
+  return values[index] / 1000.0;
+}
+
+static void framerate_report(framerate_head *heads, int count){
+  printf(
+    "%-12s %8s %6s %9s %9s %9s %9s %9s %9s %7s\n",
+    "head", "frames", "lost", "frames/s",
+    "mean_ms", "p50_ms", "p99_ms", "max_ms", "jitter_ms", "x first"
+  );
+
+  double first_rate = 0;
+  for(int i=0; i<count; i++){
+    framerate_head &head = heads[i];
+    if(head.intervals_us.empty()){
+      printf("%-12s no frames\n", head.label);
+      continue;
+    }
+
+    int64_t sum = 0;
+    int64_t longest = 0;
+    for(int64_t interval : head.intervals_us){
+      sum += interval;
+      longest = std::max(longest, interval);
+    }
+    double mean_ms = sum / 1000.0 / head.intervals_us.size();
+    double square_sum = 0;
+    for(int64_t interval : head.intervals_us){
+      double deviation = interval / 1000.0 - mean_ms;
+      square_sum += deviation * deviation;
+    }
+    double jitter_ms = sqrt(square_sum / head.intervals_us.size());
+    double rate = 1000.0 / mean_ms;
+    if(i == 0)
+      first_rate = rate;
+
+    printf(
+      "%-12s %8u %6u %9.2f %9.2f %9.2f %9.2f %9.2f %9.3f",
+      head.label,
+      head.frames,
+      head.lost,
+      rate,
+      mean_ms,
+      framerate_percentile(head.intervals_us, 0.5),
+      framerate_percentile(head.intervals_us, 0.99),
+      longest / 1000.0,
+      jitter_ms
+    );
+    if(first_rate > 0)
+      printf(" %7.2f\n", rate / first_rate);
+    else
+      printf(" %7s\n", "-");
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  uint32_t baud = 115200;
+  uint32_t warmup_s = 5;
+  uint32_t seconds = 30;
+  int opt;
+  while((opt = getopt(argc, argv, "b:w:t:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'w'){
+      warmup_s = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 't'){
+      seconds = strtoul(optarg, NULL, 10);
+    }
+    else {
+      optind = argc;
+      break;
+    }
+  }
+  int count = argc - optind;
+  if(count < 1 || count > FRAMERATE_MAX_HEADS){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-w warmup_s] [-t seconds] <label>=<port> ...\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  static framerate_head heads[FRAMERATE_MAX_HEADS];
+  static device_session sessions[FRAMERATE_MAX_HEADS];
+  struct pollfd fds[FRAMERATE_MAX_HEADS];
+  int64_t start_us = host_time_us() + warmup_s * 1000000LL;
+  for(int i=0; i<count; i++){
+    char *arg = argv[optind + i];
+    char *port = strchr(arg, '=');
+    if(!port){
+      fprintf(stderr, "%s: expected <label>=<port>\n", arg);
+      return 2;
+    }
+    *port++ = '\0';
+
+    int fd = serial_port_open(port, baud);
+    if(fd < 0){
+      fprintf(stderr, "%s: %s\n", port, strerror(errno));
+      return 1;
+    }
+    heads[i].label = arg;
+    heads[i].start_us = start_us;
+    device_session_init(sessions[i], fd, port);
+    fds[i].fd = fd;
+    fds[i].events = POLLIN;
+  }
+
+  signal(SIGINT, framerate_on_signal);
+  signal(SIGTERM, framerate_on_signal);
+
+  fprintf(
+    stderr,
+    "warming up for %us, then measuring for %us\n",
+    warmup_s,
+    seconds
+  );
+  int64_t end_us = start_us + seconds * 1000000LL;
+  int open_ports = count;
+  while(!framerate_stop && open_ports > 0 && host_time_us() < end_us){
+    int ready = poll(fds, count, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+
+    for(int i=0; i<count; i++){
+      if(fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if(!device_session_poll(sessions[i], framerate_on_reading, &heads[i])){
+        fprintf(stderr, "%s: closed\n", sessions[i].name);
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open_ports--;
+      }
+    }
+  }
+
+  framerate_report(heads, count);
+
+  return 0;
+}
@@ -0,0 +1,385 @@
+// Downloads a head's raw reading histograms (see histogram.h) and calibrates
+//  from their percentiles instead of the absolute extrema.
+//  Keeps the head's clock sync answered while it waits. -r empties the
+//    histograms first, restarting them at the head's current illumination
+//    step, and -t collects for that many seconds before downloading: run it
+//    with -r -t while the calibration targets go past the sensor.
+//  -l lo:shift switches the head to linear bins 2^shift us wide from lo, -g
+//    back to log spaced ones, either also empties them.
+//  Writes every bin to -o as CSV (bin, lo_us, width_us, raw_r-raw_c counts)
+//    and reports each channel's readings, extrema and -p percentiles on
+//    stderr, then the low and high percentiles as a calibration table for the
+//    histograms' illumination step, in color_read_calib_vals order.
+//
+// Usage: histo [-b baud] [-r] [-t seconds] [-l lo:shift | -g]
+//              [-p low,high] [-o bins.csv] <port>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "device_session.h"
+#include "histogram.h"
+#include "serial_port.h"
+
+// A download that hasn't progressed for this long is asked for again, up to
+//  HISTO_RETRIES times.
+#define HISTO_RETRY_US 2000000
+#define HISTO_RETRIES 3
+
+// Frames a download takes per channel.
+#define HISTO_CHANNEL_FRAMES \
+  ((HIST_BINS + LINK_HIST_DATA_BINS - 1) / LINK_HIST_DATA_BINS)
+
+static volatile sig_atomic_t histo_stop = 0;
+
+static const char *histo_channel_names[HIST_CHANNELS] = {
+  "red", "green", "blue", "clear"
+};
+
+struct histo_state {
+  bool have_info;
+  link_hist_info info;
+
+  // Histograms as downloaded, and which of their frames have arrived.
+  raw_histogram hist;
+  bool received[HIST_CHANNELS][HISTO_CHANNEL_FRAMES];
+  uint16_t remaining;
+  int64_t progress_us;
+};
+
+static void histo_on_signal(int){
+  histo_stop = 1;
+}
+
+static bool histo_send(device_session &session, uint8_t op){
+  link_hist_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.op = op;
+
+  return device_session_histogram(session, cmd);
+}
+
+// Starts a download, forgetting any partial one.
+static void histo_request(device_session &session, histo_state &state){
+  state.have_info = false;
+  memset(state.received, 0, sizeof(state.received));
+  state.remaining = HIST_CHANNELS * HISTO_CHANNEL_FRAMES;
+  state.progress_us = host_time_us();
+  hist_init(state.hist);
+  histo_send(session, LINK_HIST_READ);
+
+  return;
+}
+
+static void histo_on_frame(
+  device_session &,
+  const link_decoder &frame,
+  void *ctx
+){
+  histo_state &state = *(histo_state *)ctx;
+
+  if(frame.type == LINK_HIST_INFO){
+    if(!link_unpack_hist_info(frame.payload, frame.len, state.info))
+      return;
+    state.have_info = true;
+    state.hist.scale = state.info.scale;
+    state.hist.shift = state.info.shift;
+    state.hist.lo = state.info.lo;
+  }
+  else if(frame.type == LINK_HIST_DATA){
+    link_hist_data msg;
+    if(
+      !link_unpack_hist_data(frame.payload, frame.len, msg) ||
+      msg.channel >= HIST_CHANNELS ||
+      msg.first % LINK_HIST_DATA_BINS ||
+      msg.first + msg.count > HIST_BINS
+    ){
+      return;
+    }
+
+    uint16_t index = msg.first / LINK_HIST_DATA_BINS;
+    bool &received = state.received[msg.channel][index];
+    if(received)
+      return;
+    for(uint8_t i=0; i<msg.count; i++){
+      state.hist.counts[msg.channel][msg.first + i] = msg.counts[i];
+      state.hist.samples[msg.channel] += msg.counts[i];
+    }
+    received = true;
+    state.remaining--;
+    state.progress_us = host_time_us();
+  }
+
+  return;
+}
+
+// Serves the session until done() or timeout_us, or Ctrl-C.
+//  Returns false if the port closed.
+static bool histo_serve(
+  device_session &session,
+  int64_t timeout_us,
+  bool (*done)(const histo_state &),
+  const histo_state &state
+){
+  struct pollfd pfd;
+  pfd.fd = session.fd;
+  pfd.events = POLLIN;
+  int64_t start = host_time_us();
+  while(!histo_stop && !(done && done(state))){
+    if(host_time_us() - start >= timeout_us)
+      return true;
+    int ready = poll(&pfd, 1, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      return false;
+    }
+    if(ready > 0 && !device_session_poll(session, NULL, NULL)){
+      fprintf(stderr, "%s: closed\n", session.name);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool histo_have_info(const histo_state &state){
+  return state.have_info;
+}
+
+static bool histo_downloaded(const histo_state &state){
+  return state.have_info && !state.remaining;
+}
+
+static bool histo_write_csv(const char *path, const raw_histogram &hist){
+  FILE *out = fopen(path, "w");
+  if(!out){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  fprintf(out, "bin,lo_us,width_us,raw_r,raw_g,raw_b,raw_c\n");
+  for(uint16_t bin=0; bin<HIST_BINS; bin++){
+    fprintf(
+      out,
+      "%u,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32
+      ",%" PRIu32 "\n",
+      bin,
+      hist_bin_lo(hist, bin),
+      hist_bin_width(hist, bin),
+      hist.counts[0][bin],
+      hist.counts[1][bin],
+      hist.counts[2][bin],
+      hist.counts[3][bin]
+    );
+  }
+  if(fclose(out) != 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+// Parses "low,high" percentages into permille.
+static bool histo_parse_percentiles(
+  const char *arg,
+  uint16_t &low,
+  uint16_t &high
+){
+  double lo_pct;
+  double hi_pct;
+  if(sscanf(arg, "%lf,%lf", &lo_pct, &hi_pct) != 2)
+    return false;
+  if(lo_pct < 0 || hi_pct > 100 || lo_pct >= hi_pct)
+    return false;
+  low = (uint16_t)(lo_pct * 10 + 0.5);
+  high = (uint16_t)(hi_pct * 10 + 0.5);
+
+  return true;
+}
+
+static void histo_report(
+  const histo_state &state,
+  uint16_t low,
+  uint16_t high
+){
+  const raw_histogram &hist = state.hist;
+  const link_hist_info &info = state.info;
+
+  fprintf(
+    stderr,
+    "%s bins, illumination step %u, %.1fs of readings\n",
+    hist.scale == HIST_LINEAR ? "linear" : "log",
+    info.step,
+    info.age_ms / 1000.0
+  );
+  fprintf(
+    stderr,
+    "%-7s %9s %7s %7s %7s %7s %7s\n",
+    "channel", "readings", "min", "p_low", "median", "p_high", "max"
+  );
+  for(uint8_t ch=0; ch<HIST_CHANNELS; ch++){
+    fprintf(
+      stderr,
+      "%-7s %9" PRIu32 " %7" PRId32 " %7" PRId32 " %7" PRId32 " %7" PRId32
+      " %7" PRId32 "\n",
+      histo_channel_names[ch],
+      hist.samples[ch],
+      hist_percentile(hist, ch, 0),
+      hist_percentile(hist, ch, low),
+      hist_percentile(hist, ch, 500),
+      hist_percentile(hist, ch, high),
+      hist_percentile(hist, ch, 1000)
+    );
+  }
+
+  fprintf(
+    stderr,
+    "\ncalibration, p%.1f to p%.1f:\n",
+    low / 10.0,
+    high / 10.0
+  );
+  for(uint8_t ch=0; ch<HIST_CHANNELS; ch++){
+    if(!hist.samples[ch]){
+      fprintf(stderr, "  // %s: no readings\n", histo_channel_names[ch]);
+      continue;
+    }
+    fprintf(
+      stderr,
+      "  {%" PRId32 ", %" PRId32 "},\n",
+      hist_percentile(hist, ch, low),
+      hist_percentile(hist, ch, high)
+    );
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  uint32_t baud = 115200;
+  bool reset = false;
+  double collect_s = 0;
+  bool configure = false;
+  link_hist_cmd setup;
+  memset(&setup, 0, sizeof(setup));
+  setup.op = LINK_HIST_CONFIGURE;
+  setup.scale = HIST_LOG;
+  uint16_t low = 10;
+  uint16_t high = 990;
+  const char *csv_path = NULL;
+  bool usage = false;
+  int opt;
+  while((opt = getopt(argc, argv, "b:rt:l:gp:o:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'r'){
+      reset = true;
+    }
+    else if(opt == 't'){
+      collect_s = atof(optarg);
+    }
+    else if(opt == 'l'){
+      unsigned lo;
+      unsigned shift;
+      usage |= sscanf(optarg, "%u:%u", &lo, &shift) != 2 || lo > 0xFFFF;
+      setup.scale = HIST_LINEAR;
+      setup.lo = lo;
+      setup.shift = shift;
+      configure = true;
+    }
+    else if(opt == 'g'){
+      setup.scale = HIST_LOG;
+      configure = true;
+    }
+    else if(opt == 'p'){
+      usage |= !histo_parse_percentiles(optarg, low, high);
+    }
+    else if(opt == 'o'){
+      csv_path = optarg;
+    }
+    else {
+      usage = true;
+    }
+  }
+  if(usage || argc - optind != 1){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-r] [-t seconds] [-l lo:shift | -g]\n"
+      "          [-p low,high] [-o bins.csv] <port>\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  int fd = serial_port_open(argv[optind], baud);
+  if(fd < 0){
+    fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  device_session session;
+  device_session_init(session, fd, argv[optind]);
+  static histo_state state;
+  memset(&state, 0, sizeof(state));
+  session.on_frame = histo_on_frame;
+  session.frame_ctx = &state;
+
+  signal(SIGINT, histo_on_signal);
+  signal(SIGTERM, histo_on_signal);
+
+  // The setup report says whether the head took the configuration.
+  if(configure){
+    device_session_histogram(session, setup);
+    if(!histo_serve(session, HISTO_RETRY_US, histo_have_info, state))
+      return 1;
+    if(
+      !state.have_info ||
+      state.info.scale != setup.scale ||
+      state.info.lo != setup.lo ||
+      state.info.shift != setup.shift
+    ){
+      fprintf(stderr, "%s: scale not applied\n", session.name);
+      return 1;
+    }
+  }
+  else if(reset){
+    histo_send(session, LINK_HIST_RESET);
+  }
+  if(collect_s > 0){
+    fprintf(stderr, "collecting for %.1fs\n", collect_s);
+    if(!histo_serve(session, collect_s * 1000000, NULL, state))
+      return 1;
+  }
+
+  bool downloaded = false;
+  for(int attempt=0; attempt<=HISTO_RETRIES && !histo_stop; attempt++){
+    histo_request(session, state);
+    while(!histo_stop){
+      int64_t since = state.progress_us;
+      if(!histo_serve(session, HISTO_RETRY_US, histo_downloaded, state))
+        return 1;
+      if(histo_downloaded(state) || state.progress_us == since)
+        break;
+    }
+    downloaded = histo_downloaded(state);
+    if(downloaded)
+      break;
+  }
+  close(fd);
+  if(!downloaded){
+    fprintf(stderr, "%s: download incomplete\n", session.name);
+    return 1;
+  }
+
+  histo_report(state, low, high);
+  if(csv_path && !histo_write_csv(csv_path, state.hist))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,594 @@
+// Ingests the record streams of one or more sensor heads.
+//  Every head is kept synchronised to this host's clock, so the CSV written to
+//    stdout has all heads' records on one timeline. Per-device clock offset,
+//    drift and timestamp uncertainty are reported on stderr, as are process
+//    control alarms raised by the heads.
+//  With -o, synchronised records are also appended to one columnar log per
+//    head, <dir>/<device id>.cslog, for the query tool.
+//  With -e, the heads' binary log records are rendered against their firmware
+//    ELF and printed on stderr, on the host timeline.
+//  With -s, the heads stream only the telemetry subscribed to instead of
+//    full reading records (see telemetry.h), and stdout gets one row per
+//    telemetry record instead. A spec is <fields>:<mode>[:<interval>]:
+//      fields    comma separated names (raw_r ... raw_c, r ... c, class,
+//                confidence, palette, faults, illum_step) or groups (raw,
+//                rgb for r,g,b,c, all)
+//      mode      every, mean or change
+//      interval  frames, or ms with an ms suffix; for change the least time
+//                between records
+//    e.g. class changes plus per second means of the calibrated channels:
+//      -s class,confidence:change -s rgb:mean:1000ms
+//    Each subscription's records, losses and bandwidth are reported on stderr
+//    next to what the full reading stream would have cost. The -o logs are
+//    fed by reading records, so they stay empty while streams are running.
+//
+// Usage: ingest [-b baud] [-o dir] [-e firmware.elf] [-s spec ...]
+//          <port> [port ...]
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "binlog_decode.h"
+#include "device_session.h"
+#include "sensor_log.h"
+#include "serial_port.h"
+#include "spc.h"
+#include "telemetry.h"
+
+// Most heads a single ingest process will serve.
+#define INGEST_MAX_DEVICES 1024
+
+// Interval between per-device clock reports on stderr, in ms.
+#define INGEST_REPORT_INTERVAL_MS 10000
+
+// Subscriptions are resent well inside the head's lease.
+#define INGEST_RENEW_INTERVAL_MS (TELEMETRY_LEASE_MS / 3)
+
+static volatile sig_atomic_t ingest_stop = 0;
+
+// Per-port columnar logs, opened once a head's device ID is known.
+struct ingest_logs {
+  const char *dir;
+  bool streaming;
+  device_session *sessions;
+  sensor_log_writer writers[INGEST_MAX_DEVICES];
+  bool open[INGEST_MAX_DEVICES];
+};
+
+// One subscription's traffic from one head.
+struct ingest_stream_stats {
+  bool seq_known;
+  uint16_t next_seq;
+  uint32_t records;
+  uint32_t lost;            // Gaps in the record sequence numbers.
+  uint64_t bytes;           // On the wire, including link overhead, and
+  uint64_t samples;         //  frames covered, after the first record.
+  int64_t first_us;         // Host receive times of the first and last.
+  int64_t last_us;
+  uint8_t status;           // Last LINK_SUBSCRIBE_ACK status.
+  bool acked;
+};
+
+// Telemetry subscriptions asked for with -s, and frames the session itself
+//  doesn't handle.
+struct ingest_streams {
+  int count;
+  const char *specs[TELEMETRY_MAX_SUBS];
+  link_subscribe subs[TELEMETRY_MAX_SUBS];
+  device_session *sessions;
+  ingest_stream_stats stats[INGEST_MAX_DEVICES][TELEMETRY_MAX_SUBS];
+
+  // Renders LINK_LOG records if set.
+  binlog_decoder *binlog;
+};
+
+static void ingest_on_signal(int){
+  ingest_stop = 1;
+}
+
+// Appends a record to the session's log, opening it on first use.
+//  Unsynchronised records carry raw device time and are left out of the log.
+static void ingest_log_reading(
+  ingest_logs &logs,
+  device_session &session,
+  const link_reading &rec
+){
+  if(!(rec.flags & LINK_READING_FLAG_SYNCED) || !session.clock.known)
+    return;
+
+  size_t i = &session - logs.sessions;
+  if(!logs.open[i]){
+    char path[4096];
+    snprintf(
+      path, sizeof(path), "%s/%016" PRIx64 ".cslog",
+      logs.dir, session.clock.device_id
+    );
+    if(!sensor_log_writer_open(logs.writers[i], path, session.clock.device_id)){
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return;
+    }
+    logs.open[i] = true;
+  }
+
+  sensor_log_append(logs.writers[i], rec);
+
+  return;
+}
+
+// Writes one record as a CSV row, and to the logs if enabled.
+static void ingest_on_reading(
+  device_session &session,
+  const link_reading &rec,
+  void *ctx
+){
+  ingest_logs &logs = *(ingest_logs *)ctx;
+  if(logs.dir)
+    ingest_log_reading(logs, session, rec);
+
+  // Only telemetry rows go to stdout once the heads are told to stream it.
+  if(logs.streaming)
+    return;
+
+  printf(
+    "%016" PRIx64 ",%s,%u,%" PRId64 ",%u,%u,%u,%u,%u,%u,%u,%d,%d,%d,%d,%u\n",
+    session.clock.device_id,
+    session.name,
+    rec.seq,
+    rec.host_time_us,
+    rec.uncertainty_us,
+    (rec.flags & LINK_READING_FLAG_SYNCED) ? 1 : 0,
+    rec.class_index,
+    rec.raw[0], rec.raw[1], rec.raw[2], rec.raw[3],
+    rec.mapped[0], rec.mapped[1], rec.mapped[2], rec.mapped[3],
+    (rec.flags & LINK_READING_ILLUM_MASK) >> LINK_READING_ILLUM_SHIFT
+  );
+
+  return;
+}
+
+// Reports a head's process control alarm on stderr.
+static void ingest_on_spc_alarm(
+  device_session &session,
+  const link_spc_alarm &a
+){
+  static const char *channels[] = {"red", "green", "blue", "distance"};
+
+  fprintf(
+    stderr,
+    "%016" PRIx64 " %s: SPC alarm on %s at frame %u:%s%s%s%s%s%s"
+    " (mean %.2f sigma %.2f ewma %.2f cusum +%.2f/-%.2f xbar %.2f R %.2f)\n",
+    session.clock.device_id,
+    session.name,
+    a.channel < 4 ? channels[a.channel] : "?",
+    a.frame,
+    (a.alarms & SPC_ALARM_EWMA_HIGH) ? " EWMA high" : "",
+    (a.alarms & SPC_ALARM_EWMA_LOW) ? " EWMA low" : "",
+    (a.alarms & SPC_ALARM_CUSUM_HIGH) ? " CUSUM high" : "",
+    (a.alarms & SPC_ALARM_CUSUM_LOW) ? " CUSUM low" : "",
+    (a.alarms & SPC_ALARM_XBAR) ? " X-bar" : "",
+    (a.alarms & SPC_ALARM_RANGE) ? " range" : "",
+    a.mean / 65536.0, a.sigma / 65536.0, a.ewma / 65536.0,
+    a.cusum_high / 65536.0, a.cusum_low / 65536.0,
+    a.xbar / 65536.0, a.range / 65536.0
+  );
+
+  return;
+}
+
+// Prints a head's binary log record on stderr.
+static void ingest_on_log(
+  device_session &session,
+  binlog_decoder &dec,
+  const link_log &msg
+){
+  const binlog_decoded_site &site = binlog_decoder_site(dec, msg.site);
+  fprintf(
+    stderr,
+    "%016" PRIx64 " %s: %" PRId64 " %s %s:%u: %s\n",
+    session.clock.device_id,
+    session.name,
+    device_clock_to_host(session.clock, msg.device_time_us),
+    site.valid ? binlog_level_name(site.level) : "?",
+    site.valid ? site.file.c_str() : "?",
+    site.line,
+    binlog_decoder_format(dec, msg).c_str()
+  );
+
+  return;
+}
+
+// Writes a telemetry record as a CSV row, the values as name=value pairs.
+static void ingest_on_telemetry(
+  ingest_streams &streams,
+  device_session &session,
+  const link_telemetry &rec,
+  uint8_t frame_len
+){
+  if(rec.sub >= TELEMETRY_MAX_SUBS)
+    return;
+
+  ingest_stream_stats &stats =
+    streams.stats[&session - streams.sessions][rec.sub];
+  if(stats.seq_known && rec.seq != stats.next_seq)
+    stats.lost += (uint16_t)(rec.seq - stats.next_seq);
+  stats.seq_known = true;
+  stats.next_seq = rec.seq + 1;
+  // Rates are over the time since the first record, so its traffic counts
+  //  only towards the totals.
+  if(stats.records == 0)
+    stats.first_us = session.rx_time_us;
+  else{
+    stats.bytes += frame_len + LINK_FRAME_OVERHEAD;
+    stats.samples += rec.samples;
+  }
+  stats.last_us = session.rx_time_us;
+  stats.records++;
+
+  printf(
+    "%016" PRIx64 ",%s,%u,%u,%" PRId64 ",%u,",
+    session.clock.device_id,
+    session.name,
+    rec.sub,
+    rec.seq,
+    device_clock_to_host(session.clock, rec.device_time_us),
+    rec.samples
+  );
+  uint8_t n = 0;
+  for(uint8_t f=0; f<TELEMETRY_FIELD_COUNT; f++){
+    if(!(rec.fields & (1 << f)))
+      continue;
+    uint16_t val = rec.values[n++];
+    printf(
+      "%s%s=%d",
+      n > 1 ? " " : "",
+      telemetry_field_name(f),
+      telemetry_field_signed(f) ? (int)(int16_t)val : (int)val
+    );
+  }
+  printf("\n");
+
+  return;
+}
+
+// Frames the session doesn't handle itself: log records, telemetry and
+//  subscription outcomes.
+static void ingest_on_frame(
+  device_session &session,
+  const link_decoder &frame,
+  void *ctx
+){
+  ingest_streams &streams = *(ingest_streams *)ctx;
+
+  switch(frame.type){
+    case LINK_LOG: {
+      link_log msg;
+      if(streams.binlog && link_unpack_log(frame.payload, frame.len, msg))
+        ingest_on_log(session, *streams.binlog, msg);
+      break;
+    }
+
+    case LINK_TELEMETRY: {
+      link_telemetry rec;
+      if(link_unpack_telemetry(frame.payload, frame.len, rec))
+        ingest_on_telemetry(streams, session, rec, frame.len);
+      break;
+    }
+
+    case LINK_SUBSCRIBE_ACK: {
+      link_subscribe_ack ack;
+      if(
+        !link_unpack_subscribe_ack(frame.payload, frame.len, ack) ||
+        ack.sub >= TELEMETRY_MAX_SUBS
+      )
+        break;
+      ingest_stream_stats &stats =
+        streams.stats[&session - streams.sessions][ack.sub];
+      bool news = !stats.acked || stats.status != ack.status;
+      if(ack.status != TELEMETRY_OK && news){
+        fprintf(
+          stderr,
+          "%s: subscription %u (%s) refused, status %u\n",
+          session.name,
+          ack.sub,
+          ack.sub < streams.count ? streams.specs[ack.sub] : "?",
+          ack.status
+        );
+      }
+      stats.acked = true;
+      stats.status = ack.status;
+      break;
+    }
+  }
+
+  return;
+}
+
+// Parses a -s spec, see the top of the file.
+static bool ingest_parse_spec(const char *spec, link_subscribe &out){
+  memset(&out, 0, sizeof(out));
+
+  std::string text = spec;
+  size_t colon = text.find(':');
+  if(colon == std::string::npos)
+    return false;
+  std::string fields = text.substr(0, colon);
+  std::string rest = text.substr(colon + 1);
+  colon = rest.find(':');
+  std::string mode = rest.substr(0, colon);
+  std::string interval;
+  if(colon != std::string::npos)
+    interval = rest.substr(colon + 1);
+
+  size_t start = 0;
+  while(start <= fields.size()){
+    size_t comma = fields.find(',', start);
+    if(comma == std::string::npos)
+      comma = fields.size();
+    std::string name = fields.substr(start, comma - start);
+    start = comma + 1;
+
+    if(name == "raw")
+      out.fields |= TELEMETRY_RAW_R | TELEMETRY_RAW_G | TELEMETRY_RAW_B |
+        TELEMETRY_RAW_C;
+    else if(name == "rgb")
+      out.fields |= TELEMETRY_R | TELEMETRY_G | TELEMETRY_B | TELEMETRY_C;
+    else if(name == "all")
+      out.fields |= TELEMETRY_ALL_FIELDS;
+    else{
+      uint8_t f = 0;
+      while(telemetry_field_name(f) && name != telemetry_field_name(f))
+        f++;
+      if(!telemetry_field_name(f))
+        return false;
+      out.fields |= 1 << f;
+    }
+  }
+
+  if(mode == "every")
+    out.mode = TELEMETRY_EVERY_N;
+  else if(mode == "mean")
+    out.mode = TELEMETRY_MEAN;
+  else if(mode == "change")
+    out.mode = TELEMETRY_ON_CHANGE;
+  else
+    return false;
+
+  if(!interval.empty()){
+    char *end;
+    unsigned long val = strtoul(interval.c_str(), &end, 10);
+    if(end == interval.c_str() || val > 0xFFFF)
+      return false;
+    if(strcmp(end, "ms") == 0)
+      out.period_ms = val;
+    else if(*end == '\0' && out.mode != TELEMETRY_ON_CHANGE)
+      out.decimation = val;
+    else
+      return false;
+  }
+
+  return out.mode == TELEMETRY_ON_CHANGE || out.decimation || out.period_ms;
+}
+
+// Sends every subscription to every head, which also renews them.
+static void ingest_subscribe(
+  ingest_streams &streams,
+  device_session *sessions,
+  struct pollfd *fds,
+  int count
+){
+  for(int i=0; i<count; i++){
+    if(fds[i].fd < 0)
+      continue;
+    for(int s=0; s<streams.count; s++)
+      device_session_subscribe(sessions[i], streams.subs[s]);
+  }
+
+  return;
+}
+
+static void ingest_report_streams(
+  ingest_streams &streams,
+  device_session *sessions,
+  int count
+){
+  fprintf(
+    stderr,
+    "%-16s %-20s %3s %-28s %8s %6s %8s %10s\n",
+    "device", "port", "sub", "spec", "records", "lost", "B/s", "full_B/s"
+  );
+  for(int i=0; i<count; i++){
+    for(int s=0; s<streams.count; s++){
+      const ingest_stream_stats &stats = streams.stats[i][s];
+      double secs = (stats.last_us - stats.first_us) / 1e6;
+      double rate = secs > 0 ? stats.bytes / secs : 0;
+      // What the covered frames would have cost as reading records.
+      double full = secs > 0 ?
+        stats.samples * (LINK_READING_LEN + LINK_FRAME_OVERHEAD) / secs : 0;
+      fprintf(
+        stderr,
+        "%016" PRIx64 " %-20s %3d %-28s %8u %6u %8.1f %10.1f\n",
+        sessions[i].clock.device_id,
+        sessions[i].name,
+        s,
+        streams.specs[s],
+        stats.records,
+        stats.lost,
+        rate,
+        full
+      );
+    }
+  }
+
+  return;
+}
+
+static void ingest_report_clocks(device_session *sessions, int count){
+  fprintf(
+    stderr,
+    "%-16s %-20s %14s %10s %8s %7s %6s %9s %7s\n",
+    "device", "port", "offset_us", "drift_ppm", "unc_us", "samples",
+    "rtt_us", "readings", "dropped"
+  );
+  for(int i=0; i<count; i++){
+    const device_session &s = sessions[i];
+    if(!s.clock.known){
+      fprintf(stderr, "%-16s %-20s  (not synchronised)\n", "?", s.name);
+      continue;
+    }
+    fprintf(
+      stderr,
+      "%016" PRIx64 " %-20s %14" PRId64 " %10.3f %8u %7u %6u %9u %7u\n",
+      s.clock.device_id,
+      s.name,
+      s.clock.offset_us,
+      s.clock.drift_ppb / 1000.0,
+      s.clock.uncertainty_us,
+      s.clock.samples,
+      s.clock.rtt_us,
+      s.readings,
+      s.dropped
+    );
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  static device_session sessions[INGEST_MAX_DEVICES];
+  static ingest_logs logs;
+  logs.sessions = sessions;
+  static binlog_decoder binlog;
+  const char *elf = NULL;
+  static ingest_streams streams;
+  streams.sessions = sessions;
+
+  uint32_t baud = 115200;
+  int opt;
+  while((opt = getopt(argc, argv, "b:o:e:s:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'o'){
+      logs.dir = optarg;
+    }
+    else if(opt == 'e'){
+      elf = optarg;
+    }
+    else if(
+      opt == 's' &&
+      streams.count < TELEMETRY_MAX_SUBS &&
+      ingest_parse_spec(optarg, streams.subs[streams.count])
+    ){
+      streams.subs[streams.count].sub = streams.count;
+      streams.specs[streams.count++] = optarg;
+    }
+    else {
+      optind = argc;
+      break;
+    }
+  }
+  if(optind >= argc){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-o dir] [-e firmware.elf] [-s spec ...]\n"
+      "         <port> [port ...]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  if(elf && !binlog_decoder_load(binlog, elf)){
+    fprintf(stderr, "%s: %s\n", elf, strerror(errno));
+    return 1;
+  }
+  if(elf)
+    streams.binlog = &binlog;
+  logs.streaming = streams.count > 0;
+
+  struct pollfd fds[INGEST_MAX_DEVICES];
+  int count = 0;
+  for(int i=optind; i<argc && count<INGEST_MAX_DEVICES; i++){
+    int fd = serial_port_open(argv[i], baud);
+    if(fd < 0){
+      fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    device_session_init(sessions[count], fd, argv[i]);
+    sessions[count].on_spc_alarm = ingest_on_spc_alarm;
+    sessions[count].on_frame = ingest_on_frame;
+    sessions[count].frame_ctx = &streams;
+    fds[count].fd = fd;
+    fds[count].events = POLLIN;
+    count++;
+  }
+
+  signal(SIGINT, ingest_on_signal);
+  signal(SIGTERM, ingest_on_signal);
+
+  if(streams.count){
+    printf("device_id,port,sub,seq,host_time_us,samples,values\n");
+    ingest_subscribe(streams, sessions, fds, count);
+  }
+  else {
+    printf(
+      "device_id,port,seq,host_time_us,uncertainty_us,synced,class,"
+      "raw_r,raw_g,raw_b,raw_c,r,g,b,c,illum_step\n"
+    );
+  }
+
+  int64_t last_report = host_time_us();
+  int64_t last_renew = last_report;
+  int open_ports = count;
+  while(!ingest_stop && open_ports > 0){
+    int ready = poll(fds, count, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+
+    for(int i=0; i<count; i++){
+      if(fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if(!device_session_poll(sessions[i], ingest_on_reading, &logs)){
+        fprintf(stderr, "%s: closed\n", sessions[i].name);
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open_ports--;
+      }
+    }
+    fflush(stdout);
+
+    if(host_time_us() - last_report >= INGEST_REPORT_INTERVAL_MS * 1000LL){
+      last_report = host_time_us();
+      ingest_report_clocks(sessions, count);
+      if(streams.count)
+        ingest_report_streams(streams, sessions, count);
+    }
+
+    if(
+      streams.count &&
+      host_time_us() - last_renew >= INGEST_RENEW_INTERVAL_MS * 1000LL
+    ){
+      last_renew = host_time_us();
+      ingest_subscribe(streams, sessions, fds, count);
+    }
+  }
+
+  ingest_report_clocks(sessions, count);
+  if(streams.count)
+    ingest_report_streams(streams, sessions, count);
+
+  for(int i=0; i<count; i++){
+    if(logs.open[i])
+      sensor_log_writer_close(logs.writers[i]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,415 @@
+// Fits per-channel piecewise linear linearisation tables from a grey step
+//  target and writes them as the firmware's linearize_tables.h.
+//  Capture each patch of the target with ingest (a few seconds of records with
+//    the patch under the head is plenty) and pass every capture with the value
+//    the patch should calibrate to. Illumination steps are fitted separately,
+//    from whichever steps the captures contain.
+//  Per step and channel the median raw pulse width of every patch becomes a
+//    data point. Knots are placed at evenly spaced patches (all of them when
+//    there are no more patches than knots) and the knot values are the least
+//    squares fit of the piecewise linear curve through all points.
+//  Reports the residual error against the target at every patch, evaluated
+//    with the firmware's own fixed point lin_eval(), next to that of a two knot
+//    (straight line) fit for comparison.
+//
+// Usage: linfit [-k knots] [-o linearize_tables.h] <value>=<capture.csv> ...
+//  e.g. a six patch grey scale:
+//    linfit -k 6 -o ../color_detector_esp32/include/linearize_tables.h
+//      255=white.csv 200=g1.csv 150=g2.csv 100=g3.csv 50=g4.csv 0=black.csv
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "illumination.h"
+#include "linearize.h"
+
+#define LINFIT_CHANNELS 4
+
+static const char *linfit_channel_names[LINFIT_CHANNELS] = {
+  "R", "G", "B", "C"
+};
+
+// One patch of the target and its raw readings per step and channel.
+struct linfit_patch {
+  double value;
+  const char *path;
+  std::vector<uint16_t> raw[ILLUM_STEPS][LINFIT_CHANNELS];
+};
+
+// Fit of one channel at one step.
+struct linfit_fit {
+  lin_table table;
+  std::vector<uint16_t> knot_raw;
+  std::vector<int16_t> knot_value;
+};
+
+// Splits a CSV line in place.
+static std::vector<char *> linfit_split(char *line){
+  std::vector<char *> fields;
+  char *save = NULL;
+  char *field = strtok_r(line, ",\r\n", &save);
+  while(field){
+    fields.push_back(field);
+    field = strtok_r(NULL, ",\r\n", &save);
+  }
+
+  return fields;
+}
+
+// Reads an ingest CSV capture into patch.
+//  Timed out (0) and saturated readings are left out.
+static bool linfit_read_capture(linfit_patch &patch){
+  FILE *file = fopen(patch.path, "r");
+  if(!file){
+    fprintf(stderr, "%s: %s\n", patch.path, strerror(errno));
+    return false;
+  }
+
+  static const char *raw_names[LINFIT_CHANNELS] = {
+    "raw_r", "raw_g", "raw_b", "raw_c"
+  };
+  int raw_col[LINFIT_CHANNELS] = {-1, -1, -1, -1};
+  int step_col = -1;
+  char line[1024];
+  bool header = true;
+  while(fgets(line, sizeof(line), file)){
+    std::vector<char *> fields = linfit_split(line);
+    if(header){
+      for(size_t i=0; i<fields.size(); i++){
+        for(uint8_t ch=0; ch<LINFIT_CHANNELS; ch++){
+          if(strcmp(fields[i], raw_names[ch]) == 0)
+            raw_col[ch] = i;
+        }
+        if(strcmp(fields[i], "illum_step") == 0)
+          step_col = i;
+      }
+      header = false;
+      continue;
+    }
+
+    // Captures from before illumination control are all full brightness.
+    unsigned step = step_col >= 0 && (size_t)step_col < fields.size() ?
+      strtoul(fields[step_col], NULL, 10) : 0;
+    if(step >= ILLUM_STEPS)
+      continue;
+    for(uint8_t ch=0; ch<LINFIT_CHANNELS; ch++){
+      if(raw_col[ch] < 0 || (size_t)raw_col[ch] >= fields.size())
+        continue;
+      unsigned long raw = strtoul(fields[raw_col[ch]], NULL, 10);
+      if(raw > 0 && raw < 0xFFFF)
+        patch.raw[step][ch].push_back(raw);
+    }
+  }
+  fclose(file);
+
+  if(raw_col[0] < 0){
+    fprintf(
+      stderr,
+      "%s: not an ingest capture (no raw_r column)\n",
+      patch.path
+    );
+    return false;
+  }
+
+  return true;
+}
+
+// Lower median, kept integral so knots land on whole pulse widths.
+static uint16_t linfit_median(std::vector<uint16_t> &vals){
+  size_t mid = (vals.size() - 1) / 2;
+  std::nth_element(vals.begin(), vals.begin() + mid, vals.end());
+
+  return vals[mid];
+}
+
+// Solves the n x n system a x = b in place, Gaussian elimination with partial
+//  pivoting. Returns false if it's singular.
+static bool linfit_solve(
+  std::vector<double> &a,
+  std::vector<double> &b,
+  size_t n
+){
+  for(size_t col=0; col<n; col++){
+    size_t pivot = col;
+    for(size_t row=col + 1; row<n; row++){
+      if(fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+        pivot = row;
+    }
+    if(fabs(a[pivot * n + col]) < 1e-12)
+      return false;
+    if(pivot != col){
+      for(size_t k=0; k<n; k++)
+        std::swap(a[col * n + k], a[pivot * n + k]);
+      std::swap(b[col], b[pivot]);
+    }
+
+    for(size_t row=col + 1; row<n; row++){
+      double f = a[row * n + col] / a[col * n + col];
+      for(size_t k=col; k<n; k++)
+        a[row * n + k] -= f * a[col * n + k];
+      b[row] -= f * b[col];
+    }
+  }
+
+  for(size_t col=n; col-->0;){
+    for(size_t k=col + 1; k<n; k++)
+      b[col] -= a[col * n + k] * b[k];
+    b[col] /= a[col * n + col];
+  }
+
+  return true;
+}
+
+// Least squares piecewise linear fit with up to knots knots through points
+//  sorted by raw with no duplicate raw values.
+static bool linfit_fit_points(
+  const std::vector<std::pair<uint16_t, double>> &points,
+  size_t knots,
+  linfit_fit &fit
+){
+  size_t n = points.size();
+  knots = std::min(knots, n);
+  if(knots < 2)
+    return false;
+
+  // Knots on evenly spaced points, so every segment has data at both ends.
+  std::vector<double> x(knots);
+  for(size_t j=0; j<knots; j++)
+    x[j] = points[(j * (n - 1) + (knots - 1) / 2) / (knots - 1)].first;
+
+  // Hat basis normal equations, tridiagonal but small enough to not care.
+  std::vector<double> ata(knots * knots, 0);
+  std::vector<double> aty(knots, 0);
+  for(const auto &p : points){
+    size_t j = 0;
+    while(j + 2 < knots && p.first >= x[j + 1])
+      j++;
+    double t = (p.first - x[j]) / (x[j + 1] - x[j]);
+    double w[2] = {1 - t, t};
+    for(size_t r=0; r<2; r++){
+      aty[j + r] += w[r] * p.second;
+      for(size_t c=0; c<2; c++)
+        ata[(j + r) * knots + j + c] += w[r] * w[c];
+    }
+  }
+  if(!linfit_solve(ata, aty, knots))
+    return false;
+
+  fit.knot_raw.resize(knots);
+  fit.knot_value.resize(knots);
+  for(size_t j=0; j<knots; j++){
+    fit.knot_raw[j] = (uint16_t)x[j];
+    double v = round(aty[j]);
+    fit.knot_value[j] = (int16_t)std::max(-32768.0, std::min(32767.0, v));
+  }
+
+  return lin_table_build(
+    fit.table, fit.knot_raw.data(), fit.knot_value.data(), knots
+  );
+}
+
+static void linfit_residuals(
+  const linfit_fit &fit,
+  const std::vector<std::pair<uint16_t, double>> &points,
+  double &rms,
+  double &worst
+){
+  double sum = 0;
+  worst = 0;
+  for(const auto &p : points){
+    double err = lin_eval(fit.table, p.first) - p.second;
+    sum += err * err;
+    worst = std::max(worst, fabs(err));
+  }
+  rms = sqrt(sum / points.size());
+
+  return;
+}
+
+static bool linfit_write_header(
+  const char *path,
+  const linfit_fit fits[ILLUM_STEPS][LINFIT_CHANNELS],
+  const bool fitted[ILLUM_STEPS][LINFIT_CHANNELS],
+  const std::vector<linfit_patch> &patches
+){
+  FILE *out = fopen(path, "w");
+  if(!out)
+    return false;
+
+  fprintf(
+    out,
+    "// Linearisation tables per illumination step and channel.\n"
+    "//  Generated by the host linfit tool from grey step target captures,"
+    " replace\n"
+    "//    this file with its output and rebuild. Channels without a table"
+    " (knots\n"
+    "//    0) fall back to the {min, max} calibration of their step.\n"
+    "//  Fitted from:\n"
+  );
+  for(const auto &patch : patches)
+    fprintf(out, "//    %g=%s\n", patch.value, patch.path);
+  fprintf(
+    out,
+    "#ifndef LINEARIZE_TABLES_H\n"
+    "#define LINEARIZE_TABLES_H\n"
+    "\n"
+    "#include \"illumination.h\"\n"
+    "#include \"linearize.h\"\n"
+    "\n"
+    "static const lin_table linearize_tables[ILLUM_STEPS][4] = {\n"
+  );
+  for(uint8_t step=0; step<ILLUM_STEPS; step++){
+    fprintf(out, "  {\n");
+    for(uint8_t ch=0; ch<LINFIT_CHANNELS; ch++){
+      if(!fitted[step][ch]){
+        fprintf(out, "    {},\n");
+        continue;
+      }
+      const lin_table &t = fits[step][ch].table;
+      fprintf(out, "    {\n      %u,\n      {", t.knots);
+      for(uint8_t i=0; i<LIN_MAX_KNOTS; i++)
+        fprintf(out, "%s%u", i ? ", " : "", t.raw[i]);
+      fprintf(out, "},\n      {");
+      for(uint8_t i=0; i<LIN_MAX_KNOTS; i++)
+        fprintf(out, "%s%d", i ? ", " : "", t.value[i]);
+      fprintf(out, "},\n      {");
+      for(uint8_t i=0; i<LIN_MAX_KNOTS; i++)
+        fprintf(out, "%s%d", i ? ", " : "", t.slope[i]);
+      fprintf(out, "}\n    },\n");
+    }
+    fprintf(out, "  },\n");
+  }
+  fprintf(out, "};\n\n#endif\n");
+
+  return fclose(out) == 0;
+}
+
+int main(int argc, char **argv){
+  size_t knots = 8;
+  const char *out_path = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "k:o:")) != -1){
+    if(opt == 'k'){
+      knots = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'o'){
+      out_path = optarg;
+    }
+    else {
+      optind = argc + 1;
+      break;
+    }
+  }
+  if(optind >= argc || knots < 2 || knots > LIN_MAX_KNOTS){
+    fprintf(
+      stderr,
+      "usage: %s [-k knots, 2-%d] [-o linearize_tables.h] "
+      "<value>=<capture.csv> ...\n",
+      argv[0], LIN_MAX_KNOTS
+    );
+    return 2;
+  }
+
+  std::vector<linfit_patch> patches(argc - optind);
+  for(int i=optind; i<argc; i++){
+    linfit_patch &patch = patches[i - optind];
+    char *eq = strchr(argv[i], '=');
+    char *end;
+    patch.value = strtod(argv[i], &end);
+    if(!eq || end != eq){
+      fprintf(stderr, "%s: expected <value>=<capture.csv>\n", argv[i]);
+      return 2;
+    }
+    patch.path = eq + 1;
+    if(!linfit_read_capture(patch))
+      return 1;
+  }
+
+  static linfit_fit fits[ILLUM_STEPS][LINFIT_CHANNELS];
+  bool fitted[ILLUM_STEPS][LINFIT_CHANNELS] = {};
+  int tables = 0;
+  for(uint8_t step=0; step<ILLUM_STEPS; step++){
+    bool header = false;
+    for(uint8_t ch=0; ch<LINFIT_CHANNELS; ch++){
+      // Median per patch, patches with the same median averaged.
+      std::vector<std::pair<uint16_t, double>> points;
+      for(auto &patch : patches){
+        if(patch.raw[step][ch].empty())
+          continue;
+        points.push_back(
+          std::make_pair(linfit_median(patch.raw[step][ch]), patch.value)
+        );
+      }
+      std::sort(points.begin(), points.end());
+      std::vector<std::pair<uint16_t, double>> unique;
+      for(size_t i=0; i<points.size();){
+        size_t j = i;
+        double sum = 0;
+        for(; j<points.size() && points[j].first == points[i].first; j++)
+          sum += points[j].second;
+        unique.push_back(std::make_pair(points[i].first, sum / (j - i)));
+        i = j;
+      }
+      if(unique.size() < 2)
+        continue;
+
+      linfit_fit line;
+      if(
+        !linfit_fit_points(unique, knots, fits[step][ch]) ||
+        !linfit_fit_points(unique, 2, line)
+      ){
+        fprintf(
+          stderr, "step %u %s: fit failed\n", step, linfit_channel_names[ch]
+        );
+        continue;
+      }
+      fitted[step][ch] = true;
+      tables++;
+
+      double rms, worst, line_rms, line_worst;
+      linfit_residuals(fits[step][ch], unique, rms, worst);
+      linfit_residuals(line, unique, line_rms, line_worst);
+
+      if(!header){
+        printf(
+          "step %u (LED duty %u/%u)\n"
+          "  %-3s %5s %6s %8s %8s %8s %8s\n",
+          step, illum_step_duty[step], ILLUM_DUTY_MAX,
+          "ch", "knots", "points", "rms", "max", "line rms", "line max"
+        );
+        header = true;
+      }
+      printf(
+        "  %-3s %5u %6zu %8.2f %8.2f %8.2f %8.2f\n",
+        linfit_channel_names[ch], fits[step][ch].table.knots, unique.size(),
+        rms, worst, line_rms, line_worst
+      );
+      printf("      knots:");
+      for(size_t j=0; j<fits[step][ch].knot_raw.size(); j++){
+        printf(
+          " %u->%d", fits[step][ch].knot_raw[j], fits[step][ch].knot_value[j]
+        );
+      }
+      printf("\n");
+    }
+  }
+
+  if(tables == 0){
+    fprintf(stderr, "no channel had two or more distinct patches to fit\n");
+    return 1;
+  }
+
+  if(out_path && !linfit_write_header(out_path, fits, fitted, patches)){
+    fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
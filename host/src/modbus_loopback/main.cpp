@@ -0,0 +1,782 @@
+// Exercises the firmware's Modbus slave against a master stand-in, entirely
+//  on this host.
+//  A simulated head publishes snapshots as fast as it can through the same
+//    seqlock channel the firmware uses and serves them with the same slave code
+//    over Modbus TCP on loopback and Modbus RTU over a pty. The master polls
+//    both and checks:
+//    - every snapshot read is internally consistent (nothing torn),
+//    - publishing keeps going at full rate while the master polls,
+//    - configuration writes are validated and reach the head,
+//    - bad requests get the right exceptions and bad CRCs get no answer.
+//  Prints poll latencies and exits non-zero on any failed check.
+//  The head publishes at -r frames/s, far beyond the real 10 or so, but short
+//    of flat out, which would have every read racing a publish.
+//
+// Usage: modbus_loopback [-n polls] [-p tcp port] [-r frames/s]
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "modbus_slave.h"
+#include "sensor_registers.h"
+#include "sensor_snapshot.h"
+#include "serial_port.h"
+
+#define LOOPBACK_UNIT_ID 7
+#define LOOPBACK_RTU_BAUD 19200
+
+// How long the master waits for any response, in ms.
+#define LOOPBACK_TIMEOUT_MS 500
+
+// Attempts at a consistent snapshot, as on the firmware.
+#define LOOPBACK_SNAPSHOT_TRIES 4
+
+//------------------------------------------------------------------------------
+// Simulated head
+//------------------------------------------------------------------------------
+struct loopback_head {
+  sensor_snapshot_channel snapshots;
+  sensor_config_channel config_chan;
+
+  // Slave side working copy of the configuration. Only the server threads
+  //  touch it, one at a time through config_owner.
+  sensor_config config;
+  std::atomic<bool> config_owner;
+
+  uint32_t frame_interval_ns;
+  std::atomic<bool> stop;
+  std::atomic<uint64_t> published;
+};
+
+// Every snapshot field is a function of the frame number (and, for the
+//  calibrated values, the configuration), so a copy mixing two publishes is
+//  caught by recomputing it.
+static void loopback_fill_snapshot(
+  sensor_snapshot &snap,
+  uint32_t frame,
+  const sensor_config &config
+){
+  snap.frame = frame;
+  snap.illum_step = frame % ILLUM_STEPS;
+  snap.illum_duty = illum_step_duty[snap.illum_step];
+  snap.illum_settled_frames = frame & 0xFFFF;
+  snap.palette_index = frame % 13;
+  snap.class_cache_hits = frame * 3;
+  snap.class_cache_misses = frame / 11;
+  for(uint8_t i=0; i<4; i++){
+    snap.raw[i] = (frame * 13 + i * 1000) & 0x7FFF;
+    snap.mapped[i] =
+      (int16_t)(snap.raw[i] - config.calib[snap.illum_step][i][0]);
+  }
+  snap.class_index = frame % 6;
+  snap.confidence = frame % 101;
+  snap.faults = frame & 0x0F;
+  snap.sensor_timeouts = frame / 3;
+  snap.map_errors = frame / 5;
+  snap.warm_restarts = 2;
+  snap.uptime_s = frame / 1000;
+  for(uint8_t i=0; i<4; i++)
+    snap.spc_alarms[i] = (frame >> i) & 0x3F;
+  snap.spc_armed = frame & 1;
+  snap.spc_alarm_events = frame / 7;
+
+  return;
+}
+
+// The acquisition loop stand-in: applies configuration between frames and
+//  publishes every frame, never waiting on the bus.
+static void loopback_head_run(loopback_head &head){
+  sensor_config config;
+  uint32_t config_seq = 0;
+  sensor_config_read(head.config_chan, config, &config_seq, 1);
+
+  uint32_t frame = 0;
+  auto next_frame = std::chrono::steady_clock::now();
+  while(!head.stop.load(std::memory_order_relaxed)){
+    // Spin rather than sleep, sleeps are far coarser than the frame interval.
+    next_frame += std::chrono::nanoseconds(head.frame_interval_ns);
+    while(std::chrono::steady_clock::now() < next_frame)
+      ;
+
+    sensor_config next;
+    uint32_t seq;
+    if(sensor_config_read(head.config_chan, next, &seq, 1) &&
+       seq != config_seq){
+      config = next;
+      config_seq = seq;
+    }
+
+    sensor_snapshot snap;
+    loopback_fill_snapshot(snap, frame++, config);
+    sensor_snapshot_publish(head.snapshots, snap);
+    head.published.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  return;
+}
+
+static uint8_t loopback_error(uint8_t result){
+  if(result == SENSOR_REG_BAD_ADDRESS)
+    return MODBUS_EX_ILLEGAL_ADDRESS;
+  if(result == SENSOR_REG_BAD_VALUE)
+    return MODBUS_EX_ILLEGAL_VALUE;
+
+  return MODBUS_EX_NONE;
+}
+
+// Same callbacks as the firmware's modbus_server.cpp.
+static uint8_t loopback_read_input(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  loopback_head &head = *(loopback_head *)ctx;
+
+  sensor_snapshot snap;
+  if(!sensor_snapshot_read(head.snapshots, snap, LOOPBACK_SNAPSHOT_TRIES))
+    return MODBUS_EX_DEVICE_BUSY;
+
+  return loopback_error(sensor_registers_read_input(snap, start, count, out));
+}
+
+static uint8_t loopback_read_holding(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  loopback_head &head = *(loopback_head *)ctx;
+
+  return loopback_error(
+    sensor_registers_read_holding(head.config, start, count, out)
+  );
+}
+
+static uint8_t loopback_write_holding(
+  void *ctx,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+){
+  loopback_head &head = *(loopback_head *)ctx;
+
+  // The firmware serves both transports from one task, here they're two
+  //  threads, so take turns on the working copy.
+  while(head.config_owner.exchange(true, std::memory_order_acquire))
+    std::this_thread::yield();
+  uint8_t result =
+    sensor_registers_write_holding(head.config, start, count, values);
+  if(result == SENSOR_REG_OK)
+    sensor_config_publish(head.config_chan, head.config);
+  head.config_owner.store(false, std::memory_order_release);
+
+  return loopback_error(result);
+}
+
+static void loopback_slave_init(modbus_slave &slave, loopback_head &head){
+  modbus_slave_init(slave, LOOPBACK_UNIT_ID);
+  slave.read_input = loopback_read_input;
+  slave.read_holding = loopback_read_holding;
+  slave.write_holding = loopback_write_holding;
+  slave.ctx = &head;
+
+  return;
+}
+
+// Modbus TCP server, one connection at a time.
+static void loopback_tcp_serve(loopback_head &head, int listen_fd){
+  modbus_slave slave;
+  loopback_slave_init(slave, head);
+
+  while(!head.stop.load()){
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    if(poll(&pfd, 1, 50) <= 0)
+      continue;
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0)
+      continue;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t buf[MODBUS_TCP_MAX_ADU];
+    uint16_t len = 0;
+    while(!head.stop.load()){
+      struct pollfd cfd = {fd, POLLIN, 0};
+      if(poll(&cfd, 1, 50) <= 0)
+        continue;
+      ssize_t got = read(fd, buf + len, sizeof(buf) - len);
+      if(got <= 0)
+        break;
+      len += got;
+
+      int32_t adu_len;
+      while((adu_len = modbus_tcp_frame_length(buf, len)) > 0 &&
+            len >= adu_len){
+        uint8_t resp[MODBUS_TCP_MAX_ADU];
+        uint16_t resp_len = modbus_tcp_process(slave, buf, adu_len, resp);
+        if(write(fd, resp, resp_len) != resp_len)
+          break;
+        len -= adu_len;
+        memmove(buf, buf + adu_len, len);
+      }
+      if(adu_len < 0)
+        break;
+    }
+    close(fd);
+  }
+
+  return;
+}
+
+// Modbus RTU server on the pty's device end, frames split on line silence
+//  exactly as on the firmware.
+static void loopback_rtu_serve(loopback_head &head, int fd){
+  modbus_slave slave;
+  loopback_slave_init(slave, head);
+
+  int gap_ms = (modbus_rtu_frame_gap_us(LOOPBACK_RTU_BAUD) + 999) / 1000;
+  uint8_t buf[MODBUS_RTU_MAX_ADU];
+  uint16_t len = 0;
+  bool overflow = false;
+  while(!head.stop.load()){
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, len ? gap_ms : 50);
+    if(ready > 0){
+      uint8_t chunk[64];
+      ssize_t got = read(fd, chunk, sizeof(chunk));
+      for(ssize_t i=0; i<got; i++){
+        if(len < MODBUS_RTU_MAX_ADU)
+          buf[len++] = chunk[i];
+        else
+          overflow = true;
+      }
+      continue;
+    }
+    if(len == 0)
+      continue;
+
+    if(!overflow){
+      uint8_t resp[MODBUS_RTU_MAX_ADU];
+      uint16_t resp_len = modbus_rtu_process(slave, buf, len, resp);
+      if(resp_len && write(fd, resp, resp_len) != resp_len)
+        break;
+    }
+    len = 0;
+    overflow = false;
+  }
+
+  return;
+}
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Master stand-in
+//------------------------------------------------------------------------------
+struct loopback_master {
+  bool rtu;
+  int fd;
+  uint16_t transaction;
+  std::vector<double> latencies_us;
+};
+
+static void loopback_put_u16(uint8_t *buf, uint16_t val){
+  buf[0] = val >> 8;
+  buf[1] = val & 0xFF;
+
+  return;
+}
+
+static uint16_t loopback_get_u16(const uint8_t *buf){
+  return (uint16_t)((buf[0] << 8) | buf[1]);
+}
+
+// Reads until len bytes arrived or the timeout passed.
+static bool loopback_read_exact(int fd, uint8_t *buf, size_t len){
+  int64_t deadline = host_time_us() + LOOPBACK_TIMEOUT_MS * 1000LL;
+  size_t have = 0;
+  while(have < len){
+    int left_ms = (int)((deadline - host_time_us()) / 1000);
+    if(left_ms <= 0)
+      return false;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if(poll(&pfd, 1, left_ms) <= 0)
+      continue;
+    ssize_t got = read(fd, buf + have, len - have);
+    if(got <= 0 && errno != EAGAIN)
+      return false;
+    if(got > 0)
+      have += got;
+  }
+
+  return true;
+}
+
+// Sends a request PDU and receives the response PDU.
+//  corrupt flips a CRC bit on RTU to check the slave stays quiet.
+//  Returns the response PDU length, 0 on timeout or a malformed response.
+static uint16_t loopback_transact(
+  loopback_master &master,
+  const uint8_t *pdu,
+  uint16_t len,
+  uint8_t *resp,
+  bool corrupt = false
+){
+  uint8_t adu[MODBUS_TCP_MAX_ADU];
+  uint8_t in[MODBUS_TCP_MAX_ADU];
+  int64_t start = host_time_us();
+
+  if(master.rtu){
+    adu[0] = LOOPBACK_UNIT_ID;
+    memcpy(adu + 1, pdu, len);
+    uint16_t crc = modbus_crc16(adu, len + 1);
+    if(corrupt)
+      crc ^= 1;
+    adu[len + 1] = crc & 0xFF;
+    adu[len + 2] = crc >> 8;
+    if(write(master.fd, adu, len + 3) != len + 3)
+      return 0;
+
+    // Unit, function code and the next byte tell how much more to expect,
+    //  every response is at least 5 bytes.
+    if(!loopback_read_exact(master.fd, in, 3))
+      return 0;
+    uint16_t frame_len;
+    if(in[1] & 0x80)
+      frame_len = 5;
+    else if(in[1] == MODBUS_FC_READ_HOLDING || in[1] == MODBUS_FC_READ_INPUT)
+      frame_len = 3 + in[2] + 2;
+    else
+      frame_len = 8;
+    if(!loopback_read_exact(master.fd, in + 3, frame_len - 3))
+      return 0;
+
+    crc = in[frame_len - 2] | (in[frame_len - 1] << 8);
+    if(in[0] != LOOPBACK_UNIT_ID || crc != modbus_crc16(in, frame_len - 2))
+      return 0;
+
+    memcpy(resp, in + 1, frame_len - 3);
+    master.latencies_us.push_back(host_time_us() - start);
+    return frame_len - 3;
+  }
+
+  uint16_t tid = ++master.transaction;
+  loopback_put_u16(adu, tid);
+  loopback_put_u16(adu + 2, 0);
+  loopback_put_u16(adu + 4, len + 1);
+  adu[6] = LOOPBACK_UNIT_ID;
+  memcpy(adu + MODBUS_TCP_HEADER, pdu, len);
+  if(write(master.fd, adu, MODBUS_TCP_HEADER + len) != MODBUS_TCP_HEADER + len)
+    return 0;
+
+  if(!loopback_read_exact(master.fd, in, MODBUS_TCP_HEADER))
+    return 0;
+  int32_t adu_len = modbus_tcp_frame_length(in, MODBUS_TCP_HEADER);
+  if(adu_len <= 0 || loopback_get_u16(in) != tid ||
+     !loopback_read_exact(
+       master.fd, in + MODBUS_TCP_HEADER, adu_len - MODBUS_TCP_HEADER
+     )){
+    return 0;
+  }
+
+  memcpy(resp, in + MODBUS_TCP_HEADER, adu_len - MODBUS_TCP_HEADER);
+  master.latencies_us.push_back(host_time_us() - start);
+  return adu_len - MODBUS_TCP_HEADER;
+}
+
+// Reads count registers with FC 03 or 04.
+//  Returns the exception code, or MODBUS_EX_NONE with out filled. Timeouts
+//    come back as 0xFF.
+static uint8_t loopback_read(
+  loopback_master &master,
+  uint8_t fc,
+  uint16_t start,
+  uint16_t count,
+  uint16_t *out
+){
+  uint8_t req[5];
+  uint8_t resp[MODBUS_MAX_PDU];
+  req[0] = fc;
+  loopback_put_u16(req + 1, start);
+  loopback_put_u16(req + 3, count);
+
+  uint16_t len = loopback_transact(master, req, sizeof(req), resp);
+  if(len == 2 && resp[0] == (fc | 0x80))
+    return resp[1];
+  if(len != 2 + count * 2 || resp[0] != fc || resp[1] != count * 2)
+    return 0xFF;
+
+  for(uint16_t i=0; i<count; i++)
+    out[i] = loopback_get_u16(resp + 2 + i * 2);
+
+  return MODBUS_EX_NONE;
+}
+
+// Writes count holding registers with FC 16.
+static uint8_t loopback_write(
+  loopback_master &master,
+  uint16_t start,
+  uint16_t count,
+  const uint16_t *values
+){
+  uint8_t req[MODBUS_MAX_PDU];
+  uint8_t resp[MODBUS_MAX_PDU];
+  req[0] = MODBUS_FC_WRITE_MULTIPLE;
+  loopback_put_u16(req + 1, start);
+  loopback_put_u16(req + 3, count);
+  req[5] = count * 2;
+  for(uint16_t i=0; i<count; i++)
+    loopback_put_u16(req + 6 + i * 2, values[i]);
+
+  uint16_t len = loopback_transact(master, req, 6 + count * 2, resp);
+  if(len == 2 && resp[0] == (MODBUS_FC_WRITE_MULTIPLE | 0x80))
+    return resp[1];
+  if(len != 5 || resp[0] != MODBUS_FC_WRITE_MULTIPLE)
+    return 0xFF;
+
+  return MODBUS_EX_NONE;
+}
+
+static uint32_t loopback_u32(const uint16_t *regs){
+  return ((uint32_t)regs[0] << 16) | regs[1];
+}
+
+// Checks a full input register read against the snapshot it claims to be.
+static bool loopback_consistent(
+  const uint16_t *regs,
+  const sensor_config &config
+){
+  sensor_snapshot expect;
+  loopback_fill_snapshot(
+    expect, loopback_u32(regs + SENSOR_IREG_FRAME), config
+  );
+  uint16_t want[SENSOR_IREG_COUNT];
+  sensor_registers_read_input(expect, 0, SENSOR_IREG_COUNT, want);
+
+  return memcmp(regs, want, sizeof(want)) == 0;
+}
+
+static int loopback_failures = 0;
+
+static void loopback_check(const char *name, bool ok){
+  printf("  %-52s %s\n", name, ok ? "ok" : "FAILED");
+  if(!ok)
+    loopback_failures++;
+
+  return;
+}
+
+static double loopback_percentile(std::vector<double> &vals, double p){
+  if(vals.empty())
+    return 0;
+  std::sort(vals.begin(), vals.end());
+  size_t i = (size_t)(p / 100 * (vals.size() - 1) + 0.5);
+
+  return vals[i];
+}
+
+// Runs the whole check sequence over one transport.
+static void loopback_run_master(
+  loopback_master &master,
+  loopback_head &head,
+  const char *name,
+  uint32_t polls
+){
+  printf("%s\n", name);
+
+  uint16_t regs[SENSOR_IREG_COUNT];
+  sensor_config config;
+  sensor_config_read(head.config_chan, config, NULL, LOOPBACK_SNAPSHOT_TRIES);
+
+  uint8_t ex = loopback_read(
+    master, MODBUS_FC_READ_INPUT, 0, SENSOR_IREG_COUNT, regs
+  );
+  loopback_check(
+    "map version",
+    ex == MODBUS_EX_NONE && regs[SENSOR_IREG_VERSION] == SENSOR_REGISTERS_VERSION
+  );
+
+  // Full map polls while the head publishes flat out.
+  master.latencies_us.clear();
+  uint32_t torn = 0, failed = 0, busy = 0;
+  uint64_t published_before = head.published.load();
+  int64_t start = host_time_us();
+  for(uint32_t i=0; i<polls; i++){
+    ex = loopback_read(
+      master, MODBUS_FC_READ_INPUT, 0, SENSOR_IREG_COUNT, regs
+    );
+    if(ex == MODBUS_EX_DEVICE_BUSY)
+      busy++;
+    else if(ex != MODBUS_EX_NONE)
+      failed++;
+    else if(!loopback_consistent(regs, config))
+      torn++;
+  }
+  double secs = (host_time_us() - start) / 1e6;
+  double publish_rate = (head.published.load() - published_before) / secs;
+  std::vector<double> lat = master.latencies_us;
+  printf(
+    "  %u polls in %.2f s, latency p50 %.0f us p99 %.0f us max %.0f us\n",
+    polls, secs,
+    loopback_percentile(lat, 50), loopback_percentile(lat, 99),
+    loopback_percentile(lat, 100)
+  );
+  printf(
+    "  head published %.0f snapshots/s meanwhile, %u busy answers\n",
+    publish_rate, busy
+  );
+  loopback_check(
+    "head kept its frame rate",
+    publish_rate >= 0.9e9 / head.frame_interval_ns
+  );
+  loopback_check("no failed polls", failed == 0);
+  loopback_check("busy answers under 0.1%", busy * 1000 < polls);
+  loopback_check("no torn snapshots", torn == 0);
+
+  // Valid configuration: new calibration minimums and frame delay.
+  uint16_t holding[SENSOR_HREG_COUNT];
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, holding
+  );
+  loopback_check("read configuration", ex == MODBUS_EX_NONE);
+  for(uint8_t i=0; i<4; i++)
+    holding[SENSOR_HREG_CALIB + i * 2] += 1;
+  holding[SENSOR_HREG_LOOP_DELAY_MS] = 250;
+  ex = loopback_write(master, 0, SENSOR_HREG_COUNT, holding);
+  loopback_check("write configuration", ex == MODBUS_EX_NONE);
+
+  uint16_t readback[SENSOR_HREG_COUNT];
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, readback
+  );
+  loopback_check(
+    "configuration reads back",
+    ex == MODBUS_EX_NONE && memcmp(holding, readback, sizeof(holding)) == 0
+  );
+
+  // The head applies it between frames, after which every snapshot is
+  //  calibrated with it.
+  sensor_config next;
+  sensor_registers_write_holding(config, 0, SENSOR_HREG_COUNT, holding);
+  next = config;
+  bool applied = false;
+  start = host_time_us();
+  while(!applied && host_time_us() - start < LOOPBACK_TIMEOUT_MS * 1000LL){
+    ex = loopback_read(
+      master, MODBUS_FC_READ_INPUT, 0, SENSOR_IREG_COUNT, regs
+    );
+    applied = ex == MODBUS_EX_NONE && loopback_consistent(regs, next);
+  }
+  loopback_check("head applies configuration", applied);
+
+  // Invalid configuration: min above max is refused and changes nothing.
+  uint16_t bad[2] = {200, 100};
+  ex = loopback_write(master, SENSOR_HREG_CALIB, 2, bad);
+  loopback_check("min >= max refused", ex == MODBUS_EX_ILLEGAL_VALUE);
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, readback
+  );
+  loopback_check(
+    "refused write changes nothing",
+    ex == MODBUS_EX_NONE && memcmp(holding, readback, sizeof(holding)) == 0
+  );
+  uint16_t mode = ILLUM_STEPS + 1;
+  ex = loopback_write(master, SENSOR_HREG_ILLUM_MODE, 1, &mode);
+  loopback_check(
+    "unknown illumination mode refused", ex == MODBUS_EX_ILLEGAL_VALUE
+  );
+
+  // Calibration banks: registers 0-7 address the selected bank, the other
+  //  banks keep theirs.
+  uint16_t bank = 3;
+  loopback_write(master, SENSOR_HREG_CALIB_BANK, 1, &bank);
+  uint16_t banked[SENSOR_HREG_COUNT];
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, banked
+  );
+  loopback_check(
+    "select calibration bank",
+    ex == MODBUS_EX_NONE && banked[SENSOR_HREG_CALIB_BANK] == 3
+  );
+  uint16_t bank_three[8];
+  memcpy(bank_three, banked, sizeof(bank_three));
+  for(uint8_t i=0; i<4; i++)
+    banked[SENSOR_HREG_CALIB + i * 2] += 7;
+  ex = loopback_write(master, 0, SENSOR_HREG_COUNT, banked);
+  loopback_check("write calibration bank", ex == MODBUS_EX_NONE);
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, readback
+  );
+  loopback_check(
+    "calibration bank reads back",
+    ex == MODBUS_EX_NONE && memcmp(banked, readback, sizeof(banked)) == 0
+  );
+  bank = 0;
+  loopback_write(master, SENSOR_HREG_CALIB_BANK, 1, &bank);
+  ex = loopback_read(
+    master, MODBUS_FC_READ_HOLDING, 0, SENSOR_HREG_COUNT, readback
+  );
+  loopback_check(
+    "other banks untouched",
+    ex == MODBUS_EX_NONE && memcmp(holding, readback, sizeof(holding)) == 0
+  );
+  bank = 3;
+  loopback_write(master, SENSOR_HREG_CALIB_BANK, 1, &bank);
+  loopback_write(master, SENSOR_HREG_CALIB, 8, bank_three);
+  bank = 0;
+  loopback_write(master, SENSOR_HREG_CALIB_BANK, 1, &bank);
+
+  // Protocol errors.
+  ex = loopback_read(
+    master, MODBUS_FC_READ_INPUT, SENSOR_IREG_COUNT - 1, 2, regs
+  );
+  loopback_check("read past map", ex == MODBUS_EX_ILLEGAL_ADDRESS);
+  ex = loopback_read(master, MODBUS_FC_READ_INPUT, 0, 126, regs);
+  loopback_check("read over 125 registers", ex == MODBUS_EX_ILLEGAL_VALUE);
+  ex = loopback_read(master, 0x01, 0, 1, regs);
+  loopback_check("unsupported function", ex == MODBUS_EX_ILLEGAL_FUNCTION);
+
+  if(master.rtu){
+    uint8_t req[5] = {MODBUS_FC_READ_INPUT, 0, 0, 0, 1};
+    uint8_t resp[MODBUS_MAX_PDU];
+    loopback_check(
+      "bad CRC gets no answer",
+      loopback_transact(master, req, sizeof(req), resp, true) == 0
+    );
+  }
+
+  // Leave the head as it was for the next transport.
+  sensor_registers_read_holding(config, 0, SENSOR_HREG_COUNT, holding);
+  for(uint8_t i=0; i<4; i++)
+    holding[SENSOR_HREG_CALIB + i * 2] -= 1;
+  holding[SENSOR_HREG_LOOP_DELAY_MS] = 100;
+  loopback_write(master, 0, SENSOR_HREG_COUNT, holding);
+
+  return;
+}
+//------------------------------------------------------------------------------
+
+
+int main(int argc, char **argv){
+  uint32_t polls = 20000;
+  uint16_t port = 15020;
+  uint32_t rate = 100000;
+  int opt;
+  while((opt = getopt(argc, argv, "n:p:r:")) != -1){
+    if(opt == 'n'){
+      polls = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'p'){
+      port = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'r' && strtoul(optarg, NULL, 10) > 0){
+      rate = strtoul(optarg, NULL, 10);
+    }
+    else {
+      fprintf(
+        stderr, "usage: %s [-n polls] [-p tcp port] [-r frames/s]\n", argv[0]
+      );
+      return 2;
+    }
+  }
+
+  static loopback_head head;
+  // Configuration as the firmware starts out, the full brightness
+  //  calibration and the other illumination steps derived from it.
+  static const int full_calib[4][2] = {{1, 111}, {2, 125}, {1, 101}, {0, 255}};
+  sensor_config initial;
+  memset(&initial, 0, sizeof(initial));
+  for(uint8_t step=0; step<ILLUM_STEPS; step++){
+    int derived[4][2];
+    illum_derive_calib(full_calib, step, derived);
+    for(uint8_t i=0; i<4; i++){
+      initial.calib[step][i][0] = derived[i][0];
+      initial.calib[step][i][1] = derived[i][1];
+    }
+  }
+  initial.loop_delay_ms = 100;
+  sensor_snapshot_channel_init(head.snapshots);
+  sensor_config_channel_init(head.config_chan, initial);
+  head.config = initial;
+  head.config_owner = false;
+  head.frame_interval_ns = 1000000000 / rate;
+  head.stop = false;
+  head.published = 0;
+
+  // Modbus TCP on loopback.
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(listen_fd, 1) < 0){
+    fprintf(stderr, "127.0.0.1:%u: %s\n", port, strerror(errno));
+    return 1;
+  }
+
+  // Modbus RTU over a pty, the head gets the device end like a real port.
+  int pty = posix_openpt(O_RDWR | O_NOCTTY);
+  if(pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0){
+    perror("pty");
+    return 1;
+  }
+  int dev = serial_port_open(ptsname(pty), LOOPBACK_RTU_BAUD);
+  if(dev < 0){
+    perror(ptsname(pty));
+    return 1;
+  }
+
+  std::thread head_thread(loopback_head_run, std::ref(head));
+  std::thread tcp_thread(loopback_tcp_serve, std::ref(head), listen_fd);
+  std::thread rtu_thread(loopback_rtu_serve, std::ref(head), dev);
+
+  loopback_master tcp_master = {false, -1, 0, {}};
+  tcp_master.fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(tcp_master.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(connect(tcp_master.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    perror("connect");
+    return 1;
+  }
+  loopback_run_master(tcp_master, head, "Modbus TCP, loopback", polls);
+
+  // The pty has no baud rate, RTU polls are paced by the frame gap instead.
+  loopback_master rtu_master = {true, pty, 0, {}};
+  loopback_run_master(
+    rtu_master, head, "Modbus RTU, pty", polls / 20 ? polls / 20 : 1
+  );
+
+  head.stop = true;
+  head_thread.join();
+  tcp_thread.join();
+  rtu_thread.join();
+  close(tcp_master.fd);
+  close(listen_fd);
+  close(dev);
+  close(pty);
+
+  printf(
+    loopback_failures ? "%d checks FAILED\n" : "all checks passed\n",
+    loopback_failures
+  );
+
+  return loopback_failures ? 1 : 0;
+}
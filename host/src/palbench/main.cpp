@@ -0,0 +1,238 @@
+// Compares matching a reading against several palettes one by one with the
+//  fused palette_set pass, on random readings across the default calibration.
+//  Separate matching is timed both ways the firmware can do it: calibrating
+//    the reading and then palette_match() per palette, and palette_raw_match()
+//    per palette on a raw space copy of each. Reports ns per reading, the
+//    fused pass' speedup, and how often each agrees with an exact (double
+//    precision) calibrated space match.
+//  A palette may be given an acceptance radius, e.g. a product palette for a
+//    QC pass/fail, and the pass rate is reported too.
+//
+// Usage: palbench [-n readings] <palette.csv>[:tolerance] ...
+//  e.g. fine names, families and a QC check against the product colors:
+//    palbench ../colors.csv ../colors_short.csv product.csv:20
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "color_core.h"
+#include "palette.h"
+#include "palette_csv.h"
+
+#define PALBENCH_DEFAULT_READINGS 100000
+
+// Raw readings are drawn from the calibration range widened by this fraction
+//  of its span either side, so some fall out of calibration as real ones do.
+#define PALBENCH_MARGIN 0.1
+
+static void palbench_usage(){
+  fprintf(
+    stderr,
+    "usage: palbench [-n readings] <palette.csv>[:tolerance] ...\n"
+  );
+
+  return;
+}
+
+static double palbench_now_ns(){
+  return std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+// Nearest color by exact calibrated coordinates, lowest index on ties.
+static uint16_t palbench_exact(const palette &pal, const int raw[3]){
+  double coord[3];
+  for(uint8_t c=0; c<3; c++){
+    double span = color_read_calib_vals[c][1] - color_read_calib_vals[c][0];
+    coord[c] = 255 - (raw[c] - color_read_calib_vals[c][0]) * 255 / span;
+  }
+
+  uint16_t best = PALETTE_NO_MATCH;
+  double best_dist = INFINITY;
+  for(uint16_t i=0; i<pal.count; i++){
+    double dist = 0;
+    for(uint8_t c=0; c<3; c++){
+      double diff = coord[c] - pal.colors[i].rgb[c];
+      dist += diff * diff;
+    }
+    if(dist < best_dist){
+      best = i;
+      best_dist = dist;
+    }
+  }
+
+  return best;
+}
+
+int main(int argc, char **argv){
+  long readings = PALBENCH_DEFAULT_READINGS;
+  int opt;
+  while((opt = getopt(argc, argv, "n:")) != -1){
+    if(opt == 'n' && (readings = strtol(optarg, NULL, 10)) > 0)
+      continue;
+    palbench_usage();
+    return 2;
+  }
+  int npals = argc - optind;
+  if(npals < 1 || npals > PALETTE_SET_MAX){
+    palbench_usage();
+    return 2;
+  }
+
+  // Palettes, each with its optional tolerance.
+  std::vector<palette_csv> csvs(npals);
+  std::vector<uint16_t> tolerances(npals, 0);
+  for(int p=0; p<npals; p++){
+    std::string arg = argv[optind + p];
+    size_t colon = arg.rfind(':');
+    if(colon != std::string::npos){
+      tolerances[p] = strtol(arg.c_str() + colon + 1, NULL, 10);
+      arg.resize(colon);
+    }
+
+    int line = 0;
+    if(!palette_csv_load(csvs[p], arg.c_str(), &line)){
+      if(errno == EINVAL)
+        fprintf(stderr, "%s:%d: not a palette line\n", arg.c_str(), line);
+      else
+        fprintf(stderr, "%s: %s\n", arg.c_str(), strerror(errno));
+      return 1;
+    }
+  }
+
+  // Raw space copies for the separate raw path, and the fused set.
+  uint32_t total = 0;
+  for(int p=0; p<npals; p++)
+    total += csvs[p].pal.count;
+
+  std::vector<std::vector<palette_raw_color>> raw_colors(npals);
+  std::vector<palette_raw> raws(npals);
+  for(int p=0; p<npals; p++){
+    raw_colors[p].resize(csvs[p].pal.count);
+    palette_raw_begin(
+      raws[p],
+      csvs[p].pal,
+      raw_colors[p].data(),
+      color_read_calib_vals,
+      NULL
+    );
+    palette_raw_build(raws[p], csvs[p].pal.count);
+  }
+
+  std::vector<palette_set_color> set_colors(total);
+  palette_set set;
+  palette_set_init(set, set_colors.data(), total);
+  for(int p=0; p<npals; p++)
+    palette_set_add(set, csvs[p].pal, tolerances[p]);
+  palette_set_calibrate(set, color_read_calib_vals, NULL);
+
+  for(int p=0; p<npals; p++){
+    printf("palette %d: %s, %u colors", p, csvs[p].name.c_str(),
+      csvs[p].pal.count);
+    if(tolerances[p])
+      printf(", tolerance %u", tolerances[p]);
+    printf("\n");
+  }
+  printf("distinct colors: %u of %u\n\n", set.count, total);
+
+  // Readings.
+  std::mt19937 rng(1);
+  std::vector<int> raw(readings * 3);
+  for(uint8_t c=0; c<3; c++){
+    double lo = color_read_calib_vals[c][0];
+    double hi = color_read_calib_vals[c][1];
+    double margin = (hi - lo) * PALBENCH_MARGIN;
+    std::uniform_int_distribution<int> dist(
+      lo - margin < 1 ? 1 : (int)(lo - margin),
+      (int)(hi + margin)
+    );
+    for(long i=0; i<readings; i++)
+      raw[i * 3 + c] = dist(rng);
+  }
+
+  std::vector<uint16_t> sep_index(readings * npals);
+  std::vector<uint16_t> raw_index(readings * npals);
+  std::vector<palette_set_result> fused(readings);
+
+  // Calibrate, then match each palette.
+  double start = palbench_now_ns();
+  for(long i=0; i<readings; i++){
+    for(int p=0; p<npals; p++){
+      int cal[3];
+      for(uint8_t c=0; c<3; c++)
+        cal[c] = color_calibrate_channel(raw[i * 3 + c], c);
+      sep_index[i * npals + p] = palette_match(csvs[p].pal, cal, NULL);
+    }
+  }
+  double sep_ns = (palbench_now_ns() - start) / readings;
+
+  // Raw space match against each palette.
+  start = palbench_now_ns();
+  for(long i=0; i<readings; i++){
+    for(int p=0; p<npals; p++){
+      raw_index[i * npals + p] =
+        palette_raw_match(raws[p], &raw[i * 3], NULL);
+    }
+  }
+  double raw_ns = (palbench_now_ns() - start) / readings;
+
+  // Fused.
+  start = palbench_now_ns();
+  for(long i=0; i<readings; i++)
+    palette_set_match(set, &raw[i * 3], fused[i]);
+  double fused_ns = (palbench_now_ns() - start) / readings;
+
+  // Agreement with the exact match, and QC pass rates.
+  long sep_agree = 0;
+  long raw_agree = 0;
+  long fused_agree = 0;
+  std::vector<long> within(npals, 0);
+  for(long i=0; i<readings; i++){
+    for(int p=0; p<npals; p++){
+      uint16_t exact = palbench_exact(csvs[p].pal, &raw[i * 3]);
+      sep_agree += sep_index[i * npals + p] == exact;
+      raw_agree += raw_index[i * npals + p] == exact;
+      fused_agree += fused[i].index[p] == exact;
+      within[p] += (fused[i].within >> p) & 1;
+    }
+  }
+  double matches = (double)readings * npals;
+
+  printf("%-28s %10s %8s %10s\n", "", "ns/reading", "speedup", "exact");
+  printf(
+    "%-28s %10.1f %8.2f %9.3f%%\n",
+    "calibrate + match each", sep_ns, 1.0, 100 * sep_agree / matches
+  );
+  printf(
+    "%-28s %10.1f %8.2f %9.3f%%\n",
+    "raw space match each", raw_ns, sep_ns / raw_ns,
+    100 * raw_agree / matches
+  );
+  printf(
+    "%-28s %10.1f %8.2f %9.3f%%\n",
+    "fused set", fused_ns, sep_ns / fused_ns, 100 * fused_agree / matches
+  );
+  printf("\nfused over raw space match each: %.2fx\n", raw_ns / fused_ns);
+
+  for(int p=0; p<npals; p++){
+    if(tolerances[p]){
+      printf(
+        "%s: %.1f%% of readings within %u\n",
+        csvs[p].name.c_str(),
+        100.0 * within[p] / readings,
+        tolerances[p]
+      );
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,537 @@
+// Collects sampling profiler dumps from a head built with -DPROFILER and
+//  symbolises them against its firmware ELF.
+//  Keeps the head's clock sync answered while it waits, so the head runs
+//    exactly as it would under ingest. After the requested number of windows
+//    prints a flat profile on stdout:
+//      self  share of all samples whose PC fell in the function, from the PC
+//            histogram. Histogram buckets wider than a function are split
+//            between the functions they overlap by byte count.
+//      total share of sampled call stacks the function appears anywhere in.
+//    and writes <prefix>.folded (one "outer;...;leaf count" line per stack,
+//    the input format of flamegraph.pl and speedscope) and <prefix>.svg, a
+//    flame graph of the same stacks.
+//
+// Usage: profile [-b baud] [-n windows] [-o prefix] <firmware.elf> <port>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "device_session.h"
+#include "elf_symbols.h"
+#include "serial_port.h"
+
+// Flame graph layout, in SVG pixels.
+#define PROFILE_SVG_WIDTH 1200
+#define PROFILE_SVG_ROW 16
+#define PROFILE_SVG_CHAR 7
+
+// Functions listed in the flat profile.
+#define PROFILE_FLAT_ROWS 40
+
+static volatile sig_atomic_t profile_stop = 0;
+
+// Windows merged so far, plus the one being received.
+struct profile_state {
+  // Current window.
+  bool receiving;
+  link_profile_header header;
+  uint16_t bucket_frames;
+  uint16_t stack_frames;
+  std::map<uint16_t, uint32_t> window_buckets;
+  std::map<std::vector<uint32_t>, uint32_t> window_stacks;
+
+  // Completed windows.
+  uint32_t windows;
+  uint32_t incomplete;
+  link_profile_region regions[LINK_PROFILE_REGIONS];
+  uint64_t samples;
+  uint64_t isr_samples;
+  uint64_t other_samples;
+  uint64_t dropped_stacks;
+  std::map<uint16_t, uint64_t> buckets;
+  std::map<std::vector<uint32_t>, uint64_t> stacks;  // Outermost first.
+};
+
+static void profile_on_signal(int){
+  profile_stop = 1;
+}
+
+// Folds the current window into the totals once all its frames are in.
+static void profile_finish_window(profile_state &state){
+  if(
+    state.bucket_frames != state.header.bucket_frames ||
+    state.stack_frames != state.header.stack_frames
+  ){
+    return;
+  }
+
+  memcpy(state.regions, state.header.regions, sizeof(state.regions));
+  state.samples += state.header.samples;
+  state.isr_samples += state.header.isr_samples;
+  state.other_samples += state.header.other_samples;
+  state.dropped_stacks += state.header.dropped_stacks;
+  for(const auto &bucket : state.window_buckets)
+    state.buckets[bucket.first] += bucket.second;
+  for(const auto &stack : state.window_stacks)
+    state.stacks[stack.first] += stack.second;
+
+  state.receiving = false;
+  state.windows++;
+  fprintf(
+    stderr,
+    "window %u: %u samples, %u in interrupts, %zu stacks, %u dropped\n",
+    state.header.window,
+    state.header.samples,
+    state.header.isr_samples,
+    state.window_stacks.size(),
+    state.header.dropped_stacks
+  );
+
+  return;
+}
+
+static void profile_on_frame(
+  device_session &session,
+  const link_decoder &frame,
+  void *ctx
+){
+  profile_state &state = *(profile_state *)ctx;
+
+  if(frame.type == LINK_PROFILE_HEADER){
+    link_profile_header header;
+    if(!link_unpack_profile_header(frame.payload, frame.len, header))
+      return;
+    if(state.receiving)
+      state.incomplete++;
+
+    state.receiving = true;
+    state.header = header;
+    state.bucket_frames = 0;
+    state.stack_frames = 0;
+    state.window_buckets.clear();
+    state.window_stacks.clear();
+    profile_finish_window(state);
+  }
+  else if(frame.type == LINK_PROFILE_BUCKETS){
+    link_profile_buckets msg;
+    if(
+      !state.receiving ||
+      !link_unpack_profile_buckets(frame.payload, frame.len, msg) ||
+      msg.window != state.header.window
+    ){
+      return;
+    }
+
+    for(uint8_t i=0; i<msg.count; i++)
+      state.window_buckets[msg.entries[i].bucket] += msg.entries[i].count;
+    state.bucket_frames++;
+    profile_finish_window(state);
+  }
+  else if(frame.type == LINK_PROFILE_STACK){
+    link_profile_stack msg;
+    if(
+      !state.receiving ||
+      !link_unpack_profile_stack(frame.payload, frame.len, msg) ||
+      msg.window != state.header.window
+    ){
+      return;
+    }
+
+    std::vector<uint32_t> stack(msg.pcs, msg.pcs + msg.depth);
+    std::reverse(stack.begin(), stack.end());
+    state.window_stacks[stack] += msg.count;
+    state.stack_frames++;
+    profile_finish_window(state);
+  }
+
+  return;
+}
+
+// Function name for a code address, or the address itself.
+static std::string profile_name(const elf_symbols &syms, uint32_t pc){
+  const elf_symbol *sym = elf_symbols_find(syms, pc);
+  if(sym)
+    return sym->name;
+
+  char buf[16];
+  snprintf(buf, sizeof(buf), "0x%08" PRIx32, pc);
+
+  return buf;
+}
+
+// Adds a bucket's count to the functions it overlaps, by byte share.
+static void profile_attribute_bucket(
+  const elf_symbols &syms,
+  uint32_t start,
+  uint32_t width,
+  uint64_t count,
+  std::map<std::string, double> &self
+){
+  uint32_t end = start + width;
+  uint32_t addr = start;
+  while(addr < end){
+    const elf_symbol *sym = elf_symbols_find(syms, addr);
+    uint32_t stop = end;
+    if(sym && sym->size && sym->addr + sym->size < stop)
+      stop = sym->addr + sym->size;
+
+    // Stop at the next symbol too, for unsized ones and gaps.
+    auto next = std::upper_bound(
+      syms.symbols.begin(),
+      syms.symbols.end(),
+      addr,
+      [](uint32_t value, const elf_symbol &s){
+        return value < s.addr;
+      }
+    );
+    if(next != syms.symbols.end() && next->addr < stop)
+      stop = next->addr;
+
+    self[profile_name(syms, addr)] += (double)count * (stop - addr) / width;
+    addr = stop;
+  }
+
+  return;
+}
+
+static void profile_print_flat(
+  const profile_state &state,
+  const elf_symbols &syms
+){
+  std::map<std::string, double> self;
+  for(const auto &bucket : state.buckets){
+    // Regions are laid out in order, a bucket belongs to the last one
+    //  starting at or before it.
+    uint8_t r = 0;
+    while(
+      r + 1 < LINK_PROFILE_REGIONS &&
+      state.regions[r + 1].first_bucket <= bucket.first
+    ){
+      r++;
+    }
+
+    const link_profile_region &region = state.regions[r];
+    uint32_t start =
+      region.start +
+      ((uint32_t)(bucket.first - region.first_bucket) << region.shift);
+    profile_attribute_bucket(
+      syms, start, 1u << region.shift, bucket.second, self
+    );
+  }
+  if(state.isr_samples)
+    self["(other interrupts)"] += state.isr_samples;
+  if(state.other_samples)
+    self["(outside code)"] += state.other_samples;
+
+  // Inclusive counts, each function once per stack.
+  std::map<std::string, uint64_t> total;
+  uint64_t stack_samples = 0;
+  for(const auto &stack : state.stacks){
+    std::vector<std::string> seen;
+    for(uint32_t pc : stack.first){
+      std::string name = profile_name(syms, pc);
+      if(std::find(seen.begin(), seen.end(), name) != seen.end())
+        continue;
+      seen.push_back(name);
+      total[name] += stack.second;
+    }
+    stack_samples += stack.second;
+  }
+
+  std::vector<std::pair<double, std::string>> rows;
+  for(const auto &entry : self)
+    rows.push_back(std::make_pair(entry.second, entry.first));
+  std::sort(rows.rbegin(), rows.rend());
+
+  printf(
+    "%" PRIu64 " samples over %u windows, %" PRIu64 " with call stacks, "
+    "%" PRIu64 " stacks dropped. Bucket widths:",
+    state.samples, state.windows, stack_samples, state.dropped_stacks
+  );
+  for(uint8_t r=0; r<LINK_PROFILE_REGIONS; r++)
+    printf(" %u", 1u << state.regions[r].shift);
+  printf(" bytes\n\n%7s %9s %7s  %s\n", "self%", "self", "total%", "function");
+
+  for(size_t i=0; i<rows.size() && i<PROFILE_FLAT_ROWS; i++){
+    auto found = total.find(rows[i].second);
+    double total_share =
+      found != total.end() && stack_samples ?
+        100.0 * found->second / stack_samples : 0;
+    printf(
+      "%6.2f%% %9.0f %6.2f%%  %s\n",
+      state.samples ? 100.0 * rows[i].first / state.samples : 0,
+      rows[i].first,
+      total_share,
+      rows[i].second.c_str()
+    );
+  }
+
+  return;
+}
+
+//------------------------------------------------------------------------------
+// Flame graph
+//------------------------------------------------------------------------------
+struct profile_node {
+  std::string name;
+  uint64_t count;
+  std::map<std::string, size_t> children;   // Name -> node index.
+};
+
+static void profile_svg_escape(FILE *out, const std::string &text){
+  for(char c : text){
+    if(c == '<')
+      fputs("&lt;", out);
+    else if(c == '>')
+      fputs("&gt;", out);
+    else if(c == '&')
+      fputs("&amp;", out);
+    else if(c == '"')
+      fputs("&quot;", out);
+    else
+      fputc(c, out);
+  }
+
+  return;
+}
+
+static void profile_svg_node(
+  FILE *out,
+  const std::vector<profile_node> &nodes,
+  size_t index,
+  uint64_t root_count,
+  double x,
+  uint32_t depth,
+  uint32_t height
+){
+  const profile_node &node = nodes[index];
+  double width = (double)PROFILE_SVG_WIDTH * node.count / root_count;
+  if(width < 0.5)
+    return;
+
+  double y = height - (depth + 1) * PROFILE_SVG_ROW;
+  uint32_t hash = 2166136261u;
+  for(char c : node.name)
+    hash = (hash ^ (uint8_t)c) * 16777619u;
+
+  fprintf(out, "<g><title>");
+  profile_svg_escape(out, node.name);
+  fprintf(
+    out,
+    " (%" PRIu64 " samples, %.2f%%)</title>"
+    "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d\" "
+    "fill=\"rgb(%u,%u,%u)\"/>",
+    node.count, 100.0 * node.count / root_count,
+    x, y, width, PROFILE_SVG_ROW - 1,
+    205 + hash % 50, 80 + (hash >> 8) % 130, 50 + (hash >> 16) % 50
+  );
+
+  size_t chars = (size_t)(width / PROFILE_SVG_CHAR);
+  if(chars >= 3){
+    std::string label = node.name;
+    if(label.size() > chars)
+      label = label.substr(0, chars - 2) + "..";
+    fprintf(
+      out,
+      "<text x=\"%.1f\" y=\"%.1f\">",
+      x + 3, y + PROFILE_SVG_ROW - 4
+    );
+    profile_svg_escape(out, label);
+    fprintf(out, "</text>");
+  }
+  fprintf(out, "</g>\n");
+
+  for(const auto &child : node.children){
+    profile_svg_node(
+      out, nodes, child.second, root_count, x, depth + 1, height
+    );
+    x += (double)PROFILE_SVG_WIDTH * nodes[child.second].count / root_count;
+  }
+
+  return;
+}
+
+static bool profile_write_svg(
+  const char *path,
+  const std::vector<std::pair<std::vector<std::string>, uint64_t>> &folded
+){
+  std::vector<profile_node> nodes(1);
+  nodes[0].name = "all";
+  nodes[0].count = 0;
+  uint32_t max_depth = 0;
+  for(const auto &stack : folded){
+    size_t node = 0;
+    nodes[0].count += stack.second;
+    for(const std::string &name : stack.first){
+      auto found = nodes[node].children.find(name);
+      size_t child;
+      if(found == nodes[node].children.end()){
+        child = nodes.size();
+        nodes[node].children[name] = child;
+        profile_node fresh;
+        fresh.name = name;
+        fresh.count = 0;
+        nodes.push_back(fresh);
+      }
+      else {
+        child = found->second;
+      }
+      nodes[child].count += stack.second;
+      node = child;
+    }
+    max_depth = std::max(max_depth, (uint32_t)stack.first.size());
+  }
+
+  FILE *out = fopen(path, "w");
+  if(!out)
+    return false;
+
+  uint32_t height = (max_depth + 1) * PROFILE_SVG_ROW + 8;
+  fprintf(
+    out,
+    "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+    "<svg version=\"1.1\" width=\"%d\" height=\"%u\" "
+    "xmlns=\"http://www.w3.org/2000/svg\" "
+    "font-family=\"monospace\" font-size=\"11\">\n",
+    PROFILE_SVG_WIDTH, height
+  );
+  if(nodes[0].count)
+    profile_svg_node(out, nodes, 0, nodes[0].count, 0, 0, height);
+  fprintf(out, "</svg>\n");
+
+  return fclose(out) == 0;
+}
+
+static bool profile_write_stacks(
+  const profile_state &state,
+  const elf_symbols &syms,
+  const char *prefix
+){
+  // Adjacent frames in the same function (recursion, or a return address
+  //  and the PC landing in one function) are merged.
+  std::map<std::vector<std::string>, uint64_t> merged;
+  for(const auto &stack : state.stacks){
+    std::vector<std::string> names;
+    for(uint32_t pc : stack.first){
+      std::string name = profile_name(syms, pc);
+      if(names.empty() || names.back() != name)
+        names.push_back(name);
+    }
+    merged[names] += stack.second;
+  }
+  std::vector<std::pair<std::vector<std::string>, uint64_t>> folded(
+    merged.begin(), merged.end()
+  );
+
+  std::string path = std::string(prefix) + ".folded";
+  FILE *out = fopen(path.c_str(), "w");
+  if(!out){
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  for(const auto &stack : folded){
+    for(size_t i=0; i<stack.first.size(); i++)
+      fprintf(out, "%s%s", i ? ";" : "", stack.first[i].c_str());
+    fprintf(out, " %" PRIu64 "\n", stack.second);
+  }
+  if(fclose(out) != 0){
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  path = std::string(prefix) + ".svg";
+  if(!profile_write_svg(path.c_str(), folded)){
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv){
+  uint32_t baud = 115200;
+  uint32_t windows = 1;
+  const char *prefix = "profile";
+  int opt;
+  while((opt = getopt(argc, argv, "b:n:o:")) != -1){
+    if(opt == 'b'){
+      baud = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'n'){
+      windows = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'o'){
+      prefix = optarg;
+    }
+    else {
+      optind = argc;
+      break;
+    }
+  }
+  if(argc - optind != 2){
+    fprintf(
+      stderr,
+      "usage: %s [-b baud] [-n windows] [-o prefix] <firmware.elf> <port>\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  elf_symbols syms;
+  if(!elf_symbols_load(syms, argv[optind])){
+    fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  int fd = serial_port_open(argv[optind + 1], baud);
+  if(fd < 0){
+    fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+    return 1;
+  }
+
+  static profile_state state;
+  device_session session;
+  device_session_init(session, fd, argv[optind + 1]);
+  session.on_frame = profile_on_frame;
+  session.frame_ctx = &state;
+
+  signal(SIGINT, profile_on_signal);
+  signal(SIGTERM, profile_on_signal);
+
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while(!profile_stop && state.windows < windows){
+    int ready = poll(&pfd, 1, 100);
+    if(ready < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+    if(ready > 0 && !device_session_poll(session, NULL, NULL)){
+      fprintf(stderr, "%s: closed\n", session.name);
+      break;
+    }
+  }
+  close(fd);
+
+  if(state.incomplete)
+    fprintf(stderr, "%u windows arrived incomplete\n", state.incomplete);
+  if(!state.windows){
+    fprintf(stderr, "no complete profile windows received\n");
+    return 1;
+  }
+
+  profile_print_flat(state, syms);
+
+  return profile_write_stacks(state, syms, prefix) ? 0 : 1;
+}
@@ -0,0 +1,520 @@
+// Time range queries over columnar sensor logs written by ingest -o.
+//
+// Usage: query <command> [options] <log> [log ...]
+//  Commands:
+//    info          Devices, time span and record counts of each log.
+//    counts        Per-class record counts per interval.
+//    percentiles   Raw channel percentiles, min, max and mean.
+//    drift         Per-interval raw channel means and the trend across them.
+//  Options:
+//    -f <time>     Start of the range (inclusive), default: start of the logs.
+//    -t <time>     End of the range (exclusive), default: now.
+//    -i <span>     Bucket width for counts/drift, default: 1h (counts: 1d).
+//    -c <class>    counts: only count this class index.
+//    -p <list>     percentiles: comma separated percentiles, default 1,5,50,95,99.
+//  Times are "now", relative ("-7d", "-8h", "-30m", "-90s"), Unix seconds, or
+//    local "YYYY-MM-DD[THH:MM[:SS]]". Spans are seconds or N[smhd].
+//
+//  e.g. off-colour (Undef, class 5) parts per day over the last week:
+//    query counts -f -7d -c 5 logs/*.cslog
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "log_kernels.h"
+#include "sensor_log.h"
+
+#define QUERY_US_PER_S 1000000LL
+
+// Upper limit on buckets per query, keeps a typo'd -i from eating all memory.
+#define QUERY_MAX_BUCKETS 100000
+
+static const char *query_channel_names[SENSOR_LOG_CHANNELS] = {
+  "R", "G", "B", "C"
+};
+
+static int64_t query_now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (int64_t)ts.tv_sec * QUERY_US_PER_S + ts.tv_nsec / 1000;
+}
+
+// Parses "N", "Ns", "Nm", "Nh" or "Nd" into microseconds.
+//  Returns false on malformed input.
+static bool query_parse_span(const char *text, int64_t &span_us){
+  char *end;
+  double val = strtod(text, &end);
+  if(end == text || val < 0)
+    return false;
+
+  double scale = 1;
+  if(*end == 's' || *end == '\0')
+    scale = 1;
+  else if(*end == 'm')
+    scale = 60;
+  else if(*end == 'h')
+    scale = 3600;
+  else if(*end == 'd')
+    scale = 86400;
+  else
+    return false;
+  if(*end != '\0' && end[1] != '\0')
+    return false;
+
+  span_us = (int64_t)(val * scale * QUERY_US_PER_S);
+
+  return true;
+}
+
+static bool query_parse_time(const char *text, int64_t &time_us){
+  if(strcmp(text, "now") == 0){
+    time_us = query_now_us();
+    return true;
+  }
+
+  if(text[0] == '-'){
+    int64_t span;
+    if(!query_parse_span(text + 1, span))
+      return false;
+    time_us = query_now_us() - span;
+    return true;
+  }
+
+  if(strchr(text, '-') == NULL){
+    char *end;
+    long long secs = strtoll(text, &end, 10);
+    if(*end != '\0')
+      return false;
+    time_us = secs * QUERY_US_PER_S;
+    return true;
+  }
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *rest = strptime(text, "%Y-%m-%d", &tm);
+  if(!rest)
+    return false;
+  if(*rest == 'T' || *rest == ' '){
+    const char *tail = strptime(rest + 1, "%H:%M:%S", &tm);
+    if(!tail)
+      tail = strptime(rest + 1, "%H:%M", &tm);
+    rest = tail;
+  }
+  if(!rest || *rest != '\0')
+    return false;
+  tm.tm_isdst = -1;
+  time_us = (int64_t)mktime(&tm) * QUERY_US_PER_S;
+
+  return true;
+}
+
+static const char *query_format_time(int64_t time_us, char *buf, size_t len){
+  time_t secs = time_us / QUERY_US_PER_S;
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+
+  return buf;
+}
+
+// Calls fn(bucket, span, first, last) for each run of records in spans that
+//  falls in a single bucket of width interval starting at from.
+//  Records are sorted, so a run ends at a binary searched bucket boundary and
+//    whole runs go to the kernels.
+template <typename FN>
+static void query_for_each_bucket(
+  const std::vector<sensor_log_span> &spans,
+  int64_t from,
+  int64_t interval,
+  FN fn
+){
+  for(const sensor_log_span &span : spans){
+    size_t i = 0;
+    while(i < span.count){
+      size_t bucket = (span.time[i] - from) / interval;
+      int64_t bucket_end = from + (int64_t)(bucket + 1) * interval;
+      size_t last = span.time[span.count - 1] < bucket_end ?
+        span.count :
+        i + sensor_log_lower_bound(span.time + i, span.count - i, bucket_end);
+      fn(bucket, span, i, last);
+      i = last;
+    }
+  }
+
+  return;
+}
+
+static void query_usage(const char *prog){
+  fprintf(
+    stderr,
+    "usage: %s info|counts|percentiles|drift [-f from] [-t to] [-i span]\n"
+    "       [-c class] [-p p1,p2,...] <log> [log ...]\n",
+    prog
+  );
+
+  return;
+}
+
+static void query_info(std::vector<sensor_log_reader> &logs, char **paths){
+  char from_buf[32], to_buf[32];
+  printf("%-16s %10s %8s %-19s  %-19s  %s\n",
+    "device", "records", "chunks", "first", "last", "file");
+  for(size_t l=0; l<logs.size(); l++){
+    uint64_t records = 0;
+    int64_t first = 0, last = 0;
+    bool any = false;
+    for(const sensor_log_index_entry &entry : logs[l].index){
+      if(entry.count == 0)
+        continue;
+      if(!any)
+        first = entry.t_min;
+      last = entry.t_max;
+      any = true;
+      records += entry.count;
+    }
+    printf(
+      "%016" PRIx64 " %10" PRIu64 " %8zu %-19s  %-19s  %s\n",
+      logs[l].device_id,
+      records,
+      logs[l].index.size(),
+      any ? query_format_time(first, from_buf, sizeof(from_buf)) : "-",
+      any ? query_format_time(last, to_buf, sizeof(to_buf)) : "-",
+      paths[l]
+    );
+  }
+
+  return;
+}
+
+static uint64_t query_counts(
+  const std::vector<sensor_log_span> &spans,
+  int64_t from,
+  int64_t to,
+  int64_t interval,
+  int class_filter
+){
+  size_t buckets = (to - from + interval - 1) / interval;
+  std::vector<uint32_t> counts(buckets * 256, 0);
+  uint64_t total = 0;
+
+  query_for_each_bucket(spans, from, interval,
+    [&](size_t bucket, const sensor_log_span &span, size_t a, size_t b){
+      if(class_filter >= 0){
+        counts[bucket * 256 + class_filter] +=
+          kernel_count_eq_u8(span.class_index + a, b - a, class_filter);
+      }
+      else {
+        kernel_histogram_u8(span.class_index + a, b - a, &counts[bucket * 256]);
+      }
+      total += b - a;
+    }
+  );
+
+  // Only print columns for classes that showed up at all.
+  bool seen[256] = {false};
+  for(size_t k=0; k<buckets; k++){
+    for(uint16_t c=0; c<256; c++){
+      if(counts[k * 256 + c])
+        seen[c] = true;
+    }
+  }
+  if(class_filter >= 0)
+    seen[class_filter] = true;
+
+  char time_buf[32];
+  printf("%-19s %10s", "bucket", "total");
+  for(uint16_t c=0; c<256; c++){
+    if(seen[c])
+      printf(" %9s%-3u", "class_", c);
+  }
+  printf("\n");
+
+  for(size_t k=0; k<buckets; k++){
+    uint64_t bucket_total = 0;
+    for(uint16_t c=0; c<256; c++)
+      bucket_total += counts[k * 256 + c];
+    printf(
+      "%-19s %10" PRIu64,
+      query_format_time(from + (int64_t)k * interval, time_buf, sizeof(time_buf)),
+      bucket_total
+    );
+    for(uint16_t c=0; c<256; c++){
+      if(seen[c])
+        printf(" %12u", counts[k * 256 + c]);
+    }
+    printf("\n");
+  }
+
+  return total;
+}
+
+static uint64_t query_percentiles(
+  const std::vector<sensor_log_span> &spans,
+  const std::vector<double> &pcts
+){
+  uint64_t total = 0;
+  for(const sensor_log_span &span : spans)
+    total += span.count;
+  if(total == 0){
+    printf("no records in range\n");
+    return 0;
+  }
+
+  std::vector<uint32_t> hist(65536);
+  printf("%-2s %8s %8s %10s", "ch", "min", "max", "mean");
+  for(double p : pcts)
+    printf(" %7s%-4g", "p", p);
+  printf("\n");
+
+  for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+    std::fill(hist.begin(), hist.end(), 0);
+    uint64_t sum = 0;
+    uint16_t lo = 0xFFFF, hi = 0;
+    for(const sensor_log_span &span : spans){
+      uint16_t span_lo, span_hi;
+      kernel_min_max_u16(span.raw[ch], span.count, span_lo, span_hi);
+      if(span_lo < lo)
+        lo = span_lo;
+      if(span_hi > hi)
+        hi = span_hi;
+      sum += kernel_sum_u16(span.raw[ch], span.count);
+      kernel_histogram_u16(span.raw[ch], span.count, hist.data());
+    }
+
+    printf(
+      "%-2s %8u %8u %10.2f",
+      query_channel_names[ch], lo, hi, (double)sum / total
+    );
+
+    // Nearest rank percentiles off the cumulative histogram, only the
+    //  [lo, hi] bins can be populated.
+    for(double p : pcts){
+      uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+      if(rank < 1)
+        rank = 1;
+      if(rank > total)
+        rank = total;
+      uint64_t cumulative = 0;
+      uint32_t v = lo;
+      for(; v<hi; v++){
+        cumulative += hist[v];
+        if(cumulative >= rank)
+          break;
+      }
+      printf(" %11u", v);
+    }
+    printf("\n");
+  }
+
+  return total;
+}
+
+static uint64_t query_drift(
+  const std::vector<sensor_log_span> &spans,
+  int64_t from,
+  int64_t to,
+  int64_t interval
+){
+  size_t buckets = (to - from + interval - 1) / interval;
+  std::vector<uint64_t> sums(buckets * SENSOR_LOG_CHANNELS, 0);
+  std::vector<uint64_t> counts(buckets, 0);
+  uint64_t total = 0;
+
+  query_for_each_bucket(spans, from, interval,
+    [&](size_t bucket, const sensor_log_span &span, size_t a, size_t b){
+      for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+        sums[bucket * SENSOR_LOG_CHANNELS + ch] +=
+          kernel_sum_u16(span.raw[ch] + a, b - a);
+      }
+      counts[bucket] += b - a;
+      total += b - a;
+    }
+  );
+
+  char time_buf[32];
+  printf("%-19s %10s", "bucket", "records");
+  for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++)
+    printf(" %9s", query_channel_names[ch]);
+  printf("\n");
+
+  // Count weighted least squares of bucket mean against bucket centre, per
+  //  channel, plus the first/last populated bucket for a plain delta.
+  double sw = 0, sx = 0, sxx = 0;
+  double sy[SENSOR_LOG_CHANNELS] = {0}, sxy[SENSOR_LOG_CHANNELS] = {0};
+  double first_mean[SENSOR_LOG_CHANNELS] = {0};
+  double last_mean[SENSOR_LOG_CHANNELS] = {0};
+  bool any = false;
+  for(size_t k=0; k<buckets; k++){
+    if(counts[k] == 0)
+      continue;
+    printf(
+      "%-19s %10" PRIu64,
+      query_format_time(from + (int64_t)k * interval, time_buf, sizeof(time_buf)),
+      counts[k]
+    );
+    double w = (double)counts[k];
+    double x = (k + 0.5) * interval / (3600.0 * QUERY_US_PER_S);
+    sw += w;
+    sx += w * x;
+    sxx += w * x * x;
+    for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+      double mean = (double)sums[k * SENSOR_LOG_CHANNELS + ch] / counts[k];
+      printf(" %9.2f", mean);
+      sy[ch] += w * mean;
+      sxy[ch] += w * x * mean;
+      if(!any)
+        first_mean[ch] = mean;
+      last_mean[ch] = mean;
+    }
+    printf("\n");
+    any = true;
+  }
+  if(!any){
+    printf("no records in range\n");
+    return 0;
+  }
+
+  double denom = sw * sxx - sx * sx;
+  printf("%-30s", "delta (last - first bucket)");
+  for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++)
+    printf(" %9.2f", last_mean[ch] - first_mean[ch]);
+  printf("\n%-30s", "trend (per hour)");
+  for(uint8_t ch=0; ch<SENSOR_LOG_CHANNELS; ch++){
+    if(denom > 0)
+      printf(" %9.3f", (sw * sxy[ch] - sx * sy[ch]) / denom);
+    else
+      printf(" %9s", "-");
+  }
+  printf("\n");
+
+  return total;
+}
+
+int main(int argc, char **argv){
+  if(argc < 2){
+    query_usage(argv[0]);
+    return 2;
+  }
+  const char *command = argv[1];
+
+  int64_t from = INT64_MIN, to = query_now_us(), interval = 0;
+  int class_filter = -1;
+  std::vector<double> pcts = {1, 5, 50, 95, 99};
+
+  optind = 2;
+  int opt;
+  while((opt = getopt(argc, argv, "f:t:i:c:p:")) != -1){
+    bool ok = true;
+    switch(opt){
+      case 'f': ok = query_parse_time(optarg, from); break;
+      case 't': ok = query_parse_time(optarg, to); break;
+      case 'i': ok = query_parse_span(optarg, interval) && interval > 0; break;
+      case 'c':
+        class_filter = atoi(optarg);
+        ok = class_filter >= 0 && class_filter < 256;
+        break;
+      case 'p': {
+        pcts.clear();
+        char *save;
+        for(char *tok = strtok_r(optarg, ",", &save); tok;
+            tok = strtok_r(NULL, ",", &save)){
+          pcts.push_back(atof(tok));
+        }
+        ok = !pcts.empty();
+        break;
+      }
+      default:
+        ok = false;
+    }
+    if(!ok){
+      fprintf(stderr, "bad option -%c\n", opt);
+      query_usage(argv[0]);
+      return 2;
+    }
+  }
+  if(optind >= argc){
+    query_usage(argv[0]);
+    return 2;
+  }
+
+  int64_t start = query_now_us();
+
+  std::vector<sensor_log_reader> logs(argc - optind);
+  for(int i=optind; i<argc; i++){
+    if(!sensor_log_reader_open(logs[i - optind], argv[i])){
+      fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+  }
+
+  if(strcmp(command, "info") == 0){
+    query_info(logs, argv + optind);
+    return 0;
+  }
+
+  // Open ended ranges start at the earliest record across the logs.
+  if(from == INT64_MIN){
+    from = to;
+    for(const sensor_log_reader &log : logs){
+      for(const sensor_log_index_entry &entry : log.index){
+        if(entry.count > 0){
+          if(entry.t_min < from)
+            from = entry.t_min;
+          break;
+        }
+      }
+    }
+  }
+  if(to <= from){
+    fprintf(stderr, "empty time range\n");
+    return 1;
+  }
+
+  if(interval == 0){
+    interval = strcmp(command, "counts") == 0 ?
+      86400 * QUERY_US_PER_S : 3600 * QUERY_US_PER_S;
+  }
+  if((to - from) / interval >= QUERY_MAX_BUCKETS){
+    fprintf(stderr, "too many buckets, use a wider -i\n");
+    return 1;
+  }
+
+  std::vector<sensor_log_span> spans;
+  for(const sensor_log_reader &log : logs)
+    sensor_log_select(log, from, to, spans);
+
+  uint64_t records;
+  if(strcmp(command, "counts") == 0){
+    records = query_counts(spans, from, to, interval, class_filter);
+  }
+  else if(strcmp(command, "percentiles") == 0){
+    records = query_percentiles(spans, pcts);
+  }
+  else if(strcmp(command, "drift") == 0){
+    records = query_drift(spans, from, to, interval);
+  }
+  else {
+    query_usage(argv[0]);
+    return 2;
+  }
+
+  fprintf(
+    stderr,
+    "%" PRIu64 " records from %zu logs in %.2f ms\n",
+    records,
+    logs.size(),
+    (query_now_us() - start) / 1000.0
+  );
+
+  for(sensor_log_reader &log : logs)
+    sensor_log_reader_close(log);
+
+  return 0;
+}
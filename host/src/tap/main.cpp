@@ -0,0 +1,245 @@
+// Reads a broker's shared memory ring and writes the heads' reading records
+//  to stdout as CSV, the columns ingest writes with the head's index on the
+//  broker in place of the port. Any number can run against one broker.
+//  Records are unpacked straight out of the ring and only printed once the
+//    ring confirms they weren't overwritten meanwhile. Records the broker
+//    lapped tap on are counted and reported on stderr.
+//  -o starts at the oldest record the ring still holds instead of the next
+//    one published. Exits when the broker has been silent for 3s.
+//  Each -p palette.csv[:tolerance], up to PALETTE_SET_MAX of them, adds the
+//    nearest color of that palette to every row, all from one fused
+//    palette_set pass over the record's calibrated r, g, b. A palette with a
+//    tolerance also gets a _pass column, 1 if the color is within that many
+//    calibrated units: e.g. fine names, families and a QC check against the
+//    product colors. Left empty for frames with a timed out channel.
+//
+// Usage: tap [-r ring] [-o] [-p palette.csv[:tolerance] ...]
+//  e.g. tap -p ../colors.csv -p ../colors_short.csv -p product.csv:20
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "frame_ring.h"
+#include "palette.h"
+#include "palette_csv.h"
+#include "serial_port.h"
+
+// A broker this long without a heartbeat is taken as gone, in us.
+#define TAP_BROKER_TIMEOUT_US 3000000
+
+// Sleep while the ring is empty, in us. The ring has no wakeup, readers poll.
+#define TAP_IDLE_US 1000
+
+static volatile sig_atomic_t tap_stop = 0;
+
+static void tap_on_signal(int){
+  tap_stop = 1;
+}
+
+// Loads a -p palette.csv[:tolerance]. Returns false, having reported why, if
+//  it can't be.
+static bool tap_load_palette(
+  palette_csv &csv,
+  uint16_t &tolerance,
+  const char *spec
+){
+  std::string path = spec;
+  size_t colon = path.rfind(':');
+  if(colon != std::string::npos){
+    tolerance = strtol(path.c_str() + colon + 1, NULL, 10);
+    path.resize(colon);
+  }
+
+  int line = 0;
+  if(!palette_csv_load(csv, path.c_str(), &line)){
+    if(errno == EINVAL)
+      fprintf(stderr, "%s:%d: not a palette line\n", path.c_str(), line);
+    else
+      fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+// The set's palettes' columns, named after their files less the extension.
+static void tap_print_palette_header(const palette_set &set){
+  for(uint8_t p=0; p<set.palettes; p++){
+    std::string column = set.pals[p]->name;
+    size_t dot = column.rfind('.');
+    if(dot != std::string::npos && dot > 0)
+      column.resize(dot);
+    printf(",%s", column.c_str());
+    if(set.tolerance[p])
+      printf(",%s_pass", column.c_str());
+  }
+
+  return;
+}
+
+// The nearest color in each palette and the QC verdicts, from the reading's
+//  calibrated r, g, b as the head's classifier saw them.
+static void tap_print_palettes(
+  const palette_set &set,
+  const link_reading &reading
+){
+  if(!set.palettes)
+    return;
+
+  bool timed_out = false;
+  for(uint8_t c=0; c<3; c++)
+    timed_out |= reading.raw[c] == 0;
+  palette_set_result result;
+  if(!timed_out){
+    int rgb[3] = {reading.mapped[0], reading.mapped[1], reading.mapped[2]};
+    palette_set_match_calibrated(set, rgb, result);
+  }
+
+  for(uint8_t p=0; p<set.palettes; p++){
+    if(timed_out){
+      printf(set.tolerance[p] ? ",," : ",");
+      continue;
+    }
+    printf(",\"%s\"", set.pals[p]->colors[result.index[p]].name);
+    if(set.tolerance[p])
+      printf(",%u", (result.within >> p) & 1);
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  const char *name = FRAME_RING_DEFAULT_NAME;
+  bool oldest = false;
+  std::vector<const char *> palette_specs;
+  int opt;
+  while((opt = getopt(argc, argv, "r:op:")) != -1){
+    if(opt == 'r'){
+      name = optarg;
+    }
+    else if(opt == 'o'){
+      oldest = true;
+    }
+    else if(opt == 'p'){
+      palette_specs.push_back(optarg);
+    }
+    else {
+      optind = argc + 1;
+      break;
+    }
+  }
+  if(optind != argc || palette_specs.size() > PALETTE_SET_MAX){
+    fprintf(
+      stderr,
+      "usage: %s [-r ring] [-o] [-p palette.csv[:tolerance] ...]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  // Palettes, all loaded before the set is sized for their colors.
+  size_t npals = palette_specs.size();
+  std::vector<palette_csv> csvs(npals);
+  std::vector<uint16_t> tolerances(npals, 0);
+  uint32_t total = 0;
+  for(size_t p=0; p<npals; p++){
+    if(!tap_load_palette(csvs[p], tolerances[p], palette_specs[p]))
+      return 1;
+    total += csvs[p].pal.count;
+  }
+  if(total > 0xFFFF){
+    fprintf(stderr, "%u palette colors, at most 65535\n", total);
+    return 1;
+  }
+  std::vector<palette_set_color> set_colors(total);
+  palette_set set;
+  palette_set_init(set, set_colors.data(), total);
+  for(size_t p=0; p<npals; p++)
+    palette_set_add(set, csvs[p].pal, tolerances[p]);
+
+  frame_ring ring;
+  if(!frame_ring_open(ring, name)){
+    fprintf(
+      stderr,
+      "%s: %s\n",
+      name,
+      errno == EPROTO ? "not a frame ring" : strerror(errno)
+    );
+    return 1;
+  }
+
+  signal(SIGINT, tap_on_signal);
+  signal(SIGTERM, tap_on_signal);
+
+  frame_ring_reader reader;
+  frame_ring_reader_init(ring, reader, oldest);
+  uint64_t reported_lost = 0;
+
+  printf(
+    "device_id,head,seq,host_time_us,uncertainty_us,synced,class,"
+    "raw_r,raw_g,raw_b,raw_c,r,g,b,c,illum_step"
+  );
+  tap_print_palette_header(set);
+  printf("\n");
+  while(!tap_stop){
+    const frame_ring_record *rec = frame_ring_peek(ring, reader);
+    if(!rec){
+      fflush(stdout);
+      int64_t alive = ring.header->alive_us.load(std::memory_order_relaxed);
+      if(host_time_us() - alive > TAP_BROKER_TIMEOUT_US){
+        fprintf(stderr, "%s: broker stopped\n", name);
+        break;
+      }
+      usleep(TAP_IDLE_US);
+      continue;
+    }
+
+    uint64_t device_id = rec->device_id;
+    uint16_t head = rec->head;
+    link_reading reading;
+    bool is_reading =
+      rec->type == LINK_READING &&
+      link_unpack_reading(rec->payload, rec->len, reading);
+    if(!frame_ring_release(ring, reader) || !is_reading)
+      continue;
+
+    printf(
+      "%016" PRIx64 ",%u,%u,%" PRId64 ",%u,%u,%u,%u,%u,%u,%u,%d,%d,%d,%d,%u",
+      device_id,
+      head,
+      reading.seq,
+      reading.host_time_us,
+      reading.uncertainty_us,
+      (reading.flags & LINK_READING_FLAG_SYNCED) ? 1 : 0,
+      reading.class_index,
+      reading.raw[0], reading.raw[1], reading.raw[2], reading.raw[3],
+      reading.mapped[0], reading.mapped[1], reading.mapped[2],
+      reading.mapped[3],
+      (reading.flags & LINK_READING_ILLUM_MASK) >> LINK_READING_ILLUM_SHIFT
+    );
+    tap_print_palettes(set, reading);
+    printf("\n");
+
+    if(reader.lost != reported_lost){
+      fprintf(
+        stderr,
+        "%s: %" PRIu64 " records lost\n",
+        name,
+        reader.lost - reported_lost
+      );
+      reported_lost = reader.lost;
+    }
+  }
+  frame_ring_close(ring);
+
+  fprintf(stderr, "%" PRIu64 " records lost in all\n", reader.lost);
+
+  return 0;
+}
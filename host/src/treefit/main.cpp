@@ -0,0 +1,699 @@
+// Fits a decision tree, or a small forest, on labelled captures and writes it
+//  as the firmware's class_tree.h, a data driven replacement for the hand
+//  tuned thresholds of color_classify().
+//  Capture parts of each class with ingest and pass every capture with its
+//    class (red, green, blue, black, white or undef). Rows with a timed out
+//    channel are left out. Trees split on the calibrated readings (r, g, b,
+//    c) with integer thresholds, CART style: at each node the split with the
+//    lowest weighted Gini impurity, down to -d levels and no fewer than -m
+//    rows per leaf. With -n above 1 each tree is fitted on a bootstrap resample
+//    (-s seeds it) and the trees vote, ties to the lower class.
+//  Confidence is the leaf's share of its majority class for a single tree,
+//    the share of trees voting for the class for a forest, 0-100.
+//  Reports per class accuracy on the captures next to color_classify()'s.
+//    Both are on the data fitted to, so an optimistic figure for the trees;
+//    hold some captures back and run -c on them to see how it generalises.
+//  -c checks the class_tree.h this tool was built with: refits from the
+//    captures with the options recorded in it and compares the compiled code
+//    against the fit on every row and on random readings, exit 1 on any
+//    difference. Rebuild (pio run -e treefit) after writing a new one.
+//
+// Usage: treefit [-d depth] [-m min_leaf] [-n trees] [-s seed]
+//                [-o class_tree.h] <class>=<capture.csv> ...
+//        treefit -c <class>=<capture.csv> ...
+//  e.g.
+//    treefit -d 4 -o ../color_detector_esp32/include/class_tree.h
+//      red=red.csv green=green.csv blue=blue.csv black=black.csv
+//      white=white.csv
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "class_tree.h"
+#include "color_core.h"
+
+#define TREEFIT_CHANNELS 4
+#define TREEFIT_CLASSES RGB_VAL_MAPPING_LEN
+#define TREEFIT_MAX_DEPTH 8
+#define TREEFIT_MAX_TREES 15
+
+// Random readings -c compares on, besides the captured ones, and their range.
+#define TREEFIT_CHECK_PROBES 200000
+#define TREEFIT_CHECK_MIN -64
+#define TREEFIT_CHECK_MAX 320
+
+static const char *treefit_class_names[TREEFIT_CLASSES] = {
+  "red", "green", "blue", "black", "white", "undef"
+};
+
+static const char *treefit_class_enums[TREEFIT_CLASSES] = {
+  "RED_STR", "GREEN_STR", "BLUE_STR", "BLACK_STR", "WHITE_STR", "UNDEF_STR"
+};
+
+static const char *treefit_channel_enums[TREEFIT_CHANNELS] = {
+  "RED", "GREEN", "BLUE", "CLEAR"
+};
+
+struct treefit_row {
+  int readings[TREEFIT_CHANNELS];
+  uint8_t label;
+};
+
+// Leaves have feature -1.
+struct treefit_node {
+  int8_t feature;
+  int threshold;            // Rows with reading <= threshold go left.
+  int left;
+  int right;
+  uint8_t label;
+  uint8_t confidence;
+};
+
+struct treefit_tree {
+  std::vector<treefit_node> nodes;
+};
+
+struct treefit_options {
+  int depth;
+  int min_leaf;
+  int trees;
+  uint32_t seed;
+};
+
+// Splits a CSV line in place.
+static std::vector<char *> treefit_split(char *line){
+  std::vector<char *> fields;
+  char *save = NULL;
+  char *field = strtok_r(line, ",\r\n", &save);
+  while(field){
+    fields.push_back(field);
+    field = strtok_r(NULL, ",\r\n", &save);
+  }
+
+  return fields;
+}
+
+// Reads an ingest CSV capture of one class into rows.
+static bool treefit_read_capture(
+  const char *path,
+  uint8_t label,
+  std::vector<treefit_row> &rows
+){
+  FILE *file = fopen(path, "r");
+  if(!file){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  static const char *names[TREEFIT_CHANNELS] = {"r", "g", "b", "c"};
+  static const char *raw_names[3] = {"raw_r", "raw_g", "raw_b"};
+  int col[TREEFIT_CHANNELS] = {-1, -1, -1, -1};
+  int raw_col[3] = {-1, -1, -1};
+  size_t count = 0;
+  char line[1024];
+  bool header = true;
+  while(fgets(line, sizeof(line), file)){
+    std::vector<char *> fields = treefit_split(line);
+    if(header){
+      for(size_t i=0; i<fields.size(); i++){
+        for(uint8_t ch=0; ch<TREEFIT_CHANNELS; ch++){
+          if(strcmp(fields[i], names[ch]) == 0)
+            col[ch] = i;
+        }
+        for(uint8_t ch=0; ch<3; ch++){
+          if(strcmp(fields[i], raw_names[ch]) == 0)
+            raw_col[ch] = i;
+        }
+      }
+      header = false;
+      continue;
+    }
+
+    // The calibrated value of a timed out channel means nothing.
+    bool valid = true;
+    for(uint8_t ch=0; ch<3; ch++){
+      if(
+        raw_col[ch] >= 0 &&
+        (size_t)raw_col[ch] < fields.size() &&
+        strtol(fields[raw_col[ch]], NULL, 10) == 0
+      ){
+        valid = false;
+      }
+    }
+    treefit_row row;
+    row.label = label;
+    for(uint8_t ch=0; ch<TREEFIT_CHANNELS; ch++){
+      if(col[ch] < 0 || (size_t)col[ch] >= fields.size()){
+        valid = false;
+        break;
+      }
+      row.readings[ch] = strtol(fields[col[ch]], NULL, 10);
+    }
+    if(!valid)
+      continue;
+    rows.push_back(row);
+    count++;
+  }
+  fclose(file);
+
+  if(col[0] < 0){
+    fprintf(stderr, "%s: not an ingest capture (no r column)\n", path);
+    return false;
+  }
+  if(count == 0){
+    fprintf(stderr, "%s: no valid rows\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+// Majority class of counts, ties to the lower class, and its share 0-100.
+static uint8_t treefit_majority(
+  const uint32_t counts[TREEFIT_CLASSES],
+  uint8_t &confidence
+){
+  uint8_t best = 0;
+  uint32_t total = counts[0];
+  for(uint8_t i=1; i<TREEFIT_CLASSES; i++){
+    total += counts[i];
+    if(counts[i] > counts[best])
+      best = i;
+  }
+  confidence = total ? counts[best] * 100 / total : 0;
+
+  return best;
+}
+
+// Gini impurity of counts, scaled by their total so children add up.
+static double treefit_gini(const uint32_t counts[TREEFIT_CLASSES]){
+  uint64_t total = 0;
+  uint64_t square_sum = 0;
+  for(uint8_t i=0; i<TREEFIT_CLASSES; i++){
+    total += counts[i];
+    square_sum += (uint64_t)counts[i] * counts[i];
+  }
+
+  return total ? total - (double)square_sum / total : 0;
+}
+
+// Grows the subtree over rows[index], returns its node.
+static int treefit_grow(
+  treefit_tree &tree,
+  const std::vector<treefit_row> &rows,
+  std::vector<uint32_t> &index,
+  int depth,
+  const treefit_options &opts
+){
+  uint32_t counts[TREEFIT_CLASSES] = {};
+  for(uint32_t i : index)
+    counts[rows[i].label]++;
+
+  int id = tree.nodes.size();
+  treefit_node node;
+  node.feature = -1;
+  node.threshold = 0;
+  node.left = node.right = -1;
+  node.label = treefit_majority(counts, node.confidence);
+  tree.nodes.push_back(node);
+
+  double parent = treefit_gini(counts);
+  if(
+    depth >= opts.depth ||
+    index.size() < 2 * (size_t)opts.min_leaf ||
+    parent == 0
+  ){
+    return id;
+  }
+
+  // Best split over every feature and every gap between distinct values,
+  //  the first found on ties so fits are repeatable.
+  int best_feature = -1;
+  int best_threshold = 0;
+  double best_impurity = parent;
+  for(uint8_t f=0; f<TREEFIT_CHANNELS; f++){
+    std::sort(
+      index.begin(),
+      index.end(),
+      [&](uint32_t a, uint32_t b){
+        return rows[a].readings[f] < rows[b].readings[f];
+      }
+    );
+    uint32_t left[TREEFIT_CLASSES] = {};
+    uint32_t right[TREEFIT_CLASSES];
+    memcpy(right, counts, sizeof(right));
+    for(size_t i=0; i + 1<index.size(); i++){
+      const treefit_row &row = rows[index[i]];
+      left[row.label]++;
+      right[row.label]--;
+      int value = row.readings[f];
+      int next = rows[index[i + 1]].readings[f];
+      if(
+        value == next ||
+        i + 1 < (size_t)opts.min_leaf ||
+        index.size() - i - 1 < (size_t)opts.min_leaf
+      ){
+        continue;
+      }
+
+      double impurity = treefit_gini(left) + treefit_gini(right);
+      if(impurity < best_impurity - 1e-9){
+        best_impurity = impurity;
+        best_feature = f;
+        best_threshold = value + (next - value) / 2;
+      }
+    }
+  }
+  if(best_feature < 0)
+    return id;
+
+  std::vector<uint32_t> left_index;
+  std::vector<uint32_t> right_index;
+  for(uint32_t i : index){
+    if(rows[i].readings[best_feature] <= best_threshold)
+      left_index.push_back(i);
+    else
+      right_index.push_back(i);
+  }
+  index.clear();
+  index.shrink_to_fit();
+
+  int left = treefit_grow(tree, rows, left_index, depth + 1, opts);
+  int right = treefit_grow(tree, rows, right_index, depth + 1, opts);
+  tree.nodes[id].feature = best_feature;
+  tree.nodes[id].threshold = best_threshold;
+  tree.nodes[id].left = left;
+  tree.nodes[id].right = right;
+
+  return id;
+}
+
+// Fits opts.trees trees. A single tree sees every row, a forest's trees a
+//  bootstrap resample each.
+static std::vector<treefit_tree> treefit_fit(
+  const std::vector<treefit_row> &rows,
+  const treefit_options &opts
+){
+  std::vector<treefit_tree> forest(opts.trees);
+  std::mt19937 rng(opts.seed);
+  for(int t=0; t<opts.trees; t++){
+    std::vector<uint32_t> index(rows.size());
+    for(uint32_t i=0; i<rows.size(); i++)
+      index[i] = opts.trees > 1 ? rng() % rows.size() : i;
+    treefit_grow(forest[t], rows, index, 0, opts);
+  }
+
+  return forest;
+}
+
+static uint8_t treefit_predict_tree(
+  const treefit_tree &tree,
+  const int readings[TREEFIT_CHANNELS],
+  uint8_t &confidence
+){
+  const treefit_node *node = &tree.nodes[0];
+  while(node->feature >= 0){
+    node = readings[node->feature] <= node->threshold ?
+      &tree.nodes[node->left] : &tree.nodes[node->right];
+  }
+  confidence = node->confidence;
+
+  return node->label;
+}
+
+// As the generated class_tree_classify().
+static uint8_t treefit_predict(
+  const std::vector<treefit_tree> &forest,
+  const int readings[TREEFIT_CHANNELS],
+  uint8_t &confidence
+){
+  if(forest.size() == 1)
+    return treefit_predict_tree(forest[0], readings, confidence);
+
+  uint32_t votes[TREEFIT_CLASSES] = {};
+  for(const treefit_tree &tree : forest){
+    uint8_t leaf_confidence;
+    votes[treefit_predict_tree(tree, readings, leaf_confidence)]++;
+  }
+
+  return treefit_majority(votes, confidence);
+}
+
+static int treefit_depth(const treefit_tree &tree, int node){
+  const treefit_node &n = tree.nodes[node];
+  if(n.feature < 0)
+    return 0;
+
+  return 1 + std::max(
+    treefit_depth(tree, n.left),
+    treefit_depth(tree, n.right)
+  );
+}
+
+static void treefit_write_node(
+  FILE *out,
+  const treefit_tree &tree,
+  int node,
+  int indent
+){
+  const treefit_node &n = tree.nodes[node];
+  if(n.feature < 0){
+    fprintf(out, "%*s*confidence = %u;\n", indent, "", n.confidence);
+    fprintf(
+      out,
+      "%*sreturn COLOR_STR_MAP::%s;\n",
+      indent, "", treefit_class_enums[n.label]
+    );
+    return;
+  }
+
+  fprintf(
+    out,
+    "%*sif(readings[COLOR_CHANNELS::%s] <= %d){\n",
+    indent, "", treefit_channel_enums[n.feature], n.threshold
+  );
+  treefit_write_node(out, tree, n.left, indent + 2);
+  fprintf(out, "%*s}\n", indent, "");
+  treefit_write_node(out, tree, n.right, indent);
+
+  return;
+}
+
+static bool treefit_write_header(
+  const char *path,
+  const std::vector<treefit_tree> &forest,
+  const treefit_options &opts,
+  const std::vector<std::string> &inputs
+){
+  FILE *out = fopen(path, "w");
+  if(!out)
+    return false;
+
+  fprintf(
+    out,
+    "// Decision tree classifier over the calibrated readings.\n"
+    "//  Generated by the host treefit tool from labelled captures, replace"
+    " this\n"
+    "//    file with its output and rebuild. Each tree is straight-line"
+    " integer\n"
+    "//    comparisons, no tables or floats. With trees, classify_frame()"
+    " uses them\n"
+    "//    instead of color_classify_noisy().\n"
+    "//  Fitted from:\n"
+  );
+  for(const std::string &input : inputs)
+    fprintf(out, "//    %s\n", input.c_str());
+  fprintf(
+    out,
+    "#ifndef CLASS_TREE_H\n"
+    "#define CLASS_TREE_H\n"
+    "\n"
+    "#include <stdint.h>\n"
+    "\n"
+    "#include \"color_core.h\"\n"
+    "\n"
+    "// Trees and the treefit options they were fitted with, for treefit -c.\n"
+    "#define CLASS_TREES %d\n"
+    "#define CLASS_TREE_DEPTH %d\n"
+    "#define CLASS_TREE_MIN_LEAF %d\n"
+    "#define CLASS_TREE_SEED %u\n",
+    opts.trees, opts.depth, opts.min_leaf, opts.seed
+  );
+
+  for(size_t t=0; t<forest.size(); t++){
+    fprintf(
+      out,
+      "\n"
+      "static inline uint8_t class_tree_%zu(\n"
+      "  const int readings[4],\n"
+      "  uint8_t *confidence\n"
+      "){\n",
+      t
+    );
+    treefit_write_node(out, forest[t], 0, 2);
+    fprintf(out, "}\n");
+  }
+
+  fprintf(
+    out,
+    "\n"
+    "// Classifies calibrated readings, indexed by enum COLOR_CHANNELS, into"
+    " enum\n"
+    "//  COLOR_STR_MAP, with confidence 0-100.\n"
+    "static inline uint8_t class_tree_classify(\n"
+    "  const int readings[4],\n"
+    "  uint8_t *confidence\n"
+    "){\n"
+  );
+  if(forest.size() == 1){
+    fprintf(out, "  return class_tree_0(readings, confidence);\n");
+  }
+  else {
+    // Majority vote, ties to the lower class.
+    fprintf(
+      out,
+      "  uint8_t votes[RGB_VAL_MAPPING_LEN] = {};\n"
+      "  uint8_t leaf_confidence;\n"
+    );
+    for(size_t t=0; t<forest.size(); t++){
+      fprintf(
+        out,
+        "  votes[class_tree_%zu(readings, &leaf_confidence)]++;\n",
+        t
+      );
+    }
+    fprintf(
+      out,
+      "\n"
+      "  uint8_t best = 0;\n"
+      "  for(uint8_t i=1; i<RGB_VAL_MAPPING_LEN; i++){\n"
+      "    if(votes[i] > votes[best])\n"
+      "      best = i;\n"
+      "  }\n"
+      "  *confidence = votes[best] * 100 / CLASS_TREES;\n"
+      "\n"
+      "  return best;\n"
+    );
+  }
+  fprintf(out, "}\n\n#endif\n");
+
+  return fclose(out) == 0;
+}
+
+// Compares the compiled class_tree_classify() against the fit, on the rows
+//  and on random readings. Returns the number of differences.
+static uint64_t treefit_check(
+  const std::vector<treefit_tree> &forest,
+  const std::vector<treefit_row> &rows
+){
+  uint64_t differences = 0;
+  std::mt19937 rng(CLASS_TREE_SEED);
+  size_t total = rows.size() + TREEFIT_CHECK_PROBES;
+  for(size_t i=0; i<total; i++){
+    int readings[TREEFIT_CHANNELS];
+    if(i < rows.size()){
+      memcpy(readings, rows[i].readings, sizeof(readings));
+    }
+    else {
+      for(uint8_t ch=0; ch<TREEFIT_CHANNELS; ch++){
+        readings[ch] = TREEFIT_CHECK_MIN +
+          rng() % (TREEFIT_CHECK_MAX - TREEFIT_CHECK_MIN + 1);
+      }
+    }
+
+    uint8_t fit_confidence;
+    uint8_t code_confidence;
+    uint8_t fit = treefit_predict(forest, readings, fit_confidence);
+    uint8_t code = class_tree_classify(readings, &code_confidence);
+    if(fit == code && fit_confidence == code_confidence)
+      continue;
+
+    if(differences++ < 10){
+      fprintf(
+        stderr,
+        "%s {%d, %d, %d, %d}: fit %u (%u%%), class_tree.h %u (%u%%)\n",
+        i < rows.size() ? "row" : "probe",
+        readings[0], readings[1], readings[2], readings[3],
+        fit, fit_confidence, code, code_confidence
+      );
+    }
+  }
+  printf(
+    "%zu rows, %d random readings: %llu differences\n",
+    rows.size(),
+    TREEFIT_CHECK_PROBES,
+    (unsigned long long)differences
+  );
+
+  return differences;
+}
+
+static void treefit_report(
+  const std::vector<treefit_tree> &forest,
+  const std::vector<treefit_row> &rows
+){
+  uint32_t count[TREEFIT_CLASSES] = {};
+  uint32_t tree_hits[TREEFIT_CLASSES] = {};
+  uint32_t hand_hits[TREEFIT_CLASSES] = {};
+  for(const treefit_row &row : rows){
+    uint8_t confidence;
+    count[row.label]++;
+    tree_hits[row.label] +=
+      treefit_predict(forest, row.readings, confidence) == row.label;
+    hand_hits[row.label] += color_classify(row.readings) == row.label;
+  }
+
+  printf("%-7s %8s %8s %8s\n", "class", "rows", "trees", "hand");
+  uint32_t rows_all = 0;
+  uint32_t tree_all = 0;
+  uint32_t hand_all = 0;
+  for(uint8_t i=0; i<TREEFIT_CLASSES; i++){
+    if(!count[i])
+      continue;
+    printf(
+      "%-7s %8u %7.1f%% %7.1f%%\n",
+      treefit_class_names[i],
+      count[i],
+      100.0 * tree_hits[i] / count[i],
+      100.0 * hand_hits[i] / count[i]
+    );
+    rows_all += count[i];
+    tree_all += tree_hits[i];
+    hand_all += hand_hits[i];
+  }
+  printf(
+    "%-7s %8u %7.1f%% %7.1f%%\n",
+    "all",
+    rows_all,
+    100.0 * tree_all / rows_all,
+    100.0 * hand_all / rows_all
+  );
+
+  for(size_t t=0; t<forest.size(); t++){
+    size_t leaves = 0;
+    for(const treefit_node &node : forest[t].nodes)
+      leaves += node.feature < 0;
+    printf(
+      "tree %zu: depth %d, %zu leaves\n",
+      t,
+      treefit_depth(forest[t], 0),
+      leaves
+    );
+  }
+
+  return;
+}
+
+int main(int argc, char **argv){
+  treefit_options opts;
+  opts.depth = 4;
+  opts.min_leaf = 5;
+  opts.trees = 1;
+  opts.seed = 1;
+  const char *out_path = NULL;
+  bool check = false;
+  bool usage = false;
+  int opt;
+  while((opt = getopt(argc, argv, "d:m:n:s:o:c")) != -1){
+    if(opt == 'd'){
+      opts.depth = strtol(optarg, NULL, 10);
+    }
+    else if(opt == 'm'){
+      opts.min_leaf = strtol(optarg, NULL, 10);
+    }
+    else if(opt == 'n'){
+      opts.trees = strtol(optarg, NULL, 10);
+    }
+    else if(opt == 's'){
+      opts.seed = strtoul(optarg, NULL, 10);
+    }
+    else if(opt == 'o'){
+      out_path = optarg;
+    }
+    else if(opt == 'c'){
+      check = true;
+    }
+    else {
+      usage = true;
+    }
+  }
+  if(
+    usage ||
+    optind >= argc ||
+    opts.depth < 1 || opts.depth > TREEFIT_MAX_DEPTH ||
+    opts.min_leaf < 1 ||
+    opts.trees < 1 || opts.trees > TREEFIT_MAX_TREES
+  ){
+    fprintf(
+      stderr,
+      "usage: %s [-d depth, 1-%d] [-m min_leaf] [-n trees, 1-%d] [-s seed]\n"
+      "          [-o class_tree.h] <class>=<capture.csv> ...\n"
+      "       %s -c <class>=<capture.csv> ...\n",
+      argv[0], TREEFIT_MAX_DEPTH, TREEFIT_MAX_TREES, argv[0]
+    );
+    return 2;
+  }
+
+  if(check){
+    if(CLASS_TREES == 0){
+      fprintf(
+        stderr,
+        "built with a class_tree.h without trees, write one with -o and "
+        "rebuild\n"
+      );
+      return 1;
+    }
+    opts.trees = CLASS_TREES;
+    opts.depth = CLASS_TREE_DEPTH;
+    opts.min_leaf = CLASS_TREE_MIN_LEAF;
+    opts.seed = CLASS_TREE_SEED;
+  }
+
+  std::vector<treefit_row> rows;
+  std::vector<std::string> inputs;
+  for(int i=optind; i<argc; i++){
+    char *eq = strchr(argv[i], '=');
+    int label = -1;
+    for(uint8_t c=0; eq && c<TREEFIT_CLASSES; c++){
+      size_t len = eq - argv[i];
+      if(
+        strlen(treefit_class_names[c]) == len &&
+        strncmp(argv[i], treefit_class_names[c], len) == 0
+      ){
+        label = c;
+      }
+    }
+    if(label < 0){
+      fprintf(
+        stderr,
+        "%s: expected <class>=<capture.csv>, class one of red, green, blue, "
+        "black, white, undef\n",
+        argv[i]
+      );
+      return 2;
+    }
+    if(!treefit_read_capture(eq + 1, label, rows))
+      return 1;
+    inputs.push_back(argv[i]);
+  }
+
+  std::vector<treefit_tree> forest = treefit_fit(rows, opts);
+  if(check)
+    return treefit_check(forest, rows) ? 1 : 0;
+
+  treefit_report(forest, rows);
+
+  if(out_path && !treefit_write_header(out_path, forest, opts, inputs)){
+    fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}